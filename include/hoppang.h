@@ -3,6 +3,13 @@
 #ifndef HOPPANG_H
 #define HOPPANG_H
 
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
 #define PROG_VERSION "1.0"
 
 /* taken from sysexits.h */
@@ -21,4 +28,1048 @@
 
 #define NORETURN _Noreturn
 //#define NORETURN __attribute__((noreturn))
+
+#define HP_STRUCT_FROM_MEMBER(s, m, p) ((s *)((char *)(p) - offsetof(s, m)))
+
+/* USDT probes, in the format of <sys/sdt.h>, for bpftrace, perf and SystemTap to attach to a running server, e.g.
+   `bpftrace -e 'usdt:./hoppang:hoppang:conn__accept { @[arg2] = count(); }'`.  A probe is a nop and a note telling the
+   tools where its arguments are; nothing runs unless one is attached.  The arguments are values at hand, so there are
+   no semaphores.  Up to four arguments, each passed as a signed 64-bit integer; pointers to strings can be read with
+   str().  x86-64 only; elsewhere, or with -DHP_NO_PROBES, HP_PROBE() expands to nothing.
+
+     conn__accept(conn, fd, thread_index, listener_index)
+     conn__close(conn, fd, thread_index, bytes_in_write_buffer)
+     handler__start(conn, handler_name, input_len)   around on_read
+     handler__done(conn, handler_name, consumed)   consumed is -1 when the handler fails the connection
+     loop__iteration(thread_index, nevents, busy_nsec)   for the iterations that had events
+     signal__fatal(signo)   before the backtrace is written */
+#if defined(__x86_64__) && defined(__ELF__) && !defined(HP_NO_PROBES)
+#define HP_PROBE(name, ...) _HP_PROBE_SELECT(__VA_ARGS__, _HP_PROBE4, _HP_PROBE3, _HP_PROBE2, _HP_PROBE1)(name, __VA_ARGS__)
+#else
+#define HP_PROBE(name, ...)
+#endif
+#define _HP_PROBE_SELECT(_1, _2, _3, _4, n, ...) n
+#define _HP_PROBE1(name, x0) _HP_PROBE_ASM(name, "-8@%[a0]", [a0] "nor"((int64_t)(x0)))
+#define _HP_PROBE2(name, x0, x1)                                                                                               \
+        _HP_PROBE_ASM(name, "-8@%[a0] -8@%[a1]", [a0] "nor"((int64_t)(x0)), [a1] "nor"((int64_t)(x1)))
+#define _HP_PROBE3(name, x0, x1, x2)                                                                                           \
+        _HP_PROBE_ASM(name, "-8@%[a0] -8@%[a1] -8@%[a2]", [a0] "nor"((int64_t)(x0)), [a1] "nor"((int64_t)(x1)),               \
+                      [a2] "nor"((int64_t)(x2)))
+#define _HP_PROBE4(name, x0, x1, x2, x3)                                                                                       \
+        _HP_PROBE_ASM(name, "-8@%[a0] -8@%[a1] -8@%[a2] -8@%[a3]", [a0] "nor"((int64_t)(x0)), [a1] "nor"((int64_t)(x1)),      \
+                      [a2] "nor"((int64_t)(x2)), [a3] "nor"((int64_t)(x3)))
+/* the note holds the address of the nop, of _.stapsdt.base (against which the tools correct for where the binary is
+   loaded), of the semaphore (none), then the provider, the name and the arguments */
+#define _HP_PROBE_ASM(name, args, ...)                                                                                         \
+        __asm__ __volatile__("990: nop\n"                                                                                      \
+                             ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                                     \
+                             ".balign 4\n"                                                                                     \
+                             ".4byte 992f-991f, 994f-993f, 3\n"                                                                \
+                             "991: .asciz \"stapsdt\"\n"                                                                       \
+                             "992: .balign 4\n"                                                                                \
+                             "993: .8byte 990b\n"                                                                              \
+                             ".8byte _.stapsdt.base\n"                                                                         \
+                             ".8byte 0\n"                                                                                      \
+                             ".asciz \"hoppang\"\n"                                                                            \
+                             ".asciz \"" #name "\"\n"                                                                          \
+                             ".asciz \"" args "\"\n"                                                                           \
+                             "994: .balign 4\n"                                                                                \
+                             ".popsection\n"                                                                                   \
+                             ".ifndef _.stapsdt.base\n"                                                                        \
+                             ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"                           \
+                             ".weak _.stapsdt.base\n"                                                                          \
+                             ".hidden _.stapsdt.base\n"                                                                        \
+                             "_.stapsdt.base: .space 1\n"                                                                      \
+                             ".size _.stapsdt.base, 1\n"                                                                       \
+                             ".popsection\n"                                                                                   \
+                             ".endif\n"                                                                                        \
+                             :                                                                                                 \
+                             : __VA_ARGS__)
+
+/* a borrowed slice of memory; the owner decides how long it stays valid */
+typedef struct st_hp_iovec_t {
+        char *base;
+        size_t len;
+} hp_iovec_t;
+
+static inline hp_iovec_t hp_iovec_init(const void *base, size_t len)
+{
+        hp_iovec_t r = {(char *)base, len};
+        return r;
+}
+
+/* FNV-1a, with a final mix so that the low bits are usable as a bucket index */
+static inline uint64_t hp_hash(const void *_p, size_t len)
+{
+        const unsigned char *p = _p;
+        uint64_t h = 0xcbf29ce484222325;
+        size_t i;
+
+        for (i = 0; i != len; ++i)
+                h = (h ^ p[i]) * 0x100000001b3;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccd;
+        h ^= h >> 33;
+        return h;
+}
+
+typedef struct st_hp_buffer_t {
+        char *bytes;
+        size_t size;
+        size_t capacity;
+} hp_buffer_t;
+
+typedef struct st_hp_loop_t hp_loop_t;
+typedef struct st_hp_watcher_t hp_watcher_t;
+typedef struct st_hp_listener_t hp_listener_t;
+typedef struct st_hp_conn_t hp_conn_t;
+typedef struct st_hp_handler_t hp_handler_t;
+typedef struct st_hp_timer_t hp_timer_t;
+typedef struct st_hp_loop_message_t hp_loop_message_t;
+typedef struct st_hp_sendfile_t hp_sendfile_t;
+typedef struct st_hp_udp_t hp_udp_t;
+
+/* anything registered to the epoll set of a loop */
+struct st_hp_watcher_t {
+        int fd;
+        uint32_t events;
+        void (*cb)(hp_loop_t *loop, hp_watcher_t *watcher, uint32_t revents);
+};
+
+/* a one-shot timer; the loop keeps the linked ones sorted by expiry */
+struct st_hp_timer_t {
+        uint64_t expire_at;
+        void (*cb)(hp_loop_t *loop, hp_timer_t *timer);
+        hp_timer_t *_prev;
+        hp_timer_t *_next; /* NULL while unlinked */
+};
+
+/* a callback to be run on another loop, see hp_loop_post() */
+struct st_hp_loop_message_t {
+        void (*cb)(hp_loop_t *loop, hp_loop_message_t *msg);
+        hp_loop_message_t *_next;
+};
+
+/* a region of a file queued for sending after the bytes written before it, embedded by the user */
+struct st_hp_sendfile_t {
+        int fd;
+        off_t offset;
+        size_t len;
+        /* called once the region has been sent or the connection has been closed, before hp_handler_t::on_close */
+        void (*on_complete)(hp_sendfile_t *sf);
+        size_t _prefix; /* bytes of the write buffer to be sent before this region */
+        hp_sendfile_t *_next;
+};
+
+/* a datagram received by a UDP listener; with GRO, a run of datagrams from one peer arrives as one, to be cut into
+   segments of `segment_size` bytes (the last one may be shorter) */
+typedef struct st_hp_datagram_t {
+        hp_iovec_t data;
+        size_t segment_size;
+        struct sockaddr_storage peer;
+        socklen_t peerlen;
+} hp_datagram_t;
+
+/*
+ * A protocol handler.  The loop owns the socket and the buffers; the handler only sees
+ * borrowed slices of the receive buffer, which stay valid until `on_read` returns.
+ */
+struct st_hp_handler_t {
+        const char *name;
+        /* optional; returning non-zero closes the connection */
+        int (*on_accept)(hp_conn_t *conn);
+        /* returns the number of bytes consumed (the rest is handed again with more data), or -1 to close */
+        ssize_t (*on_read)(hp_conn_t *conn, hp_iovec_t input);
+        /* optional; also called for outgoing connections that could not be established */
+        void (*on_close)(hp_conn_t *conn);
+        /* optional; asked before an idle connection is moved to a less loaded loop, returning non-zero keeps it where it
+           is.  `data` moves along, hence is to hold nothing that belongs to the loop */
+        int (*on_migrate)(hp_conn_t *conn);
+        /* for UDP listeners, in place of the above; called with each batch read, the data valid until it returns */
+        void (*on_datagrams)(hp_udp_t *udp, hp_datagram_t *datagrams, size_t cnt);
+        hp_handler_t *_next;
+};
+
+/* which worker process serves the connections of a local peer; see hp_handoff_init() */
+typedef enum en_hp_route_t {
+        HP_ROUTE_ANY,
+        HP_ROUTE_UID,
+        HP_ROUTE_PID,
+} hp_route_t;
+
+/* sockopt.c: the TCP options of a listener, inherited by the connections it accepts */
+#define HP_TCP_DEFAULT_DEFER_ACCEPT 1
+
+typedef struct st_hp_tcp_profile_t {
+        int defer_accept;  /* seconds to wait for the first bytes before waking up accept; 0 disables */
+        int fastopen;      /* length of the queue of pending Fast Open requests; 0 disables */
+        int busy_poll;     /* microseconds; also applied to the epoll instances of the loops */
+        int nodelay;
+        int notsent_lowat; /* bytes; 0 keeps the system default */
+        int rcvbuf;        /* bytes; 0 keeps autotuning */
+        int sndbuf;        /* bytes; 0 keeps autotuning */
+        int incoming_cpu;  /* counts the connections whose packets arrive on the CPU that accepts them */
+} hp_tcp_profile_t;
+
+#define HP_TCP_PROFILE_INITIALIZER {HP_TCP_DEFAULT_DEFER_ACCEPT}
+
+/* returns 0 if `opt` (NAME or NAME=VALUE) was taken, 1 if it is not a profile option, -1 on a bad value */
+int hp_tcp_profile_parse_option(hp_tcp_profile_t *profile, const char *opt);
+/* to be called before bind */
+int hp_tcp_profile_apply(int fd, const hp_tcp_profile_t *profile);
+int hp_tcp_set_epoll_busy_poll(int epoll_fd, int usecs);
+
+struct st_hp_listener_t {
+        int fd;
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+        hp_handler_t *handler;
+        /* TLS is used when a certificate is given */
+        char *ssl_cert_file;
+        char *ssl_key_file;
+        /* position in the list of listeners, used to look up per-listener settings of the configuration */
+        size_t index;
+        hp_tcp_profile_t tcp;
+        /* with a certificate: after the handshake, OpenSSL installs the keys in the kernel (kTLS) if it can */
+        int ktls;
+        /* AF_UNIX only */
+        int seqpacket;
+        uid_t *allowed_uids; /* checked against SO_PEERCRED; NULL admits every user */
+        size_t num_allowed_uids;
+        hp_route_t route;
+        /* UDP: `fd` is -1, as each loop binds a socket of its own to `addr` (SO_REUSEPORT) */
+        int udp;
+        int udp_gro;
+        int udp_gso;
+};
+
+struct st_hp_conn_t {
+        hp_watcher_t watcher;
+        hp_loop_t *loop;
+        hp_listener_t *listener;
+        hp_handler_t *handler;
+        void *data; /* for use by the handler */
+        hp_buffer_t rbuf;
+        hp_buffer_t wbuf;
+        size_t peak_input;
+        struct ssl_st *ssl;
+        int ssl_want_write;
+        /* the kernel encrypts what is written to the socket, so writes and sendfile bypass OpenSSL */
+        int ktls_send;
+        int connecting; /* outgoing connection in progress */
+        int closing;
+        uint64_t client_key; /* see hp_ratelimit_addr_key(); 0 for outgoing connections */
+        /* SOCK_SEQPACKET: the handler is given one message per call and each write is sent as one message, up to
+           HP_SEQPACKET_MAX_MESSAGE bytes; sendfile is not available */
+        int seqpacket;
+        int _close_after_flush;
+        uint64_t _capture_id; /* non-zero while captured */
+        int _capture_awaiting_reply;
+        /* by hp_clock_nsec(), of a connection sampled for tracing */
+        struct st_hp_conn_trace_t {
+                uint64_t id; /* of the connection span; 0 unless traced */
+                uint64_t trace_id[2];
+                uint64_t accepted_at;
+                uint64_t request_at; /* 0 unless a request is open */
+                uint64_t replied_at; /* 0 until the handler writes */
+                uint64_t flushed_at;
+                uint64_t num_requests;
+        } _trace;
+        /* optional; called once everything written and queued has been sent, then reset to NULL */
+        void (*on_drain)(hp_conn_t *conn);
+        hp_sendfile_t *_sendfiles;
+        hp_sendfile_t **_sendfiles_tail;
+        hp_conn_t *_next; /* links the closing list, and then the free list */
+        /* accepted connections, in the order they last read */
+        uint64_t _last_read;
+        hp_conn_t *_newer;
+        hp_conn_t *_older;
+};
+
+/* clock.c: a fast clock for intervals, reading the TSC where the kernel uses it as its clocksource and clock_gettime(2)
+   elsewhere, and per-thread caches of the current time formatted */
+typedef struct st_hp_clock_tsc_t {
+        int enabled;
+        uint64_t base_tsc;
+        uint64_t base_nsec; /* CLOCK_MONOTONIC at `base_tsc` */
+        uint64_t mult;      /* nanoseconds per tick, 32.32 fixed point */
+} hp_clock_tsc_t;
+
+extern hp_clock_tsc_t hp_clock_tsc;
+
+/* calibrates the TSC against the kernel clock, taking some 20ms; to be called once before the threads start.  Returns
+   non-zero if hp_clock_nsec() reads the TSC. */
+int hp_clock_init(void);
+uint64_t hp_clock_gettime_nsec(void);
+/* monotonic, in nanoseconds; close to CLOCK_MONOTONIC but not slewed along with it, hence for intervals only */
+static inline uint64_t hp_clock_nsec(void)
+{
+#if defined(__x86_64__)
+        if (hp_clock_tsc.enabled)
+                return hp_clock_tsc.base_nsec +
+                       (uint64_t)((unsigned __int128)(__builtin_ia32_rdtsc() - hp_clock_tsc.base_tsc) * hp_clock_tsc.mult >> 32);
+#endif
+        return hp_clock_gettime_nsec();
+}
+/* the time in local time, formatted for the logs; redone once a second */
+const char *hp_clock_log_time(uint64_t wall_msec);
+/* the time as in the Date header of HTTP; redone once a second */
+const char *hp_clock_http_date(uint64_t wall_msec);
+
+/* durations in power-of-two buckets of nanoseconds: bucket i counts [2^(i-1), 2^i) */
+#define HP_LATENCY_NUM_BUCKETS 40
+
+typedef struct st_hp_latency_histogram_t {
+        uint64_t buckets[HP_LATENCY_NUM_BUCKETS];
+        uint64_t count;
+        uint64_t max;
+} hp_latency_histogram_t;
+
+static inline void hp_latency_record(hp_latency_histogram_t *h, uint64_t nsec)
+{
+        size_t i = nsec == 0 ? 0 : 64 - __builtin_clzll(nsec);
+
+        ++h->buckets[i < HP_LATENCY_NUM_BUCKETS ? i : HP_LATENCY_NUM_BUCKETS - 1];
+        ++h->count;
+        if (nsec > h->max)
+                h->max = nsec;
+}
+/* the upper bound of the bucket holding the given percentile (0 to 100), or the maximum if lower */
+uint64_t hp_latency_percentile(const hp_latency_histogram_t *h, double percentile);
+
+/* arena.c: per-worker region for long-lived state, optionally backed by 2MB pages */
+typedef enum en_hp_hugepages_t {
+        HP_HUGEPAGES_OFF = 0,
+        HP_HUGEPAGES_THP,
+        HP_HUGEPAGES_HUGETLB,
+} hp_hugepages_t;
+
+typedef struct st_hp_arena_t {
+        char *base;
+        size_t size;
+        size_t used;
+        hp_hugepages_t backing; /* what the region ended up with, after falling back */
+} hp_arena_t;
+
+/* indexed by hp_hugepages_t, NULL-terminated */
+extern const char *hp_hugepages_names[];
+
+/* a size of zero leaves the arena empty, so that every allocation fails over to malloc */
+int hp_arena_init(hp_arena_t *arena, size_t size, hp_hugepages_t mode);
+void *hp_arena_alloc(hp_arena_t *arena, size_t size, size_t align);
+void hp_arena_dispose(hp_arena_t *arena);
+
+static inline int hp_arena_contains(hp_arena_t *arena, const void *p)
+{
+        return arena->base != NULL && (const char *)p >= arena->base && (const char *)p < arena->base + arena->size;
+}
+
+/* bufpool.c: per-loop pool of I/O buffers in size classes; idle buffers are returned to the OS */
+#define HP_BUFPOOL_NUM_CLASSES 3
+#define HP_BUFPOOL_DEFAULT_IDLE_TIMEOUT 5000 /* in milliseconds */
+
+typedef struct st_hp_bufpool_t {
+        struct {
+                /* LIFO of free buffers; [0, num_cold) have had their pages returned to the OS */
+                void **entries;
+                size_t size;
+                size_t capacity;
+                size_t num_cold;
+                /* the fewest warm buffers seen since the last reclaim; that many went unused */
+                size_t min_warm;
+        } free[HP_BUFPOOL_NUM_CLASSES];
+        uint64_t idle_timeout;
+        uint64_t next_reclaim_at;
+        /* moving average of the largest input held by a connection, used as the initial size */
+        size_t read_hint;
+        /* buffers carved from the arena stay in the pool for good, and are never reclaimed */
+        hp_arena_t *arena;
+        struct {
+                uint64_t hits;
+                uint64_t misses;
+                uint64_t reclaimed_bytes;
+                size_t resident_bytes;
+        } stats;
+} hp_bufpool_t;
+
+extern const size_t hp_bufpool_class_sizes[HP_BUFPOOL_NUM_CLASSES];
+
+void hp_bufpool_init(hp_bufpool_t *pool, uint64_t idle_timeout, hp_arena_t *arena);
+/* makes sure that `buf` has at least `min_room` bytes free, moving the contents if necessary */
+int hp_bufpool_reserve(hp_bufpool_t *pool, hp_buffer_t *buf, size_t min_room);
+void hp_bufpool_release(hp_bufpool_t *pool, hp_buffer_t *buf);
+/* returns the buffers left unused since the last call to the OS; returns milliseconds until the next call is due, or -1 */
+int hp_bufpool_reclaim(hp_bufpool_t *pool, uint64_t now);
+
+/* ratelimit.c: token buckets keyed by client address or by any other key, in one table shared by the loops of a
+   process.  A bucket is refilled lazily when consulted and updated with compare-and-swap; neither timers nor locks are
+   involved. */
+#define HP_RATELIMIT_DEFAULT_SLOTS 65536
+#define HP_RATELIMIT_MAX_BURST 4000
+
+typedef struct st_hp_ratelimit_rule_t {
+        uint32_t rate; /* tokens per second; 0 disables the rule */
+        uint32_t burst;
+} hp_ratelimit_rule_t;
+
+typedef enum en_hp_ratelimit_scope_t {
+        HP_RATELIMIT_ACCEPT,  /* connections per client address */
+        HP_RATELIMIT_REQUEST, /* requests per client address */
+        HP_RATELIMIT_KEY,     /* requests per key chosen by the handler, e.g. an API key */
+        HP_RATELIMIT_NUM_SCOPES
+} hp_ratelimit_scope_t;
+
+struct st_hp_ratelimit_stats_t {
+        uint64_t rejected[HP_RATELIMIT_NUM_SCOPES];
+        uint64_t table_full; /* let through for want of a free slot */
+};
+
+void hp_ratelimit_init(size_t num_slots);
+/* hashes the address without the port; IPv6 clients are keyed by their /64, which is what they usually get */
+uint64_t hp_ratelimit_addr_key(const struct sockaddr *addr);
+/* returns non-zero if a token was taken; lets the request through if the table has no room for the key */
+int hp_ratelimit_take(hp_ratelimit_scope_t scope, uint64_t key, const hp_ratelimit_rule_t *rule, uint64_t now);
+/* empties the bucket, e.g. to refuse the next connections of a client that has exceeded its request rate */
+void hp_ratelimit_drain(hp_ratelimit_scope_t scope, uint64_t key, uint64_t now);
+/* charges a request to the client of `conn` and, if `key` is not NULL, to the key; returns the scope that refused it or
+   -1.  A client refused for its own rate also has its accept bucket emptied. */
+int hp_ratelimit_request(hp_conn_t *conn, const hp_iovec_t *key);
+/* parses RATE[/BURST]; BURST defaults to RATE, or to HP_RATELIMIT_MAX_BURST if smaller */
+int hp_ratelimit_parse_rule(const char *s, hp_ratelimit_rule_t *rule);
+void hp_ratelimit_get_stats(struct st_hp_ratelimit_stats_t *stats);
+
+/* sockfilter.c: a deny-list of address ranges, enforced by a BPF program on the listening sockets so that SYNs from
+   denied ranges are dropped by the kernel */
+typedef struct st_hp_addr_range_t {
+        int family;
+        unsigned prefixlen;
+        uint8_t addr[16]; /* network byte order, host part cleared */
+} hp_addr_range_t;
+
+/* parses ADDRESS[/PREFIXLEN] */
+int hp_parse_addr_range(const char *s, hp_addr_range_t *range);
+int hp_sockfilter_set_listeners(const int *fds, size_t num_fds);
+/* replaces the deny-list; the program is attached the first time the list is not empty */
+int hp_sockfilter_update(const hp_addr_range_t *ranges, size_t num_ranges);
+/* SYNs dropped so far; counted by the eBPF program only */
+uint64_t hp_sockfilter_num_dropped(void);
+
+/* udp.c: UDP listeners, read with recvmmsg and written with sendmmsg */
+#define HP_UDP_BATCH 32
+#define HP_UDP_MAX_PAYLOAD 65507
+
+struct st_hp_udp_t {
+        hp_watcher_t watcher;
+        hp_loop_t *loop;
+        hp_listener_t *listener;
+        int gso; /* cleared once the kernel refuses to segment */
+        struct st_hp_udp_batch_t *_batch;
+};
+
+/* binds the socket of the loop; called by hp_loop_add_listener() */
+hp_udp_t *hp_udp_open(hp_loop_t *loop, hp_listener_t *listener);
+/* queues a datagram; the queue is sent when full and after hp_handler_t::on_datagrams returns, or by hp_udp_flush().  Runs
+   of datagrams of one size to one peer are sent as one (UDP_SEGMENT). */
+int hp_udp_send(hp_udp_t *udp, const struct sockaddr *peer, socklen_t peerlen, const void *payload, size_t len);
+void hp_udp_flush(hp_udp_t *udp);
+void hp_udp_register_echo(void);
+
+/* config.c: settings that can be changed without a restart.  Loops see an immutable snapshot that is replaced as a
+   whole; see hp_config_publish(). */
+#define HP_DEFAULT_MAX_CONNECTIONS 1024
+
+typedef struct st_hp_config_t {
+        uint64_t generation; /* set when published */
+        /* total across the loops; listeners stop accepting when reached */
+        size_t max_connections;
+        /* indexed by hp_listener_t::index; NULL for listeners without TLS */
+        struct ssl_ctx_st **ssl_ctxs;
+        size_t num_listeners;
+        hp_ratelimit_rule_t rate_limits[HP_RATELIMIT_NUM_SCOPES];
+        char *rate_limit_key_header; /* names the request header that holds the key of HP_RATELIMIT_KEY */
+        hp_addr_range_t *deny;
+        size_t num_deny;
+} hp_config_t;
+
+extern hp_config_t *hp_config_current;
+
+hp_config_t *hp_config_create(size_t num_listeners);
+/* reads `name: value` lines; returns -1 after reporting the offending line */
+int hp_config_load_file(hp_config_t *config, const char *fn);
+void hp_config_free(hp_config_t *config);
+/* replaces the current snapshot, then waits until every loop has passed a quiescent point and frees the previous one;
+   must not be called from a loop */
+void hp_config_publish(hp_config_t *config);
+
+#define HP_LOOP_DEFAULT_REBALANCE_INTERVAL 1000
+
+typedef struct st_hp_loop_config_t {
+        uint64_t buffer_idle_timeout;
+        size_t arena_size;
+        hp_hugepages_t hugepages;
+        /* how often a loop compares its connections against the others, in milliseconds; 0 disables */
+        uint64_t rebalance_interval;
+} hp_loop_config_t;
+
+struct st_hp_loop_t {
+        int epoll_fd;
+        size_t thread_index;
+        hp_watcher_t wakeup;
+        size_t num_conns;
+        /* counted for listeners with hp_tcp_profile_t::incoming_cpu */
+        uint64_t num_accepts_local_cpu;
+        uint64_t num_accepts_remote_cpu;
+        /* connections of AF_UNIX listeners */
+        uint64_t num_peers_refused;
+        uint64_t num_handed_off;
+        uint64_t num_handed_in;
+        /* idle connections moved between the loops of the process */
+        uint64_t num_migrated_out;
+        uint64_t num_migrated_in;
+        /* handshakes of listeners with hp_listener_t::ktls, by what the kernel took over */
+        uint64_t num_ktls_send;
+        uint64_t num_ktls_recv;
+        uint64_t num_ktls_fallbacks; /* encrypted in user space, e.g. for want of the kernel module or the cipher */
+        /* of the UDP listeners, counting GRO and GSO segments one by one */
+        uint64_t num_datagrams_received;
+        uint64_t num_datagrams_sent;
+        uint64_t num_datagrams_dropped;
+        hp_arena_t arena;
+        hp_bufpool_t bufpool;
+        /* refreshed at the start of every iteration, which is the quiescent point of the loop */
+        hp_config_t *config;
+        uint64_t quiescent_epoch; /* UINT64_MAX while blocked in epoll_wait */
+        /* monotonic and wall clocks in milliseconds, updated once per iteration */
+        uint64_t now;
+        uint64_t wall_now; /* since the epoch */
+        /* time spent handling the events of an iteration */
+        hp_latency_histogram_t busy;
+        hp_timer_t _timers; /* sentinel of the list sorted by expiry */
+        pthread_mutex_t _inbox_mutex;
+        hp_loop_message_t *_inbox;
+        hp_loop_message_t **_inbox_tail;
+        hp_conn_t *_closing;
+        hp_conn_t *_free_conns;
+        struct st_hp_loop_listener_t **_listeners;
+        size_t _num_listeners;
+        int _listeners_paused;
+        int _busy_poll;
+        hp_watcher_t _handoff;
+        uint64_t _rebalance_interval;
+        hp_timer_t _rebalance_timer;
+        hp_conn_t *_newest;
+        hp_conn_t *_oldest;
+        struct st_hp_trace_ring_t *_trace_ring; /* NULL unless tracing */
+};
+
+/* handler.c */
+void hp_register_handler(hp_handler_t *handler);
+hp_handler_t *hp_find_handler(const char *name);
+
+/* evloop.c */
+#define HP_SEQPACKET_MAX_MESSAGE 65536
+
+/* Worker processes hand the connections of routed listeners to each other over datagram sockets that carry the
+   descriptors (SCM_RIGHTS).  `inboxes[i]` and `outboxes[i]` are the two ends of the socket of process i; a process reads
+   its own inbox and writes to the outboxes of the others. */
+typedef struct st_hp_handoff_t {
+        size_t num_peers;
+        size_t self;
+        int *inboxes;
+        int *outboxes;
+} hp_handoff_t;
+
+/* to be called before the loops are created */
+void hp_handoff_init(const hp_handoff_t *handoff);
+/* to be called by the thread that runs the loop, so that its memory is faulted in on the local node */
+hp_loop_t *hp_loop_create(size_t thread_index, const hp_loop_config_t *config);
+int hp_loop_add_watcher(hp_loop_t *loop, hp_watcher_t *watcher);
+int hp_loop_update_watcher(hp_loop_t *loop, hp_watcher_t *watcher, uint32_t events);
+void hp_loop_remove_watcher(hp_loop_t *loop, hp_watcher_t *watcher);
+int hp_loop_add_listener(hp_loop_t *loop, hp_listener_t *listener);
+int hp_loop_run_once(hp_loop_t *loop, int timeout_ms);
+/* async-signal-safe */
+void hp_loop_wakeup(hp_loop_t *loop);
+void hp_loop_wakeup_all(void);
+/* runs `msg->cb` on the thread of `loop`; can be called from any thread */
+void hp_loop_post(hp_loop_t *loop, hp_loop_message_t *msg);
+/* Quiescent-state-based reclamation.  A loop does not hold on to shared objects across the start of an iteration,
+   hence an object unlinked from a shared structure can be freed once every loop has started a new iteration.  The
+   unlinking thread calls hp_loop_start_grace_period(), and the object is safe to free once
+   hp_loop_quiescent_epoch() has reached the returned value. */
+uint64_t hp_loop_start_grace_period(void);
+/* the oldest epoch seen by the loops, or UINT64_MAX if there are none */
+uint64_t hp_loop_quiescent_epoch(void);
+void hp_timer_link(hp_loop_t *loop, hp_timer_t *timer, uint64_t delay_ms);
+void hp_timer_unlink(hp_timer_t *timer);
+static inline int hp_timer_is_linked(const hp_timer_t *timer)
+{
+        return timer->_next != NULL;
+}
+/* starts a non-blocking connect; `handler->on_accept` is called once connected.  Writes made before that are
+   buffered.  Outgoing connections do not count toward max-connections. */
+hp_conn_t *hp_conn_connect(hp_loop_t *loop, const struct sockaddr *addr, socklen_t addrlen, hp_handler_t *handler, void *data);
+int hp_conn_write(hp_conn_t *conn, const void *src, size_t len);
+int hp_conn_writev(hp_conn_t *conn, const hp_iovec_t *bufs, size_t cnt);
+void hp_conn_close(hp_conn_t *conn);
+/* closes the connection once everything written has been sent; further input and writes are discarded */
+void hp_conn_close_after_flush(hp_conn_t *conn);
+/* queues a region of a file behind what has been written so far; sent with sendfile(2), or over TLS copied through the
+   write buffer a chunk at a time as the socket drains */
+int hp_conn_sendfile(hp_conn_t *conn, hp_sendfile_t *sf);
+static inline int hp_conn_is_flushed(const hp_conn_t *conn)
+{
+        return conn->wbuf.size == 0 && conn->_sendfiles == NULL;
+}
+
+/* capture.c: records what the accepted connections receive, and when, for tools/replay.c */
+#define HP_CAPTURE_MAGIC "HPCAP1\n" /* with its NUL */
+#define HP_CAPTURE_HEADER_SIZE (sizeof(HP_CAPTURE_MAGIC) + 8)
+#define HP_CAPTURE_DEFAULT_MAX_SIZE 1024 /* in megabytes, per process */
+
+enum {
+        HP_CAPTURE_OPEN = 'O',
+        HP_CAPTURE_DATA = 'D',
+        HP_CAPTURE_REPLY = 'R', /* the first write of the handler after receiving */
+        HP_CAPTURE_CLOSE = 'C',
+};
+
+extern int hp_capture_enabled;
+
+/* to be called before the loops start, after hp_clock_init(); `create` truncates the file and writes the header, which
+   the processes that do not create it read their start time from.  `instance` tells apart the connections of the
+   worker processes, up to 256. */
+int hp_capture_open(const char *path, int create, size_t instance, uint64_t max_size);
+/* writes out what the calling loop has buffered, if it has grown or a second has passed, or if `force` */
+void hp_capture_flush(hp_loop_t *loop, int force);
+void hp_capture_conn_open(hp_conn_t *conn);
+void hp_capture_conn_data(hp_conn_t *conn, const void *bytes, size_t len);
+void hp_capture_conn_reply(hp_conn_t *conn);
+void hp_capture_conn_close(hp_conn_t *conn);
+
+/* trace.c: spans of the connections sampled for tracing, recorded without allocating into a ring per loop and exported
+   as OTLP/JSON by a thread of their own */
+#define HP_TRACE_RING_SIZE 16384      /* spans per loop; a power of two */
+#define HP_TRACE_EXPORT_INTERVAL 500 /* in milliseconds */
+
+typedef enum en_hp_span_kind_t {
+        HP_SPAN_CONNECTION,
+        HP_SPAN_TLS_HANDSHAKE,
+        HP_SPAN_REQUEST,
+        HP_SPAN_HANDLER,
+        HP_SPAN_WRITE,
+} hp_span_kind_t;
+
+typedef struct st_hp_trace_ring_t hp_trace_ring_t;
+
+struct st_hp_trace_stats_t {
+        uint64_t recorded;
+        uint64_t dropped; /* for want of room in the ring */
+};
+
+extern int hp_trace_enabled;
+
+/* `output` is a file or unix:PATH; a connection is traced with the probability `ratio`.  Called before the loops are made,
+   and starts the exporter */
+int hp_trace_init(const char *output, double ratio);
+hp_trace_ring_t *hp_trace_ring_create(size_t thread_index);
+const struct st_hp_trace_stats_t *hp_trace_get_stats(hp_loop_t *loop);
+/* writes out what the rings hold; also called by the exporter */
+void hp_trace_export(void);
+/* called by the loop: hp_trace_conn_open() when tracing, the others when hp_conn_t::_trace.id is non-zero */
+void hp_trace_conn_open(hp_conn_t *conn);
+void hp_trace_conn_handshake(hp_conn_t *conn);
+void hp_trace_conn_data(hp_conn_t *conn);
+void hp_trace_conn_reply(hp_conn_t *conn);
+void hp_trace_conn_flushed(hp_conn_t *conn);
+void hp_trace_conn_close(hp_conn_t *conn);
+
+/* parallel.c: runs `cb` for each index in [0, num_jobs) on up to `num_threads` threads, including the caller */
+void hp_parallel_for(size_t num_jobs, size_t num_threads, void (*cb)(size_t index, void *arg), void *arg);
+
+/* coro.c: stackful coroutines.  Each runs on a stack of its own, mapped with a guard page below it and pooled per
+   thread; only the pages it touches take memory. */
+#define HP_CORO_DEFAULT_STACK_SIZE (64 * 1024)
+
+typedef struct st_hp_coro_t hp_coro_t;
+
+struct st_hp_coro_t {
+        void (*fn)(hp_coro_t *co, void *arg);
+        void *arg;
+        int finished;
+        void *_stack;
+        void *_stack_base;
+        struct st_hp_coro_context_t *_context;
+        struct st_hp_coro_context_t *_caller;
+};
+
+struct st_hp_coro_stats_t {
+        uint64_t created;
+        uint64_t switches;
+        uint64_t stack_maps;   /* stacks newly mapped */
+        uint64_t stack_reuses; /* taken from the pool */
+};
+
+/* the coroutine is placed at the top of its stack; it does not run until resumed */
+hp_coro_t *hp_coro_create(void (*fn)(hp_coro_t *co, void *arg), void *arg, size_t stack_size);
+/* runs the coroutine until it yields, returning 1, or until `fn` returns, returning 0; the coroutine is then gone */
+int hp_coro_resume(hp_coro_t *co);
+/* returns to the caller of hp_coro_resume(); called from within the coroutine */
+void hp_coro_yield(hp_coro_t *co);
+/* bytes of the stack backed by memory */
+size_t hp_coro_stack_used(hp_coro_t *co);
+/* of the calling thread */
+const struct st_hp_coro_stats_t *hp_coro_get_stats(void);
+
+/* cohandler.c: handlers written as sequential code, running a coroutine per connection */
+typedef struct st_hp_co_t {
+        hp_conn_t *conn;
+        void *data; /* for use by the handler */
+        hp_coro_t *_coro; /* NULL once `main` has returned */
+        int _wait;
+        hp_iovec_t _input;
+        size_t *_consumed; /* non-NULL while resumed from on_read */
+        hp_timer_t _timer;
+} hp_co_t;
+
+typedef struct st_hp_coro_handler_t {
+        hp_handler_t super;
+        size_t stack_size;
+        /* the connection is closed once it returns */
+        void (*main)(hp_co_t *co);
+} hp_coro_handler_t;
+
+void hp_coro_handler_init(hp_coro_handler_t *handler, const char *name, void (*main)(hp_co_t *co));
+/* returns the number of bytes read, waiting for some if there are none; 0 once the connection is closed */
+ssize_t hp_co_read(hp_co_t *co, void *buf, size_t len);
+/* returns 0 once `len` bytes are read, or -1 if the connection was closed before */
+int hp_co_read_full(hp_co_t *co, void *buf, size_t len);
+int hp_co_write(hp_co_t *co, const void *buf, size_t len);
+/* returns -1 if the connection was or got closed */
+int hp_co_sleep(hp_co_t *co, uint64_t delay_ms);
+/* registers the reference handler `co-echo`, the frame echo written sequentially */
+void hp_coro_register_echo(void);
+
+/* profile.c: a sampling profiler for the loop threads, writing folded stacks.  Started and stopped on the thread to
+   be sampled; the stacks are named and appended to the file on the task pool */
+#define HP_PROFILE_DEFAULT_RATE 99 /* in Hz; off the multiples of the periodic timers */
+#define HP_PROFILE_MAX_DEPTH 64
+
+typedef struct st_hp_profile_t hp_profile_t;
+
+/* installs the handler of SIGPROF */
+void hp_profile_init(void);
+int hp_profile_start(unsigned rate);
+/* `label` is the outermost frame of each stack, e.g. naming the thread */
+int hp_profile_stop(hp_loop_t *loop, const char *path, const char *label);
+
+/* taskpool.c: work-stealing pool of compute threads, sized apart from the loops, for work that would stall a loop */
+typedef struct st_hp_task_t hp_task_t;
+
+/* embedded by the user */
+struct st_hp_task_t {
+        /* runs on a compute thread; must not touch the connections or anything else of the loop */
+        void (*run)(hp_task_t *task);
+        /* then runs on the loop that submitted the task */
+        void (*on_complete)(hp_loop_t *loop, hp_task_t *task);
+        hp_loop_t *_loop;
+        hp_task_t *_next;
+        hp_loop_message_t _complete;
+};
+
+struct st_hp_taskpool_stats_t {
+        size_t num_threads;
+        uint64_t submitted; /* by the loops */
+        uint64_t run;       /* by the compute threads, spawned ones included */
+        uint64_t stolen;
+        uint64_t run_inline; /* for want of a pool, or of room in the deque of the spawning thread */
+};
+
+/* starts the compute threads; without, tasks run on the loop that submits them */
+int hp_taskpool_start(size_t num_threads);
+void hp_task_submit(hp_loop_t *loop, hp_task_t *task);
+/* called from hp_task_t::run, to split the work; `task` completes on the loop of `parent`, in no particular order */
+void hp_task_spawn(hp_task_t *parent, hp_task_t *task);
+void hp_taskpool_get_stats(struct st_hp_taskpool_stats_t *stats);
+
+/* ssl.c */
+void hp_ssl_init(void);
+/* loads the context of every listener with a certificate into `ctxs` (indexed like `listeners`, NULL for the others);
+   identical files are loaded once, and unchanged ones come from the cache of previous calls */
+int hp_ssl_load_contexts(hp_listener_t *listeners, size_t num_listeners, size_t num_threads, struct ssl_ctx_st **ctxs);
+
+/* upstream.c: per-loop pool of connections to backends, kept open and reused across requests */
+#define HP_UPSTREAM_DEFAULT_MAX_CONNS 32
+#define HP_UPSTREAM_DEFAULT_QUEUE_TIMEOUT 1000 /* in milliseconds */
+
+typedef struct st_hp_upstream_t {
+        char *name; /* HOST:PORT, as given */
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+} hp_upstream_t;
+
+typedef struct st_hp_upstream_req_t hp_upstream_req_t;
+
+/* a request for a connection, embedded by the user; the callbacks run on the loop of the pool */
+struct st_hp_upstream_req_t {
+        /* called once; `conn` is NULL if none could be had within the queue timeout, or if connecting failed */
+        void (*on_connect)(hp_upstream_req_t *req, hp_conn_t *conn);
+        /* while the connection is leased; same convention as hp_handler_t::on_read */
+        ssize_t (*on_read)(hp_upstream_req_t *req, hp_conn_t *conn, hp_iovec_t input);
+        /* the leased connection was closed by the peer or by an error */
+        void (*on_close)(hp_upstream_req_t *req);
+        int reused; /* set before on_connect: the connection has served other requests before */
+        uint64_t _deadline;
+        void *_lease;
+        hp_upstream_req_t *_prev;
+        hp_upstream_req_t *_next;
+};
+
+typedef struct st_hp_upstream_pool_t {
+        hp_loop_t *loop;
+        struct st_hp_upstream_backend_t *backends;
+        size_t num_backends;
+        size_t max_conns; /* per backend */
+        uint64_t queue_timeout;
+        hp_upstream_req_t _queue; /* sentinel of the requests waiting for a connection */
+        hp_timer_t _queue_timer;
+        struct {
+                uint64_t connects;
+                uint64_t reuses;
+                uint64_t queued;
+                uint64_t timeouts;
+                uint64_t connect_errors;
+        } stats;
+} hp_upstream_pool_t;
+
+int hp_upstream_pool_init(hp_upstream_pool_t *pool, hp_loop_t *loop, hp_upstream_t *upstreams, size_t num_upstreams,
+                          size_t max_conns, uint64_t queue_timeout);
+/* hands out an idle connection of the backend with the fewest outstanding requests, opens a new one if that backend is
+   below the cap, or queues the request */
+void hp_upstream_acquire(hp_upstream_pool_t *pool, hp_upstream_req_t *req);
+/* withdraws a request that has not been handed a connection yet */
+void hp_upstream_cancel(hp_upstream_pool_t *pool, hp_upstream_req_t *req);
+/* ends the lease; the connection is kept for reuse unless `reusable` is zero */
+void hp_upstream_release(hp_upstream_pool_t *pool, hp_conn_t *conn, int reusable);
+
+/* cache.c: byte-bounded, sharded cache of responses shared by the loops.  Lookups take no lock; an entry returned by
+   hp_cache_get() stays valid until the calling loop reaches its next quiescent point, or until released if retained.
+   Concurrent misses for the same key are coalesced, so that only one of them goes to the origin. */
+#define HP_CACHE_DEFAULT_NUM_SHARDS 16
+
+typedef struct st_hp_cache_t hp_cache_t;
+typedef struct st_hp_cache_waiter_t hp_cache_waiter_t;
+
+typedef struct st_hp_cache_entry_t {
+        uint64_t hash;
+        uint64_t expire_at;
+        hp_iovec_t key;
+        hp_iovec_t value;
+        size_t _refcnt;
+        unsigned char _referenced;
+        uint64_t _retire_epoch;
+        struct st_hp_cache_entry_t *_next;       /* in the bucket */
+        struct st_hp_cache_entry_t *_clock_prev; /* in the CLOCK ring, then the retire list */
+        struct st_hp_cache_entry_t *_clock_next;
+} hp_cache_entry_t;
+
+/* a loop waiting for the fetch of another one, embedded by the user */
+struct st_hp_cache_waiter_t {
+        hp_loop_message_t super;
+        hp_loop_t *loop;
+        /* runs on `loop`; `entry` is retained for the waiter, or NULL if the fetch was abandoned */
+        void (*cb)(hp_cache_waiter_t *waiter, hp_cache_entry_t *entry);
+        hp_cache_entry_t *_entry;
+        uint64_t _hash;
+        void *_fetch;
+        hp_cache_waiter_t *_next;
+};
+
+typedef enum en_hp_cache_join_t {
+        HP_CACHE_FETCH, /* the caller fetches, then calls hp_cache_fill() or hp_cache_abandon() */
+        HP_CACHE_WAIT   /* the callback of the waiter will be called */
+} hp_cache_join_t;
+
+struct st_hp_cache_stats_t {
+        uint64_t insertions;
+        uint64_t evictions;
+        uint64_t expirations;
+        uint64_t coalesced;
+        size_t bytes;
+        size_t num_entries;
+};
+
+/* `ttl` is in milliseconds, 0 meaning forever */
+hp_cache_t *hp_cache_create(size_t capacity, size_t num_shards, uint64_t ttl);
+hp_cache_entry_t *hp_cache_get(hp_cache_t *cache, hp_iovec_t key, uint64_t now);
+/* to keep an entry past the quiescent point */
+void hp_cache_retain(hp_cache_entry_t *entry);
+void hp_cache_release(hp_cache_entry_t *entry);
+/* to be called after a miss; the key is copied */
+hp_cache_join_t hp_cache_join(hp_cache_t *cache, hp_iovec_t key, hp_cache_waiter_t *waiter, uint64_t now);
+/* stores the response of the fetch and hands it to the waiters; values that do not fit are handed out but not stored */
+void hp_cache_fill(hp_cache_t *cache, hp_iovec_t key, hp_iovec_t value, uint64_t now);
+/* ends the fetch without a response; the waiters are called with NULL */
+void hp_cache_abandon(hp_cache_t *cache, hp_iovec_t key);
+/* withdraws a waiter; returns -1 if its callback has already been posted, in which case it will still be called */
+int hp_cache_cancel_wait(hp_cache_t *cache, hp_cache_waiter_t *waiter);
+void hp_cache_get_stats(hp_cache_t *cache, struct st_hp_cache_stats_t *stats);
+
+/* frame.c: length-prefixed binary framing (32-bit big-endian length followed by the payload) */
+#define HP_FRAME_HEADER_SIZE 4
+#define HP_FRAME_DEFAULT_MAX_SIZE (16 * 1024 * 1024)
+
+typedef struct st_hp_frame_handler_t {
+        hp_handler_t super;
+        size_t max_frame_size;
+        /* payload is borrowed from the receive buffer; returns non-zero to close the connection */
+        int (*on_frame)(hp_conn_t *conn, hp_iovec_t payload);
+} hp_frame_handler_t;
+
+/* returns the size of the frame (header included), 0 if incomplete, or -1 if the frame is too large */
+ssize_t hp_frame_decode(hp_iovec_t input, size_t max_frame_size, hp_iovec_t *payload);
+int hp_frame_send(hp_conn_t *conn, const void *payload, size_t len);
+void hp_frame_handler_init(hp_frame_handler_t *handler, const char *name, int (*on_frame)(hp_conn_t *, hp_iovec_t));
+/* registers the reference handler `frame-echo` */
+void hp_frame_register_echo(void);
+/* registers `frame-sha256`, which answers each frame with its SHA-256 digest, computed on the task pool */
+void hp_frame_register_sha256(void);
+
+/* http1.c: HTTP/1.x request heads */
+#define HP_HTTP1_MAX_HEADERS 64
+
+typedef struct st_hp_http1_header_t {
+        hp_iovec_t name;
+        hp_iovec_t value;
+} hp_http1_header_t;
+
+/* the slices point into the parsed input */
+typedef struct st_hp_http1_request_t {
+        hp_iovec_t method;
+        hp_iovec_t path;
+        int minor_version;
+        hp_http1_header_t headers[HP_HTTP1_MAX_HEADERS];
+        size_t num_headers;
+} hp_http1_request_t;
+
+/* returns the size of the head, 0 if incomplete, or -1 if malformed */
+ssize_t hp_http1_parse_request(hp_iovec_t input, hp_http1_request_t *req);
+/* case-insensitive; returns the first occurrence, or NULL */
+const hp_http1_header_t *hp_http1_find_header(const hp_http1_request_t *req, const char *name);
+/* returns non-zero if the comma-separated list names `token` with a non-zero q-value, e.g. for Accept-Encoding */
+int hp_http1_contains_token(hp_iovec_t list, const char *token);
+
+/* compress.c: content encodings, with compressors pooled per loop and reset between streams rather than set up anew */
+typedef enum en_hp_encoding_t {
+        HP_ENCODING_GZIP,
+        HP_ENCODING_ZSTD,
+        HP_ENCODING_BROTLI,
+        HP_NUM_ENCODINGS
+} hp_encoding_t;
+
+typedef struct st_hp_compressor_t hp_compressor_t;
+
+/* per loop */
+struct st_hp_compress_stats_t {
+        uint64_t created;
+        uint64_t reused;
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+};
+
+/* the Content-Encoding tokens, indexed by hp_encoding_t */
+extern const char *hp_encoding_names[];
+/* whether the library of the encoding was built in */
+int hp_encoding_is_available(hp_encoding_t encoding);
+/* called on a loop; `size_hint` is the size of the whole input if known, else 0.  Returns NULL on failure. */
+hp_compressor_t *hp_compressor_acquire(hp_encoding_t encoding, int level, size_t size_hint);
+/* appends to `out`, growing it, the output for `len` more bytes of input, flushed so that it can be decoded; `final`
+   ends the stream.  Can be called on any thread, one at a time. */
+int hp_compressor_run(hp_compressor_t *c, const void *src, size_t len, int final, hp_buffer_t *out);
+/* returns it to the pool of the calling loop */
+void hp_compressor_release(hp_compressor_t *c);
+const struct st_hp_compress_stats_t *hp_compress_get_stats(void);
+
+/* file.c: static files over HTTP/1.1, registered as the handler `file`.  Each loop keeps the files it serves open,
+   along with their attributes and precompressed variants, until inotify reports a change or they are evicted.  Text
+   without a variant in an accepted encoding is compressed on the task pool. */
+#define HP_FILE_DEFAULT_CACHE_ENTRIES 1024
+
+typedef struct st_hp_file_config_t {
+        const char *root;
+        size_t max_cache_entries; /* per loop */
+} hp_file_config_t;
+
+/* per loop */
+struct st_hp_file_stats_t {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t invalidations;
+        uint64_t evictions;
+        uint64_t compressed_cached;  /* variants compressed whole and kept with the entry */
+        uint64_t compressed_streams; /* responses compressed as they are sent */
+        uint64_t compress_skipped;   /* sent as they are for want of a slot */
+};
+
+/* the configuration is first read when a connection arrives, hence may be filled in after registering */
+void hp_file_register(const hp_file_config_t *config);
+const struct st_hp_file_stats_t *hp_file_get_stats(void);
+
+/* proxy.c: relays frames to upstreams, registered as the handler `proxy` */
+typedef struct st_hp_proxy_config_t {
+        hp_upstream_t *upstreams;
+        size_t num_upstreams;
+        size_t max_conns; /* per upstream and loop */
+        uint64_t queue_timeout;
+        hp_cache_t *cache; /* responses keyed by the request, if set */
+} hp_proxy_config_t;
+
+/* per loop */
+struct st_hp_proxy_stats_t {
+        uint64_t cache_hits;
+        uint64_t cache_misses;
+        uint64_t cache_waits;
+};
+
+/* the configuration is first read when a connection arrives, hence may be filled in after registering */
+void hp_proxy_register(const hp_proxy_config_t *config);
+/* the pool of the calling loop, or NULL if it has not proxied anything yet */
+hp_upstream_pool_t *hp_proxy_get_pool(void);
+const struct st_hp_proxy_stats_t *hp_proxy_get_stats(void);
+
+/* scan.c: byte-class scanning for parsers (CRLF, `:`, token boundaries).  hp_scan_init() picks the
+   fastest kernel the CPU supports (AVX2, SSE4.2, or the scalar fallback). */
+typedef struct st_hp_scan_set_t {
+        uint8_t bitmap[32];
+        /* rows indexed by the low nibble, one bit per high nibble; for bytes below and above 0x80 */
+        uint8_t nibble_lo[16];
+        uint8_t nibble_hi[16];
+} hp_scan_set_t;
+
+typedef const char *(*hp_scan_find_cb)(const char *p, const char *end, const hp_scan_set_t *set);
+
+typedef struct st_hp_scan_kernel_t {
+        const char *name;
+        hp_scan_find_cb find;
+        int (*is_supported)(void);
+} hp_scan_kernel_t;
+
+/* NULL-terminated, ordered from the fastest */
+extern const hp_scan_kernel_t hp_scan_kernels[];
+extern hp_scan_find_cb hp_scan_find_impl;
+extern hp_scan_set_t hp_scan_eol_set;      /* CR, LF */
+extern hp_scan_set_t hp_scan_colon_set;    /* `:`, CR, LF */
+extern hp_scan_set_t hp_scan_nontoken_set; /* anything that is not a tchar of RFC 7230 */
+
+void hp_scan_set_init(hp_scan_set_t *set);
+void hp_scan_set_add(hp_scan_set_t *set, unsigned char lo, unsigned char hi);
+/* returns the name of the selected kernel */
+const char *hp_scan_init(void);
+
+/* returns the first byte in [p, end) that belongs to the set, or end */
+static inline const char *hp_scan_find(const char *p, const char *end, const hp_scan_set_t *set)
+{
+        return hp_scan_find_impl(p, end, set);
+}
+
 #endif
@@ -0,0 +1,133 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Bump allocator over one large region per worker, for state that lives as long as the worker
+   (connection tables, pooled buffers).  The region can be backed by explicit hugetlbfs pages or
+   by transparent huge pages, and is pre-faulted by the thread that owns it so that the pages are
+   local to its NUMA node.  When huge pages are unavailable, the next weaker backing is used. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "hoppang.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define PAGE_SIZE_ 4096
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+const char *hp_hugepages_names[] = {"off", "thp", "hugetlb", NULL};
+
+static void *map_hugetlb(size_t size)
+{
+#ifdef MAP_HUGETLB
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB | MAP_POPULATE,
+                       -1, 0);
+        return p != MAP_FAILED ? p : NULL;
+#else
+        errno = ENOTSUP;
+        return NULL;
+#endif
+}
+
+static void *map_thp(size_t size)
+{
+#ifdef MADV_HUGEPAGE
+        char *p, *aligned;
+
+        /* over-allocate so that the region can start on a huge page boundary */
+        if ((p = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+                return NULL;
+        aligned = (char *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (aligned != p)
+                munmap(p, aligned - p);
+        munmap(aligned + size, p + HUGE_PAGE_SIZE - aligned);
+        if (madvise(aligned, size, MADV_HUGEPAGE) != 0) {
+                munmap(aligned, size);
+                return NULL;
+        }
+        return aligned;
+#else
+        errno = ENOTSUP;
+        return NULL;
+#endif
+}
+
+static void *map_plain(size_t size)
+{
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p != MAP_FAILED ? p : NULL;
+}
+
+static void prefault(char *p, size_t size)
+{
+        size_t off;
+
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(p, size, MADV_POPULATE_WRITE) == 0)
+                return;
+#endif
+        for (off = 0; off < size; off += PAGE_SIZE_)
+                p[off] = 0;
+}
+
+int hp_arena_init(hp_arena_t *arena, size_t size, hp_hugepages_t mode)
+{
+        memset(arena, 0, sizeof(*arena));
+        if (size == 0)
+                return 0;
+        size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+        switch (mode) {
+        case HP_HUGEPAGES_HUGETLB:
+                if ((arena->base = map_hugetlb(size)) != NULL) {
+                        arena->backing = HP_HUGEPAGES_HUGETLB;
+                        break;
+                }
+                fprintf(stderr, "[WARN] failed to map %zu bytes of hugetlb pages (%s); falling back to transparent huge pages\n",
+                        size, strerror(errno));
+                /* fallthru */
+        case HP_HUGEPAGES_THP:
+                if ((arena->base = map_thp(size)) != NULL) {
+                        arena->backing = HP_HUGEPAGES_THP;
+                        break;
+                }
+                fprintf(stderr, "[WARN] transparent huge pages are not available (%s); using normal pages\n", strerror(errno));
+                /* fallthru */
+        case HP_HUGEPAGES_OFF:
+                if ((arena->base = map_plain(size)) == NULL) {
+                        perror("failed to map arena");
+                        return -1;
+                }
+                arena->backing = HP_HUGEPAGES_OFF;
+                break;
+        }
+        arena->size = size;
+        /* hugetlb mappings are populated by MAP_POPULATE */
+        if (arena->backing != HP_HUGEPAGES_HUGETLB)
+                prefault(arena->base, size);
+
+        return 0;
+}
+
+void *hp_arena_alloc(hp_arena_t *arena, size_t size, size_t align)
+{
+        size_t off = (arena->used + align - 1) & ~(align - 1);
+
+        if (arena->base == NULL || off + size > arena->size)
+                return NULL;
+        arena->used = off + size;
+        return arena->base + off;
+}
+
+void hp_arena_dispose(hp_arena_t *arena)
+{
+        if (arena->base != NULL)
+                munmap(arena->base, arena->size);
+        memset(arena, 0, sizeof(*arena));
+}
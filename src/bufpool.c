@@ -0,0 +1,199 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Per-loop I/O buffer pool.  Buffers come in 4K/16K/64K classes and are page-aligned, so that
+   the pages of a free buffer can be handed back to the OS while the buffer itself stays in the
+   pool.  Larger buffers are allocated and freed on demand.
+
+   Every `idle_timeout`, the buffers that stayed in the pool during the whole interval are
+   released with MADV_DONTNEED.  MADV_FREE would be cheaper, but the pages are only taken when
+   the system is under pressure, and the RSS does not come down until then.
+
+   When the loop has an arena, class buffers are carved from it first.  Those are pinned: they
+   cycle through the pool like the others but are never released, as the arena may be made of
+   huge pages that cannot be partially returned. */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "hoppang.h"
+
+#define PAGE_SIZE_ 4096
+/* cold buffers only cost address space; beyond this many per class they are freed */
+#define MAX_COLD 64
+
+const size_t hp_bufpool_class_sizes[HP_BUFPOOL_NUM_CLASSES] = {4096, 16384, 65536};
+
+void hp_bufpool_init(hp_bufpool_t *pool, uint64_t idle_timeout, hp_arena_t *arena)
+{
+        memset(pool, 0, sizeof(*pool));
+        pool->idle_timeout = idle_timeout;
+        pool->arena = arena;
+}
+
+static int is_pinned(hp_bufpool_t *pool, const void *p)
+{
+        return pool->arena != NULL && hp_arena_contains(pool->arena, p);
+}
+
+static int find_class(size_t capacity)
+{
+        int i;
+
+        for (i = 0; i != HP_BUFPOOL_NUM_CLASSES; ++i)
+                if (capacity <= hp_bufpool_class_sizes[i])
+                        return i;
+        return -1;
+}
+
+static void *alloc_pages(size_t size)
+{
+        void *p;
+
+        if (posix_memalign(&p, PAGE_SIZE_, size) != 0)
+                return NULL;
+        return p;
+}
+
+static void *pop(hp_bufpool_t *pool, int cls)
+{
+        size_t warm;
+        void *p;
+
+        if (pool->free[cls].size == 0)
+                return NULL;
+        p = pool->free[cls].entries[--pool->free[cls].size];
+        if (pool->free[cls].size < pool->free[cls].num_cold) {
+                /* the pages are faulted in again as they are touched */
+                pool->free[cls].num_cold = pool->free[cls].size;
+                if (!is_pinned(pool, p))
+                        pool->stats.resident_bytes += hp_bufpool_class_sizes[cls];
+        }
+        warm = pool->free[cls].size - pool->free[cls].num_cold;
+        if (warm < pool->free[cls].min_warm)
+                pool->free[cls].min_warm = warm;
+        return p;
+}
+
+static int push(hp_bufpool_t *pool, int cls, void *p)
+{
+        if (pool->free[cls].size == pool->free[cls].capacity) {
+                size_t capacity = pool->free[cls].capacity != 0 ? pool->free[cls].capacity * 2 : 64;
+                void **entries = realloc(pool->free[cls].entries, sizeof(entries[0]) * capacity);
+                if (entries == NULL)
+                        return -1;
+                pool->free[cls].entries = entries;
+                pool->free[cls].capacity = capacity;
+        }
+        pool->free[cls].entries[pool->free[cls].size++] = p;
+        return 0;
+}
+
+int hp_bufpool_reserve(hp_bufpool_t *pool, hp_buffer_t *buf, size_t min_room)
+{
+        size_t need = buf->size + min_room, capacity;
+        char *bytes = NULL;
+        int cls;
+
+        if (buf->capacity >= need)
+                return 0;
+
+        if ((cls = find_class(need)) != -1) {
+                capacity = hp_bufpool_class_sizes[cls];
+                if ((bytes = pop(pool, cls)) != NULL) {
+                        ++pool->stats.hits;
+                } else if (pool->arena != NULL && (bytes = hp_arena_alloc(pool->arena, capacity, PAGE_SIZE_)) != NULL) {
+                        ++pool->stats.misses;
+                }
+        } else {
+                /* doubles, so that a buffer grown a read at a time is copied O(n) bytes in all */
+                capacity = buf->capacity * 2 > need ? buf->capacity * 2 : need;
+                capacity = (capacity + PAGE_SIZE_ - 1) / PAGE_SIZE_ * PAGE_SIZE_;
+        }
+        if (bytes == NULL) {
+                if ((bytes = alloc_pages(capacity)) == NULL)
+                        return -1;
+                ++pool->stats.misses;
+                pool->stats.resident_bytes += capacity;
+        }
+
+        if (buf->size != 0)
+                memcpy(bytes, buf->bytes, buf->size);
+        {
+                size_t size = buf->size;
+                hp_bufpool_release(pool, buf);
+                buf->size = size;
+        }
+        buf->bytes = bytes;
+        buf->capacity = capacity;
+
+        return 0;
+}
+
+void hp_bufpool_release(hp_bufpool_t *pool, hp_buffer_t *buf)
+{
+        int cls;
+
+        if (buf->bytes == NULL)
+                return;
+        if ((cls = find_class(buf->capacity)) == -1 || hp_bufpool_class_sizes[cls] != buf->capacity ||
+            push(pool, cls, buf->bytes) != 0) {
+                /* a pinned buffer always fits a class, and the free list only fails to grow on OOM */
+                if (is_pinned(pool, buf->bytes))
+                        goto Exit;
+                free(buf->bytes);
+                pool->stats.resident_bytes -= buf->capacity;
+        }
+Exit:
+        *buf = (hp_buffer_t){NULL, 0, 0};
+}
+
+int hp_bufpool_reclaim(hp_bufpool_t *pool, uint64_t now)
+{
+        int cls, has_warm = 0;
+
+        if (pool->idle_timeout == 0)
+                return -1;
+
+        if (now >= pool->next_reclaim_at) {
+                for (cls = 0; cls != HP_BUFPOOL_NUM_CLASSES; ++cls) {
+                        size_t class_size = hp_bufpool_class_sizes[cls], i, j;
+                        /* the bottom of the warm region is what was not touched during the interval */
+                        for (i = 0; i != pool->free[cls].min_warm; ++i) {
+                                void *p = pool->free[cls].entries[pool->free[cls].num_cold + i];
+                                if (is_pinned(pool, p))
+                                        continue;
+                                madvise(p, class_size, MADV_DONTNEED);
+                                pool->stats.resident_bytes -= class_size;
+                                pool->stats.reclaimed_bytes += class_size;
+                        }
+                        pool->free[cls].num_cold += pool->free[cls].min_warm;
+                        /* free the oldest cold buffers beyond the limit; pinned ones are kept */
+                        if (pool->free[cls].num_cold > MAX_COLD) {
+                                size_t excess = pool->free[cls].num_cold - MAX_COLD;
+                                for (i = 0, j = 0; i != pool->free[cls].size; ++i) {
+                                        void *p = pool->free[cls].entries[i];
+                                        if (excess != 0 && i < pool->free[cls].num_cold && !is_pinned(pool, p)) {
+                                                free(p);
+                                                --excess;
+                                                continue;
+                                        }
+                                        pool->free[cls].entries[j++] = p;
+                                }
+                                pool->free[cls].num_cold -= pool->free[cls].size - j;
+                                pool->free[cls].size = j;
+                        }
+                        pool->free[cls].min_warm = pool->free[cls].size - pool->free[cls].num_cold;
+                }
+                pool->next_reclaim_at = now + pool->idle_timeout;
+        }
+
+        for (cls = 0; cls != HP_BUFPOOL_NUM_CLASSES; ++cls)
+                if (pool->free[cls].size != pool->free[cls].num_cold)
+                        has_warm = 1;
+        if (!has_warm)
+                return -1;
+        return pool->next_reclaim_at - now < INT_MAX ? (int)(pool->next_reclaim_at - now) : INT_MAX;
+}
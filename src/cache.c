@@ -0,0 +1,434 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Response cache shared by the loops.  The keys are spread over shards, each with its own lock,
+   byte budget and CLOCK ring.  Readers walk the bucket chains without taking the lock: entries are
+   fully built before being linked with a release store, and an unlinked entry keeps its `_next`
+   intact and is freed only after every loop has passed a quiescent point (see
+   hp_loop_start_grace_period()).  A hit merely sets the reference bit, which the CLOCK hand clears
+   as it sweeps; entries found unreferenced or expired are evicted.
+
+   A miss registers a fetch for the key; the misses that follow while it is in progress wait for
+   its result instead of going to the origin themselves, and are called back on their own loops. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hoppang.h"
+
+#define MIN_BUCKETS 64
+#define EXPECTED_ENTRY_SIZE 1024 /* for sizing the bucket arrays, which are never resized */
+#define MAX_ENTRY_SHARE 8        /* entries larger than 1/8 of a shard would flush too much of it */
+
+struct st_cache_fetch_t {
+        uint64_t hash;
+        hp_iovec_t key;
+        hp_cache_waiter_t *waiters;
+        hp_cache_waiter_t **waiters_tail;
+        struct st_cache_fetch_t *next;
+};
+
+struct st_cache_shard_t {
+        pthread_mutex_t mutex;
+        hp_cache_entry_t **buckets;
+        size_t bucket_mask;
+        size_t capacity;
+        size_t bytes;
+        size_t num_entries;
+        hp_cache_entry_t *hand; /* NULL if the ring is empty */
+        hp_cache_entry_t *retired;
+        hp_cache_entry_t **retired_tail;
+        struct st_cache_fetch_t *fetches;
+        uint64_t insertions;
+        uint64_t evictions;
+        uint64_t expirations;
+        uint64_t coalesced;
+} __attribute__((aligned(64)));
+
+struct st_hp_cache_t {
+        struct st_cache_shard_t *shards;
+        size_t num_shards;
+        uint64_t ttl;
+};
+
+static struct st_cache_shard_t *get_shard(hp_cache_t *cache, uint64_t hash)
+{
+        return cache->shards + (hash >> 32) % cache->num_shards;
+}
+
+static size_t entry_size(hp_cache_entry_t *entry)
+{
+        return sizeof(*entry) + entry->key.len + entry->value.len;
+}
+
+static int entry_matches(hp_cache_entry_t *entry, uint64_t hash, hp_iovec_t key)
+{
+        return entry->hash == hash && entry->key.len == key.len && memcmp(entry->key.base, key.base, key.len) == 0;
+}
+
+static int is_expired(hp_cache_entry_t *entry, uint64_t now)
+{
+        return entry->expire_at != 0 && entry->expire_at <= now;
+}
+
+hp_cache_t *hp_cache_create(size_t capacity, size_t num_shards, uint64_t ttl)
+{
+        hp_cache_t *cache;
+        size_t num_buckets, i;
+
+        if (num_shards == 0)
+                num_shards = HP_CACHE_DEFAULT_NUM_SHARDS;
+        for (num_buckets = MIN_BUCKETS; num_buckets < capacity / num_shards / EXPECTED_ENTRY_SIZE; num_buckets *= 2)
+                ;
+
+        if ((cache = calloc(1, sizeof(*cache))) == NULL)
+                return NULL;
+        if (posix_memalign((void **)&cache->shards, 64, num_shards * sizeof(cache->shards[0])) != 0)
+                goto Error;
+        memset(cache->shards, 0, num_shards * sizeof(cache->shards[0]));
+        cache->num_shards = num_shards;
+        cache->ttl = ttl;
+        for (i = 0; i != num_shards; ++i) {
+                struct st_cache_shard_t *shard = cache->shards + i;
+                pthread_mutex_init(&shard->mutex, NULL);
+                if ((shard->buckets = calloc(num_buckets, sizeof(shard->buckets[0]))) == NULL)
+                        goto Error;
+                shard->bucket_mask = num_buckets - 1;
+                shard->capacity = capacity / num_shards;
+                shard->retired_tail = &shard->retired;
+        }
+        return cache;
+
+Error:
+        if (cache->shards != NULL) {
+                for (i = 0; i != num_shards; ++i)
+                        free(cache->shards[i].buckets);
+                free(cache->shards);
+        }
+        free(cache);
+        return NULL;
+}
+
+hp_cache_entry_t *hp_cache_get(hp_cache_t *cache, hp_iovec_t key, uint64_t now)
+{
+        uint64_t hash = hp_hash(key.base, key.len);
+        struct st_cache_shard_t *shard = get_shard(cache, hash);
+        hp_cache_entry_t *entry;
+
+        for (entry = __atomic_load_n(shard->buckets + (hash & shard->bucket_mask), __ATOMIC_ACQUIRE); entry != NULL;
+             entry = __atomic_load_n(&entry->_next, __ATOMIC_ACQUIRE)) {
+                if (!entry_matches(entry, hash, key))
+                        continue;
+                if (is_expired(entry, now))
+                        return NULL;
+                /* checked first so that hot entries do not keep bouncing the cache line between the readers */
+                if (!__atomic_load_n(&entry->_referenced, __ATOMIC_RELAXED))
+                        __atomic_store_n(&entry->_referenced, 1, __ATOMIC_RELAXED);
+                return entry;
+        }
+        return NULL;
+}
+
+void hp_cache_retain(hp_cache_entry_t *entry)
+{
+        __atomic_add_fetch(&entry->_refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void hp_cache_release(hp_cache_entry_t *entry)
+{
+        if (__atomic_sub_fetch(&entry->_refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+                free(entry);
+}
+
+/* frees the entries that no loop can be looking at any more; called with the lock held */
+static void reclaim(struct st_cache_shard_t *shard)
+{
+        hp_cache_entry_t *entry;
+        uint64_t epoch;
+
+        if (shard->retired == NULL)
+                return;
+        /* the list is in the order of retirement, hence of the epochs */
+        epoch = hp_loop_quiescent_epoch();
+        while ((entry = shard->retired) != NULL && entry->_retire_epoch <= epoch) {
+                if ((shard->retired = entry->_clock_next) == NULL)
+                        shard->retired_tail = &shard->retired;
+                hp_cache_release(entry);
+        }
+}
+
+static hp_cache_entry_t *find_locked(struct st_cache_shard_t *shard, uint64_t hash, hp_iovec_t key, hp_cache_entry_t ***slot)
+{
+        hp_cache_entry_t **p, *entry;
+
+        for (p = shard->buckets + (hash & shard->bucket_mask); (entry = *p) != NULL; p = &entry->_next) {
+                if (entry_matches(entry, hash, key)) {
+                        if (slot != NULL)
+                                *slot = p;
+                        return entry;
+                }
+        }
+        return NULL;
+}
+
+static void unlink_entry(struct st_cache_shard_t *shard, hp_cache_entry_t *entry, hp_cache_entry_t **slot)
+{
+        /* readers standing on the entry carry on through its `_next`, which is left as is */
+        __atomic_store_n(slot, entry->_next, __ATOMIC_RELEASE);
+
+        if (entry->_clock_next == entry) {
+                shard->hand = NULL;
+        } else {
+                if (shard->hand == entry)
+                        shard->hand = entry->_clock_next;
+                entry->_clock_prev->_clock_next = entry->_clock_next;
+                entry->_clock_next->_clock_prev = entry->_clock_prev;
+        }
+        shard->bytes -= entry_size(entry);
+        --shard->num_entries;
+
+        entry->_retire_epoch = hp_loop_start_grace_period();
+        entry->_clock_prev = NULL;
+        entry->_clock_next = NULL;
+        *shard->retired_tail = entry;
+        shard->retired_tail = &entry->_clock_next;
+}
+
+static void evict_one(struct st_cache_shard_t *shard, uint64_t now)
+{
+        hp_cache_entry_t *entry, **slot;
+
+        /* two sweeps at most; the first one clears the reference bits */
+        while (1) {
+                entry = shard->hand;
+                if (is_expired(entry, now)) {
+                        ++shard->expirations;
+                        break;
+                }
+                if (!__atomic_load_n(&entry->_referenced, __ATOMIC_RELAXED)) {
+                        ++shard->evictions;
+                        break;
+                }
+                __atomic_store_n(&entry->_referenced, 0, __ATOMIC_RELAXED);
+                shard->hand = entry->_clock_next;
+        }
+        find_locked(shard, entry->hash, entry->key, &slot);
+        unlink_entry(shard, entry, slot);
+}
+
+static void insert_entry(struct st_cache_shard_t *shard, hp_cache_entry_t *entry)
+{
+        hp_cache_entry_t **bucket = shard->buckets + (entry->hash & shard->bucket_mask);
+
+        /* behind the hand, so that it is the last to be looked at */
+        if (shard->hand == NULL) {
+                entry->_clock_prev = entry->_clock_next = entry;
+                shard->hand = entry;
+        } else {
+                entry->_clock_next = shard->hand;
+                entry->_clock_prev = shard->hand->_clock_prev;
+                entry->_clock_prev->_clock_next = entry;
+                shard->hand->_clock_prev = entry;
+        }
+        shard->bytes += entry_size(entry);
+        ++shard->num_entries;
+        ++shard->insertions;
+
+        entry->_next = *bucket;
+        __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+}
+
+static struct st_cache_fetch_t *take_fetch(struct st_cache_shard_t *shard, uint64_t hash, hp_iovec_t key)
+{
+        struct st_cache_fetch_t **p, *fetch;
+
+        for (p = &shard->fetches; (fetch = *p) != NULL; p = &fetch->next) {
+                if (fetch->hash == hash && fetch->key.len == key.len && memcmp(fetch->key.base, key.base, key.len) == 0) {
+                        *p = fetch->next;
+                        return fetch;
+                }
+        }
+        return NULL;
+}
+
+static void on_waiter_message(hp_loop_t *loop, hp_loop_message_t *msg)
+{
+        hp_cache_waiter_t *waiter = HP_STRUCT_FROM_MEMBER(hp_cache_waiter_t, super, msg);
+
+        waiter->cb(waiter, waiter->_entry);
+}
+
+/* posts the waiters detached from their fetch; called without the lock */
+static void notify_waiters(hp_cache_waiter_t *waiter)
+{
+        hp_cache_waiter_t *next;
+
+        for (; waiter != NULL; waiter = next) {
+                next = waiter->_next;
+                hp_loop_post(waiter->loop, &waiter->super);
+        }
+}
+
+hp_cache_join_t hp_cache_join(hp_cache_t *cache, hp_iovec_t key, hp_cache_waiter_t *waiter, uint64_t now)
+{
+        uint64_t hash = hp_hash(key.base, key.len);
+        struct st_cache_shard_t *shard = get_shard(cache, hash);
+        struct st_cache_fetch_t *fetch;
+        hp_cache_entry_t *entry;
+
+        waiter->super.cb = on_waiter_message;
+        waiter->_hash = hash;
+        waiter->_fetch = NULL;
+        waiter->_next = NULL;
+
+        pthread_mutex_lock(&shard->mutex);
+        reclaim(shard);
+
+        /* filled since the lookup */
+        if ((entry = find_locked(shard, hash, key, NULL)) != NULL && !is_expired(entry, now)) {
+                hp_cache_retain(entry);
+                waiter->_entry = entry;
+                pthread_mutex_unlock(&shard->mutex);
+                notify_waiters(waiter);
+                return HP_CACHE_WAIT;
+        }
+
+        for (fetch = shard->fetches; fetch != NULL; fetch = fetch->next) {
+                if (fetch->hash == hash && fetch->key.len == key.len && memcmp(fetch->key.base, key.base, key.len) == 0) {
+                        waiter->_fetch = fetch;
+                        *fetch->waiters_tail = waiter;
+                        fetch->waiters_tail = &waiter->_next;
+                        ++shard->coalesced;
+                        pthread_mutex_unlock(&shard->mutex);
+                        return HP_CACHE_WAIT;
+                }
+        }
+
+        /* without a record of the fetch, the misses that follow go to the origin as well */
+        if ((fetch = malloc(sizeof(*fetch) + key.len)) != NULL) {
+                fetch->hash = hash;
+                fetch->key = hp_iovec_init(fetch + 1, key.len);
+                memcpy(fetch->key.base, key.base, key.len);
+                fetch->waiters = NULL;
+                fetch->waiters_tail = &fetch->waiters;
+                fetch->next = shard->fetches;
+                shard->fetches = fetch;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        return HP_CACHE_FETCH;
+}
+
+void hp_cache_fill(hp_cache_t *cache, hp_iovec_t key, hp_iovec_t value, uint64_t now)
+{
+        uint64_t hash = hp_hash(key.base, key.len);
+        struct st_cache_shard_t *shard = get_shard(cache, hash);
+        struct st_cache_fetch_t *fetch;
+        hp_cache_entry_t *entry, *old, **slot;
+        hp_cache_waiter_t *waiter, *waiters = NULL;
+        size_t size = sizeof(*entry) + key.len + value.len;
+        int stored = 0;
+
+        if ((entry = malloc(size)) == NULL) {
+                hp_cache_abandon(cache, key);
+                return;
+        }
+        memset(entry, 0, sizeof(*entry));
+        entry->hash = hash;
+        entry->expire_at = cache->ttl != 0 ? now + cache->ttl : 0;
+        entry->key = hp_iovec_init(entry + 1, key.len);
+        memcpy(entry->key.base, key.base, key.len);
+        entry->value = hp_iovec_init(entry->key.base + key.len, value.len);
+        memcpy(entry->value.base, value.base, value.len);
+
+        pthread_mutex_lock(&shard->mutex);
+        reclaim(shard);
+
+        if (size <= shard->capacity / MAX_ENTRY_SHARE) {
+                if ((old = find_locked(shard, hash, key, &slot)) != NULL)
+                        unlink_entry(shard, old, slot);
+                while (shard->bytes + size > shard->capacity)
+                        evict_one(shard, now);
+                entry->_refcnt = 1;
+                insert_entry(shard, entry);
+                stored = 1;
+        }
+
+        if ((fetch = take_fetch(shard, hash, key)) != NULL) {
+                waiters = fetch->waiters;
+                for (waiter = waiters; waiter != NULL; waiter = waiter->_next) {
+                        /* once linked, the entry can be retained by the readers concurrently */
+                        hp_cache_retain(entry);
+                        waiter->_entry = entry;
+                        waiter->_fetch = NULL;
+                }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        /* neither stored nor waited for */
+        if (!stored && waiters == NULL)
+                free(entry);
+        notify_waiters(waiters);
+        free(fetch);
+}
+
+void hp_cache_abandon(hp_cache_t *cache, hp_iovec_t key)
+{
+        uint64_t hash = hp_hash(key.base, key.len);
+        struct st_cache_shard_t *shard = get_shard(cache, hash);
+        struct st_cache_fetch_t *fetch;
+        hp_cache_waiter_t *waiter, *waiters = NULL;
+
+        pthread_mutex_lock(&shard->mutex);
+        if ((fetch = take_fetch(shard, hash, key)) != NULL) {
+                waiters = fetch->waiters;
+                for (waiter = waiters; waiter != NULL; waiter = waiter->_next) {
+                        waiter->_entry = NULL;
+                        waiter->_fetch = NULL;
+                }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        notify_waiters(waiters);
+        free(fetch);
+}
+
+int hp_cache_cancel_wait(hp_cache_t *cache, hp_cache_waiter_t *waiter)
+{
+        struct st_cache_shard_t *shard = get_shard(cache, waiter->_hash);
+        struct st_cache_fetch_t *fetch;
+        hp_cache_waiter_t **p;
+        int ret = -1;
+
+        pthread_mutex_lock(&shard->mutex);
+        if ((fetch = waiter->_fetch) != NULL) {
+                for (p = &fetch->waiters; *p != waiter; p = &(*p)->_next)
+                        ;
+                if ((*p = waiter->_next) == NULL)
+                        fetch->waiters_tail = p;
+                waiter->_fetch = NULL;
+                ret = 0;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        return ret;
+}
+
+void hp_cache_get_stats(hp_cache_t *cache, struct st_hp_cache_stats_t *stats)
+{
+        size_t i;
+
+        memset(stats, 0, sizeof(*stats));
+        for (i = 0; i != cache->num_shards; ++i) {
+                struct st_cache_shard_t *shard = cache->shards + i;
+                pthread_mutex_lock(&shard->mutex);
+                stats->insertions += shard->insertions;
+                stats->evictions += shard->evictions;
+                stats->expirations += shard->expirations;
+                stats->coalesced += shard->coalesced;
+                stats->bytes += shard->bytes;
+                stats->num_entries += shard->num_entries;
+                pthread_mutex_unlock(&shard->mutex);
+        }
+}
@@ -0,0 +1,177 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Traffic capture.  What the accepted connections receive is appended to a file along with when,
+   for tools/replay.c to send again.  The file starts with HP_CAPTURE_MAGIC and the time the capture
+   began, in microseconds of CLOCK_MONOTONIC as 8 bytes little-endian.  A record is a type byte
+   followed by varints: the connection id, the time in microseconds since the capture began, and
+   for data the length and the bytes.  The time at which a handler first writes after receiving is
+   recorded as well, so that the replay has the latencies of the capture to compare against.
+
+   Each loop appends to a buffer of its own and writes it out with one write(2) once it has grown,
+   or once a second; the file is opened with O_APPEND so that the loops, and the worker processes,
+   never split each other's records.  The records of a connection are in order except when it
+   moves to another loop; the replay sorts them by time.  What TLS connections receive is captured
+   decrypted. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hoppang.h"
+
+#define FLUSH_SIZE (64 * 1024)
+#define FLUSH_INTERVAL 1000 /* in milliseconds */
+#define MAX_RECORD_HEAD 32  /* type and up to three varints */
+
+int hp_capture_enabled;
+
+static struct {
+        int fd;
+        uint64_t start_nsec; /* by hp_clock_nsec(), which the records are timed with */
+        size_t instance; /* distinguishes the ids of the worker processes */
+        uint64_t max_size;
+        uint64_t written; /* by this process */
+        uint64_t num_conns;
+} capture = {-1};
+
+static __thread struct {
+        hp_buffer_t buf;
+        uint64_t last_flush;
+} out;
+
+static char *encode_varint(char *p, uint64_t v)
+{
+        while (v >= 0x80) {
+                *p++ = (char)(v | 0x80);
+                v >>= 7;
+        }
+        *p++ = (char)v;
+        return p;
+}
+
+int hp_capture_open(const char *path, int create, size_t instance, uint64_t max_size)
+{
+        unsigned char header[HP_CAPTURE_HEADER_SIZE];
+        uint64_t start_usec = 0, monotonic_start;
+        size_t i;
+
+        if (create) {
+                if ((capture.fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND | O_CLOEXEC, 0644)) == -1)
+                        return -1;
+                /* the worker processes read the start from the file, so that their times agree */
+                monotonic_start = hp_clock_gettime_nsec();
+                start_usec = monotonic_start / 1000;
+                memcpy(header, HP_CAPTURE_MAGIC, sizeof(HP_CAPTURE_MAGIC));
+                for (i = 0; i != 8; ++i)
+                        header[sizeof(HP_CAPTURE_MAGIC) + i] = (unsigned char)(start_usec >> (i * 8));
+                if (write(capture.fd, header, sizeof(header)) != sizeof(header))
+                        goto Error;
+        } else {
+                if ((capture.fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC)) == -1)
+                        return -1;
+                if (pread(capture.fd, header, sizeof(header), 0) != sizeof(header) ||
+                    memcmp(header, HP_CAPTURE_MAGIC, sizeof(HP_CAPTURE_MAGIC)) != 0) {
+                        errno = EINVAL;
+                        goto Error;
+                }
+                for (i = 0; i != 8; ++i)
+                        start_usec |= (uint64_t)header[sizeof(HP_CAPTURE_MAGIC) + i] << (i * 8);
+                monotonic_start = start_usec * 1000;
+        }
+        /* the start as it reads on the interval clock; the two clocks are compared only this once */
+        capture.start_nsec = hp_clock_nsec() - (hp_clock_gettime_nsec() - monotonic_start);
+        capture.instance = instance;
+        /* a worker restarted by the supervisor does not reuse the ids of the one it replaces */
+        capture.num_conns = (hp_clock_gettime_nsec() - monotonic_start) / 1000;
+        capture.max_size = max_size;
+        hp_capture_enabled = 1;
+        return 0;
+
+Error:
+        close(capture.fd);
+        capture.fd = -1;
+        return -1;
+}
+
+void hp_capture_flush(hp_loop_t *loop, int force)
+{
+        ssize_t r;
+
+        if (!hp_capture_enabled) {
+                out.buf.size = 0;
+                return;
+        }
+        if (out.buf.size == 0 || (!force && out.buf.size < FLUSH_SIZE && loop->now - out.last_flush < FLUSH_INTERVAL))
+                return;
+        out.last_flush = loop->now;
+        if (__atomic_add_fetch(&capture.written, out.buf.size, __ATOMIC_RELAXED) > capture.max_size) {
+                if (__atomic_exchange_n(&hp_capture_enabled, 0, __ATOMIC_RELAXED))
+                        fprintf(stderr, "[INFO] capture reached its size limit; stopped\n");
+                out.buf.size = 0;
+                return;
+        }
+        while ((r = write(capture.fd, out.buf.bytes, out.buf.size)) == -1 && errno == EINTR)
+                ;
+        if (r != (ssize_t)out.buf.size) {
+                fprintf(stderr, "[ERROR] failed to write capture:%s; stopped\n", r == -1 ? strerror(errno) : "short write");
+                __atomic_store_n(&hp_capture_enabled, 0, __ATOMIC_RELAXED);
+        }
+        out.buf.size = 0;
+}
+
+static void append_record(hp_conn_t *conn, int type, const void *bytes, size_t len)
+{
+        size_t need = MAX_RECORD_HEAD + len, capacity;
+        uint64_t usec = (hp_clock_nsec() - capture.start_nsec) / 1000;
+        char *p, *grown;
+
+        if (!hp_capture_enabled)
+                return;
+        if (out.buf.capacity - out.buf.size < need) {
+                for (capacity = out.buf.capacity != 0 ? out.buf.capacity : FLUSH_SIZE * 2; capacity - out.buf.size < need;
+                     capacity *= 2)
+                        ;
+                if ((grown = realloc(out.buf.bytes, capacity)) == NULL)
+                        return;
+                out.buf.bytes = grown;
+                out.buf.capacity = capacity;
+        }
+        p = out.buf.bytes + out.buf.size;
+        *p++ = (char)type;
+        p = encode_varint(p, conn->_capture_id);
+        p = encode_varint(p, usec);
+        if (type == HP_CAPTURE_DATA) {
+                p = encode_varint(p, len);
+                memcpy(p, bytes, len);
+                p += len;
+        }
+        out.buf.size = p - out.buf.bytes;
+        hp_capture_flush(conn->loop, 0);
+}
+
+void hp_capture_conn_open(hp_conn_t *conn)
+{
+        conn->_capture_id = __atomic_add_fetch(&capture.num_conns, 1, __ATOMIC_RELAXED) << 8 | (capture.instance & 0xff);
+        append_record(conn, HP_CAPTURE_OPEN, NULL, 0);
+}
+
+void hp_capture_conn_data(hp_conn_t *conn, const void *bytes, size_t len)
+{
+        append_record(conn, HP_CAPTURE_DATA, bytes, len);
+        conn->_capture_awaiting_reply = 1;
+}
+
+void hp_capture_conn_reply(hp_conn_t *conn)
+{
+        append_record(conn, HP_CAPTURE_REPLY, NULL, 0);
+        conn->_capture_awaiting_reply = 0;
+}
+
+void hp_capture_conn_close(hp_conn_t *conn)
+{
+        append_record(conn, HP_CAPTURE_CLOSE, NULL, 0);
+        conn->_capture_id = 0;
+}
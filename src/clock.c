@@ -0,0 +1,138 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Time.  The loops read the coarse clocks once per iteration (hp_loop_t::now, wall_now), which is
+   enough for timers and for anything shown to people.  Intervals finer than that are measured with
+   hp_clock_nsec(), which scales the TSC when the kernel trusts it, that is when the TSC is
+   invariant and is the clocksource, so that the counters of the CPUs agree; it takes a few
+   nanoseconds without a call into the vDSO.  Elsewhere hp_clock_nsec() is clock_gettime(2).
+
+   The current time formatted for the logs and for the Date header changes once a second; each
+   thread keeps the last string it made. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "hoppang.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#define CALIBRATION_NSEC 20000000
+
+hp_clock_tsc_t hp_clock_tsc;
+
+struct st_formatted_t {
+        time_t sec;
+        char buf[40];
+};
+
+static __thread struct st_formatted_t log_time = {-1}, http_date = {-1};
+
+#if defined(__x86_64__)
+
+static int kernel_uses_tsc(void)
+{
+        unsigned eax, ebx, ecx, edx;
+        char name[32] = "";
+        FILE *fp;
+
+        /* invariant: runs at a constant rate through P-, C- and T-states */
+        if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || (edx & (1u << 8)) == 0)
+                return 0;
+        /* the kernel falls back to another clocksource once it finds the TSC unstable, e.g. across sockets */
+        if ((fp = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r")) == NULL)
+                return 0;
+        if (fgets(name, sizeof(name), fp) == NULL)
+                name[0] = '\0';
+        fclose(fp);
+        return strcmp(name, "tsc\n") == 0;
+}
+
+static uint64_t timespec_nsec(const struct timespec *ts)
+{
+        return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+int hp_clock_init(void)
+{
+        struct timespec start, end, mono, delay = {0, CALIBRATION_NSEC};
+        uint64_t start_tsc, end_tsc;
+
+        if (!kernel_uses_tsc())
+                return 0;
+        /* against the raw clock, which NTP does not slew */
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        start_tsc = __builtin_ia32_rdtsc();
+        nanosleep(&delay, NULL);
+        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+        end_tsc = __builtin_ia32_rdtsc();
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        if (end_tsc <= start_tsc)
+                return 0;
+
+        hp_clock_tsc.mult = ((timespec_nsec(&end) - timespec_nsec(&start)) << 32) / (end_tsc - start_tsc);
+        hp_clock_tsc.base_tsc = end_tsc;
+        hp_clock_tsc.base_nsec = timespec_nsec(&mono);
+        hp_clock_tsc.enabled = 1;
+        return 1;
+}
+
+#else
+
+int hp_clock_init(void)
+{
+        return 0;
+}
+
+#endif
+
+uint64_t hp_clock_gettime_nsec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+const char *hp_clock_log_time(uint64_t wall_msec)
+{
+        time_t sec = (time_t)(wall_msec / 1000);
+        struct tm tm;
+
+        if (sec != log_time.sec) {
+                localtime_r(&sec, &tm);
+                strftime(log_time.buf, sizeof(log_time.buf), "%Y-%m-%d %H:%M:%S %z", &tm);
+                log_time.sec = sec;
+        }
+        return log_time.buf;
+}
+
+const char *hp_clock_http_date(uint64_t wall_msec)
+{
+        time_t sec = (time_t)(wall_msec / 1000);
+        struct tm tm;
+
+        if (sec != http_date.sec) {
+                gmtime_r(&sec, &tm);
+                strftime(http_date.buf, sizeof(http_date.buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+                http_date.sec = sec;
+        }
+        return http_date.buf;
+}
+
+uint64_t hp_latency_percentile(const hp_latency_histogram_t *h, double percentile)
+{
+        uint64_t rank = (uint64_t)(h->count * percentile / 100), seen = 0, bound;
+        size_t i;
+
+        for (i = 0; i != HP_LATENCY_NUM_BUCKETS; ++i) {
+                if ((seen += h->buckets[i]) > rank) {
+                        bound = i == 0 ? 0 : (uint64_t)1 << i;
+                        return bound < h->max ? bound : h->max;
+                }
+        }
+        return h->max;
+}
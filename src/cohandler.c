@@ -0,0 +1,209 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Handlers written as straight-line code.  Each connection runs `main` in a coroutine of its own;
+   hp_co_read() returns what has been received, and yields to the loop when there is nothing, to be
+   resumed from on_read; hp_co_sleep() yields until a timer fires.  Writes go to the write buffer of
+   the connection as with any handler, and the loop sends them as the socket allows.
+
+   Once the connection is closed every call returns at once with an error, so that `main` runs to
+   its end; the coroutine is then gone before on_close returns. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hoppang.h"
+
+enum {
+        WAIT_NONE,
+        WAIT_READ,
+        WAIT_SLEEP,
+};
+
+static void coro_main(hp_coro_t *coro, void *_co)
+{
+        hp_co_t *co = _co;
+        hp_coro_handler_t *self = HP_STRUCT_FROM_MEMBER(hp_coro_handler_t, super, co->conn->handler);
+
+        self->main(co);
+}
+
+/* runs the coroutine until it yields or ends; the connection is closed once `main` has returned */
+static void resume(hp_co_t *co)
+{
+        if (!hp_coro_resume(co->_coro)) {
+                co->_coro = NULL;
+                hp_conn_close(co->conn);
+        }
+}
+
+static int on_co_accept(hp_conn_t *conn)
+{
+        hp_coro_handler_t *self = HP_STRUCT_FROM_MEMBER(hp_coro_handler_t, super, conn->handler);
+        hp_co_t *co;
+
+        /* a message is to be consumed whole, but `main` reads as much as it wants */
+        if (conn->seqpacket) {
+                fprintf(stderr, "[ERROR] handler `%s` does not serve SOCK_SEQPACKET connections\n", conn->handler->name);
+                return -1;
+        }
+        if ((co = calloc(1, sizeof(*co))) == NULL)
+                return -1;
+        co->conn = conn;
+        if ((co->_coro = hp_coro_create(coro_main, co, self->stack_size)) == NULL) {
+                perror("[ERROR] failed to allocate a coroutine stack");
+                free(co);
+                return -1;
+        }
+        conn->data = co;
+        resume(co);
+        return 0;
+}
+
+static ssize_t on_co_read(hp_conn_t *conn, hp_iovec_t input)
+{
+        hp_co_t *co = conn->data;
+        size_t consumed = 0;
+
+        /* what arrives meanwhile stays in the read buffer, from which hp_co_read() takes it later */
+        if (co->_coro == NULL || co->_wait != WAIT_READ)
+                return 0;
+        co->_input = input;
+        co->_consumed = &consumed;
+        resume(co);
+        co->_consumed = NULL;
+        return (ssize_t)consumed;
+}
+
+static void on_co_close(hp_conn_t *conn)
+{
+        hp_co_t *co = conn->data;
+
+        if (co == NULL)
+                return;
+        if (co->_coro != NULL) {
+                if (hp_timer_is_linked(&co->_timer))
+                        hp_timer_unlink(&co->_timer);
+                /* unwinds; the connection is marked closing, so nothing yields again */
+                resume(co);
+                if (co->_coro != NULL) {
+                        fprintf(stderr, "[ERROR] coroutine of handler `%s` yielded after its connection was closed\n",
+                                conn->handler->name);
+                        abort();
+                }
+        }
+        conn->data = NULL;
+        free(co);
+}
+
+/* the timers belong to the loop, and the input is tracked from its stack */
+static int on_co_migrate(hp_conn_t *conn)
+{
+        return -1;
+}
+
+static void on_co_timer(hp_loop_t *loop, hp_timer_t *timer)
+{
+        hp_co_t *co = HP_STRUCT_FROM_MEMBER(hp_co_t, _timer, timer);
+
+        resume(co);
+}
+
+ssize_t hp_co_read(hp_co_t *co, void *buf, size_t len)
+{
+        hp_conn_t *conn = co->conn;
+        size_t n;
+
+        while (1) {
+                if (co->_consumed != NULL) {
+                        /* resumed from on_read; the loop consumes from the read buffer once it returns */
+                        n = co->_input.len - *co->_consumed;
+                        if (n > len)
+                                n = len;
+                        memcpy(buf, co->_input.base + *co->_consumed, n);
+                        *co->_consumed += n;
+                } else {
+                        n = conn->rbuf.size < len ? conn->rbuf.size : len;
+                        memcpy(buf, conn->rbuf.bytes, n);
+                        memmove(conn->rbuf.bytes, conn->rbuf.bytes + n, conn->rbuf.size - n);
+                        conn->rbuf.size -= n;
+                }
+                if (n != 0 || len == 0)
+                        return (ssize_t)n;
+                if (conn->closing)
+                        return 0;
+                co->_wait = WAIT_READ;
+                hp_coro_yield(co->_coro);
+                co->_wait = WAIT_NONE;
+        }
+}
+
+int hp_co_read_full(hp_co_t *co, void *buf, size_t len)
+{
+        ssize_t r;
+
+        while (len != 0) {
+                if ((r = hp_co_read(co, buf, len)) <= 0)
+                        return -1;
+                buf = (char *)buf + r;
+                len -= r;
+        }
+        return 0;
+}
+
+int hp_co_write(hp_co_t *co, const void *buf, size_t len)
+{
+        if (co->conn->closing)
+                return -1;
+        return hp_conn_write(co->conn, buf, len);
+}
+
+int hp_co_sleep(hp_co_t *co, uint64_t delay_ms)
+{
+        if (co->conn->closing)
+                return -1;
+        co->_timer.cb = on_co_timer;
+        hp_timer_link(co->conn->loop, &co->_timer, delay_ms);
+        co->_wait = WAIT_SLEEP;
+        hp_coro_yield(co->_coro);
+        co->_wait = WAIT_NONE;
+        /* woken early by on_close */
+        return co->conn->closing ? -1 : 0;
+}
+
+void hp_coro_handler_init(hp_coro_handler_t *handler, const char *name, void (*main)(hp_co_t *co))
+{
+        *handler = (hp_coro_handler_t){{name, on_co_accept, on_co_read, on_co_close, on_co_migrate, NULL, NULL},
+                                       HP_CORO_DEFAULT_STACK_SIZE, main};
+}
+
+/* the frame echo written sequentially */
+static void co_echo_main(hp_co_t *co)
+{
+        unsigned char header[HP_FRAME_HEADER_SIZE];
+        char *payload;
+        size_t len;
+
+        while (hp_co_read_full(co, header, sizeof(header)) == 0) {
+                len = (size_t)header[0] << 24 | (size_t)header[1] << 16 | (size_t)header[2] << 8 | header[3];
+                if (len > HP_FRAME_DEFAULT_MAX_SIZE || (payload = malloc(len + 1)) == NULL)
+                        return;
+                if (hp_co_read_full(co, payload, len) != 0) {
+                        free(payload);
+                        return;
+                }
+                if (hp_co_write(co, header, sizeof(header)) != 0 || hp_co_write(co, payload, len) != 0) {
+                        free(payload);
+                        return;
+                }
+                free(payload);
+        }
+}
+
+void hp_coro_register_echo(void)
+{
+        static hp_coro_handler_t echo;
+
+        hp_coro_handler_init(&echo, "co-echo", co_echo_main);
+        hp_register_handler(&echo.super);
+}
@@ -0,0 +1,306 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Content encodings.  Setting up a compressor allocates its window and match tables, which costs
+   more than compressing a small body, so each loop keeps the compressors it has released and hands
+   them out again after a reset: deflateReset() and ZSTD_CCtx_reset() keep the tables.  Brotli has
+   no reset, so its encoders are made per stream.  A compressor is acquired and released on a loop;
+   in between it may be run on any thread, one at a time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hoppang.h"
+
+#ifdef HP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HP_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define MAX_POOLED 16 /* per encoding and thread */
+#define MIN_OUTPUT_ROOM 16384
+
+const char *hp_encoding_names[] = {"gzip", "zstd", "br", NULL};
+
+struct st_hp_compressor_t {
+        hp_encoding_t encoding;
+        union {
+#ifdef HP_HAVE_ZLIB
+                z_stream zs;
+#endif
+#ifdef HP_HAVE_BROTLI
+                BrotliEncoderState *br;
+#endif
+#ifdef HP_HAVE_ZSTD
+                ZSTD_CCtx *zstd;
+#endif
+                int _unused;
+        };
+        /* counted by whichever thread runs it, added to the stats of the loop on release */
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+        hp_compressor_t *_next;
+};
+
+static __thread struct {
+        hp_compressor_t *free_list[HP_NUM_ENCODINGS];
+        size_t num_free[HP_NUM_ENCODINGS];
+} pool;
+static __thread struct st_hp_compress_stats_t stats;
+
+int hp_encoding_is_available(hp_encoding_t encoding)
+{
+        switch (encoding) {
+#ifdef HP_HAVE_ZLIB
+        case HP_ENCODING_GZIP:
+                return 1;
+#endif
+#ifdef HP_HAVE_ZSTD
+        case HP_ENCODING_ZSTD:
+                return 1;
+#endif
+#ifdef HP_HAVE_BROTLI
+        case HP_ENCODING_BROTLI:
+                return 1;
+#endif
+        default:
+                return 0;
+        }
+}
+
+static void destroy(hp_compressor_t *c)
+{
+        switch (c->encoding) {
+#ifdef HP_HAVE_ZLIB
+        case HP_ENCODING_GZIP:
+                deflateEnd(&c->zs);
+                break;
+#endif
+#ifdef HP_HAVE_BROTLI
+        case HP_ENCODING_BROTLI:
+                if (c->br != NULL)
+                        BrotliEncoderDestroyInstance(c->br);
+                break;
+#endif
+#ifdef HP_HAVE_ZSTD
+        case HP_ENCODING_ZSTD:
+                ZSTD_freeCCtx(c->zstd);
+                break;
+#endif
+        default:
+                break;
+        }
+        free(c);
+}
+
+static hp_compressor_t *create(hp_encoding_t encoding)
+{
+        hp_compressor_t *c;
+
+        if ((c = calloc(1, sizeof(*c))) == NULL)
+                return NULL;
+        c->encoding = encoding;
+        switch (encoding) {
+#ifdef HP_HAVE_ZLIB
+        case HP_ENCODING_GZIP:
+                /* 16 + window bits asks for the gzip wrapper */
+                if (deflateInit2(&c->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                        goto Error;
+                return c;
+#endif
+#ifdef HP_HAVE_BROTLI
+        case HP_ENCODING_BROTLI:
+                /* made in hp_compressor_acquire() */
+                return c;
+#endif
+#ifdef HP_HAVE_ZSTD
+        case HP_ENCODING_ZSTD:
+                if ((c->zstd = ZSTD_createCCtx()) == NULL)
+                        goto Error;
+                return c;
+#endif
+        default:
+                goto Error;
+        }
+
+Error:
+        free(c);
+        return NULL;
+}
+
+hp_compressor_t *hp_compressor_acquire(hp_encoding_t encoding, int level, size_t size_hint)
+{
+        hp_compressor_t *c;
+
+        if ((c = pool.free_list[encoding]) != NULL) {
+                pool.free_list[encoding] = c->_next;
+                --pool.num_free[encoding];
+                ++stats.reused;
+        } else {
+                if ((c = create(encoding)) == NULL)
+                        return NULL;
+                ++stats.created;
+        }
+
+        switch (encoding) {
+#ifdef HP_HAVE_ZLIB
+        case HP_ENCODING_GZIP:
+                if (deflateParams(&c->zs, level, Z_DEFAULT_STRATEGY) != Z_OK)
+                        goto Error;
+                break;
+#endif
+#ifdef HP_HAVE_BROTLI
+        case HP_ENCODING_BROTLI:
+                if ((c->br = BrotliEncoderCreateInstance(NULL, NULL, NULL)) == NULL)
+                        goto Error;
+                BrotliEncoderSetParameter(c->br, BROTLI_PARAM_QUALITY, (uint32_t)level);
+                BrotliEncoderSetParameter(c->br, BROTLI_PARAM_LGWIN, 22);
+                if (size_hint != 0)
+                        BrotliEncoderSetParameter(c->br, BROTLI_PARAM_SIZE_HINT,
+                                                  size_hint < (1u << 30) ? (uint32_t)size_hint : 1u << 30);
+                break;
+#endif
+#ifdef HP_HAVE_ZSTD
+        case HP_ENCODING_ZSTD:
+                ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel, level);
+                if (size_hint != 0)
+                        ZSTD_CCtx_setPledgedSrcSize(c->zstd, size_hint);
+                break;
+#endif
+        default:
+                break;
+        }
+        return c;
+
+Error:
+        destroy(c);
+        return NULL;
+}
+
+void hp_compressor_release(hp_compressor_t *c)
+{
+        int ok = 1;
+
+        stats.bytes_in += c->bytes_in;
+        stats.bytes_out += c->bytes_out;
+        c->bytes_in = 0;
+        c->bytes_out = 0;
+        switch (c->encoding) {
+#ifdef HP_HAVE_ZLIB
+        case HP_ENCODING_GZIP:
+                ok = deflateReset(&c->zs) == Z_OK;
+                break;
+#endif
+#ifdef HP_HAVE_BROTLI
+        case HP_ENCODING_BROTLI:
+                BrotliEncoderDestroyInstance(c->br);
+                c->br = NULL;
+                break;
+#endif
+#ifdef HP_HAVE_ZSTD
+        case HP_ENCODING_ZSTD:
+                ok = !ZSTD_isError(ZSTD_CCtx_reset(c->zstd, ZSTD_reset_session_only));
+                break;
+#endif
+        default:
+                break;
+        }
+        if (!ok || pool.num_free[c->encoding] >= MAX_POOLED) {
+                destroy(c);
+                return;
+        }
+        c->_next = pool.free_list[c->encoding];
+        pool.free_list[c->encoding] = c;
+        ++pool.num_free[c->encoding];
+}
+
+static int reserve(hp_buffer_t *out)
+{
+        size_t capacity;
+        char *bytes;
+
+        if (out->capacity - out->size >= MIN_OUTPUT_ROOM)
+                return 0;
+        capacity = out->capacity * 2 > out->size + MIN_OUTPUT_ROOM ? out->capacity * 2 : out->size + MIN_OUTPUT_ROOM;
+        if ((bytes = realloc(out->bytes, capacity)) == NULL)
+                return -1;
+        out->bytes = bytes;
+        out->capacity = capacity;
+        return 0;
+}
+
+int hp_compressor_run(hp_compressor_t *c, const void *src, size_t len, int final, hp_buffer_t *out)
+{
+        size_t size_before = out->size;
+
+        switch (c->encoding) {
+#ifdef HP_HAVE_ZLIB
+        case HP_ENCODING_GZIP: {
+                int flush = final ? Z_FINISH : Z_SYNC_FLUSH, r;
+                c->zs.next_in = (Bytef *)src;
+                c->zs.avail_in = (uInt)len;
+                do {
+                        if (reserve(out) != 0)
+                                return -1;
+                        c->zs.next_out = (Bytef *)out->bytes + out->size;
+                        c->zs.avail_out = (uInt)(out->capacity - out->size);
+                        r = deflate(&c->zs, flush);
+                        out->size = out->capacity - c->zs.avail_out;
+                        if (r == Z_STREAM_ERROR)
+                                return -1;
+                        /* done once the input is in and the output did not fill up */
+                } while (c->zs.avail_out == 0 || c->zs.avail_in != 0 || (final && r != Z_STREAM_END));
+        } break;
+#endif
+#ifdef HP_HAVE_BROTLI
+        case HP_ENCODING_BROTLI: {
+                const uint8_t *next_in = src;
+                size_t avail_in = len, avail_out;
+                uint8_t *next_out;
+                do {
+                        if (reserve(out) != 0)
+                                return -1;
+                        next_out = (uint8_t *)out->bytes + out->size;
+                        avail_out = out->capacity - out->size;
+                        if (!BrotliEncoderCompressStream(c->br, final ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_FLUSH, &avail_in,
+                                                         &next_in, &avail_out, &next_out, NULL))
+                                return -1;
+                        out->size = out->capacity - avail_out;
+                } while (avail_in != 0 || BrotliEncoderHasMoreOutput(c->br) ||
+                         (final && !BrotliEncoderIsFinished(c->br)));
+        } break;
+#endif
+#ifdef HP_HAVE_ZSTD
+        case HP_ENCODING_ZSTD: {
+                ZSTD_inBuffer in = {src, len, 0};
+                ZSTD_outBuffer zout;
+                size_t remaining;
+                do {
+                        if (reserve(out) != 0)
+                                return -1;
+                        zout = (ZSTD_outBuffer){out->bytes + out->size, out->capacity - out->size, 0};
+                        remaining = ZSTD_compressStream2(c->zstd, &zout, &in, final ? ZSTD_e_end : ZSTD_e_flush);
+                        out->size += zout.pos;
+                        if (ZSTD_isError(remaining))
+                                return -1;
+                } while (remaining != 0);
+        } break;
+#endif
+        default:
+                return -1;
+        }
+
+        c->bytes_in += len;
+        c->bytes_out += out->size - size_before;
+        return 0;
+}
+
+const struct st_hp_compress_stats_t *hp_compress_get_stats(void)
+{
+        return &stats;
+}
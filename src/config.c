@@ -0,0 +1,179 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Reloadable configuration.  A reload builds a new snapshot away from the loops (parsing the
+   file, loading certificates) and publishes it with a single pointer store.  The loops never
+   lock: each one picks up the current snapshot at the start of an iteration, its quiescent point.
+   Once every loop has passed one after the swap, the previous snapshot is freed. */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/ssl.h>
+
+#include "hoppang.h"
+
+hp_config_t *hp_config_current = NULL;
+static uint64_t generation = 0;
+
+static pthread_mutex_t publish_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+hp_config_t *hp_config_create(size_t num_listeners)
+{
+        hp_config_t *config;
+
+        if ((config = calloc(1, sizeof(*config))) == NULL)
+                return NULL;
+        config->max_connections = HP_DEFAULT_MAX_CONNECTIONS;
+        config->num_listeners = num_listeners;
+        if (num_listeners != 0 && (config->ssl_ctxs = calloc(num_listeners, sizeof(config->ssl_ctxs[0]))) == NULL) {
+                free(config);
+                return NULL;
+        }
+        return config;
+}
+
+void hp_config_free(hp_config_t *config)
+{
+        size_t i;
+
+        /* connections hold their own references to the contexts they were accepted with */
+        for (i = 0; i != config->num_listeners; ++i)
+                if (config->ssl_ctxs[i] != NULL)
+                        SSL_CTX_free(config->ssl_ctxs[i]);
+        free(config->ssl_ctxs);
+        free(config->rate_limit_key_header);
+        free(config->deny);
+        free(config);
+}
+
+static char *trim(char *s)
+{
+        char *end;
+
+        while (isspace((unsigned char)*s))
+                ++s;
+        for (end = s + strlen(s); end != s && isspace((unsigned char)end[-1]); --end)
+                ;
+        *end = '\0';
+        return s;
+}
+
+static int parse_size(const char *value, size_t *out)
+{
+        char *end;
+        unsigned long long v;
+
+        errno = 0;
+        v = strtoull(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0' || v == 0)
+                return -1;
+        *out = (size_t)v;
+        return 0;
+}
+
+static int rate_limit_scope(const char *name)
+{
+        if (strcmp(name, "accept") == 0)
+                return HP_RATELIMIT_ACCEPT;
+        if (strcmp(name, "request") == 0)
+                return HP_RATELIMIT_REQUEST;
+        if (strcmp(name, "key") == 0)
+                return HP_RATELIMIT_KEY;
+        return -1;
+}
+
+int hp_config_load_file(hp_config_t *config, const char *fn)
+{
+        FILE *fp;
+        char line[1024], *name, *value;
+        unsigned lineno = 0;
+        int scope, ret = -1;
+
+        if ((fp = fopen(fn, "r")) == NULL) {
+                fprintf(stderr, "[ERROR] failed to open configuration file:%s:%s\n", fn, strerror(errno));
+                return -1;
+        }
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                ++lineno;
+                if ((value = strchr(line, '#')) != NULL)
+                        *value = '\0';
+                if (*(name = trim(line)) == '\0')
+                        continue;
+                if ((value = strchr(name, ':')) == NULL) {
+                        fprintf(stderr, "[ERROR] %s:%u: expected `name: value`\n", fn, lineno);
+                        goto Exit;
+                }
+                *value++ = '\0';
+                name = trim(name);
+                value = trim(value);
+                if (strcmp(name, "max-connections") == 0) {
+                        if (parse_size(value, &config->max_connections) != 0) {
+                                fprintf(stderr, "[ERROR] %s:%u: max-connections must be a positive integer\n", fn, lineno);
+                                goto Exit;
+                        }
+                } else if (strncmp(name, "rate-limit-", 11) == 0 && (scope = rate_limit_scope(name + 11)) != -1) {
+                        if (hp_ratelimit_parse_rule(value, config->rate_limits + scope) != 0) {
+                                fprintf(stderr, "[ERROR] %s:%u: %s must be RATE[/BURST] with BURST at most %d\n", fn, lineno,
+                                        name, HP_RATELIMIT_MAX_BURST);
+                                goto Exit;
+                        }
+                } else if (strcmp(name, "rate-limit-key-header") == 0) {
+                        free(config->rate_limit_key_header);
+                        if ((config->rate_limit_key_header = strdup(value)) == NULL) {
+                                perror("strdup");
+                                goto Exit;
+                        }
+                } else if (strcmp(name, "deny") == 0) {
+                        hp_addr_range_t *deny;
+                        if ((deny = realloc(config->deny, sizeof(*deny) * (config->num_deny + 1))) == NULL) {
+                                perror("realloc");
+                                goto Exit;
+                        }
+                        config->deny = deny;
+                        if (hp_parse_addr_range(value, config->deny + config->num_deny) != 0) {
+                                fprintf(stderr, "[ERROR] %s:%u: deny must be ADDRESS[/PREFIXLEN]:%s\n", fn, lineno, value);
+                                goto Exit;
+                        }
+                        ++config->num_deny;
+                } else {
+                        fprintf(stderr, "[ERROR] %s:%u: unknown directive:%s\n", fn, lineno, name);
+                        goto Exit;
+                }
+        }
+        ret = 0;
+
+Exit:
+        fclose(fp);
+        return ret;
+}
+
+void hp_config_publish(hp_config_t *config)
+{
+        struct timespec interval = {0, 1000000};
+        hp_config_t *old;
+        uint64_t epoch;
+
+        pthread_mutex_lock(&publish_mutex);
+
+        old = hp_config_current;
+        config->generation = ++generation;
+        /* the pointer goes first: a loop that sees the new epoch is bound to see the new snapshot */
+        __atomic_store_n(&hp_config_current, config, __ATOMIC_SEQ_CST);
+        epoch = hp_loop_start_grace_period();
+
+        if (old != NULL) {
+                /* idle loops are blocked in epoll_wait; wake them up so that they pass their quiescent point */
+                hp_loop_wakeup_all();
+                while (hp_loop_quiescent_epoch() < epoch)
+                        nanosleep(&interval, NULL);
+                hp_config_free(old);
+        }
+
+        pthread_mutex_unlock(&publish_mutex);
+}
@@ -0,0 +1,238 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Stackful coroutines.  On x86-64 a switch saves the six callee-saved registers on the stack being
+   left and swaps the stack pointer, a few nanoseconds; elsewhere it falls back to ucontext, which
+   also saves the signal mask at the cost of a system call.  The stacks are mapped with a guard
+   page below them, so that an overflow faults instead of overwriting a neighbour, and are kept in a
+   per-thread pool: mapping and unmapping them per coroutine would cost more than the switches.
+   Only the pages that a coroutine touches are backed by memory. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "hoppang.h"
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#define MAX_POOLED_STACKS 256 /* per thread */
+
+struct st_stack_t {
+        struct st_stack_t *next; /* while pooled; kept at the top of the stack */
+        size_t size;             /* without the guard page */
+};
+
+static __thread struct {
+        struct st_stack_t *head;
+        size_t count;
+} pool;
+static __thread struct st_hp_coro_stats_t stats;
+
+#if defined(__x86_64__)
+
+/* saves the callee-saved registers onto the current stack, stores the stack pointer into `*from` and continues with
+   the one that `to` was saved as */
+void hp_coro_switch(void **from, void *to);
+__asm__(".text\n"
+        ".globl hp_coro_switch\n"
+        ".type hp_coro_switch,@function\n"
+        "hp_coro_switch:\n"
+        "        pushq %rbp\n"
+        "        pushq %rbx\n"
+        "        pushq %r12\n"
+        "        pushq %r13\n"
+        "        pushq %r14\n"
+        "        pushq %r15\n"
+        "        movq %rsp, (%rdi)\n"
+        "        movq %rsi, %rsp\n"
+        "        popq %r15\n"
+        "        popq %r14\n"
+        "        popq %r13\n"
+        "        popq %r12\n"
+        "        popq %rbx\n"
+        "        popq %rbp\n"
+        "        ret\n"
+        ".size hp_coro_switch,.-hp_coro_switch\n"
+        /* the first switch to a coroutine returns here, with the coroutine in r12 */
+        "hp_coro_trampoline:\n"
+        "        movq %r12, %rdi\n"
+        "        call hp_coro__entry\n"
+        "        ud2\n");
+
+void hp_coro__entry(hp_coro_t *co);
+extern char hp_coro_trampoline[];
+
+struct st_hp_coro_context_t {
+        void *sp;
+};
+
+static void context_init(hp_coro_t *co, char *top)
+{
+        void **sp = (void **)(top - 72); /* 16-byte aligned once the trampoline is entered */
+
+        sp[0] = NULL;               /* r15 */
+        sp[1] = NULL;               /* r14 */
+        sp[2] = NULL;               /* r13 */
+        sp[3] = co;                 /* r12 */
+        sp[4] = NULL;               /* rbx */
+        sp[5] = NULL;               /* rbp */
+        sp[6] = hp_coro_trampoline; /* return address */
+        co->_context->sp = sp;
+}
+
+#define CONTEXT_SWITCH(from, to) hp_coro_switch(&(from)->sp, (to)->sp)
+
+#else
+
+void hp_coro__entry(hp_coro_t *co);
+
+struct st_hp_coro_context_t {
+        ucontext_t uc;
+};
+
+static void ucontext_entry(unsigned hi, unsigned lo)
+{
+        hp_coro__entry((hp_coro_t *)((uintptr_t)hi << 32 | lo));
+}
+
+static void context_init(hp_coro_t *co, char *top)
+{
+        uintptr_t p = (uintptr_t)co;
+
+        getcontext(&co->_context->uc);
+        co->_context->uc.uc_stack.ss_sp = co->_stack_base;
+        co->_context->uc.uc_stack.ss_size = top - (char *)co->_stack_base;
+        co->_context->uc.uc_link = NULL;
+        makecontext(&co->_context->uc, (void (*)(void))ucontext_entry, 2, (unsigned)(p >> 32), (unsigned)p);
+}
+
+#define CONTEXT_SWITCH(from, to) swapcontext(&(from)->uc, &(to)->uc)
+
+#endif
+
+static struct st_stack_t *stack_get(size_t size)
+{
+        struct st_stack_t *stack;
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        char *base;
+
+        if ((stack = pool.head) != NULL && stack->size == size) {
+                pool.head = stack->next;
+                --pool.count;
+                ++stats.stack_reuses;
+                return stack;
+        }
+        if ((base = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                         -1, 0)) == MAP_FAILED)
+                return NULL;
+        if (mprotect(base, page_size, PROT_NONE) != 0) {
+                munmap(base, size + page_size);
+                return NULL;
+        }
+        ++stats.stack_maps;
+        stack = (struct st_stack_t *)(base + page_size + size) - 1;
+        stack->size = size;
+        return stack;
+}
+
+static void stack_put(struct st_stack_t *stack)
+{
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+        if (pool.count < MAX_POOLED_STACKS) {
+                stack->next = pool.head;
+                pool.head = stack;
+                ++pool.count;
+                return;
+        }
+        munmap((char *)(stack + 1) - stack->size - page_size, stack->size + page_size);
+}
+
+static void *stack_base(struct st_stack_t *stack)
+{
+        return (char *)(stack + 1) - stack->size;
+}
+
+hp_coro_t *hp_coro_create(void (*fn)(hp_coro_t *co, void *arg), void *arg, size_t stack_size)
+{
+        struct st_stack_t *stack;
+        hp_coro_t *co;
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        char *top;
+
+        stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+        if ((stack = stack_get(stack_size)) == NULL)
+                return NULL;
+        /* the coroutine and its context live at the top of its stack, below the pool link */
+        top = (char *)stack;
+        co = (hp_coro_t *)((uintptr_t)(top - sizeof(*co)) & ~(uintptr_t)15);
+        co->_context = (struct st_hp_coro_context_t *)((uintptr_t)((char *)co - sizeof(*co->_context)) & ~(uintptr_t)15);
+        top = (char *)co->_context;
+        co->fn = fn;
+        co->arg = arg;
+        co->finished = 0;
+        co->_stack = stack;
+        co->_stack_base = stack_base(stack);
+        co->_caller = NULL;
+        context_init(co, top);
+        ++stats.created;
+        return co;
+}
+
+void hp_coro__entry(hp_coro_t *co)
+{
+        co->fn(co, co->arg);
+        co->finished = 1;
+        /* never resumed again; hp_coro_resume() returns the stack to the pool */
+        CONTEXT_SWITCH(co->_context, co->_caller);
+        abort();
+}
+
+int hp_coro_resume(hp_coro_t *co)
+{
+        struct st_hp_coro_context_t caller;
+
+        co->_caller = &caller;
+        ++stats.switches;
+        CONTEXT_SWITCH(&caller, co->_context);
+        co->_caller = NULL;
+        if (co->finished) {
+                stack_put(co->_stack);
+                return 0;
+        }
+        return 1;
+}
+
+void hp_coro_yield(hp_coro_t *co)
+{
+        ++stats.switches;
+        CONTEXT_SWITCH(co->_context, co->_caller);
+}
+
+size_t hp_coro_stack_used(hp_coro_t *co)
+{
+        unsigned char vec[64];
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE), num_pages = ((struct st_stack_t *)co->_stack)->size / page_size, i, j,
+               n, used = 0;
+
+        /* counts the resident pages; untouched ones are not backed */
+        for (i = 0; i < num_pages; i += n) {
+                n = num_pages - i < sizeof(vec) ? num_pages - i : sizeof(vec);
+                if (mincore((char *)co->_stack_base + i * page_size, n * page_size, vec) != 0)
+                        return 0;
+                for (j = 0; j != n; ++j)
+                        used += vec[j] & 1;
+        }
+        return used * page_size;
+}
+
+const struct st_hp_coro_stats_t *hp_coro_get_stats(void)
+{
+        return &stats;
+}
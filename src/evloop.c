@@ -0,0 +1,1435 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Per-thread epoll loop.  Every worker thread owns one loop; listeners are shared among
+   the loops and accepted connections stay on the loop that accepted them. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "hoppang.h"
+
+#define READ_MIN_ROOM 4096
+#define MAX_EVENTS 64
+#define MAX_ACCEPTS_PER_EVENT 16
+#define REBALANCE_MIN_SURPLUS 8 /* connections above the mean that a loop tolerates, on top of an eighth of the mean */
+#define MAX_MIGRATIONS_PER_ROUND 64
+
+struct st_hp_loop_listener_t {
+        hp_watcher_t watcher;
+        hp_listener_t *listener;
+};
+
+/* every loop ever created, for the ones that need to reach them all */
+static pthread_mutex_t all_loops_mutex = PTHREAD_MUTEX_INITIALIZER;
+static hp_loop_t **all_loops = NULL;
+static size_t num_all_loops = 0;
+
+/* across the loops, checked against max-connections */
+static size_t num_connections = 0;
+
+/* advanced by hp_loop_start_grace_period(), and read by each loop at its quiescent point */
+static uint64_t grace_epoch = 0;
+
+/* set by hp_handoff_init() if the worker processes route connections to each other */
+static hp_handoff_t handoff_config;
+static const hp_handoff_t *handoff = NULL;
+
+static void on_handoff(hp_loop_t *loop, hp_watcher_t *watcher, uint32_t revents);
+static void on_rebalance(hp_loop_t *loop, hp_timer_t *timer);
+
+/* the coarse clocks are read from the vDSO without touching the TSC, and tick as often as the scheduler */
+static void update_now(hp_loop_t *loop)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        loop->now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        loop->wall_now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void buffer_consume(hp_buffer_t *buf, size_t delta)
+{
+        if (delta == buf->size) {
+                buf->size = 0;
+        } else if (delta != 0) {
+                memmove(buf->bytes, buf->bytes + delta, buf->size - delta);
+                buf->size -= delta;
+        }
+}
+
+int hp_loop_add_watcher(hp_loop_t *loop, hp_watcher_t *watcher)
+{
+        struct epoll_event ev;
+
+        ev.events = watcher->events;
+        ev.data.ptr = watcher;
+        return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, watcher->fd, &ev);
+}
+
+int hp_loop_update_watcher(hp_loop_t *loop, hp_watcher_t *watcher, uint32_t events)
+{
+        struct epoll_event ev;
+
+        if (watcher->events == events)
+                return 0;
+        watcher->events = events;
+        ev.events = events;
+        ev.data.ptr = watcher;
+        return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, watcher->fd, &ev);
+}
+
+void hp_loop_remove_watcher(hp_loop_t *loop, hp_watcher_t *watcher)
+{
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watcher->fd, NULL);
+}
+
+static void on_wakeup(hp_loop_t *loop, hp_watcher_t *watcher, uint32_t revents)
+{
+        hp_loop_message_t *msg;
+        uint64_t cnt;
+        ssize_t r;
+
+        while ((r = read(watcher->fd, &cnt, sizeof(cnt))) == -1 && errno == EINTR)
+                ;
+
+        pthread_mutex_lock(&loop->_inbox_mutex);
+        msg = loop->_inbox;
+        loop->_inbox = NULL;
+        loop->_inbox_tail = &loop->_inbox;
+        pthread_mutex_unlock(&loop->_inbox_mutex);
+
+        while (msg != NULL) {
+                hp_loop_message_t *next = msg->_next;
+                msg->cb(loop, msg);
+                msg = next;
+        }
+}
+
+void hp_loop_post(hp_loop_t *loop, hp_loop_message_t *msg)
+{
+        int was_empty;
+
+        msg->_next = NULL;
+        pthread_mutex_lock(&loop->_inbox_mutex);
+        was_empty = loop->_inbox == NULL;
+        *loop->_inbox_tail = msg;
+        loop->_inbox_tail = &msg->_next;
+        pthread_mutex_unlock(&loop->_inbox_mutex);
+
+        /* a non-empty inbox has a wakeup pending already */
+        if (was_empty)
+                hp_loop_wakeup(loop);
+}
+
+void hp_loop_wakeup(hp_loop_t *loop)
+{
+        uint64_t one = 1;
+        ssize_t r;
+
+        r = write(loop->wakeup.fd, &one, sizeof(one)); (void) r;
+}
+
+void hp_loop_wakeup_all(void)
+{
+        size_t i;
+
+        pthread_mutex_lock(&all_loops_mutex);
+        for (i = 0; i != num_all_loops; ++i)
+                hp_loop_wakeup(all_loops[i]);
+        pthread_mutex_unlock(&all_loops_mutex);
+}
+
+uint64_t hp_loop_start_grace_period(void)
+{
+        return __atomic_add_fetch(&grace_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+uint64_t hp_loop_quiescent_epoch(void)
+{
+        uint64_t min = UINT64_MAX, epoch;
+        size_t i;
+
+        pthread_mutex_lock(&all_loops_mutex);
+        for (i = 0; i != num_all_loops; ++i)
+                if ((epoch = __atomic_load_n(&all_loops[i]->quiescent_epoch, __ATOMIC_ACQUIRE)) < min)
+                        min = epoch;
+        pthread_mutex_unlock(&all_loops_mutex);
+
+        return min;
+}
+
+/* the quiescent point: nothing from the previous iteration refers to shared objects any more.  The epoch is read
+   first; whatever was unlinked before it was advanced is out of reach of what the loop reads afterwards.  The fence
+   keeps those reads from being performed before the announcement is visible, as a loop coming back from being
+   offline might otherwise pick up an object that is being freed. */
+static void quiesce(hp_loop_t *loop)
+{
+        uint64_t epoch = __atomic_load_n(&grace_epoch, __ATOMIC_SEQ_CST);
+
+        __atomic_store_n(&loop->quiescent_epoch, epoch, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        loop->config = __atomic_load_n(&hp_config_current, __ATOMIC_SEQ_CST);
+}
+
+/* a loop blocked in epoll_wait holds nothing, hence does not hold back reclamation either */
+static void go_offline(hp_loop_t *loop)
+{
+        __atomic_store_n(&loop->quiescent_epoch, UINT64_MAX, __ATOMIC_RELEASE);
+}
+
+void hp_handoff_init(const hp_handoff_t *_handoff)
+{
+        handoff_config = *_handoff;
+        handoff = &handoff_config;
+}
+
+hp_loop_t *hp_loop_create(size_t thread_index, const hp_loop_config_t *config)
+{
+        hp_loop_t *loop;
+
+        if ((loop = calloc(1, sizeof(*loop))) == NULL)
+                return NULL;
+        loop->thread_index = thread_index;
+        update_now(loop);
+        loop->_timers._prev = loop->_timers._next = &loop->_timers;
+        pthread_mutex_init(&loop->_inbox_mutex, NULL);
+        loop->_inbox_tail = &loop->_inbox;
+        if (hp_arena_init(&loop->arena, config->arena_size, config->hugepages) != 0) {
+                free(loop);
+                return NULL;
+        }
+        hp_bufpool_init(&loop->bufpool, config->buffer_idle_timeout, &loop->arena);
+        loop->wakeup.fd = -1;
+        if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+                goto Error;
+        if ((loop->wakeup.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+                goto Error;
+        loop->wakeup.events = EPOLLIN;
+        loop->wakeup.cb = on_wakeup;
+        if (hp_loop_add_watcher(loop, &loop->wakeup) != 0)
+                goto Error;
+        /* every loop of the process takes from the inbox, one at a time */
+        if (handoff != NULL) {
+                loop->_handoff = (hp_watcher_t){handoff->inboxes[handoff->self], EPOLLIN | EPOLLEXCLUSIVE, on_handoff};
+                if (hp_loop_add_watcher(loop, &loop->_handoff) != 0)
+                        goto Error;
+        }
+        if (hp_trace_enabled && (loop->_trace_ring = hp_trace_ring_create(thread_index)) == NULL)
+                goto Error;
+        if ((loop->_rebalance_interval = config->rebalance_interval) != 0) {
+                loop->_rebalance_timer.cb = on_rebalance;
+                hp_timer_link(loop, &loop->_rebalance_timer, loop->_rebalance_interval);
+        }
+
+        pthread_mutex_lock(&all_loops_mutex);
+        if ((all_loops = realloc(all_loops, sizeof(all_loops[0]) * (num_all_loops + 1))) == NULL) {
+                pthread_mutex_unlock(&all_loops_mutex);
+                goto Error;
+        }
+        quiesce(loop);
+        all_loops[num_all_loops++] = loop;
+        pthread_mutex_unlock(&all_loops_mutex);
+
+        return loop;
+
+Error:
+        perror("failed to create event loop");
+        if (loop->epoll_fd != -1)
+                close(loop->epoll_fd);
+        if (loop->wakeup.fd != -1)
+                close(loop->wakeup.fd);
+        hp_arena_dispose(&loop->arena);
+        free(loop);
+        return NULL;
+}
+
+static void conn_update_events(hp_conn_t *conn)
+{
+        if (conn->closing)
+                return;
+        if (conn->connecting) {
+                hp_loop_update_watcher(conn->loop, &conn->watcher, EPOLLOUT);
+                return;
+        }
+        hp_loop_update_watcher(conn->loop, &conn->watcher,
+                               EPOLLIN | (conn->wbuf.size != 0 || conn->_sendfiles != NULL || conn->ssl_want_write ? EPOLLOUT : 0));
+}
+
+/* maps the result of an SSL call to the convention of read(2) and write(2) */
+static ssize_t ssl_result(hp_conn_t *conn, int ret)
+{
+        switch (SSL_get_error(conn->ssl, ret)) {
+        case SSL_ERROR_WANT_WRITE:
+                conn->ssl_want_write = 1;
+                /* fallthru */
+        case SSL_ERROR_WANT_READ:
+                errno = EAGAIN;
+                return -1;
+        case SSL_ERROR_ZERO_RETURN:
+                return 0;
+        default:
+                ERR_clear_error();
+                errno = EPROTO;
+                return -1;
+        }
+}
+
+static ssize_t conn_recv(hp_conn_t *conn, char *buf, size_t len)
+{
+        ssize_t r;
+        int ret;
+
+        if (conn->ssl != NULL) {
+                conn->ssl_want_write = 0;
+                if ((ret = SSL_read(conn->ssl, buf, (int)len)) > 0)
+                        return ret;
+                return ssl_result(conn, ret);
+        }
+        while ((r = read(conn->watcher.fd, buf, len)) == -1 && errno == EINTR)
+                ;
+        return r;
+}
+
+static ssize_t conn_send(hp_conn_t *conn, const char *buf, size_t len)
+{
+        ssize_t r;
+        int ret;
+
+        if (conn->ssl != NULL && !conn->ktls_send) {
+                conn->ssl_want_write = 0;
+                if ((ret = SSL_write(conn->ssl, buf, (int)len)) > 0)
+                        return ret;
+                return ssl_result(conn, ret);
+        }
+        while ((r = write(conn->watcher.fd, buf, len)) == -1 && errno == EINTR)
+                ;
+        return r;
+}
+
+/* returns zero once the whole region has been sent */
+static int conn_send_file(hp_conn_t *conn, hp_sendfile_t *sf)
+{
+        off_t offset;
+        ssize_t r;
+
+        while (sf->len != 0) {
+                offset = sf->offset;
+                if ((r = sendfile(conn->watcher.fd, sf->fd, &offset, sf->len)) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno != EAGAIN)
+                                hp_conn_close(conn);
+                        return -1;
+                }
+                /* the file has been truncated; the length promised to the peer can no longer be met */
+                if (r == 0) {
+                        hp_conn_close(conn);
+                        return -1;
+                }
+                sf->offset += r;
+                sf->len -= r;
+        }
+        return 0;
+}
+
+/* over TLS without kTLS, where the kernel cannot encrypt what it splices: reads the next chunk of the region to the front
+   of the write buffer, ahead of what was written after the region, to be sent as its prefix; at most the largest buffer
+   class, so that neither the buffer nor the read grows with the file */
+static int conn_copy_file(hp_conn_t *conn, hp_sendfile_t *sf)
+{
+        size_t chunk = sf->len, filled = 0;
+        ssize_t r;
+
+        if (chunk > hp_bufpool_class_sizes[HP_BUFPOOL_NUM_CLASSES - 1])
+                chunk = hp_bufpool_class_sizes[HP_BUFPOOL_NUM_CLASSES - 1];
+        if (hp_bufpool_reserve(&conn->loop->bufpool, &conn->wbuf, chunk) != 0)
+                goto Error;
+        memmove(conn->wbuf.bytes + chunk, conn->wbuf.bytes, conn->wbuf.size);
+        while (filled != chunk) {
+                if ((r = pread(sf->fd, conn->wbuf.bytes + filled, chunk - filled, sf->offset + filled)) <= 0) {
+                        if (r == -1 && errno == EINTR)
+                                continue;
+                        /* an error, or the file has been truncated */
+                        memmove(conn->wbuf.bytes, conn->wbuf.bytes + chunk, conn->wbuf.size);
+                        goto Error;
+                }
+                filled += r;
+        }
+        conn->wbuf.size += chunk;
+        sf->offset += chunk;
+        sf->len -= chunk;
+        sf->_prefix = chunk;
+        return 0;
+
+Error:
+        hp_conn_close(conn);
+        return -1;
+}
+
+/* the write buffer of a SOCK_SEQPACKET connection holds messages, each prefixed by its length */
+static int conn_send_messages(hp_conn_t *conn)
+{
+        uint32_t len;
+        ssize_t wret;
+
+        while (conn->wbuf.size != 0) {
+                memcpy(&len, conn->wbuf.bytes, sizeof(len));
+                while ((wret = send(conn->watcher.fd, conn->wbuf.bytes + sizeof(len), len, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+                        ;
+                if (wret == -1)
+                        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+                buffer_consume(&conn->wbuf, sizeof(len) + len);
+        }
+        return 0;
+}
+
+static void conn_flush(hp_conn_t *conn)
+{
+        void (*on_drain)(hp_conn_t *conn);
+        hp_sendfile_t *sf;
+        size_t limit;
+        ssize_t wret;
+
+        if (conn->seqpacket) {
+                if (conn_send_messages(conn) != 0)
+                        hp_conn_close(conn);
+                goto Exit;
+        }
+
+        /* the buffered bytes and the file regions go out in the order they were written */
+        while (1) {
+                sf = conn->_sendfiles;
+                if ((limit = sf != NULL ? sf->_prefix : conn->wbuf.size) != 0) {
+                        if ((wret = conn_send(conn, conn->wbuf.bytes, limit)) == -1) {
+                                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                        hp_conn_close(conn);
+                                break;
+                        }
+                        buffer_consume(&conn->wbuf, wret);
+                        if (sf != NULL)
+                                sf->_prefix -= wret;
+                        continue;
+                }
+                if (sf == NULL)
+                        break;
+                if (sf->len != 0 && conn->ssl != NULL && !conn->ktls_send) {
+                        if (conn_copy_file(conn, sf) != 0)
+                                break;
+                        continue;
+                }
+                if (conn_send_file(conn, sf) != 0)
+                        break;
+                if ((conn->_sendfiles = sf->_next) == NULL)
+                        conn->_sendfiles_tail = &conn->_sendfiles;
+                sf->on_complete(sf);
+        }
+
+Exit:
+        if (conn->_trace.id != 0)
+                hp_trace_conn_flushed(conn);
+        if (conn->wbuf.size == 0)
+                hp_bufpool_release(&conn->loop->bufpool, &conn->wbuf);
+        if (conn->_close_after_flush && conn->wbuf.size == 0 && conn->_sendfiles == NULL)
+                hp_conn_close(conn);
+        conn_update_events(conn);
+        if ((on_drain = conn->on_drain) != NULL && !conn->closing && conn->wbuf.size == 0 && conn->_sendfiles == NULL) {
+                conn->on_drain = NULL;
+                on_drain(conn);
+        }
+}
+
+static void conn_link_newest(hp_loop_t *loop, hp_conn_t *conn)
+{
+        conn->_last_read = loop->now;
+        conn->_newer = NULL;
+        if ((conn->_older = loop->_newest) != NULL) {
+                loop->_newest->_newer = conn;
+        } else {
+                loop->_oldest = conn;
+        }
+        loop->_newest = conn;
+}
+
+static void conn_unlink(hp_loop_t *loop, hp_conn_t *conn)
+{
+        if (conn->_newer != NULL) {
+                conn->_newer->_older = conn->_older;
+        } else {
+                loop->_newest = conn->_older;
+        }
+        if (conn->_older != NULL) {
+                conn->_older->_newer = conn->_newer;
+        } else {
+                loop->_oldest = conn->_newer;
+        }
+}
+
+static void conn_dispose(hp_conn_t *conn)
+{
+        hp_loop_t *loop = conn->loop;
+        hp_sendfile_t *sf;
+
+        HP_PROBE(conn__close, conn, conn->watcher.fd, loop->thread_index, conn->wbuf.size);
+        while ((sf = conn->_sendfiles) != NULL) {
+                conn->_sendfiles = sf->_next;
+                sf->on_complete(sf);
+        }
+        if (conn->handler->on_close != NULL)
+                conn->handler->on_close(conn);
+        if (conn->_capture_id != 0)
+                hp_capture_conn_close(conn);
+        if (conn->_trace.id != 0)
+                hp_trace_conn_close(conn);
+        hp_loop_remove_watcher(loop, &conn->watcher);
+        if (conn->ssl != NULL) {
+                /* best effort; the socket is non-blocking */
+                SSL_shutdown(conn->ssl);
+                SSL_free(conn->ssl);
+                ERR_clear_error();
+        }
+        close(conn->watcher.fd);
+        hp_bufpool_release(&loop->bufpool, &conn->rbuf);
+        hp_bufpool_release(&loop->bufpool, &conn->wbuf);
+        /* connections that were handed large messages start with large buffers */
+        loop->bufpool.read_hint = (loop->bufpool.read_hint * 7 + conn->peak_input) / 8;
+        conn->_next = loop->_free_conns;
+        loop->_free_conns = conn;
+        if (conn->listener != NULL) {
+                conn_unlink(loop, conn);
+                --loop->num_conns;
+                /* loops that stopped accepting at the limit may resume */
+                if (__atomic_fetch_sub(&num_connections, 1, __ATOMIC_RELAXED) == loop->config->max_connections)
+                        hp_loop_wakeup_all();
+        }
+}
+
+static hp_conn_t *conn_alloc(hp_loop_t *loop)
+{
+        hp_conn_t *conn;
+
+        /* connection objects are recycled, never freed; the table lives in the arena while it has room */
+        if ((conn = loop->_free_conns) != NULL) {
+                loop->_free_conns = conn->_next;
+        } else if ((conn = hp_arena_alloc(&loop->arena, sizeof(*conn), 64)) == NULL) {
+                if ((conn = malloc(sizeof(*conn))) == NULL)
+                        return NULL;
+        }
+        memset(conn, 0, sizeof(*conn));
+        conn->_sendfiles_tail = &conn->_sendfiles;
+        return conn;
+}
+
+/* the probes bracket the handler, for the tools to time it */
+static ssize_t conn_call_on_read(hp_conn_t *conn, hp_iovec_t input)
+{
+        ssize_t consumed;
+
+        HP_PROBE(handler__start, conn, conn->handler->name, input.len);
+        consumed = conn->handler->on_read(conn, input);
+        HP_PROBE(handler__done, conn, conn->handler->name, consumed);
+        return consumed;
+}
+
+/* called once the connection is ready for the handler, i.e. after the TLS handshake if any */
+static void conn_on_established(hp_conn_t *conn)
+{
+        if (conn->handler->on_accept != NULL && conn->handler->on_accept(conn) != 0)
+                hp_conn_close(conn);
+}
+
+/* OpenSSL installs the keys once the handshake is done, for the directions that the kernel and the cipher support; the
+   receiving side stays behind SSL_read(), which also handles the records that are not data */
+static void conn_check_ktls(hp_conn_t *conn)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+        hp_loop_t *loop = conn->loop;
+
+        if (!conn->listener->ktls)
+                return;
+        if (BIO_get_ktls_recv(SSL_get_rbio(conn->ssl)))
+                ++loop->num_ktls_recv;
+        if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl))) {
+                conn->ktls_send = 1;
+                ++loop->num_ktls_send;
+        } else {
+                ++loop->num_ktls_fallbacks;
+        }
+#endif
+}
+
+/* returns non-zero while the handshake is in progress */
+static int conn_handshake(hp_conn_t *conn)
+{
+        int ret;
+
+        conn->ssl_want_write = 0;
+        if ((ret = SSL_do_handshake(conn->ssl)) == 1) {
+                if (conn->_trace.id != 0)
+                        hp_trace_conn_handshake(conn);
+                conn_check_ktls(conn);
+                conn_on_established(conn);
+                return 0;
+        }
+        if (ssl_result(conn, ret) == -1 && errno == EAGAIN) {
+                conn_update_events(conn);
+        } else {
+                hp_conn_close(conn);
+        }
+        return 1;
+}
+
+/* one message per call to the handler, which is to consume it whole; MSG_TRUNC reports the length of the ones that do not
+   fit */
+static void conn_on_read_messages(hp_conn_t *conn)
+{
+        hp_bufpool_t *pool = &conn->loop->bufpool;
+        size_t num_reads = MAX_ACCEPTS_PER_EVENT;
+        ssize_t rret;
+
+        if (hp_bufpool_reserve(pool, &conn->rbuf, HP_SEQPACKET_MAX_MESSAGE) != 0) {
+                hp_conn_close(conn);
+                return;
+        }
+        do {
+                while ((rret = recv(conn->watcher.fd, conn->rbuf.bytes, HP_SEQPACKET_MAX_MESSAGE, MSG_TRUNC)) == -1 &&
+                       errno == EINTR)
+                        ;
+                if (rret == -1) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                hp_conn_close(conn);
+                        break;
+                }
+                /* an empty message cannot be told from the end of the stream */
+                if (rret == 0 || rret > HP_SEQPACKET_MAX_MESSAGE) {
+                        hp_conn_close(conn);
+                        break;
+                }
+                if ((size_t)rret > conn->peak_input)
+                        conn->peak_input = rret;
+                if (conn->_close_after_flush)
+                        continue;
+                if (conn->_trace.id != 0)
+                        hp_trace_conn_data(conn);
+                if (conn_call_on_read(conn, hp_iovec_init(conn->rbuf.bytes, rret)) != rret) {
+                        hp_conn_close(conn);
+                        break;
+                }
+        } while (!conn->closing && --num_reads != 0);
+        hp_bufpool_release(pool, &conn->rbuf);
+}
+
+static void conn_on_read(hp_conn_t *conn)
+{
+        hp_bufpool_t *pool = &conn->loop->bufpool;
+        size_t min_room = READ_MIN_ROOM;
+        ssize_t rret, consumed;
+
+        if (conn->seqpacket) {
+                conn_on_read_messages(conn);
+                return;
+        }
+
+        if (conn->rbuf.bytes == NULL && pool->read_hint > min_room) {
+                min_room = pool->read_hint;
+                if (min_room > hp_bufpool_class_sizes[HP_BUFPOOL_NUM_CLASSES - 1])
+                        min_room = hp_bufpool_class_sizes[HP_BUFPOOL_NUM_CLASSES - 1];
+        }
+
+        /* OpenSSL may hold decrypted bytes that the socket no longer signals; drain them */
+        do {
+                if (hp_bufpool_reserve(pool, &conn->rbuf, min_room) != 0) {
+                        hp_conn_close(conn);
+                        return;
+                }
+                if ((rret = conn_recv(conn, conn->rbuf.bytes + conn->rbuf.size, conn->rbuf.capacity - conn->rbuf.size)) <= 0)
+                        break;
+                if (conn->_capture_id != 0)
+                        hp_capture_conn_data(conn, conn->rbuf.bytes + conn->rbuf.size, rret);
+                if (conn->_trace.id != 0)
+                        hp_trace_conn_data(conn);
+                conn->rbuf.size += rret;
+                min_room = READ_MIN_ROOM;
+        } while (conn->ssl != NULL && SSL_pending(conn->ssl) > 0);
+        if (rret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (conn->ssl_want_write)
+                        conn_update_events(conn);
+        } else if (rret <= 0) {
+                hp_conn_close(conn);
+                return;
+        }
+        if (conn->rbuf.size == 0)
+                goto Exit;
+        if (conn->rbuf.size > conn->peak_input)
+                conn->peak_input = conn->rbuf.size;
+        /* the handler is done with the connection; what follows is discarded */
+        if (conn->_close_after_flush) {
+                conn->rbuf.size = 0;
+                goto Exit;
+        }
+
+        /* the handler parses in-place; whatever it does not consume stays for the next round */
+        if ((consumed = conn_call_on_read(conn, hp_iovec_init(conn->rbuf.bytes, conn->rbuf.size))) == -1) {
+                hp_conn_close(conn);
+                return;
+        }
+        buffer_consume(&conn->rbuf, consumed);
+
+Exit:
+        /* idle connections do not hold buffers */
+        if (conn->rbuf.size == 0)
+                hp_bufpool_release(pool, &conn->rbuf);
+}
+
+static void conn_on_connect(hp_conn_t *conn)
+{
+        socklen_t len = sizeof(int);
+        int err;
+
+        if (getsockopt(conn->watcher.fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+                hp_conn_close(conn);
+                return;
+        }
+        conn->connecting = 0;
+        conn_on_established(conn);
+        /* send what was written while connecting */
+        if (!conn->closing)
+                conn_flush(conn);
+}
+
+static void on_conn_event(hp_loop_t *loop, hp_watcher_t *watcher, uint32_t revents)
+{
+        hp_conn_t *conn = HP_STRUCT_FROM_MEMBER(hp_conn_t, watcher, watcher);
+
+        if (conn->closing)
+                return;
+        if (conn->connecting) {
+                conn_on_connect(conn);
+                return;
+        }
+        if (conn->ssl != NULL && !SSL_is_init_finished(conn->ssl) && conn_handshake(conn))
+                return;
+        if ((revents & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0) {
+                if (conn->listener != NULL) {
+                        conn_unlink(loop, conn);
+                        conn_link_newest(loop, conn);
+                }
+                conn_on_read(conn);
+        }
+        if ((revents & EPOLLOUT) != 0 && !conn->closing)
+                conn_flush(conn);
+}
+
+static int listener_watch(hp_loop_t *loop, struct st_hp_loop_listener_t *ll)
+{
+        /* only one of the threads blocked on the listener is woken up per connection */
+        ll->watcher.events = EPOLLIN | EPOLLEXCLUSIVE;
+        return hp_loop_add_watcher(loop, &ll->watcher);
+}
+
+/* stops or resumes accepting, depending on the number of connections; EPOLLEXCLUSIVE cannot be modified, hence the
+   listeners are removed from and added back to the epoll set */
+static void update_listeners(hp_loop_t *loop)
+{
+        int paused = __atomic_load_n(&num_connections, __ATOMIC_RELAXED) >= loop->config->max_connections;
+        size_t i;
+
+        if (paused == loop->_listeners_paused)
+                return;
+        for (i = 0; i != loop->_num_listeners; ++i) {
+                if (paused) {
+                        hp_loop_remove_watcher(loop, &loop->_listeners[i]->watcher);
+                } else if (listener_watch(loop, loop->_listeners[i]) != 0) {
+                        perror("failed to resume listener");
+                }
+        }
+        loop->_listeners_paused = paused;
+}
+
+/* sets up a connection accepted here or handed over by another process; takes the ownership of `fd` */
+static void conn_accepted(hp_loop_t *loop, hp_listener_t *listener, int fd, uint64_t client_key)
+{
+        hp_conn_t *conn;
+        SSL_CTX *ssl_ctx;
+
+        if ((conn = conn_alloc(loop)) == NULL) {
+                close(fd);
+                return;
+        }
+        conn->watcher = (hp_watcher_t){fd, EPOLLIN, on_conn_event};
+        conn->loop = loop;
+        conn->listener = listener;
+        conn->handler = listener->handler;
+        conn->client_key = client_key;
+        conn->seqpacket = listener->seqpacket;
+        if (listener->tcp.incoming_cpu) {
+                int cpu;
+                socklen_t cpulen = sizeof(cpu);
+                if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpulen) == 0 && cpu != -1) {
+                        if (cpu == sched_getcpu())
+                                ++loop->num_accepts_local_cpu;
+                        else
+                                ++loop->num_accepts_remote_cpu;
+                }
+        }
+        if ((ssl_ctx = listener->index < loop->config->num_listeners ? loop->config->ssl_ctxs[listener->index] : NULL) != NULL) {
+                if ((conn->ssl = SSL_new(ssl_ctx)) == NULL || SSL_set_fd(conn->ssl, fd) != 1) {
+                        if (conn->ssl != NULL)
+                                SSL_free(conn->ssl);
+                        ERR_clear_error();
+                        conn->ssl = NULL;
+                        goto Discard;
+                }
+                SSL_set_accept_state(conn->ssl);
+#ifdef SSL_OP_ENABLE_KTLS
+                if (listener->ktls)
+                        SSL_set_options(conn->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+        }
+        if (hp_loop_add_watcher(loop, &conn->watcher) != 0) {
+                if (conn->ssl != NULL)
+                        SSL_free(conn->ssl);
+                goto Discard;
+        }
+        ++loop->num_conns;
+        __atomic_fetch_add(&num_connections, 1, __ATOMIC_RELAXED);
+        conn_link_newest(loop, conn);
+        HP_PROBE(conn__accept, conn, fd, loop->thread_index, listener->index);
+        /* message boundaries would not survive the replay over a stream */
+        if (hp_capture_enabled && !conn->seqpacket)
+                hp_capture_conn_open(conn);
+        if (hp_trace_enabled)
+                hp_trace_conn_open(conn);
+        /* TLS connections are handed to the handler once the handshake completes */
+        if (conn->ssl == NULL)
+                conn_on_established(conn);
+        return;
+
+Discard:
+        close(fd);
+        conn->_next = loop->_free_conns;
+        loop->_free_conns = conn;
+}
+
+/* refused before any TLS or handler work; the reset spares us the TIME_WAIT state */
+static int take_accept_token(hp_loop_t *loop, int fd, uint64_t client_key)
+{
+        struct linger reset = {1, 0};
+
+        if (hp_ratelimit_take(HP_RATELIMIT_ACCEPT, client_key, loop->config->rate_limits + HP_RATELIMIT_ACCEPT, loop->now))
+                return 1;
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        return 0;
+}
+
+static int get_peer_key(int fd, uint64_t *client_key, struct ucred *cred)
+{
+        socklen_t credlen = sizeof(*cred);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, cred, &credlen) != 0)
+                return -1;
+        /* local peers are told apart by user */
+        *client_key = hp_hash(&cred->uid, sizeof(cred->uid));
+        return 0;
+}
+
+static int handoff_send(size_t target, hp_listener_t *listener, int fd)
+{
+        uint32_t index = (uint32_t)listener->index;
+        struct iovec iov = {&index, sizeof(index)};
+        union {
+                char buf[CMSG_SPACE(sizeof(int))];
+                struct cmsghdr align;
+        } cbuf;
+        struct msghdr msg = {NULL};
+        struct cmsghdr *cmsg;
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf.buf;
+        msg.msg_controllen = sizeof(cbuf.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        return sendmsg(handoff->outboxes[target], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(index) ? 0 : -1;
+}
+
+/* admits a local peer by its credentials and routes it; returns 1 if the connection is to be served here, 0 if it was
+   refused or handed over */
+static int unix_accepted(hp_loop_t *loop, hp_listener_t *listener, int fd, uint64_t *client_key)
+{
+        struct ucred cred;
+        uint64_t route_key;
+        size_t i, target;
+
+        if (get_peer_key(fd, client_key, &cred) != 0)
+                goto Refuse;
+        if (listener->allowed_uids != NULL) {
+                for (i = 0; i != listener->num_allowed_uids && listener->allowed_uids[i] != cred.uid; ++i)
+                        ;
+                if (i == listener->num_allowed_uids)
+                        goto Refuse;
+        }
+        if (listener->route == HP_ROUTE_ANY || handoff == NULL)
+                return 1;
+        route_key = listener->route == HP_ROUTE_UID ? *client_key : hp_hash(&cred.pid, sizeof(cred.pid));
+        /* serve it here if the inbox of the other one is full */
+        if ((target = route_key % handoff->num_peers) == handoff->self || handoff_send(target, listener, fd) != 0)
+                return 1;
+        ++loop->num_handed_off;
+        return 0;
+
+Refuse:
+        ++loop->num_peers_refused;
+        return 0;
+}
+
+static void on_listener_event(hp_loop_t *loop, hp_watcher_t *watcher, uint32_t revents)
+{
+        struct st_hp_loop_listener_t *ll = HP_STRUCT_FROM_MEMBER(struct st_hp_loop_listener_t, watcher, watcher);
+        hp_listener_t *listener = ll->listener;
+        size_t num_accepts = MAX_ACCEPTS_PER_EVENT;
+        struct sockaddr_storage peer;
+        socklen_t peerlen;
+        uint64_t client_key;
+        int fd;
+
+        do {
+                if (__atomic_load_n(&num_connections, __ATOMIC_RELAXED) >= loop->config->max_connections) {
+                        update_listeners(loop);
+                        break;
+                }
+                peerlen = sizeof(peer);
+                if ((fd = accept4(watcher->fd, (struct sockaddr *)&peer, &peerlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                                perror("accept failed");
+                        break;
+                }
+                if (listener->addr.ss_family == AF_UNIX) {
+                        if (!unix_accepted(loop, listener, fd, &client_key)) {
+                                close(fd);
+                                continue;
+                        }
+                } else {
+                        client_key = hp_ratelimit_addr_key((struct sockaddr *)&peer);
+                }
+                if (!take_accept_token(loop, fd, client_key)) {
+                        close(fd);
+                        continue;
+                }
+                conn_accepted(loop, listener, fd, client_key);
+        } while (--num_accepts != 0);
+}
+
+/* the sender has checked the credentials; the rate is limited here, where all the connections of the peer end up */
+static void on_handoff(hp_loop_t *loop, hp_watcher_t *watcher, uint32_t revents)
+{
+        size_t num_accepts = MAX_ACCEPTS_PER_EVENT, i;
+        uint32_t index;
+        struct iovec iov = {&index, sizeof(index)};
+        union {
+                char buf[CMSG_SPACE(sizeof(int))];
+                struct cmsghdr align;
+        } cbuf;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        struct ucred cred;
+        uint64_t client_key;
+        ssize_t rret;
+        int fd;
+
+        do {
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = cbuf.buf;
+                msg.msg_controllen = sizeof(cbuf.buf);
+                if ((rret = recvmsg(watcher->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) == -1) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                                perror("failed to receive a handed-off connection");
+                        break;
+                }
+                if ((cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                        continue;
+                memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+                for (i = 0; i != loop->_num_listeners && loop->_listeners[i]->listener->index != index; ++i)
+                        ;
+                if (rret != sizeof(index) || i == loop->_num_listeners || get_peer_key(fd, &client_key, &cred) != 0 ||
+                    !take_accept_token(loop, fd, client_key)) {
+                        close(fd);
+                        continue;
+                }
+                ++loop->num_handed_in;
+                conn_accepted(loop, loop->_listeners[i]->listener, fd, client_key);
+        } while (--num_accepts != 0);
+}
+
+/* what a connection carries to the loop it moves to; its buffers are empty and it has nothing queued */
+struct st_migration_t {
+        hp_loop_message_t super;
+        int fd;
+        hp_listener_t *listener;
+        hp_handler_t *handler;
+        void *data;
+        struct ssl_st *ssl;
+        int ktls_send;
+        uint64_t client_key;
+        size_t peak_input;
+        int seqpacket;
+        uint64_t capture_id;
+        int capture_awaiting_reply;
+        struct st_hp_conn_trace_t trace;
+};
+
+static void on_migration(hp_loop_t *loop, hp_loop_message_t *msg)
+{
+        struct st_migration_t *m = HP_STRUCT_FROM_MEMBER(struct st_migration_t, super, msg);
+        hp_conn_t *conn;
+
+        if ((conn = conn_alloc(loop)) == NULL) {
+                /* too late to refuse; the connection is lost, but the handler is given one on the stack to free what it
+                   holds */
+                hp_conn_t lost;
+
+                memset(&lost, 0, sizeof(lost));
+                lost.watcher.fd = m->fd;
+                lost.loop = loop;
+                lost.listener = m->listener;
+                lost.handler = m->handler;
+                lost.data = m->data;
+                lost.ssl = m->ssl;
+                lost._capture_id = m->capture_id;
+                lost._trace = m->trace;
+                lost.closing = 1;
+                if (lost.handler->on_close != NULL)
+                        lost.handler->on_close(&lost);
+                if (lost._capture_id != 0)
+                        hp_capture_conn_close(&lost);
+                if (lost._trace.id != 0)
+                        hp_trace_conn_close(&lost);
+                if (m->ssl != NULL)
+                        SSL_free(m->ssl);
+                close(m->fd);
+                __atomic_fetch_sub(&num_connections, 1, __ATOMIC_RELAXED);
+                free(m);
+                return;
+        }
+        conn->watcher = (hp_watcher_t){m->fd, EPOLLIN, on_conn_event};
+        conn->loop = loop;
+        conn->listener = m->listener;
+        conn->handler = m->handler;
+        conn->data = m->data;
+        conn->ssl = m->ssl;
+        conn->ktls_send = m->ktls_send;
+        conn->client_key = m->client_key;
+        conn->peak_input = m->peak_input;
+        conn->seqpacket = m->seqpacket;
+        conn->_capture_id = m->capture_id;
+        conn->_capture_awaiting_reply = m->capture_awaiting_reply;
+        conn->_trace = m->trace;
+        free(m);
+        ++loop->num_conns;
+        ++loop->num_migrated_in;
+        conn_link_newest(loop, conn);
+        if (hp_loop_add_watcher(loop, &conn->watcher) != 0)
+                hp_conn_close(conn);
+}
+
+/* a connection moves only between requests: nothing buffered in either direction, nor inside OpenSSL */
+static int conn_is_idle(hp_conn_t *conn)
+{
+        if (conn->closing || conn->_close_after_flush || conn->rbuf.size != 0 || conn->wbuf.size != 0 || conn->_sendfiles != NULL)
+                return 0;
+        if (conn->ssl != NULL && (!SSL_is_init_finished(conn->ssl) || SSL_pending(conn->ssl) != 0 || conn->ssl_want_write))
+                return 0;
+        return conn->handler->on_migrate == NULL || conn->handler->on_migrate(conn) == 0;
+}
+
+static int conn_migrate(hp_conn_t *conn, hp_loop_t *to)
+{
+        hp_loop_t *loop = conn->loop;
+        struct st_migration_t *m;
+
+        if ((m = malloc(sizeof(*m))) == NULL)
+                return -1;
+        *m = (struct st_migration_t){{on_migration}, conn->watcher.fd, conn->listener, conn->handler, conn->data, conn->ssl,
+                                     conn->ktls_send, conn->client_key, conn->peak_input, conn->seqpacket, conn->_capture_id,
+                                     conn->_capture_awaiting_reply, conn->_trace};
+        /* from here on, only the other loop touches the socket; what arrives meanwhile waits in the kernel */
+        hp_loop_remove_watcher(loop, &conn->watcher);
+        conn_unlink(loop, conn);
+        hp_bufpool_release(&loop->bufpool, &conn->rbuf);
+        hp_bufpool_release(&loop->bufpool, &conn->wbuf);
+        conn->_next = loop->_free_conns;
+        loop->_free_conns = conn;
+        --loop->num_conns;
+        ++loop->num_migrated_out;
+        hp_loop_post(to, &m->super);
+        return 0;
+}
+
+/* Each loop looks at the others on its own timer, and if it holds well above the mean, hands its longest idle connections
+   to the least loaded one.  Only connections that have not read for a whole interval are candidates, so that busy ones
+   keep their warm caches, and no more move than would bring either side to the mean. */
+static void on_rebalance(hp_loop_t *loop, hp_timer_t *timer)
+{
+        hp_loop_t *target = NULL;
+        hp_conn_t *conn, *newer;
+        size_t i, total = 0, mean, num_conns, target_conns = SIZE_MAX, num_moves;
+
+        hp_timer_link(loop, timer, loop->_rebalance_interval);
+
+        pthread_mutex_lock(&all_loops_mutex);
+        for (i = 0; i != num_all_loops; ++i) {
+                num_conns = __atomic_load_n(&all_loops[i]->num_conns, __ATOMIC_RELAXED);
+                total += num_conns;
+                if (num_conns < target_conns) {
+                        target = all_loops[i];
+                        target_conns = num_conns;
+                }
+        }
+        mean = total / num_all_loops;
+        pthread_mutex_unlock(&all_loops_mutex);
+
+        if (target == loop || loop->num_conns < mean + mean / 8 + REBALANCE_MIN_SURPLUS)
+                return;
+        num_moves = loop->num_conns - mean;
+        if (mean - target_conns < num_moves)
+                num_moves = mean - target_conns;
+        if (num_moves > MAX_MIGRATIONS_PER_ROUND)
+                num_moves = MAX_MIGRATIONS_PER_ROUND;
+
+        for (conn = loop->_oldest; conn != NULL && num_moves != 0; conn = newer) {
+                newer = conn->_newer;
+                if (loop->now - conn->_last_read < loop->_rebalance_interval)
+                        break;
+                if (conn_is_idle(conn) && conn_migrate(conn, target) == 0)
+                        --num_moves;
+        }
+}
+
+int hp_loop_add_listener(hp_loop_t *loop, hp_listener_t *listener)
+{
+        struct st_hp_loop_listener_t *ll, **listeners;
+
+        /* not accepted from; the loop reads from a socket of its own */
+        if (listener->udp)
+                return hp_udp_open(loop, listener) != NULL ? 0 : -1;
+
+        if ((listeners = realloc(loop->_listeners, sizeof(listeners[0]) * (loop->_num_listeners + 1))) == NULL)
+                return -1;
+        loop->_listeners = listeners;
+        if ((ll = malloc(sizeof(*ll))) == NULL)
+                return -1;
+        ll->watcher = (hp_watcher_t){listener->fd, 0, on_listener_event};
+        ll->listener = listener;
+        /* the loop polls as long as the most demanding of its listeners asks for */
+        if (listener->tcp.busy_poll > loop->_busy_poll) {
+                if (hp_tcp_set_epoll_busy_poll(loop->epoll_fd, listener->tcp.busy_poll) == 0) {
+                        loop->_busy_poll = listener->tcp.busy_poll;
+                } else if (loop->thread_index == 0) {
+                        perror("[WARN] busy polling is not available to epoll");
+                }
+        }
+        if (!loop->_listeners_paused && listener_watch(loop, ll) != 0) {
+                free(ll);
+                return -1;
+        }
+        loop->_listeners[loop->_num_listeners++] = ll;
+        return 0;
+}
+
+/* a message is sent whole or not at all; one that does not fit in the socket waits in the buffer behind the others */
+static int conn_write_message(hp_conn_t *conn, struct iovec *iov, size_t cnt, size_t total)
+{
+        struct msghdr msg = {NULL};
+        uint32_t len = (uint32_t)total;
+        ssize_t wret;
+        size_t i;
+
+        if (total > HP_SEQPACKET_MAX_MESSAGE)
+                goto Error;
+        if (conn->wbuf.size == 0) {
+                msg.msg_iov = iov;
+                msg.msg_iovlen = cnt;
+                while ((wret = sendmsg(conn->watcher.fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+                        ;
+                if (wret != -1)
+                        return 0;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        goto Error;
+        }
+        if (hp_bufpool_reserve(&conn->loop->bufpool, &conn->wbuf, sizeof(len) + total) != 0)
+                goto Error;
+        memcpy(conn->wbuf.bytes + conn->wbuf.size, &len, sizeof(len));
+        conn->wbuf.size += sizeof(len);
+        for (i = 0; i != cnt; ++i) {
+                memcpy(conn->wbuf.bytes + conn->wbuf.size, iov[i].iov_base, iov[i].iov_len);
+                conn->wbuf.size += iov[i].iov_len;
+        }
+        conn_update_events(conn);
+        return 0;
+
+Error:
+        hp_conn_close(conn);
+        return -1;
+}
+
+int hp_conn_writev(hp_conn_t *conn, const hp_iovec_t *bufs, size_t cnt)
+{
+        struct iovec iov[cnt];
+        size_t i, total = 0, written = 0;
+        ssize_t wret;
+
+        if (conn->closing || conn->_close_after_flush)
+                return -1;
+        if (conn->_capture_awaiting_reply)
+                hp_capture_conn_reply(conn);
+        if (conn->_trace.id != 0)
+                hp_trace_conn_reply(conn);
+
+        for (i = 0; i != cnt; ++i) {
+                iov[i].iov_base = bufs[i].base;
+                iov[i].iov_len = bufs[i].len;
+                total += bufs[i].len;
+        }
+        if (conn->seqpacket)
+                return conn_write_message(conn, iov, cnt, total);
+
+        /* write directly if nothing is pending, buffer the rest; TLS records are always written from the buffer, unless the
+           kernel makes them */
+        if (conn->wbuf.size == 0 && conn->_sendfiles == NULL && (conn->ssl == NULL || conn->ktls_send) && !conn->connecting) {
+                while ((wret = writev(conn->watcher.fd, iov, (int)cnt)) == -1 && errno == EINTR)
+                        ;
+                if (wret == -1) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                hp_conn_close(conn);
+                                return -1;
+                        }
+                } else {
+                        written = wret;
+                }
+        }
+        if (written == total) {
+                if (conn->_trace.id != 0)
+                        hp_trace_conn_flushed(conn);
+                return 0;
+        }
+
+        if (hp_bufpool_reserve(&conn->loop->bufpool, &conn->wbuf, total - written) != 0) {
+                hp_conn_close(conn);
+                return -1;
+        }
+        for (i = 0; i != cnt; ++i) {
+                if (written >= bufs[i].len) {
+                        written -= bufs[i].len;
+                        continue;
+                }
+                memcpy(conn->wbuf.bytes + conn->wbuf.size, bufs[i].base + written, bufs[i].len - written);
+                conn->wbuf.size += bufs[i].len - written;
+                written = 0;
+        }
+        if (conn->ssl != NULL) {
+                conn_flush(conn);
+        } else {
+                conn_update_events(conn);
+        }
+
+        return 0;
+}
+
+int hp_conn_write(hp_conn_t *conn, const void *src, size_t len)
+{
+        hp_iovec_t buf = hp_iovec_init(src, len);
+
+        return hp_conn_writev(conn, &buf, 1);
+}
+
+hp_conn_t *hp_conn_connect(hp_loop_t *loop, const struct sockaddr *addr, socklen_t addrlen, hp_handler_t *handler, void *data)
+{
+        hp_conn_t *conn;
+        int fd;
+
+        if ((fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+                return NULL;
+        if (connect(fd, addr, addrlen) != 0 && errno != EINPROGRESS)
+                goto Error;
+        if ((conn = conn_alloc(loop)) == NULL)
+                goto Error;
+        conn->watcher = (hp_watcher_t){fd, EPOLLOUT, on_conn_event};
+        conn->loop = loop;
+        conn->handler = handler;
+        conn->data = data;
+        conn->connecting = 1;
+        if (hp_loop_add_watcher(loop, &conn->watcher) != 0) {
+                conn->_next = loop->_free_conns;
+                loop->_free_conns = conn;
+                goto Error;
+        }
+        return conn;
+
+Error:
+        close(fd);
+        return NULL;
+}
+
+int hp_conn_sendfile(hp_conn_t *conn, hp_sendfile_t *sf)
+{
+        hp_sendfile_t *pending;
+        int was_idle = conn->wbuf.size == 0 && conn->_sendfiles == NULL;
+
+        /* a file region would not be one message */
+        if (conn->closing || conn->_close_after_flush || conn->seqpacket)
+                goto Error;
+        if (conn->_capture_awaiting_reply)
+                hp_capture_conn_reply(conn);
+        if (conn->_trace.id != 0)
+                hp_trace_conn_reply(conn);
+
+        sf->_prefix = conn->wbuf.size;
+        for (pending = conn->_sendfiles; pending != NULL; pending = pending->_next)
+                sf->_prefix -= pending->_prefix;
+        sf->_next = NULL;
+        *conn->_sendfiles_tail = sf;
+        conn->_sendfiles_tail = &sf->_next;
+
+        if (was_idle && !conn->connecting) {
+                conn_flush(conn);
+        } else {
+                conn_update_events(conn);
+        }
+        return 0;
+
+Error:
+        hp_conn_close(conn);
+        sf->on_complete(sf);
+        return -1;
+}
+
+void hp_conn_close_after_flush(hp_conn_t *conn)
+{
+        if (conn->wbuf.size == 0 && conn->_sendfiles == NULL) {
+                hp_conn_close(conn);
+                return;
+        }
+        conn->_close_after_flush = 1;
+}
+
+void hp_conn_close(hp_conn_t *conn)
+{
+        if (conn->closing)
+                return;
+        /* disposal is deferred to the end of the loop iteration, so that callbacks up the stack stay valid */
+        conn->closing = 1;
+        conn->_next = conn->loop->_closing;
+        conn->loop->_closing = conn;
+}
+
+void hp_timer_link(hp_loop_t *loop, hp_timer_t *timer, uint64_t delay_ms)
+{
+        hp_timer_t *pos;
+
+        timer->expire_at = loop->now + delay_ms;
+        /* timers of one kind share a duration, hence are mostly linked in order; search from the tail */
+        for (pos = loop->_timers._prev; pos != &loop->_timers && pos->expire_at > timer->expire_at; pos = pos->_prev)
+                ;
+        timer->_prev = pos;
+        timer->_next = pos->_next;
+        pos->_next->_prev = timer;
+        pos->_next = timer;
+}
+
+void hp_timer_unlink(hp_timer_t *timer)
+{
+        if (timer->_next == NULL)
+                return;
+        timer->_prev->_next = timer->_next;
+        timer->_next->_prev = timer->_prev;
+        timer->_prev = timer->_next = NULL;
+}
+
+static void run_timers(hp_loop_t *loop)
+{
+        hp_timer_t *timer;
+
+        while ((timer = loop->_timers._next) != &loop->_timers && timer->expire_at <= loop->now) {
+                hp_timer_unlink(timer);
+                timer->cb(loop, timer);
+        }
+}
+
+int hp_loop_run_once(hp_loop_t *loop, int timeout_ms)
+{
+        struct epoll_event events[MAX_EVENTS];
+        uint64_t busy_since, busy;
+        int nevents, i;
+
+        quiesce(loop);
+        update_listeners(loop);
+
+        if (loop->_timers._next != &loop->_timers) {
+                uint64_t expire_at = loop->_timers._next->expire_at;
+                int until = expire_at <= loop->now ? 0 : expire_at - loop->now < INT_MAX ? (int)(expire_at - loop->now) : INT_MAX;
+                if (timeout_ms == -1 || until < timeout_ms)
+                        timeout_ms = until;
+        }
+        if (timeout_ms != 0)
+                go_offline(loop);
+        nevents = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout_ms);
+        if (timeout_ms != 0)
+                quiesce(loop);
+        update_now(loop);
+        if (nevents == -1) {
+                if (errno == EINTR)
+                        return 0;
+                return -1;
+        }
+        busy_since = hp_clock_nsec();
+        for (i = 0; i != nevents; ++i) {
+                hp_watcher_t *watcher = events[i].data.ptr;
+                watcher->cb(loop, watcher, events[i].events);
+        }
+        run_timers(loop);
+
+        /* dispose the connections closed during this iteration, flushing what can be flushed */
+        while (loop->_closing != NULL) {
+                hp_conn_t *conn = loop->_closing;
+                size_t limit;
+                loop->_closing = conn->_next;
+                /* up to the first file region; what follows it cannot go out before it */
+                if (conn->seqpacket) {
+                        conn_send_messages(conn);
+                } else if ((limit = conn->_sendfiles != NULL ? conn->_sendfiles->_prefix : conn->wbuf.size) != 0) {
+                        conn_send(conn, conn->wbuf.bytes, limit);
+                }
+                conn_dispose(conn);
+        }
+        if (nevents != 0) {
+                busy = hp_clock_nsec() - busy_since;
+                hp_latency_record(&loop->busy, busy);
+                HP_PROBE(loop__iteration, loop->thread_index, nevents, busy);
+        }
+        if (hp_capture_enabled)
+                hp_capture_flush(loop, 0);
+
+        return nevents;
+}
@@ -0,0 +1,976 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Static files.  Each loop keeps a table of the files it has served, holding the open descriptors
+   of the file and of its precompressed `.gz`, `.zst` and `.br` siblings along with what the response
+   headers need, so that serving a hot file takes no open(2) or fstat(2).  The directories of the
+   cached files are watched with inotify; a change to a file or to one of its variants drops the
+   entry, and the next request opens the file afresh.  Bodies go out with sendfile(2); a response
+   still being sent keeps its entry alive after it has been dropped from the table.
+
+   Text that has no sibling in an accepted encoding is compressed on the task pool, never on the
+   loop.  A small file is compressed whole, into a memfd that becomes a variant of the entry, so
+   that the next requests for it are served like a precompressed sibling; a large one is streamed
+   with chunked encoding, a chunk being compressed while the previous one is sent, and the next one
+   waiting for the socket to drain once the write buffer is full.  The requests pipelined behind a
+   response being compressed wait in the read buffer. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hoppang.h"
+
+#define NUM_BUCKETS 4096
+#define MAX_HEAD_SIZE 8192
+#define INDEX_FILE "index.html"
+#define COMPRESS_MIN_SIZE 256                 /* smaller bodies are sent as they are */
+#define COMPRESS_CACHE_MAX_SIZE (256 * 1024)  /* larger ones are streamed rather than compressed whole */
+#define COMPRESS_CACHE_BUDGET (64 * 1024 * 1024) /* bytes of compressed variants made per loop */
+#define COMPRESS_MAX_INFLIGHT 64              /* responses being compressed per loop; more are sent as they are */
+#define STREAM_CHUNK_SIZE (64 * 1024)
+#define STREAM_LOW_WATER (128 * 1024) /* the next chunk is compressed at once while the write buffer holds less */
+
+enum {
+        VARIANT_IDENTITY,
+        VARIANT_GZIP,
+        VARIANT_ZSTD,
+        VARIANT_BROTLI,
+        NUM_VARIANTS
+};
+
+static const struct {
+        const char *suffix;
+        const char *encoding; /* token of Accept-Encoding and Content-Encoding */
+        const char *etag_suffix;
+        hp_encoding_t encoding_id;
+        int stream_level; /* while the client waits for each chunk */
+        int cache_level;  /* for a variant made once and served many times */
+} variants[NUM_VARIANTS] = {{"", NULL, "", 0, 0, 0},
+                            {".gz", "gzip", "-gz", HP_ENCODING_GZIP, 6, 9},
+                            {".zst", "zstd", "-zst", HP_ENCODING_ZSTD, 3, 12},
+                            {".br", "br", "-br", HP_ENCODING_BROTLI, 5, 9}};
+
+struct st_file_dir_t;
+
+struct st_file_entry_t {
+        uint64_t hash;
+        char *path; /* relative to the root */
+        const char *name; /* the last component of `path` */
+        struct {
+                int fd; /* -1 if absent */
+                off_t size;
+                int made; /* compressed by us rather than found beside the file */
+        } variants[NUM_VARIANTS];
+        const char *mime_type;
+        int compressible; /* text large enough to be worth compressing */
+        char etag[40];
+        char last_modified[32];
+        size_t refcnt; /* one for the table while linked, one per response being sent */
+        struct st_file_dir_t *dir;
+        struct st_file_entry_t *bucket_next;
+        struct st_file_entry_t *lru_prev;
+        struct st_file_entry_t *lru_next;
+        struct st_file_entry_t *dir_prev;
+        struct st_file_entry_t *dir_next;
+};
+
+struct st_file_dir_t {
+        int wd;
+        char *path; /* relative to the root, "." for the root itself */
+        struct st_file_entry_t *entries;
+        struct st_file_dir_t *next;
+};
+
+struct st_file_cache_t {
+        hp_loop_t *loop;
+        int root_fd;
+        hp_watcher_t inotify; /* fd is -1 if unavailable, in which case nothing is cached */
+        struct st_file_dir_t *dirs;
+        struct st_file_entry_t *buckets[NUM_BUCKETS];
+        struct st_file_entry_t lru; /* sentinel; most recently used first */
+        size_t num_entries;
+};
+
+struct st_file_response_t {
+        hp_sendfile_t super;
+        struct st_file_entry_t *entry;
+};
+
+/* a response being compressed, set as the data of its connection */
+struct st_file_compress_t {
+        hp_task_t super;
+        hp_conn_t *conn; /* NULL once closed */
+        struct st_file_entry_t *entry;
+        size_t variant;
+        hp_compressor_t *compressor;
+        int keep_alive;
+        int whole; /* compressed at once into `fd`, to become a variant of the entry; streamed otherwise */
+        int in_flight; /* on the task pool */
+        /* filled in by the task */
+        off_t offset; /* of the input yet to be compressed */
+        char *input;
+        hp_buffer_t output;
+        int fd;
+        int final;
+        int failed;
+};
+
+static const hp_file_config_t *config;
+static hp_handler_t file_handler;
+
+/* one cache per loop, and each loop runs on its own thread */
+static __thread struct st_file_cache_t *cache;
+static __thread struct st_hp_file_stats_t stats;
+static __thread size_t num_compressing;
+static __thread size_t made_bytes; /* held by the compressed variants of the entries */
+
+static const struct {
+        const char *ext;
+        const char *type;
+} mime_types[] = {{"html", "text/html"},
+                  {"htm", "text/html"},
+                  {"css", "text/css"},
+                  {"js", "application/javascript"},
+                  {"json", "application/json"},
+                  {"txt", "text/plain"},
+                  {"xml", "application/xml"},
+                  {"svg", "image/svg+xml"},
+                  {"png", "image/png"},
+                  {"jpg", "image/jpeg"},
+                  {"jpeg", "image/jpeg"},
+                  {"gif", "image/gif"},
+                  {"webp", "image/webp"},
+                  {"ico", "image/x-icon"},
+                  {"woff", "font/woff"},
+                  {"woff2", "font/woff2"},
+                  {"wasm", "application/wasm"},
+                  {"pdf", "application/pdf"},
+                  {"mp4", "video/mp4"},
+                  {NULL, NULL}};
+
+static ssize_t on_read(hp_conn_t *conn, hp_iovec_t input);
+
+const struct st_hp_file_stats_t *hp_file_get_stats(void)
+{
+        return &stats;
+}
+
+static const char *get_mime_type(const char *name)
+{
+        const char *ext = strrchr(name, '.');
+        size_t i;
+
+        if (ext != NULL) {
+                for (i = 0; mime_types[i].ext != NULL; ++i)
+                        if (strcasecmp(ext + 1, mime_types[i].ext) == 0)
+                                return mime_types[i].type;
+        }
+        return "application/octet-stream";
+}
+
+static int is_compressible_type(const char *type)
+{
+        return strncmp(type, "text/", 5) == 0 || strcmp(type, "application/javascript") == 0 ||
+               strcmp(type, "application/json") == 0 || strcmp(type, "application/xml") == 0 ||
+               strcmp(type, "image/svg+xml") == 0 || strcmp(type, "application/wasm") == 0;
+}
+
+static void entry_release(struct st_file_entry_t *entry)
+{
+        size_t i;
+
+        if (--entry->refcnt != 0)
+                return;
+        for (i = 0; i != NUM_VARIANTS; ++i) {
+                if (entry->variants[i].fd != -1)
+                        close(entry->variants[i].fd);
+                if (entry->variants[i].made)
+                        made_bytes -= entry->variants[i].size;
+        }
+        free(entry);
+}
+
+static void entry_unlink(struct st_file_cache_t *fc, struct st_file_entry_t *entry)
+{
+        struct st_file_entry_t **slot;
+
+        for (slot = fc->buckets + entry->hash % NUM_BUCKETS; *slot != entry; slot = &(*slot)->bucket_next)
+                ;
+        *slot = entry->bucket_next;
+        entry->lru_prev->lru_next = entry->lru_next;
+        entry->lru_next->lru_prev = entry->lru_prev;
+        if (entry->dir_prev != NULL) {
+                entry->dir_prev->dir_next = entry->dir_next;
+        } else {
+                entry->dir->entries = entry->dir_next;
+        }
+        if (entry->dir_next != NULL)
+                entry->dir_next->dir_prev = entry->dir_prev;
+        --fc->num_entries;
+        entry_release(entry);
+}
+
+static void invalidate_dir(struct st_file_cache_t *fc, struct st_file_dir_t *dir, const char *name)
+{
+        struct st_file_entry_t *entry, *next;
+        size_t len, i;
+
+        for (entry = dir->entries; entry != NULL; entry = next) {
+                next = entry->dir_next;
+                /* the event may be about the file itself or one of its variants */
+                if (name != NULL) {
+                        len = strlen(entry->name);
+                        if (strncmp(name, entry->name, len) != 0)
+                                continue;
+                        for (i = 0; i != NUM_VARIANTS; ++i)
+                                if (strcmp(name + len, variants[i].suffix) == 0)
+                                        break;
+                        if (i == NUM_VARIANTS)
+                                continue;
+                }
+                entry_unlink(fc, entry);
+                ++stats.invalidations;
+        }
+}
+
+static void on_inotify(hp_loop_t *loop, hp_watcher_t *watcher, uint32_t revents)
+{
+        struct st_file_cache_t *fc = HP_STRUCT_FROM_MEMBER(struct st_file_cache_t, inotify, watcher);
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *ev;
+        struct st_file_dir_t **slot, *dir;
+        ssize_t r;
+        char *p;
+
+        while ((r = read(watcher->fd, buf, sizeof(buf))) > 0) {
+                for (p = buf; p < buf + r; p += sizeof(*ev) + ev->len) {
+                        ev = (const struct inotify_event *)p;
+                        if ((ev->mask & IN_Q_OVERFLOW) != 0) {
+                                /* events were lost; anything could have changed */
+                                for (dir = fc->dirs; dir != NULL; dir = dir->next)
+                                        invalidate_dir(fc, dir, NULL);
+                                continue;
+                        }
+                        for (slot = &fc->dirs; (dir = *slot) != NULL; slot = &dir->next)
+                                if (dir->wd == ev->wd)
+                                        break;
+                        if (dir == NULL)
+                                continue;
+                        if ((ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) != 0) {
+                                invalidate_dir(fc, dir, NULL);
+                                if ((ev->mask & IN_IGNORED) != 0) {
+                                        *slot = dir->next;
+                                        free(dir->path);
+                                        free(dir);
+                                }
+                                continue;
+                        }
+                        invalidate_dir(fc, dir, ev->len != 0 ? ev->name : NULL);
+                }
+        }
+}
+
+static struct st_file_cache_t *get_cache(hp_loop_t *loop)
+{
+        struct st_file_cache_t *fc;
+
+        if (cache != NULL)
+                return cache;
+
+        if ((fc = calloc(1, sizeof(*fc))) == NULL) {
+                perror("failed to create file cache");
+                abort();
+        }
+        fc->loop = loop;
+        fc->lru.lru_prev = fc->lru.lru_next = &fc->lru;
+        if ((fc->root_fd = open(config->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+                fprintf(stderr, "[ERROR] failed to open document root:%s:%s\n", config->root, strerror(errno));
+        fc->inotify = (hp_watcher_t){inotify_init1(IN_NONBLOCK | IN_CLOEXEC), EPOLLIN, on_inotify};
+        if (fc->inotify.fd == -1 || hp_loop_add_watcher(loop, &fc->inotify) != 0) {
+                fprintf(stderr, "[WARN] inotify is unavailable (%s); files will not be cached\n", strerror(errno));
+                if (fc->inotify.fd != -1)
+                        close(fc->inotify.fd);
+                fc->inotify.fd = -1;
+        }
+        return cache = fc;
+}
+
+static struct st_file_dir_t *watch_dir(struct st_file_cache_t *fc, const char *path, size_t len)
+{
+        struct st_file_dir_t *dir;
+        char abspath[PATH_MAX];
+        int wd;
+
+        if (len == 0) {
+                path = ".";
+                len = 1;
+        }
+        if (snprintf(abspath, sizeof(abspath), "%s/%.*s", config->root, (int)len, path) >= (int)sizeof(abspath))
+                return NULL;
+        if ((wd = inotify_add_watch(fc->inotify.fd, abspath,
+                                    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                        IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)) == -1)
+                return NULL;
+        /* watching the same directory twice returns the same descriptor */
+        for (dir = fc->dirs; dir != NULL; dir = dir->next)
+                if (dir->wd == wd)
+                        return dir;
+        if ((dir = calloc(1, sizeof(*dir))) == NULL || (dir->path = strndup(path, len)) == NULL) {
+                free(dir);
+                return NULL;
+        }
+        dir->wd = wd;
+        dir->next = fc->dirs;
+        fc->dirs = dir;
+        return dir;
+}
+
+static struct st_file_entry_t *lookup(struct st_file_cache_t *fc, const char *path, uint64_t hash)
+{
+        struct st_file_entry_t *entry;
+
+        for (entry = fc->buckets[hash % NUM_BUCKETS]; entry != NULL; entry = entry->bucket_next) {
+                if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+                        entry->lru_prev->lru_next = entry->lru_next;
+                        entry->lru_next->lru_prev = entry->lru_prev;
+                        entry->lru_next = fc->lru.lru_next;
+                        entry->lru_prev = &fc->lru;
+                        fc->lru.lru_next->lru_prev = entry;
+                        fc->lru.lru_next = entry;
+                        return entry;
+                }
+        }
+        return NULL;
+}
+
+/* returns the entry with a reference for the caller, or NULL with errno set */
+static struct st_file_entry_t *open_entry(struct st_file_cache_t *fc, const char *path, size_t path_len, uint64_t hash)
+{
+        struct st_file_entry_t *entry;
+        char variant_path[PATH_MAX];
+        const char *name;
+        struct stat st;
+        struct tm tm;
+        size_t i;
+        int fd;
+
+        if ((fd = openat(fc->root_fd, path, O_RDONLY | O_CLOEXEC)) == -1)
+                return NULL;
+        if (fstat(fd, &st) != 0)
+                goto Error;
+        if (!S_ISREG(st.st_mode)) {
+                errno = S_ISDIR(st.st_mode) ? EISDIR : EACCES;
+                goto Error;
+        }
+        if ((entry = calloc(1, sizeof(*entry) + path_len + 1)) == NULL)
+                goto Error;
+        entry->hash = hash;
+        entry->path = memcpy(entry + 1, path, path_len + 1);
+        name = strrchr(entry->path, '/');
+        entry->name = name != NULL ? name + 1 : entry->path;
+        entry->variants[VARIANT_IDENTITY].fd = fd;
+        entry->variants[VARIANT_IDENTITY].size = st.st_size;
+        entry->mime_type = get_mime_type(entry->name);
+        entry->compressible = is_compressible_type(entry->mime_type) && st.st_size >= COMPRESS_MIN_SIZE;
+        snprintf(entry->etag, sizeof(entry->etag), "%lx-%llx", (unsigned long)st.st_mtime, (unsigned long long)st.st_size);
+        gmtime_r(&st.st_mtime, &tm);
+        strftime(entry->last_modified, sizeof(entry->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        entry->refcnt = 1;
+
+        for (i = 1; i != NUM_VARIANTS; ++i) {
+                struct stat vst;
+                entry->variants[i].fd = -1;
+                if (snprintf(variant_path, sizeof(variant_path), "%s%s", path, variants[i].suffix) >= (int)sizeof(variant_path))
+                        continue;
+                if ((fd = openat(fc->root_fd, variant_path, O_RDONLY | O_CLOEXEC)) == -1)
+                        continue;
+                if (fstat(fd, &vst) != 0 || !S_ISREG(vst.st_mode)) {
+                        close(fd);
+                        continue;
+                }
+                entry->variants[i].fd = fd;
+                entry->variants[i].size = vst.st_size;
+        }
+        return entry;
+
+Error:
+        close(fd);
+        return NULL;
+}
+
+static void cache_insert(struct st_file_cache_t *fc, struct st_file_entry_t *entry)
+{
+        struct st_file_dir_t *dir;
+        size_t dir_len = entry->name != entry->path ? entry->name - entry->path - 1 : 0;
+
+        /* without a watch, a change would go unnoticed */
+        if (fc->inotify.fd == -1 || (dir = watch_dir(fc, entry->path, dir_len)) == NULL)
+                return;
+        if (fc->num_entries >= config->max_cache_entries) {
+                entry_unlink(fc, fc->lru.lru_prev);
+                ++stats.evictions;
+        }
+
+        ++entry->refcnt;
+        entry->dir = dir;
+        entry->dir_prev = NULL;
+        entry->dir_next = dir->entries;
+        if (dir->entries != NULL)
+                dir->entries->dir_prev = entry;
+        dir->entries = entry;
+        entry->bucket_next = fc->buckets[entry->hash % NUM_BUCKETS];
+        fc->buckets[entry->hash % NUM_BUCKETS] = entry;
+        entry->lru_next = fc->lru.lru_next;
+        entry->lru_prev = &fc->lru;
+        fc->lru.lru_next->lru_prev = entry;
+        fc->lru.lru_next = entry;
+        ++fc->num_entries;
+}
+
+static int hex_value(char c)
+{
+        if ('0' <= c && c <= '9')
+                return c - '0';
+        if ('a' <= (c | 0x20) && (c | 0x20) <= 'f')
+                return (c | 0x20) - 'a' + 10;
+        return -1;
+}
+
+static int is_dot_segment(const char *segment, size_t len)
+{
+        return (len == 1 && segment[0] == '.') || (len == 2 && segment[0] == '.' && segment[1] == '.');
+}
+
+/* decodes the path of the request into `dst` without the leading slash; returns -1 if it is not acceptable */
+static int normalize_path(hp_iovec_t src, char *dst, size_t dst_size)
+{
+        const char *p = src.base, *end = src.base + src.len, *q;
+        size_t len = 0, segment_start = 0;
+        int hi, lo;
+
+        if ((q = memchr(p, '?', src.len)) != NULL)
+                end = q;
+        if (p == end || *p++ != '/')
+                return -1;
+        for (; p != end; ++p) {
+                char c = *p;
+                if (c == '%') {
+                        if (end - p < 3 || (hi = hex_value(p[1])) == -1 || (lo = hex_value(p[2])) == -1)
+                                return -1;
+                        c = (char)(hi << 4 | lo);
+                        p += 2;
+                }
+                /* control characters would end up in the Location header of a redirect */
+                if ((unsigned char)c < 0x20 || c == 0x7f || len + 1 >= dst_size - sizeof(INDEX_FILE))
+                        return -1;
+                if (c == '/') {
+                        /* reject `.`, `..` and empty segments rather than resolving them */
+                        if (len == segment_start || is_dot_segment(dst + segment_start, len - segment_start))
+                                return -1;
+                        segment_start = len + 1;
+                }
+                dst[len++] = c;
+        }
+        if (is_dot_segment(dst + segment_start, len - segment_start))
+                return -1;
+        if (len == segment_start) {
+                memcpy(dst + len, INDEX_FILE, sizeof(INDEX_FILE));
+        } else {
+                dst[len] = '\0';
+        }
+        return 0;
+}
+
+static void send_response(hp_conn_t *conn, int status, const char *reason, const char *extra_headers, int keep_alive)
+{
+        char head[512 + PATH_MAX]; /* room for a Location header */
+        int len;
+
+        len = snprintf(head, sizeof(head),
+                       "HTTP/1.1 %d %s\r\nDate: %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n%s%s\r\n%s\n",
+                       status, reason, hp_clock_http_date(conn->loop->wall_now), strlen(reason) + 1, extra_headers,
+                       keep_alive ? "" : "Connection: close\r\n", reason);
+        hp_conn_write(conn, head, len);
+}
+
+/* returns 0 if the range is satisfiable, 1 if the header is to be ignored, -1 if unsatisfiable */
+static int parse_range(hp_iovec_t value, off_t size, off_t *start, off_t *end)
+{
+        const char *p = value.base, *endp = value.base + value.len;
+        unsigned long long first = 0, last = 0;
+        int has_first = 0, has_last = 0;
+
+        /* a single byte range; multiple ones are served as a whole, which the RFC permits */
+        if (value.len < 6 || strncasecmp(p, "bytes=", 6) != 0 || memchr(p, ',', value.len) != NULL)
+                return 1;
+        for (p += 6; p != endp && *p >= '0' && *p <= '9'; ++p, has_first = 1)
+                first = first * 10 + (*p - '0');
+        if (p == endp || *p++ != '-')
+                return 1;
+        for (; p != endp && *p >= '0' && *p <= '9'; ++p, has_last = 1)
+                last = last * 10 + (*p - '0');
+        if (p != endp || (!has_first && !has_last))
+                return 1;
+
+        if (!has_first) {
+                /* suffix */
+                if (last == 0)
+                        return -1;
+                *start = (off_t)last >= size ? 0 : size - (off_t)last;
+                *end = size;
+                return 0;
+        }
+        if (has_last && last < first)
+                return 1;
+        if ((off_t)first >= size)
+                return -1;
+        *start = (off_t)first;
+        *end = has_last && (off_t)last < size ? (off_t)last + 1 : size;
+        return 0;
+}
+
+static void on_response_sent(hp_sendfile_t *sf)
+{
+        struct st_file_response_t *res = HP_STRUCT_FROM_MEMBER(struct st_file_response_t, super, sf);
+
+        entry_release(res->entry);
+        free(res);
+}
+
+/* `content_length` is -1 for a chunked body */
+static int build_head(hp_conn_t *conn, char *head, size_t size, struct st_file_entry_t *entry, size_t variant, const char *status,
+                      long long content_length, const char *content_range, int keep_alive)
+{
+        int len, may_vary = entry->compressible;
+        size_t i;
+
+        len = snprintf(head, size, "HTTP/1.1 %s\r\nDate: %s\r\nContent-Type: %s\r\n", status,
+                       hp_clock_http_date(conn->loop->wall_now), entry->mime_type);
+        if (content_length != -1) {
+                len += snprintf(head + len, size - len, "Content-Length: %lld\r\n", content_length);
+        } else {
+                len += snprintf(head + len, size - len, "Transfer-Encoding: chunked\r\n");
+        }
+        len += snprintf(head + len, size - len, "Last-Modified: %s\r\nETag: \"%s%s\"\r\nAccept-Ranges: bytes\r\n%s",
+                        entry->last_modified, entry->etag, variants[variant].etag_suffix, content_range);
+        if (variant != VARIANT_IDENTITY)
+                len += snprintf(head + len, size - len, "Content-Encoding: %s\r\n", variants[variant].encoding);
+        for (i = 1; i != NUM_VARIANTS; ++i)
+                if (entry->variants[i].fd != -1)
+                        may_vary = 1;
+        if (may_vary)
+                len += snprintf(head + len, size - len, "Vary: Accept-Encoding\r\n");
+        len += snprintf(head + len, size - len, "%s\r\n", keep_alive ? "" : "Connection: close\r\n");
+        return len;
+}
+
+/* sends the bytes [start, end) of a variant, taking over the reference to the entry */
+static void send_entry(hp_conn_t *conn, struct st_file_entry_t *entry, size_t variant, off_t start, off_t end,
+                       const char *content_range, int is_head, int keep_alive)
+{
+        struct st_file_response_t *res;
+        char head[1024];
+        int len;
+
+        len = build_head(conn, head, sizeof(head), entry, variant, content_range[0] != '\0' ? "206 Partial Content" : "200 OK",
+                         (long long)(end - start), content_range, keep_alive);
+        hp_conn_write(conn, head, len);
+
+        if (is_head || end == start) {
+                entry_release(entry);
+                return;
+        }
+        if ((res = malloc(sizeof(*res))) == NULL) {
+                entry_release(entry);
+                hp_conn_close(conn);
+                return;
+        }
+        res->super.fd = entry->variants[variant].fd;
+        res->super.offset = start;
+        res->super.len = end - start;
+        res->super.on_complete = on_response_sent;
+        res->entry = entry;
+        hp_conn_sendfile(conn, &res->super);
+}
+
+/* runs on the task pool: compresses the next chunk, or the whole file into a memfd */
+static void run_compress(hp_task_t *task)
+{
+        struct st_file_compress_t *job = HP_STRUCT_FROM_MEMBER(struct st_file_compress_t, super, task);
+        int src_fd = job->entry->variants[VARIANT_IDENTITY].fd;
+        off_t size = job->entry->variants[VARIANT_IDENTITY].size;
+        size_t len = job->whole ? (size_t)size : STREAM_CHUNK_SIZE, off;
+        ssize_t r;
+
+        if (job->input == NULL && (job->input = malloc(len)) == NULL)
+                goto Error;
+        if ((off_t)len > size - job->offset)
+                len = size - job->offset;
+        for (off = 0; off != len; off += r) {
+                if ((r = pread(src_fd, job->input + off, len - off, job->offset + off)) <= 0) {
+                        if (r == -1 && errno == EINTR) {
+                                r = 0;
+                                continue;
+                        }
+                        /* truncated meanwhile */
+                        goto Error;
+                }
+        }
+        job->offset += len;
+        job->final = job->offset == size;
+        job->output.size = 0;
+        if (hp_compressor_run(job->compressor, job->input, len, job->final, &job->output) != 0)
+                goto Error;
+        if (job->whole) {
+                if ((job->fd = memfd_create("hoppang-file", MFD_CLOEXEC)) == -1)
+                        goto Error;
+                for (off = 0; off != job->output.size; off += r) {
+                        if ((r = write(job->fd, job->output.bytes + off, job->output.size - off)) == -1) {
+                                if (errno == EINTR) {
+                                        r = 0;
+                                        continue;
+                                }
+                                goto Error;
+                        }
+                }
+        }
+        return;
+
+Error:
+        job->failed = 1;
+}
+
+/* answers what was pipelined behind a response once it has been compressed */
+static void resume_input(hp_conn_t *conn)
+{
+        ssize_t consumed;
+
+        if (conn->closing || conn->rbuf.size == 0)
+                return;
+        if ((consumed = on_read(conn, hp_iovec_init(conn->rbuf.bytes, conn->rbuf.size))) == -1) {
+                hp_conn_close(conn);
+                return;
+        }
+        memmove(conn->rbuf.bytes, conn->rbuf.bytes + consumed, conn->rbuf.size - consumed);
+        conn->rbuf.size -= consumed;
+}
+
+static void finish_compress(struct st_file_compress_t *job)
+{
+        hp_conn_t *conn = job->conn;
+        int keep_alive = job->keep_alive;
+
+        hp_compressor_release(job->compressor);
+        entry_release(job->entry);
+        if (job->fd != -1)
+                close(job->fd);
+        free(job->input);
+        free(job->output.bytes);
+        free(job);
+        --num_compressing;
+
+        if (conn == NULL)
+                return;
+        conn->data = NULL;
+        if (!keep_alive) {
+                hp_conn_close_after_flush(conn);
+        } else {
+                resume_input(conn);
+        }
+}
+
+static void submit_compress(struct st_file_compress_t *job)
+{
+        job->in_flight = 1;
+        hp_task_submit(job->conn->loop, &job->super);
+}
+
+static void on_stream_drain(hp_conn_t *conn)
+{
+        submit_compress(conn->data);
+}
+
+static void on_compress_complete(hp_loop_t *loop, hp_task_t *task)
+{
+        struct st_file_compress_t *job = HP_STRUCT_FROM_MEMBER(struct st_file_compress_t, super, task);
+        struct st_file_entry_t *entry = job->entry;
+        hp_conn_t *conn = job->conn;
+        char size_line[24];
+
+        job->in_flight = 0;
+
+        if (job->whole) {
+                /* kept even if the client has gone, for the next ones; an entry dropped meanwhile takes it along */
+                if (!job->failed && entry->variants[job->variant].fd == -1) {
+                        entry->variants[job->variant].fd = job->fd;
+                        entry->variants[job->variant].size = job->output.size;
+                        entry->variants[job->variant].made = 1;
+                        made_bytes += job->output.size;
+                        job->fd = -1;
+                        ++stats.compressed_cached;
+                }
+                if (conn != NULL) {
+                        /* as it is, should it have failed */
+                        size_t variant = entry->variants[job->variant].fd != -1 ? job->variant : VARIANT_IDENTITY;
+                        ++entry->refcnt;
+                        send_entry(conn, entry, variant, 0, entry->variants[variant].size, "", 0, job->keep_alive);
+                }
+                finish_compress(job);
+                return;
+        }
+
+        if (conn == NULL) {
+                finish_compress(job);
+                return;
+        }
+        /* the head is gone; cutting the connection is all that tells the client */
+        if (job->failed) {
+                hp_conn_close(conn);
+                return;
+        }
+        if (job->output.size != 0) {
+                hp_iovec_t bufs[3] = {{size_line, sprintf(size_line, "%zx\r\n", job->output.size)},
+                                      {job->output.bytes, job->output.size},
+                                      {"\r\n", 2}};
+                hp_conn_writev(conn, bufs, 3);
+        }
+        if (job->final) {
+                hp_conn_write(conn, "0\r\n\r\n", 5);
+                finish_compress(job);
+                return;
+        }
+        if (conn->closing)
+                return;
+        /* one chunk ahead of the socket, and no more */
+        if (conn->wbuf.size < STREAM_LOW_WATER) {
+                submit_compress(job);
+        } else {
+                conn->on_drain = on_stream_drain;
+        }
+}
+
+/* returns 0 if the response is being compressed, or -1 if it is to be sent as it is */
+static int start_compress(hp_conn_t *conn, struct st_file_entry_t *entry, size_t variant, int minor_version, int keep_alive)
+{
+        struct st_file_compress_t *job;
+        off_t size = entry->variants[VARIANT_IDENTITY].size;
+        int whole = size <= COMPRESS_CACHE_MAX_SIZE && made_bytes < COMPRESS_CACHE_BUDGET;
+        char head[1024];
+        int len;
+
+        /* the end of a stream is marked by chunked encoding, which HTTP/1.0 does not have */
+        if (!whole && minor_version < 1)
+                return -1;
+        if (num_compressing >= COMPRESS_MAX_INFLIGHT) {
+                ++stats.compress_skipped;
+                return -1;
+        }
+        if ((job = calloc(1, sizeof(*job))) == NULL)
+                return -1;
+        if ((job->compressor = hp_compressor_acquire(variants[variant].encoding_id,
+                                                     whole ? variants[variant].cache_level : variants[variant].stream_level,
+                                                     (size_t)size)) == NULL) {
+                free(job);
+                return -1;
+        }
+        job->super.run = run_compress;
+        job->super.on_complete = on_compress_complete;
+        job->conn = conn;
+        job->entry = entry;
+        job->variant = variant;
+        job->keep_alive = keep_alive;
+        job->whole = whole;
+        job->fd = -1;
+        ++num_compressing;
+        conn->data = job;
+
+        if (!whole) {
+                len = build_head(conn, head, sizeof(head), entry, variant, "200 OK", -1, "", keep_alive);
+                hp_conn_write(conn, head, len);
+                ++stats.compressed_streams;
+        }
+        submit_compress(job);
+        return 0;
+}
+
+/* returns non-zero if the connection is to be kept */
+static int handle_request(hp_conn_t *conn, hp_http1_request_t *req)
+{
+        struct st_file_cache_t *fc = get_cache(conn->loop);
+        const hp_http1_header_t *header;
+        struct st_file_entry_t *entry;
+        char path[PATH_MAX], content_range[96] = "";
+        off_t start = 0, end;
+        size_t variant = VARIANT_IDENTITY, i;
+        const char *key_header = conn->loop->config->rate_limit_key_header;
+        int keep_alive, is_head, ranged = 0;
+        uint64_t hash;
+
+        header = key_header != NULL ? hp_http1_find_header(req, key_header) : NULL;
+        if (hp_ratelimit_request(conn, header != NULL ? &header->value : NULL) != -1) {
+                send_response(conn, 429, "Too Many Requests", "Retry-After: 1\r\n", 0);
+                return 0;
+        }
+        if ((header = hp_http1_find_header(req, "connection")) != NULL) {
+                keep_alive = req->minor_version >= 1 ? !hp_http1_contains_token(header->value, "close")
+                                                     : hp_http1_contains_token(header->value, "keep-alive");
+        } else {
+                keep_alive = req->minor_version >= 1;
+        }
+        /* bodies are not expected, and skipping them is not worth it */
+        if (hp_http1_find_header(req, "transfer-encoding") != NULL ||
+            ((header = hp_http1_find_header(req, "content-length")) != NULL && !(header->value.len == 1 && header->value.base[0] == '0'))) {
+                send_response(conn, 400, "Bad Request", "", 0);
+                return 0;
+        }
+        if (req->method.len == 3 && memcmp(req->method.base, "GET", 3) == 0) {
+                is_head = 0;
+        } else if (req->method.len == 4 && memcmp(req->method.base, "HEAD", 4) == 0) {
+                is_head = 1;
+        } else {
+                send_response(conn, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n", keep_alive);
+                return keep_alive;
+        }
+        if (normalize_path(req->path, path, sizeof(path)) != 0) {
+                send_response(conn, 400, "Bad Request", "", keep_alive);
+                return keep_alive;
+        }
+
+        hash = hp_hash(path, strlen(path));
+        if ((entry = lookup(fc, path, hash)) != NULL) {
+                ++entry->refcnt;
+                ++stats.hits;
+        } else {
+                ++stats.misses;
+                if ((entry = open_entry(fc, path, strlen(path), hash)) == NULL) {
+                        switch (errno) {
+                        case ENOENT:
+                        case ENOTDIR:
+                                send_response(conn, 404, "Not Found", "", keep_alive);
+                                break;
+                        case EISDIR: {
+                                char location[PATH_MAX + 16];
+                                snprintf(location, sizeof(location), "Location: /%s/\r\n", path);
+                                send_response(conn, 301, "Moved Permanently", location, keep_alive);
+                        } break;
+                        case EACCES:
+                        case EPERM:
+                                send_response(conn, 403, "Forbidden", "", keep_alive);
+                                break;
+                        default:
+                                send_response(conn, 500, "Internal Server Error", "", keep_alive);
+                                break;
+                        }
+                        return keep_alive;
+                }
+                cache_insert(fc, entry);
+        }
+
+        end = entry->variants[VARIANT_IDENTITY].size;
+        if ((header = hp_http1_find_header(req, "range")) != NULL) {
+                switch (parse_range(header->value, end, &start, &end)) {
+                case 0:
+                        ranged = 1;
+                        snprintf(content_range, sizeof(content_range), "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)start,
+                                 (long long)end - 1, (long long)entry->variants[VARIANT_IDENTITY].size);
+                        break;
+                case -1:
+                        snprintf(content_range, sizeof(content_range), "Content-Range: bytes */%lld\r\n",
+                                 (long long)entry->variants[VARIANT_IDENTITY].size);
+                        send_response(conn, 416, "Range Not Satisfiable", content_range, keep_alive);
+                        entry_release(entry);
+                        return keep_alive;
+                default:
+                        break;
+                }
+        }
+        /* ranges refer to the identity encoding; the smallest acceptable variant is chosen otherwise */
+        if (!ranged && (header = hp_http1_find_header(req, "accept-encoding")) != NULL) {
+                for (i = NUM_VARIANTS - 1; i != VARIANT_IDENTITY; --i) {
+                        if (entry->variants[i].fd != -1 && hp_http1_contains_token(header->value, variants[i].encoding)) {
+                                variant = i;
+                                end = entry->variants[i].size;
+                                break;
+                        }
+                }
+                /* none at hand; the response to HEAD would need the body compressed to be told its length */
+                if (variant == VARIANT_IDENTITY && entry->compressible && !is_head) {
+                        for (i = NUM_VARIANTS - 1; i != VARIANT_IDENTITY; --i) {
+                                if (hp_encoding_is_available(variants[i].encoding_id) &&
+                                    hp_http1_contains_token(header->value, variants[i].encoding) &&
+                                    start_compress(conn, entry, i, req->minor_version, keep_alive) == 0)
+                                        return 1;
+                        }
+                }
+        }
+
+        send_entry(conn, entry, variant, start, end, content_range, is_head, keep_alive);
+        return keep_alive;
+}
+
+static ssize_t on_read(hp_conn_t *conn, hp_iovec_t input)
+{
+        hp_http1_request_t req;
+        size_t consumed = 0;
+        ssize_t r;
+
+        /* pipelined requests are answered in order, the responses queued behind each other; those behind a response being
+           compressed stay in the read buffer until it is done */
+        while (consumed != input.len && !conn->closing && conn->data == NULL) {
+                if ((r = hp_http1_parse_request(hp_iovec_init(input.base + consumed, input.len - consumed), &req)) == 0) {
+                        if (input.len - consumed <= MAX_HEAD_SIZE)
+                                break;
+                        send_response(conn, 431, "Request Header Fields Too Large", "", 0);
+                        hp_conn_close_after_flush(conn);
+                        return input.len;
+                }
+                if (r == -1) {
+                        send_response(conn, 400, "Bad Request", "", 0);
+                        hp_conn_close_after_flush(conn);
+                        return input.len;
+                }
+                consumed += r;
+                if (!handle_request(conn, &req)) {
+                        hp_conn_close_after_flush(conn);
+                        return input.len;
+                }
+        }
+        return consumed;
+}
+
+static void on_close(hp_conn_t *conn)
+{
+        struct st_file_compress_t *job;
+
+        if ((job = conn->data) == NULL)
+                return;
+        conn->data = NULL;
+        job->conn = NULL;
+        /* one on the task pool is finished once it is back */
+        if (!job->in_flight)
+                finish_compress(job);
+}
+
+/* the compression in progress completes on this loop */
+static int on_migrate(hp_conn_t *conn)
+{
+        return conn->data != NULL ? -1 : 0;
+}
+
+void hp_file_register(const hp_file_config_t *_config)
+{
+        config = _config;
+        file_handler = (hp_handler_t){"file", NULL, on_read, on_close, on_migrate, NULL, NULL};
+        hp_register_handler(&file_handler);
+}
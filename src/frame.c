@@ -0,0 +1,218 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Length-prefixed binary framing, the reference protocol handler.
+   Each frame is a 32-bit big-endian payload length followed by the payload; on SOCK_SEQPACKET
+   connections a frame is one message, and the message boundary stands in for the length. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#include "hoppang.h"
+
+/* frames of a connection whose digests are being computed; a client that pipelines more is cut off */
+#define MAX_PENDING_DIGESTS 256
+
+ssize_t hp_frame_decode(hp_iovec_t input, size_t max_frame_size, hp_iovec_t *payload)
+{
+        const unsigned char *p = (const unsigned char *)input.base;
+        size_t len;
+
+        if (input.len < HP_FRAME_HEADER_SIZE)
+                return 0;
+        len = (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+        if (len > max_frame_size)
+                return -1;
+        if (input.len - HP_FRAME_HEADER_SIZE < len)
+                return 0;
+
+        /* the payload points into the input, no copy */
+        *payload = hp_iovec_init(input.base + HP_FRAME_HEADER_SIZE, len);
+        return (ssize_t)(HP_FRAME_HEADER_SIZE + len);
+}
+
+int hp_frame_send(hp_conn_t *conn, const void *payload, size_t len)
+{
+        unsigned char header[HP_FRAME_HEADER_SIZE];
+        hp_iovec_t bufs[2];
+
+        if (conn->seqpacket)
+                return hp_conn_write(conn, payload, len);
+        header[0] = (unsigned char)(len >> 24);
+        header[1] = (unsigned char)(len >> 16);
+        header[2] = (unsigned char)(len >> 8);
+        header[3] = (unsigned char)len;
+        bufs[0] = hp_iovec_init(header, sizeof(header));
+        bufs[1] = hp_iovec_init(payload, len);
+
+        return hp_conn_writev(conn, bufs, len != 0 ? 2 : 1);
+}
+
+static ssize_t on_frame_read(hp_conn_t *conn, hp_iovec_t input)
+{
+        hp_frame_handler_t *self = HP_STRUCT_FROM_MEMBER(hp_frame_handler_t, super, conn->handler);
+        size_t consumed = 0;
+        hp_iovec_t payload;
+        ssize_t r;
+
+        if (conn->seqpacket) {
+                if (input.len > self->max_frame_size) {
+                        fprintf(stderr, "[frame] closing connection; frame exceeds %zu bytes\n", self->max_frame_size);
+                        return -1;
+                }
+                if (hp_ratelimit_request(conn, NULL) != -1 || self->on_frame(conn, input) != 0)
+                        return -1;
+                return (ssize_t)input.len;
+        }
+
+        /* dispatch as many complete frames as the input holds */
+        while ((r = hp_frame_decode(hp_iovec_init(input.base + consumed, input.len - consumed),
+                                    self->max_frame_size, &payload)) > 0) {
+                /* frames carry no status; a client over its rate is cut off */
+                if (hp_ratelimit_request(conn, NULL) != -1)
+                        return -1;
+                if (self->on_frame(conn, payload) != 0)
+                        return -1;
+                consumed += r;
+                if (conn->closing)
+                        break;
+        }
+        if (r == -1) {
+                fprintf(stderr, "[frame] closing connection; frame exceeds %zu bytes\n", self->max_frame_size);
+                return -1;
+        }
+
+        return (ssize_t)consumed;
+}
+
+void hp_frame_handler_init(hp_frame_handler_t *handler, const char *name, int (*on_frame)(hp_conn_t *, hp_iovec_t))
+{
+        *handler = (hp_frame_handler_t){{name, NULL, on_frame_read, NULL, NULL, NULL, NULL}, HP_FRAME_DEFAULT_MAX_SIZE, on_frame};
+}
+
+static int on_echo_frame(hp_conn_t *conn, hp_iovec_t payload)
+{
+        return hp_frame_send(conn, payload.base, payload.len);
+}
+
+void hp_frame_register_echo(void)
+{
+        static hp_frame_handler_t echo;
+
+        hp_frame_handler_init(&echo, "frame-echo", on_echo_frame);
+        hp_register_handler(&echo.super);
+}
+
+struct st_digest_task_t {
+        hp_task_t super;
+        struct st_digest_conn_t *owner;
+        struct st_digest_task_t *next;
+        int done;
+        unsigned char md[SHA256_DIGEST_LENGTH];
+        size_t len;
+        unsigned char payload[1];
+};
+
+/* the digests are sent in the order of the frames, whichever finishes first */
+struct st_digest_conn_t {
+        hp_conn_t *conn; /* NULL once closed; the state goes with the last task */
+        struct st_digest_task_t *head;
+        struct st_digest_task_t **tail;
+        size_t num_pending;
+};
+
+static void run_digest(hp_task_t *_task)
+{
+        struct st_digest_task_t *task = HP_STRUCT_FROM_MEMBER(struct st_digest_task_t, super, _task);
+
+        SHA256(task->payload, task->len, task->md);
+}
+
+static void on_digest_complete(hp_loop_t *loop, hp_task_t *_task)
+{
+        struct st_digest_task_t *task = HP_STRUCT_FROM_MEMBER(struct st_digest_task_t, super, _task);
+        struct st_digest_conn_t *state = task->owner;
+
+        task->done = 1;
+        while ((task = state->head) != NULL && task->done) {
+                if (state->conn != NULL && hp_frame_send(state->conn, task->md, sizeof(task->md)) != 0) {
+                        hp_conn_close(state->conn);
+                        state->conn = NULL;
+                }
+                if ((state->head = task->next) == NULL)
+                        state->tail = &state->head;
+                --state->num_pending;
+                free(task);
+        }
+        if (state->conn == NULL && state->head == NULL)
+                free(state);
+}
+
+static int on_sha256_frame(hp_conn_t *conn, hp_iovec_t payload)
+{
+        struct st_digest_conn_t *state = conn->data;
+        struct st_digest_task_t *task;
+
+        if (state == NULL) {
+                if ((state = malloc(sizeof(*state))) == NULL)
+                        return -1;
+                *state = (struct st_digest_conn_t){conn, NULL, &state->head, 0};
+                conn->data = state;
+        }
+        if (state->num_pending == MAX_PENDING_DIGESTS) {
+                fprintf(stderr, "[frame] closing connection; more than %d frames pending\n", MAX_PENDING_DIGESTS);
+                return -1;
+        }
+        /* the payload is in the read buffer, which is reused once this returns */
+        if ((task = malloc(offsetof(struct st_digest_task_t, payload) + payload.len)) == NULL)
+                return -1;
+        task->super.run = run_digest;
+        task->super.on_complete = on_digest_complete;
+        task->owner = state;
+        task->next = NULL;
+        task->done = 0;
+        task->len = payload.len;
+        memcpy(task->payload, payload.base, payload.len);
+        *state->tail = task;
+        state->tail = &task->next;
+        ++state->num_pending;
+        hp_task_submit(conn->loop, &task->super);
+        return 0;
+}
+
+static void on_sha256_close(hp_conn_t *conn)
+{
+        struct st_digest_conn_t *state = conn->data;
+
+        if (state == NULL)
+                return;
+        conn->data = NULL;
+        state->conn = NULL;
+        if (state->head == NULL)
+                free(state);
+}
+
+/* the completions are posted to this loop */
+static int on_sha256_migrate(hp_conn_t *conn)
+{
+        struct st_digest_conn_t *state = conn->data;
+
+        if (state == NULL)
+                return 0;
+        if (state->head != NULL)
+                return -1;
+        free(state);
+        conn->data = NULL;
+        return 0;
+}
+
+void hp_frame_register_sha256(void)
+{
+        static hp_frame_handler_t sha256;
+
+        hp_frame_handler_init(&sha256, "frame-sha256", on_sha256_frame);
+        sha256.super.on_close = on_sha256_close;
+        sha256.super.on_migrate = on_sha256_migrate;
+        hp_register_handler(&sha256.super);
+}
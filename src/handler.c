@@ -0,0 +1,25 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+#include <string.h>
+
+#include "hoppang.h"
+
+/* handlers are registered before the worker threads are started, hence no locking */
+static hp_handler_t *handlers = NULL;
+
+void hp_register_handler(hp_handler_t *handler)
+{
+        handler->_next = handlers;
+        handlers = handler;
+}
+
+hp_handler_t *hp_find_handler(const char *name)
+{
+        hp_handler_t *handler;
+
+        for (handler = handlers; handler != NULL; handler = handler->_next)
+                if (strcmp(handler->name, name) == 0)
+                        return handler;
+
+        return NULL;
+}
@@ -0,0 +1,135 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* HTTP/1.x request heads, parsed in place.  Line ends, header names and token boundaries are found
+   with the scan kernels; the parser is restarted from the beginning when more input arrives, which
+   is fine for heads that fit in a few packets. */
+
+#include <string.h>
+#include <strings.h>
+
+#include "hoppang.h"
+
+/* returns the end of the line (excluding CRLF or LF) and sets `*next`, or NULL if the line is incomplete or broken */
+static const char *find_eol(const char *p, const char *end, const char **next, int *broken)
+{
+        const char *eol = hp_scan_find(p, end, &hp_scan_eol_set);
+
+        if (eol == end)
+                return NULL;
+        if (*eol == '\r') {
+                if (eol + 1 == end)
+                        return NULL;
+                if (eol[1] != '\n') {
+                        *broken = 1;
+                        return NULL;
+                }
+                *next = eol + 2;
+        } else {
+                *next = eol + 1;
+        }
+        return eol;
+}
+
+static int parse_request_line(const char *p, const char *eol, hp_http1_request_t *req)
+{
+        const char *q;
+
+        /* method SP request-target SP HTTP-version */
+        if ((q = hp_scan_find(p, eol, &hp_scan_nontoken_set)) == p || q == eol || *q != ' ')
+                return -1;
+        req->method = hp_iovec_init(p, q - p);
+        p = q + 1;
+        if ((q = memchr(p, ' ', eol - p)) == NULL || q == p)
+                return -1;
+        req->path = hp_iovec_init(p, q - p);
+        p = q + 1;
+        if (eol - p != 8 || memcmp(p, "HTTP/1.", 7) != 0 || p[7] < '0' || p[7] > '9')
+                return -1;
+        req->minor_version = p[7] - '0';
+        return 0;
+}
+
+ssize_t hp_http1_parse_request(hp_iovec_t input, hp_http1_request_t *req)
+{
+        const char *p = input.base, *end = input.base + input.len, *eol, *next, *colon, *value;
+        int broken = 0;
+
+        req->num_headers = 0;
+
+        /* tolerate empty lines before the request (RFC 7230 section 3.5) */
+        while ((eol = find_eol(p, end, &next, &broken)) != NULL && eol == p)
+                p = next;
+        if (eol == NULL)
+                return broken ? -1 : 0;
+        if (parse_request_line(p, eol, req) != 0)
+                return -1;
+        p = next;
+
+        while (1) {
+                if ((eol = find_eol(p, end, &next, &broken)) == NULL)
+                        return broken ? -1 : 0;
+                if (eol == p)
+                        return next - input.base;
+                /* obsolete line folding is rejected, as the RFC allows */
+                if (*p == ' ' || *p == '\t')
+                        return -1;
+                if ((colon = hp_scan_find(p, eol, &hp_scan_colon_set)) == eol || colon == p ||
+                    hp_scan_find(p, colon, &hp_scan_nontoken_set) != colon)
+                        return -1;
+                if (req->num_headers == HP_HTTP1_MAX_HEADERS)
+                        return -1;
+                for (value = colon + 1; value != eol && (*value == ' ' || *value == '\t'); ++value)
+                        ;
+                while (eol != value && (eol[-1] == ' ' || eol[-1] == '\t'))
+                        --eol;
+                req->headers[req->num_headers].name = hp_iovec_init(p, colon - p);
+                req->headers[req->num_headers].value = hp_iovec_init(value, eol - value);
+                ++req->num_headers;
+                p = next;
+        }
+}
+
+const hp_http1_header_t *hp_http1_find_header(const hp_http1_request_t *req, const char *name)
+{
+        size_t i, len = strlen(name);
+
+        for (i = 0; i != req->num_headers; ++i)
+                if (req->headers[i].name.len == len && strncasecmp(req->headers[i].name.base, name, len) == 0)
+                        return req->headers + i;
+        return NULL;
+}
+
+/* qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] ) */
+static int is_zero_qvalue(const char *p, const char *end)
+{
+        if (p == end || *p++ != '0')
+                return 0;
+        if (p != end && *p == '.')
+                for (++p; p != end && *p == '0'; ++p)
+                        ;
+        return p == end || *p == ',' || *p == ';' || *p == ' ' || *p == '\t';
+}
+
+int hp_http1_contains_token(hp_iovec_t list, const char *token)
+{
+        const char *p = list.base, *end = list.base + list.len, *q;
+        size_t len = strlen(token);
+
+        /* 1#( token *( OWS ";" OWS param ) ); a q-value of zero excludes the token */
+        while (p != end) {
+                while (p != end && (*p == ' ' || *p == '\t' || *p == ','))
+                        ++p;
+                for (q = p; q != end && *q != ',' && *q != ';' && *q != ' ' && *q != '\t'; ++q)
+                        ;
+                if ((size_t)(q - p) == len && strncasecmp(p, token, len) == 0) {
+                        for (p = q; p != end && *p != ','; ++p)
+                                if ((*p == 'q' || *p == 'Q') && end - p >= 2 && p[1] == '=' && (p[-1] == ';' || p[-1] == ' '))
+                                        return !is_zero_qvalue(p + 2, end);
+                        return 1;
+                }
+                while (q != end && *q != ',')
+                        ++q;
+                p = q;
+        }
+        return 0;
+}
@@ -14,16 +14,25 @@
 #include <limits.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <poll.h>
 #include <pwd.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#endif
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -41,27 +50,113 @@
 
 #include "hoppang.h"
 
+struct listen_spec_t {
+        char *arg; /* owns the strings below */
+        char *hostname;
+        char *servname;
+        hp_handler_t *handler;
+        char *ssl_cert_file;
+        char *ssl_key_file;
+        int ktls;
+        hp_tcp_profile_t tcp;
+        char *unix_path; /* listens to a Unix-domain socket instead of HOSTNAME:SERVNAME if set */
+        int seqpacket;
+        int udp; /* bound by every loop on its own, hence not passed to the workers */
+        int udp_gro;
+        int udp_gso;
+        uid_t *allowed_uids;
+        size_t num_allowed_uids;
+        hp_route_t route;
+        hp_listener_t *listeners;
+        size_t num_listeners;
+        int failed;
+};
+
+/* one slot per worker process in the segment shared with the supervisor; each field has a single writer */
+struct worker_stats_t {
+        /* written by the supervisor */
+        pid_t pid;
+        uint64_t started_at;
+        uint64_t restarts;
+        /* written by the worker */
+        size_t num_conns;
+        uint64_t buffer_hits;
+        uint64_t buffer_misses;
+        size_t resident_bytes;
+};
+
 static struct 
 {
         char *pid_file;
         char *error_log;
+        char *config_file;
         size_t num_threads;
+        size_t num_compute_threads; /* of the task pool, in each process */
         struct {
                 pthread_t tid;
+                hp_loop_t *volatile loop;
         } *threads;
+        struct listen_spec_t *listen_specs;
+        size_t num_listen_specs;
+        hp_listener_t *listeners;
+        size_t num_listeners;
+        hp_loop_config_t loop_config;
+        hp_proxy_config_t proxy;
+        size_t cache_size; /* in bytes; no cache if zero */
+        uint64_t cache_ttl;
+        hp_file_config_t file;
+        const char *capture_path;
+        uint64_t capture_size; /* in bytes, per process */
+        unsigned profile_rate;
+        const char *profile_path;
+        double trace_ratio; /* of the connections sampled for tracing */
+        const char *trace_output;
         volatile sig_atomic_t shutdown_requested;
+        volatile sig_atomic_t stats_generation;
+        volatile sig_atomic_t profile_generation; /* odd while profiling */
+        size_t num_workers; /* runs as the supervisor of that many processes when non-zero */
+        ssize_t worker_index; /* -1 unless this process is a worker */
+        struct worker_stats_t *worker_stats;
         int     opt_foo;
         int     opt_bar;
 } conf = {
         NULL,   /* pid_file */
         NULL,   /* error_log */
+        NULL,   /* config_file */
+        0,      /* inited in main() */
         0,      /* inited in main() */
         NULL,     /* threads */
+        NULL,   /* listen_specs */
+        0,      /* num_listen_specs */
+        NULL,   /* listeners */
+        0,      /* num_listeners */
+        {HP_BUFPOOL_DEFAULT_IDLE_TIMEOUT, 0, HP_HUGEPAGES_OFF, HP_LOOP_DEFAULT_REBALANCE_INTERVAL}, /* loop_config */
+        {NULL, 0, HP_UPSTREAM_DEFAULT_MAX_CONNS, HP_UPSTREAM_DEFAULT_QUEUE_TIMEOUT, NULL}, /* proxy */
+        0,      /* cache_size */
+        0,      /* cache_ttl */
+        {".", HP_FILE_DEFAULT_CACHE_ENTRIES}, /* file */
+        NULL,   /* capture_path */
+        (uint64_t)HP_CAPTURE_DEFAULT_MAX_SIZE * 1024 * 1024, /* capture_size */
+        HP_PROFILE_DEFAULT_RATE, /* profile_rate */
+        "hoppang.folded", /* profile_path */
+        0,      /* trace_ratio */
+        "hoppang-traces.json", /* trace_output */
         0,      /* shutdown_requested */
+        0,      /* stats_generation */
+        0,      /* profile_generation */
+        0,      /* num_workers */
+        -1,     /* worker_index */
+        NULL,   /* worker_stats */
         0,      /* inited in main() */
         0,      /* inited in main() */ 
 };
 
+/* simply use a large value, and let the kernel clip it to the internal max */
+#define HP_SOMAXCONN (65535)
+
+/* in megabytes, per thread */
+#define DEFAULT_HUGEPAGE_ARENA_SIZE 32
+
 
 static void set_signal_handler(int signo, void (*cb)(int signo))
 {
@@ -73,10 +168,42 @@ static void set_signal_handler(int signo, void (*cb)(int signo))
     sigaction(signo, &action, NULL);
 }
 
+static void notify_all_threads(void)
+{
+        size_t i;
+
+        if (conf.threads == NULL)
+                return;
+        for (i = 0; i != conf.num_threads; ++i) {
+                if (conf.threads[i].loop != NULL)
+                        hp_loop_wakeup(conf.threads[i].loop);
+        }
+}
+
 static void on_sigterm(int signo)
 {
         conf.shutdown_requested = 1;
-//        notify_all_threads();
+        notify_all_threads();
+}
+
+static void on_sigusr1(int signo)
+{
+        ++conf.stats_generation;
+        notify_all_threads();
+}
+
+static void on_sigusr2(int signo)
+{
+        ++conf.profile_generation;
+        notify_all_threads();
+}
+
+/* posted by SIGHUP; the reload itself runs on its own thread, off the loops */
+static sem_t reload_sem;
+
+static void on_sighup(int signo)
+{
+        sem_post(&reload_sem);
 }
 
 static pid_t spawnp(const char *cmd, char **argv, const int *mapped_fds)
@@ -220,6 +347,7 @@ static void on_sigfatal(int signo)
         int framecnt;
 
         set_signal_handler(signo, SIG_DFL);
+        HP_PROBE(signal__fatal, signo);
 
         framecnt = backtrace(frames, sizeof(frames) / sizeof(frames[0]));
         fprintf(stderr, "received fatal signal %d; backtrace follows, #%d\n", signo, framecnt);
@@ -233,6 +361,10 @@ static void setup_signal_handlers(void)
 {
         set_signal_handler(SIGTERM, on_sigterm);
         set_signal_handler(SIGPIPE, SIG_IGN);
+        set_signal_handler(SIGUSR1, on_sigusr1);
+        set_signal_handler(SIGHUP, on_sighup);
+        set_signal_handler(SIGUSR2, on_sigusr2);
+        hp_profile_init();
 #ifdef __linux__
         if ((backtrace_symbols_to_fd = popen_annotate_backtrace_symbols()) == -1) {
                 backtrace_symbols_to_fd = 2;
@@ -268,15 +400,706 @@ static size_t get_nrproc()
 #endif
 }
 
+static void set_cloexec(int fd)
+{
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+                perror("failed to set FD_CLOEXEC");
+                abort();
+        }
+}
+
+static int open_tcp_listener(const char *hostname, const char *servname, int domain, int type, int protocol,
+                             struct sockaddr *addr, socklen_t addrlen, const hp_tcp_profile_t *tcp)
+{
+        int fd;
+
+        if ((fd = socket(domain, type | SOCK_NONBLOCK, protocol)) == -1)
+                goto Error;
+        set_cloexec(fd);
+        { /* set reuseaddr */
+                int flag = 1;
+                if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) != 0)
+                        goto Error;
+        }
+        if (hp_tcp_profile_apply(fd, tcp) != 0)
+                goto Error;
+#ifdef IPV6_V6ONLY
+        /* set IPv6only */
+        if (domain == AF_INET6) {
+                int flag = 1;
+                if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag)) != 0)
+                        goto Error;
+        }
+#endif
+        if (bind(fd, addr, addrlen) != 0)
+                goto Error;
+        if (listen(fd, HP_SOMAXCONN) != 0)
+                goto Error;
+
+        return fd;
+
+Error:
+        if (fd != -1)
+                close(fd);
+        fprintf(stderr, "failed to listen to port %s:%s: %s\n", hostname != NULL ? hostname : "ANY", servname,
+                strerror(errno));
+        return -1;
+}
+
+static int open_unix_listener(const char *path, int type, struct sockaddr_un *sun)
+{
+        struct stat st;
+        int fd = -1;
+
+        memset(sun, 0, sizeof(*sun));
+        sun->sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(sun->sun_path)) {
+                errno = ENAMETOOLONG;
+                goto Error;
+        }
+        strcpy(sun->sun_path, path);
+        /* a socket left by a previous run is replaced; anything else at the path is not */
+        if (lstat(path, &st) == 0) {
+                if (!S_ISSOCK(st.st_mode)) {
+                        fprintf(stderr, "failed to listen to %s: the path exists and is not a socket\n", path);
+                        return -1;
+                }
+                unlink(path);
+        }
+        if ((fd = socket(AF_UNIX, type | SOCK_NONBLOCK, 0)) == -1)
+                goto Error;
+        set_cloexec(fd);
+        if (bind(fd, (struct sockaddr *)sun, sizeof(*sun)) != 0)
+                goto Error;
+        if (listen(fd, HP_SOMAXCONN) != 0)
+                goto Error;
+
+        return fd;
+
+Error:
+        if (fd != -1)
+                close(fd);
+        fprintf(stderr, "failed to listen to %s: %s\n", path, strerror(errno));
+        return -1;
+}
+
+static int parse_uid(const char *s, uid_t *uid)
+{
+        struct passwd *pw;
+        char *end;
+        unsigned long v;
+
+        v = strtoul(s, &end, 10);
+        if (end != s && *end == '\0') {
+                *uid = (uid_t)v;
+                return 0;
+        }
+        if ((pw = getpwnam(s)) == NULL)
+                return -1;
+        *uid = pw->pw_uid;
+        return 0;
+}
+
+/* parses `[HOST:]PORT[,OPTION...]`, `udp:[HOST:]PORT[,OPTION...]` or `unix:PATH[,OPTION...]`; the addresses are
+   resolved and bound later by open_listeners() */
+static int on_option_listen(const char *arg)
+{
+        struct listen_spec_t spec = {strdup(arg)};
+        char *opts, *opt, *addr;
+        size_t num_tcp_options = 0, num_unix_options = 0, num_udp_options = 0;
+        int r;
+
+        spec.tcp = (hp_tcp_profile_t)HP_TCP_PROFILE_INITIALIZER;
+        spec.udp_gro = 1;
+        spec.udp_gso = 1;
+        if ((opts = strchr(spec.arg, ',')) != NULL)
+                *opts++ = '\0';
+        addr = spec.arg;
+        if (strncmp(spec.arg, "unix:", 5) == 0) {
+                spec.unix_path = spec.arg + 5;
+        } else if (strncmp(spec.arg, "udp:", 4) == 0) {
+                spec.udp = 1;
+                addr = spec.arg + 4;
+        }
+        spec.handler = hp_find_handler(spec.udp ? "udp-echo" : "frame-echo");
+        while ((opt = strsep(&opts, ",")) != NULL) {
+                if (strncmp(opt, "handler=", 8) == 0) {
+                        if ((spec.handler = hp_find_handler(opt + 8)) == NULL) {
+                                fprintf(stderr, "unknown handler:%s\n", opt + 8);
+                                return -1;
+                        }
+                } else if (strncmp(opt, "cert=", 5) == 0) {
+                        spec.ssl_cert_file = opt + 5;
+                } else if (strncmp(opt, "key=", 4) == 0) {
+                        spec.ssl_key_file = opt + 4;
+                } else if (strcmp(opt, "ktls") == 0) {
+                        spec.ktls = 1;
+                } else if (strcmp(opt, "seqpacket") == 0) {
+                        spec.seqpacket = 1;
+                        ++num_unix_options;
+                } else if (strncmp(opt, "allow-uid=", 10) == 0) {
+                        spec.allowed_uids = realloc(spec.allowed_uids, sizeof(*spec.allowed_uids) * (spec.num_allowed_uids + 1));
+                        if (parse_uid(opt + 10, spec.allowed_uids + spec.num_allowed_uids) != 0) {
+                                fprintf(stderr, "unknown user:%s\n", opt + 10);
+                                return -1;
+                        }
+                        ++spec.num_allowed_uids;
+                        ++num_unix_options;
+                } else if (strncmp(opt, "route=", 6) == 0) {
+                        if (strcmp(opt + 6, "uid") == 0) {
+                                spec.route = HP_ROUTE_UID;
+                        } else if (strcmp(opt + 6, "pid") == 0) {
+                                spec.route = HP_ROUTE_PID;
+                        } else {
+                                fprintf(stderr, "listen option `route` takes `uid` or `pid`:%s\n", opt);
+                                return -1;
+                        }
+                        ++num_unix_options;
+                } else if (strcmp(opt, "no-gro") == 0) {
+                        spec.udp_gro = 0;
+                        ++num_udp_options;
+                } else if (strcmp(opt, "no-gso") == 0) {
+                        spec.udp_gso = 0;
+                        ++num_udp_options;
+                } else if ((r = hp_tcp_profile_parse_option(&spec.tcp, opt)) != 1) {
+                        if (r != 0)
+                                return -1;
+                        ++num_tcp_options;
+                } else {
+                        fprintf(stderr, "unknown listen option:%s\n", opt);
+                        return -1;
+                }
+        }
+        /* a handler reads either a stream of frames or datagrams */
+        if (spec.udp ? spec.handler->on_datagrams == NULL : spec.handler->on_read == NULL) {
+                fprintf(stderr, "handler `%s` does not serve %s listeners:%s\n", spec.handler->name, spec.udp ? "UDP" : "stream",
+                        arg);
+                return -1;
+        }
+        if (num_udp_options != 0 && !spec.udp) {
+                fprintf(stderr, "listen options `no-gro` and `no-gso` apply to UDP only:%s\n", arg);
+                return -1;
+        }
+        if (spec.unix_path != NULL) {
+                /* the peers are on the same host; there is nothing to encrypt or to tune */
+                if (spec.ssl_cert_file != NULL || spec.ssl_key_file != NULL || spec.ktls || num_tcp_options != 0) {
+                        fprintf(stderr, "TLS and TCP options do not apply to Unix-domain sockets:%s\n", arg);
+                        return -1;
+                }
+                if (spec.unix_path[0] == '\0') {
+                        fprintf(stderr, "Unix-domain socket requires a path:%s\n", arg);
+                        return -1;
+                }
+                spec.tcp.defer_accept = 0;
+                goto Add;
+        }
+        if (num_unix_options != 0) {
+                fprintf(stderr, "listen options `seqpacket`, `allow-uid` and `route` apply to Unix-domain sockets only:%s\n",
+                        arg);
+                return -1;
+        }
+        if (spec.udp && (spec.ssl_cert_file != NULL || spec.ssl_key_file != NULL || spec.ktls || num_tcp_options != 0)) {
+                fprintf(stderr, "TLS and TCP options do not apply to UDP:%s\n", arg);
+                return -1;
+        }
+        if ((spec.ssl_key_file != NULL || spec.ktls) && spec.ssl_cert_file == NULL) {
+                fprintf(stderr, "listen options `key` and `ktls` require `cert`:%s\n", arg);
+                return -1;
+        }
+        /* the key may be in the same PEM file as the certificate */
+        if (spec.ssl_cert_file != NULL && spec.ssl_key_file == NULL)
+                spec.ssl_key_file = spec.ssl_cert_file;
+
+        /* split host and port; IPv6 addresses are given as [ADDR]:PORT */
+        if ((spec.servname = strrchr(addr, ':')) != NULL) {
+                *spec.servname++ = '\0';
+                spec.hostname = addr;
+                if (spec.hostname[0] == '[' && spec.hostname[strlen(spec.hostname) - 1] == ']') {
+                        ++spec.hostname;
+                        spec.hostname[strlen(spec.hostname) - 1] = '\0';
+                }
+        } else {
+                spec.servname = addr;
+        }
+
+Add:
+        conf.listen_specs = realloc(conf.listen_specs, sizeof(*conf.listen_specs) * (conf.num_listen_specs + 1));
+        conf.listen_specs[conf.num_listen_specs++] = spec;
+        return 0;
+}
+
+static void listener_init(hp_listener_t *listener, const struct listen_spec_t *spec)
+{
+        listener->handler = spec->handler;
+        listener->ssl_cert_file = spec->ssl_cert_file;
+        listener->ssl_key_file = spec->ssl_key_file;
+        listener->ktls = spec->ktls;
+        listener->tcp = spec->tcp;
+        listener->seqpacket = spec->seqpacket;
+        listener->allowed_uids = spec->allowed_uids;
+        listener->num_allowed_uids = spec->num_allowed_uids;
+        listener->route = spec->route;
+        listener->udp = spec->udp;
+        listener->udp_gro = spec->udp_gro;
+        listener->udp_gso = spec->udp_gso;
+}
+
+static void add_spec_listener(struct listen_spec_t *spec, int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+        hp_listener_t *listener;
+
+        spec->listeners = realloc(spec->listeners, sizeof(*spec->listeners) * (spec->num_listeners + 1));
+        listener = spec->listeners + spec->num_listeners++;
+        memset(listener, 0, sizeof(*listener));
+        listener->fd = fd;
+        memcpy(&listener->addr, addr, addrlen);
+        listener->addrlen = addrlen;
+        listener_init(listener, spec);
+}
+
+/* binds a socket that is closed right away, so that an address in use is reported at start-up rather than by each loop,
+   and so that port 0 is fixed once for all of them */
+static int check_udp_address(struct listen_spec_t *spec, const struct sockaddr *addr, socklen_t addrlen)
+{
+        struct sockaddr_storage bound;
+        socklen_t boundlen = sizeof(bound);
+        int fd, flag = 1;
+
+        if ((fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP)) == -1)
+                goto Error;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) != 0)
+                goto Error;
+        if (addr->sa_family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag)) != 0)
+                goto Error;
+        if (bind(fd, addr, addrlen) != 0 || getsockname(fd, (struct sockaddr *)&bound, &boundlen) != 0)
+                goto Error;
+        close(fd);
+        add_spec_listener(spec, -1, (struct sockaddr *)&bound, boundlen);
+        return 0;
+
+Error:
+        if (fd != -1)
+                close(fd);
+        fprintf(stderr, "failed to listen to UDP port %s:%s: %s\n", spec->hostname != NULL ? spec->hostname : "ANY",
+                spec->servname, strerror(errno));
+        return -1;
+}
+
+static void open_listen_spec(size_t index, void *unused)
+{
+        struct listen_spec_t *spec = conf.listen_specs + index;
+        struct addrinfo hints, *res, *ai;
+        struct sockaddr_un sun;
+        int error, fd;
+
+        if (spec->unix_path != NULL) {
+                if ((fd = open_unix_listener(spec->unix_path, spec->seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, &sun)) == -1) {
+                        spec->failed = 1;
+                        return;
+                }
+                add_spec_listener(spec, fd, (struct sockaddr *)&sun, sizeof(sun));
+                return;
+        }
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = spec->udp ? SOCK_DGRAM : SOCK_STREAM;
+        hints.ai_protocol = spec->udp ? IPPROTO_UDP : IPPROTO_TCP;
+        hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV | AI_PASSIVE;
+        if ((error = getaddrinfo(spec->hostname, spec->servname, &hints, &res)) != 0) {
+                fprintf(stderr, "failed to resolve the listening address %s:%s: %s\n",
+                        spec->hostname != NULL ? spec->hostname : "ANY", spec->servname, gai_strerror(error));
+                spec->failed = 1;
+                return;
+        }
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+                if (spec->udp) {
+                        if (check_udp_address(spec, ai->ai_addr, ai->ai_addrlen) != 0) {
+                                spec->failed = 1;
+                                break;
+                        }
+                        continue;
+                }
+                if ((fd = open_tcp_listener(spec->hostname, spec->servname, ai->ai_family, ai->ai_socktype, ai->ai_protocol,
+                                            ai->ai_addr, ai->ai_addrlen, &spec->tcp)) == -1) {
+                        spec->failed = 1;
+                        break;
+                }
+                add_spec_listener(spec, fd, ai->ai_addr, ai->ai_addrlen);
+        }
+        freeaddrinfo(res);
+}
+
+static int on_option_upstream(const char *arg)
+{
+        hp_upstream_t *upstream;
+
+        if (strrchr(arg, ':') == NULL) {
+                fprintf(stderr, "upstream must be given as HOST:PORT:%s\n", arg);
+                return -1;
+        }
+        conf.proxy.upstreams = realloc(conf.proxy.upstreams, sizeof(*conf.proxy.upstreams) * (conf.proxy.num_upstreams + 1));
+        upstream = conf.proxy.upstreams + conf.proxy.num_upstreams++;
+        memset(upstream, 0, sizeof(*upstream));
+        upstream->name = strdup(arg);
+        return 0;
+}
+
+/* the address of an upstream is resolved once, at start-up */
+static int resolve_upstreams(void)
+{
+        struct addrinfo hints, *res;
+        size_t i;
+        int error;
+
+        for (i = 0; i != conf.proxy.num_upstreams; ++i) {
+                hp_upstream_t *upstream = conf.proxy.upstreams + i;
+                char *copy = strdup(upstream->name), *host = copy, *port = strrchr(host, ':');
+                *port++ = '\0';
+                if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+                        ++host;
+                        host[strlen(host) - 1] = '\0';
+                }
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_socktype = SOCK_STREAM;
+                hints.ai_protocol = IPPROTO_TCP;
+                hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+                if ((error = getaddrinfo(host, port, &hints, &res)) != 0) {
+                        fprintf(stderr, "failed to resolve upstream %s: %s\n", upstream->name, gai_strerror(error));
+                        free(copy);
+                        return -1;
+                }
+                memcpy(&upstream->addr, res->ai_addr, res->ai_addrlen);
+                upstream->addrlen = res->ai_addrlen;
+                freeaddrinfo(res);
+                free(copy);
+        }
+        for (i = 0; i != conf.num_listen_specs; ++i) {
+                if (conf.listen_specs[i].handler == hp_find_handler("proxy") && conf.proxy.num_upstreams == 0) {
+                        fprintf(stderr, "handler `proxy` requires --upstream\n");
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+static void append_spec_listeners(struct listen_spec_t *spec)
+{
+        size_t i;
+
+        conf.listeners = realloc(conf.listeners, sizeof(*conf.listeners) * (conf.num_listeners + spec->num_listeners));
+        for (i = 0; i != spec->num_listeners; ++i) {
+                conf.listeners[conf.num_listeners] = spec->listeners[i];
+                conf.listeners[conf.num_listeners].index = conf.num_listeners;
+                ++conf.num_listeners;
+        }
+}
+
+/* resolves and binds the listeners in parallel */
+static int open_listeners(void)
+{
+        size_t i;
+
+        hp_parallel_for(conf.num_listen_specs, conf.num_threads, open_listen_spec, NULL);
+
+        /* flatten, preserving the order given on the command line */
+        for (i = 0; i != conf.num_listen_specs; ++i) {
+                if (conf.listen_specs[i].failed)
+                        return -1;
+                append_spec_listeners(conf.listen_specs + i);
+        }
+
+        return 0;
+}
+
+/* the UDP listeners are not inherited; a worker resolves them again, and its loop binds to the address next to those of
+   the other workers */
+static int open_udp_listeners(void)
+{
+        size_t i;
+
+        for (i = 0; i != conf.num_listen_specs; ++i) {
+                struct listen_spec_t *spec = conf.listen_specs + i;
+                if (!spec->udp)
+                        continue;
+                open_listen_spec(i, NULL);
+                if (spec->failed)
+                        return -1;
+                append_spec_listeners(spec);
+        }
+        return 0;
+}
+
+/* takes over the listeners opened by the supervisor, given as `SPEC:FD,...` where SPEC is the index of the --listen
+   option */
+static int adopt_listeners(const char *list)
+{
+        char *copy, *p, *entry;
+        int ret = -1;
+
+        if (list == NULL) {
+                fprintf(stderr, "[ERROR] no listeners were passed by the supervisor\n");
+                return -1;
+        }
+        copy = p = strdup(list);
+        /* empty when all are UDP */
+        if (*p == '\0')
+                p = NULL;
+
+        while ((entry = strsep(&p, ",")) != NULL) {
+                hp_listener_t *listener;
+                unsigned long spec_index;
+                int fd;
+                if (sscanf(entry, "%lu:%d", &spec_index, &fd) != 2 || spec_index >= conf.num_listen_specs) {
+                        fprintf(stderr, "[ERROR] the listeners passed by the supervisor do not match the options:%s\n", list);
+                        goto Exit;
+                }
+                conf.listeners = realloc(conf.listeners, sizeof(*conf.listeners) * (conf.num_listeners + 1));
+                listener = conf.listeners + conf.num_listeners;
+                memset(listener, 0, sizeof(*listener));
+                listener->fd = fd;
+                listener->addrlen = sizeof(listener->addr);
+                if (getsockname(fd, (struct sockaddr *)&listener->addr, &listener->addrlen) != 0) {
+                        perror("inherited listener is not a socket");
+                        goto Exit;
+                }
+                set_cloexec(fd);
+                listener_init(listener, conf.listen_specs + spec_index);
+                listener->index = conf.num_listeners++;
+        }
+        ret = 0;
+
+Exit:
+        free(copy);
+        return ret;
+}
+
+/* reads the configuration file and loads the TLS contexts; returns NULL on error */
+static hp_config_t *build_config(void)
+{
+        hp_config_t *config;
+
+        if ((config = hp_config_create(conf.num_listeners)) == NULL) {
+                perror("failed to allocate configuration");
+                return NULL;
+        }
+        if ((conf.config_file != NULL && hp_config_load_file(config, conf.config_file) != 0) ||
+            hp_ssl_load_contexts(conf.listeners, conf.num_listeners, conf.num_threads, config->ssl_ctxs) != 0) {
+                hp_config_free(config);
+                return NULL;
+        }
+        return config;
+}
+
+/* the filter is on the sockets themselves, hence kept by the process that opened them; workers leave it to the
+   supervisor */
+static int update_sockfilter(const hp_config_t *config)
+{
+        if (conf.worker_index != -1)
+                return 0;
+        if (hp_sockfilter_update(config->deny, config->num_deny) != 0) {
+                fprintf(stderr, "[ERROR] failed to update the deny-list\n");
+                return -1;
+        }
+        return 0;
+}
+
+static void *reload_main(void *unused)
+{
+        hp_config_t *config;
+
+        while (1) {
+                if (sem_wait(&reload_sem) != 0)
+                        continue;
+                fprintf(stderr, "[INFO] reloading the configuration\n");
+                if ((config = build_config()) == NULL) {
+                        fprintf(stderr, "[ERROR] reload failed; keeping the current configuration\n");
+                        continue;
+                }
+                update_sockfilter(config);
+                /* this thread is the only one to publish, hence the snapshot stays valid */
+                hp_config_publish(config);
+                fprintf(stderr, "[INFO] configuration reloaded (generation %" PRIu64 ", max-connections %zu)\n", config->generation,
+                        config->max_connections);
+        }
+
+        return NULL;
+}
+
+static uint64_t now_msec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void print_stats(hp_loop_t *loop)
+{
+        hp_bufpool_t *pool = &loop->bufpool;
+        hp_upstream_pool_t *upstreams;
+        uint64_t lookups = pool->stats.hits + pool->stats.misses;
+
+        if (loop->thread_index == 0)
+                fprintf(stderr, "[stats] taken at %s\n", hp_clock_log_time(loop->wall_now));
+        fprintf(stderr, "[stats] thread %zu: connections %zu, buffer pool hit rate %.1f%% (%" PRIu64 "/%" PRIu64
+                "), resident %zu bytes, reclaimed %" PRIu64 " bytes\n",
+                loop->thread_index, loop->num_conns, lookups != 0 ? pool->stats.hits * 100.0 / lookups : 0.0,
+                pool->stats.hits, lookups, pool->stats.resident_bytes, pool->stats.reclaimed_bytes);
+        if (loop->busy.count != 0)
+                fprintf(stderr, "[stats] thread %zu: busy iterations %" PRIu64 ", handling time p50 < %" PRIu64 "us, p99 < %" PRIu64
+                        "us, max %" PRIu64 "us\n",
+                        loop->thread_index, loop->busy.count, (hp_latency_percentile(&loop->busy, 50) + 999) / 1000,
+                        (hp_latency_percentile(&loop->busy, 99) + 999) / 1000, loop->busy.max / 1000);
+        if (loop->arena.base != NULL)
+                fprintf(stderr, "[stats] thread %zu: arena %zu/%zu bytes used (%s)\n", loop->thread_index, loop->arena.used,
+                        loop->arena.size, hp_hugepages_names[loop->arena.backing]);
+        if ((upstreams = hp_proxy_get_pool()) != NULL)
+                fprintf(stderr, "[stats] thread %zu: upstream connects %" PRIu64 ", reuses %" PRIu64 ", queued %" PRIu64
+                        ", queue timeouts %" PRIu64 ", connect errors %" PRIu64 "\n",
+                        loop->thread_index, upstreams->stats.connects, upstreams->stats.reuses, upstreams->stats.queued,
+                        upstreams->stats.timeouts, upstreams->stats.connect_errors);
+        if (loop->num_accepts_local_cpu + loop->num_accepts_remote_cpu != 0)
+                fprintf(stderr, "[stats] thread %zu: accepted on the receiving CPU %" PRIu64 ", elsewhere %" PRIu64 "\n",
+                        loop->thread_index, loop->num_accepts_local_cpu, loop->num_accepts_remote_cpu);
+        if (loop->num_peers_refused + loop->num_handed_off + loop->num_handed_in != 0)
+                fprintf(stderr, "[stats] thread %zu: local peers refused %" PRIu64 ", handed off %" PRIu64 ", handed in %" PRIu64 "\n",
+                        loop->thread_index, loop->num_peers_refused, loop->num_handed_off, loop->num_handed_in);
+        if (loop->num_migrated_out + loop->num_migrated_in != 0)
+                fprintf(stderr, "[stats] thread %zu: idle connections moved out %" PRIu64 ", in %" PRIu64 "\n", loop->thread_index,
+                        loop->num_migrated_out, loop->num_migrated_in);
+        if (loop->num_datagrams_received + loop->num_datagrams_sent + loop->num_datagrams_dropped != 0)
+                fprintf(stderr, "[stats] thread %zu: datagrams received %" PRIu64 ", sent %" PRIu64 ", dropped %" PRIu64 "\n",
+                        loop->thread_index, loop->num_datagrams_received, loop->num_datagrams_sent, loop->num_datagrams_dropped);
+        if (hp_trace_enabled)
+                fprintf(stderr, "[stats] thread %zu: spans recorded %" PRIu64 ", dropped %" PRIu64 "\n", loop->thread_index,
+                        hp_trace_get_stats(loop)->recorded, hp_trace_get_stats(loop)->dropped);
+        if (loop->num_ktls_send + loop->num_ktls_fallbacks != 0)
+                fprintf(stderr, "[stats] thread %zu: kTLS send %" PRIu64 ", receive %" PRIu64 ", user-space fallbacks %" PRIu64 "\n",
+                        loop->thread_index, loop->num_ktls_send, loop->num_ktls_recv, loop->num_ktls_fallbacks);
+        if (hp_coro_get_stats()->created != 0) {
+                const struct st_hp_coro_stats_t *coro = hp_coro_get_stats();
+                fprintf(stderr, "[stats] thread %zu: coroutines %" PRIu64 ", switches %" PRIu64 ", stacks mapped %" PRIu64
+                        ", reused %" PRIu64 "\n",
+                        loop->thread_index, coro->created, coro->switches, coro->stack_maps, coro->stack_reuses);
+        }
+        if (hp_file_get_stats()->hits + hp_file_get_stats()->misses != 0) {
+                const struct st_hp_file_stats_t *file = hp_file_get_stats();
+                fprintf(stderr, "[stats] thread %zu: file cache hits %" PRIu64 ", misses %" PRIu64 ", invalidations %" PRIu64
+                        ", evictions %" PRIu64 "\n",
+                        loop->thread_index, file->hits, file->misses, file->invalidations, file->evictions);
+        }
+        if (hp_file_get_stats()->compressed_cached + hp_file_get_stats()->compressed_streams != 0) {
+                const struct st_hp_file_stats_t *file = hp_file_get_stats();
+                const struct st_hp_compress_stats_t *compress = hp_compress_get_stats();
+                fprintf(stderr, "[stats] thread %zu: compressed variants kept %" PRIu64 ", streams %" PRIu64
+                        ", sent uncompressed for want of a slot %" PRIu64 ", compressors created %" PRIu64 ", reused %" PRIu64
+                        ", bytes in %" PRIu64 ", out %" PRIu64 "\n",
+                        loop->thread_index, file->compressed_cached, file->compressed_streams, file->compress_skipped,
+                        compress->created, compress->reused, compress->bytes_in, compress->bytes_out);
+        }
+        if (loop->thread_index == 0) {
+                struct st_hp_ratelimit_stats_t ratelimit;
+                struct st_hp_taskpool_stats_t tasks;
+                hp_taskpool_get_stats(&tasks);
+                if (tasks.submitted + tasks.run_inline != 0)
+                        fprintf(stderr, "[stats] task pool: %zu threads, submitted %" PRIu64 ", run %" PRIu64 ", stolen %" PRIu64
+                                ", run inline %" PRIu64 "\n",
+                                tasks.num_threads, tasks.submitted, tasks.run, tasks.stolen, tasks.run_inline);
+                if (hp_sockfilter_num_dropped() != 0)
+                        fprintf(stderr, "[stats] deny-list: %" PRIu64 " SYNs dropped\n", hp_sockfilter_num_dropped());
+                hp_ratelimit_get_stats(&ratelimit);
+                if (ratelimit.rejected[HP_RATELIMIT_ACCEPT] + ratelimit.rejected[HP_RATELIMIT_REQUEST] +
+                        ratelimit.rejected[HP_RATELIMIT_KEY] + ratelimit.table_full != 0)
+                        fprintf(stderr, "[stats] rate limit: rejected connections %" PRIu64 ", requests %" PRIu64
+                                ", keyed requests %" PRIu64 ", let through for want of room %" PRIu64 "\n",
+                                ratelimit.rejected[HP_RATELIMIT_ACCEPT], ratelimit.rejected[HP_RATELIMIT_REQUEST],
+                                ratelimit.rejected[HP_RATELIMIT_KEY], ratelimit.table_full);
+        }
+        if (conf.proxy.cache != NULL) {
+                const struct st_hp_proxy_stats_t *proxy = hp_proxy_get_stats();
+                fprintf(stderr, "[stats] thread %zu: cache hits %" PRIu64 ", misses %" PRIu64 ", waited for others %" PRIu64 "\n",
+                        loop->thread_index, proxy->cache_hits, proxy->cache_misses, proxy->cache_waits);
+                /* the cache is shared; one report is enough */
+                if (loop->thread_index == 0) {
+                        struct st_hp_cache_stats_t cache;
+                        hp_cache_get_stats(conf.proxy.cache, &cache);
+                        fprintf(stderr, "[stats] cache: %zu entries, %zu/%zu bytes, insertions %" PRIu64 ", evictions %" PRIu64
+                                ", expirations %" PRIu64 ", coalesced misses %" PRIu64 "\n",
+                                cache.num_entries, cache.bytes, conf.cache_size, cache.insertions, cache.evictions,
+                                cache.expirations, cache.coalesced);
+                }
+        }
+}
+
+static void update_worker_stats(hp_loop_t *loop)
+{
+        struct worker_stats_t *stats = conf.worker_stats + conf.worker_index;
+
+        /* the supervisor reads the fields one by one; a torn view across fields is fine for reporting */
+        __atomic_store_n(&stats->num_conns, loop->num_conns, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->buffer_hits, loop->bufpool.stats.hits, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->buffer_misses, loop->bufpool.stats.misses, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->resident_bytes, loop->bufpool.stats.resident_bytes, __ATOMIC_RELAXED);
+}
+
+static void toggle_profile(hp_loop_t *loop, int on)
+{
+        char label[64];
+
+        if (on) {
+                if (hp_profile_start(conf.profile_rate) != 0)
+                        fprintf(stderr, "[ERROR] failed to start the profiler on thread %zu\n", loop->thread_index);
+                else if (loop->thread_index == 0)
+                        fprintf(stderr, "[INFO] (pid:%d) profiling at %uHz until the next SIGUSR2\n", (int)getpid(), conf.profile_rate);
+        } else {
+                snprintf(label, sizeof(label), "pid-%d;loop-%zu", (int)getpid(), loop->thread_index);
+                hp_profile_stop(loop, conf.profile_path, label);
+        }
+}
+
 NORETURN static void *run_loop(void *_thread_index)
 {
         size_t thread_index = (size_t)_thread_index;
+        sig_atomic_t stats_generation = conf.stats_generation, profile_generation = 0;
+        hp_loop_t *loop;
+        int timeout;
+        size_t i;
 
-        /* do things */
+        if ((loop = hp_loop_create(thread_index, &conf.loop_config)) == NULL)
+                abort();
+        for (i = 0; i != conf.num_listeners; ++i) {
+                if (hp_loop_add_listener(loop, conf.listeners + i) != 0) {
+                        perror("failed to register listener");
+                        abort();
+                }
+        }
+        conf.threads[thread_index].loop = loop;
 
         fprintf(stderr, "%lu (pid:%d)\n",  thread_index, (int) getpid());
 
-        sleep(1);
+        /* do things */
+        while (!conf.shutdown_requested) {
+                timeout = hp_bufpool_reclaim(&loop->bufpool, loop->now);
+                if (hp_loop_run_once(loop, timeout) == -1) {
+                        perror("epoll_wait failed");
+                        abort();
+                }
+                if (stats_generation != conf.stats_generation) {
+                        stats_generation = conf.stats_generation;
+                        print_stats(loop);
+                }
+                /* by parity, so that two signals in a row cancel out */
+                if (profile_generation % 2 != conf.profile_generation % 2)
+                        toggle_profile(loop, conf.profile_generation % 2);
+                profile_generation = conf.profile_generation;
+                if (conf.worker_stats != NULL)
+                        update_worker_stats(loop);
+        }
+
+        if (hp_capture_enabled)
+                hp_capture_flush(loop, 1);
+        if (hp_trace_enabled)
+                hp_trace_export();
 
         /* the process that detects num_connections becoming zero performs the last cleanup */
         if (conf.pid_file != NULL)
@@ -285,16 +1108,412 @@ NORETURN static void *run_loop(void *_thread_index)
         _exit(0);
 }
 
+#ifdef __linux__
+
+/* a worker that dies sooner than this after its start is restarted after the same delay, so that a crash on start-up
+   does not turn into a fork loop */
+#define WORKER_MIN_LIFETIME 1000 /* in milliseconds */
+
+static void on_sigchld(int signo)
+{
+        /* only interrupts ppoll() in run_supervisor() */
+}
+
+static void print_worker_stats(void)
+{
+        size_t i, total_conns = 0;
+        uint64_t total_restarts = 0;
+
+        for (i = 0; i != conf.num_workers; ++i) {
+                struct worker_stats_t *stats = conf.worker_stats + i;
+                size_t num_conns = __atomic_load_n(&stats->num_conns, __ATOMIC_RELAXED);
+                fprintf(stderr, "[stats] worker %zu (pid:%d): connections %zu, restarts %" PRIu64
+                        ", buffer pool hits %" PRIu64 "/%" PRIu64 ", resident %zu bytes\n",
+                        i, (int)stats->pid, num_conns, stats->restarts, __atomic_load_n(&stats->buffer_hits, __ATOMIC_RELAXED),
+                        __atomic_load_n(&stats->buffer_hits, __ATOMIC_RELAXED) +
+                                __atomic_load_n(&stats->buffer_misses, __ATOMIC_RELAXED),
+                        __atomic_load_n(&stats->resident_bytes, __ATOMIC_RELAXED));
+                total_conns += num_conns;
+                total_restarts += stats->restarts;
+        }
+        fprintf(stderr, "[stats] total: connections %zu in %zu workers, %" PRIu64 " restarts\n", total_conns, conf.num_workers,
+                total_restarts);
+        if (hp_sockfilter_num_dropped() != 0)
+                fprintf(stderr, "[stats] deny-list: %" PRIu64 " SYNs dropped\n", hp_sockfilter_num_dropped());
+}
+
+static void spawn_worker(size_t index, char **argv, const int *mapped_fds)
+{
+        struct worker_stats_t *stats = conf.worker_stats + index;
+        char buf[32];
+        pid_t pid;
+
+        sprintf(buf, "%zu", index);
+        setenv("HOPPANG_WORKER", buf, 1);
+        /* a worker restarted while the others are being profiled joins in */
+        setenv("HOPPANG_PROFILING", conf.profile_generation % 2 != 0 ? "1" : "0", 1);
+        if ((pid = spawnp("/proc/self/exe", argv, mapped_fds)) == -1) {
+                fprintf(stderr, "[ERROR] failed to spawn worker %zu:%s\n", index, strerror(errno));
+                stats->pid = 0;
+        } else {
+                stats->pid = pid;
+        }
+        /* a failed spawn is retried like a worker that died on start-up */
+        stats->started_at = now_msec();
+        stats->num_conns = 0;
+        stats->buffer_hits = 0;
+        stats->buffer_misses = 0;
+        stats->resident_bytes = 0;
+}
+
+/* forks the workers, which inherit the listeners and a shared stats segment, and restarts the ones that die */
+NORETURN static void run_supervisor(char **argv)
+{
+        sig_atomic_t stats_generation = conf.stats_generation, profile_generation = conf.profile_generation;
+        char *listeners_env = malloc(conf.num_listeners * 32 + 1), *p = listeners_env, *handoff_env = NULL, buf[32];
+        int *mapped_fds = malloc(sizeof(*mapped_fds) * ((conf.num_listeners + conf.num_workers * 2) * 2 + 3)), *handoff_fds = NULL,
+            shm_fd, fd_base = 0, status;
+        size_t i, j, num_mapped = 0, num_alive = 0, num_handoff_fds = 0;
+        sigset_t mask, orig_mask;
+        pid_t pid;
+
+        /* the stats segment outlives the workers, hence it is made before them */
+        if ((shm_fd = memfd_create("hoppang-stats", MFD_CLOEXEC)) == -1 ||
+            ftruncate(shm_fd, sizeof(*conf.worker_stats) * conf.num_workers) != 0 ||
+            (conf.worker_stats = mmap(NULL, sizeof(*conf.worker_stats) * conf.num_workers, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                      shm_fd, 0)) == MAP_FAILED) {
+                perror("failed to create the shared stats segment");
+                exit(EX_OSERR);
+        }
+        /* a socket per worker, to which the others send the connections that it is to serve */
+        for (i = 0; i != conf.num_listen_specs; ++i)
+                if (conf.listen_specs[i].route != HP_ROUTE_ANY)
+                        break;
+        if (i != conf.num_listen_specs) {
+                handoff_fds = malloc(sizeof(*handoff_fds) * conf.num_workers * 2);
+                for (num_handoff_fds = 0; num_handoff_fds != conf.num_workers * 2; num_handoff_fds += 2) {
+                        if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, handoff_fds + num_handoff_fds) != 0) {
+                                perror("failed to create the handoff sockets");
+                                exit(EX_OSERR);
+                        }
+                }
+        }
+
+        /* the descriptors are passed at consecutive numbers above all the ones in use, so that dup2 in the child never
+           overwrites a descriptor yet to be mapped */
+        for (i = 0; i != conf.num_listeners; ++i)
+                if (conf.listeners[i].fd >= fd_base)
+                        fd_base = conf.listeners[i].fd + 1;
+        if (shm_fd >= fd_base)
+                fd_base = shm_fd + 1;
+        for (i = 0; i != num_handoff_fds; ++i)
+                if (handoff_fds[i] >= fd_base)
+                        fd_base = handoff_fds[i] + 1;
+        *p = '\0';
+        for (i = 0; i != conf.num_listen_specs; ++i) {
+                if (conf.listen_specs[i].udp)
+                        continue;
+                for (j = 0; j != conf.listen_specs[i].num_listeners; ++j) {
+                        mapped_fds[num_mapped * 2] = conf.listen_specs[i].listeners[j].fd;
+                        mapped_fds[num_mapped * 2 + 1] = fd_base + (int)num_mapped;
+                        p += sprintf(p, "%s%zu:%d", p == listeners_env ? "" : ",", i, fd_base + (int)num_mapped);
+                        ++num_mapped;
+                }
+        }
+        if (num_handoff_fds != 0) {
+                /* `IN:OUT,...` in the order of the workers */
+                p = handoff_env = malloc(num_handoff_fds * 16 + 1);
+                *p = '\0';
+                for (i = 0; i != num_handoff_fds; ++i) {
+                        mapped_fds[num_mapped * 2] = handoff_fds[i];
+                        mapped_fds[num_mapped * 2 + 1] = fd_base + (int)num_mapped;
+                        p += sprintf(p, "%s%d", i == 0 ? "" : i % 2 == 0 ? "," : ":", fd_base + (int)num_mapped);
+                        ++num_mapped;
+                }
+                setenv("HOPPANG_HANDOFF", handoff_env, 1);
+        }
+        mapped_fds[num_mapped * 2] = shm_fd;
+        mapped_fds[num_mapped * 2 + 1] = fd_base + (int)num_mapped;
+        mapped_fds[num_mapped * 2 + 2] = -1;
+        setenv("HOPPANG_LISTENERS", listeners_env, 1);
+        sprintf(buf, "%d", fd_base + (int)num_mapped);
+        setenv("HOPPANG_STATS_FD", buf, 1);
+
+        /* the signals are only taken inside ppoll(), so that none is lost between checking the flags and sleeping; the
+           workers unblock them on start */
+        set_signal_handler(SIGCHLD, on_sigchld);
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGHUP);
+        sigaddset(&mask, SIGUSR1);
+        sigaddset(&mask, SIGUSR2);
+        sigprocmask(SIG_BLOCK, &mask, &orig_mask);
+
+        for (i = 0; i != conf.num_workers; ++i)
+                spawn_worker(i, argv, mapped_fds);
+        fprintf(stderr, "[INFO] supervising %zu workers\n", conf.num_workers);
+
+        while (!conf.shutdown_requested) {
+                uint64_t now = now_msec(), wake_at = UINT64_MAX;
+                struct timespec timeout;
+                while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                        for (i = 0; i != conf.num_workers; ++i)
+                                if (conf.worker_stats[i].pid == pid)
+                                        break;
+                        if (i == conf.num_workers)
+                                continue;
+                        if (WIFSIGNALED(status)) {
+                                fprintf(stderr, "[WARN] worker %zu (pid:%d) killed by signal %d; restarting\n", i, (int)pid,
+                                        WTERMSIG(status));
+                        } else {
+                                fprintf(stderr, "[WARN] worker %zu (pid:%d) exited with status %d; restarting\n", i, (int)pid,
+                                        WEXITSTATUS(status));
+                        }
+                        conf.worker_stats[i].pid = 0;
+                        ++conf.worker_stats[i].restarts;
+                }
+                for (i = 0; i != conf.num_workers; ++i) {
+                        struct worker_stats_t *stats = conf.worker_stats + i;
+                        if (stats->pid != 0)
+                                continue;
+                        if (now - stats->started_at >= WORKER_MIN_LIFETIME) {
+                                spawn_worker(i, argv, mapped_fds);
+                        } else if (stats->started_at + WORKER_MIN_LIFETIME < wake_at) {
+                                wake_at = stats->started_at + WORKER_MIN_LIFETIME;
+                        }
+                }
+                if (sem_trywait(&reload_sem) == 0) {
+                        hp_config_t *config;
+                        if ((config = build_config()) != NULL) {
+                                update_sockfilter(config);
+                                hp_config_free(config);
+                        }
+                        for (i = 0; i != conf.num_workers; ++i)
+                                if (conf.worker_stats[i].pid != 0)
+                                        kill(conf.worker_stats[i].pid, SIGHUP);
+                }
+                if (stats_generation != conf.stats_generation) {
+                        stats_generation = conf.stats_generation;
+                        print_worker_stats();
+                }
+                if (profile_generation != conf.profile_generation) {
+                        profile_generation = conf.profile_generation;
+                        for (i = 0; i != conf.num_workers; ++i)
+                                if (conf.worker_stats[i].pid != 0)
+                                        kill(conf.worker_stats[i].pid, SIGUSR2);
+                }
+                if (wake_at != UINT64_MAX) {
+                        timeout.tv_sec = (wake_at - now) / 1000;
+                        timeout.tv_nsec = (wake_at - now) % 1000 * 1000000;
+                }
+                ppoll(NULL, 0, wake_at != UINT64_MAX ? &timeout : NULL, &orig_mask);
+        }
+
+        for (i = 0; i != conf.num_workers; ++i) {
+                if (conf.worker_stats[i].pid != 0) {
+                        kill(conf.worker_stats[i].pid, SIGTERM);
+                        ++num_alive;
+                }
+        }
+        while (num_alive != 0 && (pid = wait(NULL)) != -1)
+                --num_alive;
+        if (conf.pid_file != NULL)
+                unlink(conf.pid_file);
+
+        exit(0);
+}
+
+/* takes the handoff sockets passed by the supervisor as `IN:OUT,...`, one pair per worker */
+static int adopt_handoff(const char *list)
+{
+        hp_handoff_t handoff = {1, (size_t)conf.worker_index};
+        const char *p;
+        size_t i;
+        int n;
+
+        for (p = list; *p != '\0'; ++p)
+                if (*p == ',')
+                        ++handoff.num_peers;
+        p = list;
+        handoff.inboxes = malloc(sizeof(*handoff.inboxes) * handoff.num_peers);
+        handoff.outboxes = malloc(sizeof(*handoff.outboxes) * handoff.num_peers);
+        for (i = 0; i != handoff.num_peers; ++i) {
+                if (sscanf(p, "%d:%d%n", handoff.inboxes + i, handoff.outboxes + i, &n) != 2 || (p[n] != ',' && p[n] != '\0'))
+                        goto Error;
+                set_cloexec(handoff.inboxes[i]);
+                set_cloexec(handoff.outboxes[i]);
+                p += n;
+                if (*p == ',')
+                        ++p;
+        }
+        if (*p != '\0' || handoff.self >= handoff.num_peers)
+                goto Error;
+        /* the inbox of the others is only written to */
+        for (i = 0; i != handoff.num_peers; ++i)
+                if (i != handoff.self)
+                        close(handoff.inboxes[i]);
+        hp_handoff_init(&handoff);
+        return 0;
+
+Error:
+        fprintf(stderr, "[ERROR] malformed list of handoff sockets passed by the supervisor:%s\n", list);
+        return -1;
+}
+
+/* called first thing by a process spawned by run_supervisor() */
+static void setup_worker(const char *index)
+{
+        sigset_t mask;
+        int shm_fd;
+
+        conf.worker_index = (ssize_t)strtoul(index, NULL, 10);
+        if (getenv("HOPPANG_PROFILING") != NULL)
+                conf.profile_generation = atoi(getenv("HOPPANG_PROFILING"));
+        conf.num_threads = 1;
+        /* the supervisor removes the pid file */
+        conf.pid_file = NULL;
+
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        /* exit along with the supervisor; it may have gone before the request was made */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1)
+                exit(0);
+
+        shm_fd = atoi(getenv("HOPPANG_STATS_FD"));
+        conf.worker_stats = mmap(NULL, sizeof(*conf.worker_stats) * (conf.worker_index + 1), PROT_READ | PROT_WRITE, MAP_SHARED,
+                                 shm_fd, 0);
+        if (conf.worker_stats == MAP_FAILED) {
+                perror("failed to map the shared stats segment");
+                exit(EX_OSERR);
+        }
+        close(shm_fd);
+}
+
+#endif
+
 static int parse_option(int argc, char **argv) 
 {
         int ch;
-        static struct option longopts[] = {{"foo", required_argument, NULL, 'f'},
+        static struct option longopts[] = {{"conf", required_argument, NULL, 'c'},
+                                           {"listen", required_argument, NULL, 'l'},
+                                           {"workers", required_argument, NULL, 'w'},
+                                           {"upstream", required_argument, NULL, 'u'},
+                                           {"upstream-max-conns", required_argument, NULL, 'M'},
+                                           {"upstream-queue-timeout", required_argument, NULL, 'Q'},
+                                           {"cache-size", required_argument, NULL, 'C'},
+                                           {"cache-ttl", required_argument, NULL, 'T'},
+                                           {"root", required_argument, NULL, 'r'},
+                                           {"file-cache-entries", required_argument, NULL, 'F'},
+                                           {"buffer-idle-timeout", required_argument, NULL, 'B'},
+                                           {"huge-pages", required_argument, NULL, 'H'},
+                                           {"arena-size", required_argument, NULL, 'A'},
+                                           {"rebalance-interval", required_argument, NULL, 'R'},
+                                           {"compute-threads", required_argument, NULL, 'P'},
+                                           {"capture", required_argument, NULL, 'K'},
+                                           {"capture-size", required_argument, NULL, 'Z'},
+                                           {"profile-rate", required_argument, NULL, 'J'},
+                                           {"profile-output", required_argument, NULL, 'O'},
+                                           {"trace-ratio", required_argument, NULL, 'X'},
+                                           {"trace-output", required_argument, NULL, 'Y'},
+                                           {"foo", required_argument, NULL, 'f'},
                                            {"bar", no_argument, NULL, 'b'},
                                            {"version", no_argument, NULL, 'v'},
                                            {"help", no_argument, NULL, 'h'},
                                            {NULL, 0, NULL, 0}};
-        while ((ch = getopt_long(argc, argv, "f:bvh", longopts, NULL)) != -1) {
+        while ((ch = getopt_long(argc, argv, "c:l:w:u:r:B:H:A:f:bvh", longopts, NULL)) != -1) {
                 switch (ch) {
+                case 'c':
+                        conf.config_file = optarg;
+                        break;
+                case 'l':
+                        if (on_option_listen(optarg) != 0)
+                                exit(EX_CONFIG);
+                        break;
+                case 'w':
+#ifdef __linux__
+                        conf.num_workers = strtoul(optarg, NULL, 10);
+#else
+                        fprintf(stderr, "--workers is only supported on Linux\n");
+                        exit(EX_CONFIG);
+#endif
+                        break;
+                case 'u':
+                        if (on_option_upstream(optarg) != 0)
+                                exit(EX_CONFIG);
+                        break;
+                case 'M':
+                        if ((conf.proxy.max_conns = strtoul(optarg, NULL, 10)) == 0) {
+                                fprintf(stderr, "upstream-max-conns must be a positive integer\n");
+                                exit(EX_CONFIG);
+                        }
+                        break;
+                case 'Q':
+                        conf.proxy.queue_timeout = strtoull(optarg, NULL, 10);
+                        break;
+                case 'C':
+                        conf.cache_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                        break;
+                case 'T':
+                        conf.cache_ttl = strtoull(optarg, NULL, 10);
+                        break;
+                case 'r':
+                        conf.file.root = optarg;
+                        break;
+                case 'F':
+                        if ((conf.file.max_cache_entries = strtoul(optarg, NULL, 10)) == 0) {
+                                fprintf(stderr, "file-cache-entries must be a positive integer\n");
+                                exit(EX_CONFIG);
+                        }
+                        break;
+                case 'B':
+                        conf.loop_config.buffer_idle_timeout = strtoull(optarg, NULL, 10);
+                        break;
+                case 'H': {
+                        size_t i;
+                        for (i = 0; hp_hugepages_names[i] != NULL; ++i)
+                                if (strcmp(optarg, hp_hugepages_names[i]) == 0)
+                                        break;
+                        if (hp_hugepages_names[i] == NULL) {
+                                fprintf(stderr, "huge-pages must be one of: off, thp, hugetlb\n");
+                                exit(EX_CONFIG);
+                        }
+                        conf.loop_config.hugepages = (hp_hugepages_t)i;
+                } break;
+                case 'A':
+                        conf.loop_config.arena_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                        break;
+                case 'R':
+                        conf.loop_config.rebalance_interval = strtoull(optarg, NULL, 10);
+                        break;
+                case 'P':
+                        conf.num_compute_threads = strtoul(optarg, NULL, 10);
+                        break;
+                case 'K':
+                        conf.capture_path = optarg;
+                        break;
+                case 'Z':
+                        conf.capture_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                        break;
+                case 'J':
+                        if ((conf.profile_rate = (unsigned)strtoul(optarg, NULL, 10)) == 0 || conf.profile_rate > 10000) {
+                                fprintf(stderr, "[ERROR] --profile-rate takes 1 to 10000\n");
+                                exit(EX_CONFIG);
+                        }
+                        break;
+                case 'O':
+                        conf.profile_path = optarg;
+                        break;
+                case 'X':
+                        if ((conf.trace_ratio = strtod(optarg, NULL)) < 0 || conf.trace_ratio > 1) {
+                                fprintf(stderr, "[ERROR] --trace-ratio takes 0 to 1\n");
+                                exit(EX_CONFIG);
+                        }
+                        break;
+                case 'Y':
+                        conf.trace_output = optarg;
+                        break;
                 case 'f':
                         conf.opt_foo = atoi(optarg);
                         break;
@@ -311,11 +1530,104 @@ static int parse_option(int argc, char **argv)
                                "  %s [options]\n"
                                "\n"
                                "Options:\n"
+                               "  -c, --conf file    reads `name: value` settings that are reloaded on SIGHUP:\n"
+                               "                       max-connections: N  (default: %d)\n"
+                               "                       rate-limit-accept: RATE[/BURST]  connections per second\n"
+                               "                         from an address (IPv6: per /64)\n"
+                               "                       rate-limit-request: RATE[/BURST]  requests per second\n"
+                               "                         from an address; exceeding it also blocks new\n"
+                               "                         connections until the accept bucket refills\n"
+                               "                       rate-limit-key: RATE[/BURST]  requests per second per\n"
+                               "                         value of the header named by rate-limit-key-header\n"
+                               "                       BURST is at most %d; limits apply per process\n"
+                               "                       deny: ADDRESS[/PREFIXLEN]  SYNs from the range are\n"
+                               "                         dropped by a socket filter; may be repeated\n"
+                               "                     TLS certificates are also reloaded on SIGHUP\n"
+                               "  -l, --listen addr  listens to [HOST:]PORT[,handler=NAME][,cert=FILE[,key=FILE][,ktls]]\n"
+                               "                     [,TCP-OPTION...], udp:[HOST:]PORT[,handler=NAME][,no-gro][,no-gso]\n"
+                               "                     or unix:PATH[,handler=NAME][,UNIX-OPTION...];\n"
+                               "                     may be repeated.  With ktls, the kernel encrypts once the\n"
+                               "                     handshake is done (if the `tls` module and the cipher\n"
+                               "                     allow), and files are sent without a copy.  TCP options are:\n"
+                               "                       defer-accept=SECS (default: %d; 0 disables)\n"
+                               "                       fastopen=QUEUE-LENGTH\n"
+                               "                       busy-poll=USECS (also set on the epoll instances)\n"
+                               "                       nodelay\n"
+                               "                       notsent-lowat=BYTES\n"
+                               "                       rcvbuf=BYTES, sndbuf=BYTES (disable autotuning)\n"
+                               "                       incoming-cpu (reports whether connections are\n"
+                               "                         accepted on the CPU their packets arrive at)\n"
+                               "                     (hoppang-tcpbench compares them over loopback)\n"
+                               "                     Unix-domain socket options are:\n"
+                               "                       seqpacket (one frame per message)\n"
+                               "                       allow-uid=USER (checked against the credentials of\n"
+                               "                         the peer; may be repeated, default: any user)\n"
+                               "                       route=uid|pid (with --workers, the connections of a\n"
+                               "                         user or process are all served by one worker)\n"
+                               "                     UDP listeners (default handler: udp-echo) read and write\n"
+                               "                     %d datagrams per system call; runs from one peer are\n"
+                               "                     received (GRO) and sent (GSO) as one unless disabled\n"
+                               "  -w, --workers num  runs that many single-threaded worker processes under a\n"
+                               "                     supervisor that restarts them when they die, instead of\n"
+                               "                     threads in one process (default: 0, use threads)\n"
+                               "  -u, --upstream addr\n"
+                               "                     HOST:PORT to which the `proxy` handler relays frames; may be\n"
+                               "                     repeated, requests go to the least busy one\n"
+                               "  --upstream-max-conns num\n"
+                               "                     connections per upstream and thread (default: %d)\n"
+                               "  --upstream-queue-timeout msec\n"
+                               "                     how long a request waits for a connection when all are busy\n"
+                               "                     (default: %d)\n"
+                               "  --cache-size mb    caches the responses relayed by the `proxy` handler, keyed\n"
+                               "                     by the request; shared by the threads of a process\n"
+                               "                     (default: 0, no cache)\n"
+                               "  --cache-ttl msec   how long a cached response is served; 0 means until\n"
+                               "                     evicted (default: 0)\n"
+                               "  -r, --root dir     document root of the `file` handler (default: .)\n"
+                               "  --file-cache-entries num\n"
+                               "                     files kept open per thread by the `file` handler\n"
+                               "                     (default: %d)\n"
+                               "  -B, --buffer-idle-timeout msec\n"
+                               "                     returns pooled buffers unused for the period to the OS;\n"
+                               "                     0 disables (default: %d)\n"
+                               "  -H, --huge-pages mode\n"
+                               "                     backs the per-thread arena with `hugetlb` or `thp` pages,\n"
+                               "                     falling back to normal pages (default: off)\n"
+                               "  -A, --arena-size mb\n"
+                               "                     size of the per-thread arena holding connections and\n"
+                               "                     buffers (default: %d when huge pages are on, else 0)\n"
+                               "  --rebalance-interval msec\n"
+                               "                     how often a thread with well above the mean number of\n"
+                               "                     connections moves the ones idle for as long to the least\n"
+                               "                     loaded thread; 0 disables, as do --workers (default: %d)\n"
+                               "  --compute-threads num\n"
+                               "                     threads that run the CPU-heavy work handlers offload (e.g.\n"
+                               "                     `frame-sha256`), per process; 0 runs it on the loops\n"
+                               "                     (default: %zu, the number of CPUs)\n"
+                               "  --capture file     records what the accepted connections receive, and when, for\n"
+                               "                     hoppang-replay to send again (decrypted, for TLS listeners)\n"
+                               "  --capture-size mb  stops capturing once a process has written that much\n"
+                               "                     (default: %d)\n"
+                               "  --profile-rate hz  samples the stacks of the loops that many times a second of\n"
+                               "                     CPU time between one SIGUSR2 and the next (default: %d)\n"
+                               "  --profile-output file\n"
+                               "                     file to which the folded stacks are appended, for\n"
+                               "                     flamegraph.pl (default: %s)\n"
+                               "  --trace-ratio ratio\n"
+                               "                     share of the accepted connections traced, as a connection\n"
+                               "                     span with the TLS handshake and the requests under it\n"
+                               "                     (default: 0)\n"
+                               "  --trace-output file|unix:path\n"
+                               "                     where the spans are written as OTLP/JSON lines\n"
+                               "                     (default: %s)\n"
                                "  -f, --foo arg      option foo\n"
                                "  -b, --bar          option bar\n"
                                "  -v, --version      prints the version number\n"
                                "  -h, --help         print this help\n"
-                               "\n", argv[0], argv[0]);
+                               "\n", argv[0], argv[0], HP_DEFAULT_MAX_CONNECTIONS, HP_RATELIMIT_MAX_BURST, HP_TCP_DEFAULT_DEFER_ACCEPT, HP_UDP_BATCH, HP_UPSTREAM_DEFAULT_MAX_CONNS,
+                               HP_UPSTREAM_DEFAULT_QUEUE_TIMEOUT, HP_FILE_DEFAULT_CACHE_ENTRIES, HP_BUFPOOL_DEFAULT_IDLE_TIMEOUT, DEFAULT_HUGEPAGE_ARENA_SIZE,
+                               HP_LOOP_DEFAULT_REBALANCE_INTERVAL, conf.num_compute_threads, HP_CAPTURE_DEFAULT_MAX_SIZE,
+                               HP_PROFILE_DEFAULT_RATE, conf.profile_path, conf.trace_output);
                         exit(0);
                         break;
                 case ':':
@@ -326,25 +1638,91 @@ static int parse_option(int argc, char **argv)
                         break;
                 }
         }
+        if (conf.loop_config.hugepages != HP_HUGEPAGES_OFF && conf.loop_config.arena_size == 0)
+                conf.loop_config.arena_size = (size_t)DEFAULT_HUGEPAGE_ARENA_SIZE * 1024 * 1024;
         return optind;
         
 }
 
 int main(int argc, char **argv)
 {
-        const char *cmd = argv[0];
+        const char *cmd = argv[0], *worker_index;
+        char **orig_argv = argv;
         int error_log_fd = -1;
         int r;
         
         conf.num_threads = get_nrproc();
+        conf.num_compute_threads = conf.num_threads;
 
         fprintf(stderr, "[INFO] num_threads is %lu\n", conf.num_threads);
 
+        fprintf(stderr, "[INFO] scan kernel is %s\n", hp_scan_init());
+        fprintf(stderr, "[INFO] intervals are timed with %s\n", hp_clock_init() ? "the TSC" : "clock_gettime");
+
+        /* handlers must be known before the listeners refer to them */
+        hp_frame_register_echo();
+        hp_frame_register_sha256();
+        hp_coro_register_echo();
+        hp_udp_register_echo();
+        hp_proxy_register(&conf.proxy);
+        hp_file_register(&conf.file);
+
         /* option */
         r = parse_option(argc, argv);   /* returns optind */
         argc -= r;
         argv += r;
 
+        if (resolve_upstreams() != 0)
+                return EX_CONFIG;
+        hp_ratelimit_init(HP_RATELIMIT_DEFAULT_SLOTS);
+        if (conf.cache_size != 0 &&
+            (conf.proxy.cache = hp_cache_create(conf.cache_size, HP_CACHE_DEFAULT_NUM_SHARDS, conf.cache_ttl)) == NULL) {
+                fprintf(stderr, "[ERROR] failed to create the cache\n");
+                return EX_OSERR;
+        }
+
+#ifdef __linux__
+        if ((worker_index = getenv("HOPPANG_WORKER")) != NULL) {
+                conf.num_workers = 0;
+                setup_worker(worker_index);
+                if (adopt_listeners(getenv("HOPPANG_LISTENERS")) != 0 || open_udp_listeners() != 0)
+                        return EX_CONFIG;
+                if (getenv("HOPPANG_HANDOFF") != NULL && adopt_handoff(getenv("HOPPANG_HANDOFF")) != 0)
+                        return EX_CONFIG;
+        } else
+#endif
+        if (open_listeners() != 0)
+                return EX_CONFIG;
+        /* the supervisor starts the file, and its workers append to it */
+        if (conf.capture_path != NULL &&
+            hp_capture_open(conf.capture_path, conf.worker_index == -1, conf.worker_index + 1, conf.capture_size) != 0) {
+                fprintf(stderr, "[ERROR] failed to open capture file:%s:%s\n", conf.capture_path, strerror(errno));
+                return EX_CONFIG;
+        }
+        /* each process exports the spans of its own loops */
+        if (conf.trace_ratio > 0 && conf.num_workers == 0 && hp_trace_init(conf.trace_output, conf.trace_ratio) != 0) {
+                fprintf(stderr, "[ERROR] failed to open trace output:%s:%s\n", conf.trace_output, strerror(errno));
+                return EX_CONFIG;
+        }
+        {
+                int *fds = alloca(sizeof(*fds) * conf.num_listeners);
+                size_t i, n = 0;
+                /* the filter reads IP headers */
+                for (i = 0; i != conf.num_listeners; ++i)
+                        if (conf.listeners[i].addr.ss_family != AF_UNIX && !conf.listeners[i].udp)
+                                fds[n++] = conf.listeners[i].fd;
+                if (hp_sockfilter_set_listeners(fds, n) != 0)
+                        return EX_OSERR;
+        }
+        {
+                hp_config_t *config;
+                if ((config = build_config()) == NULL)
+                        return EX_CONFIG;
+                if (update_sockfilter(config) != 0)
+                        return EX_OSERR;
+                hp_config_publish(config);
+        }
+
         /* conf */
         
 
@@ -362,6 +1740,7 @@ int main(int argc, char **argv)
                 }
         }
 
+        sem_init(&reload_sem, 0, 0);
         setup_signal_handlers();
 
         /* open the log file to redirect STDIN/STDERR to, before calling setuid */
@@ -413,13 +1792,26 @@ int main(int argc, char **argv)
 
         assert(conf.num_threads != 0);
 
+#ifdef __linux__
+        if (conf.num_workers != 0)
+                run_supervisor(orig_argv);
+#endif
+
         /* start the threads */
-        conf.threads = alloca(sizeof(conf.threads[0]) * conf.num_threads);
-        size_t i;
-        for (i = 1; i != conf.num_threads; ++i) {
+        {
                 pthread_t tid;
-                pthread_create(&tid, NULL, run_loop, (void *)i);
+                pthread_create(&tid, NULL, reload_main, NULL);
+        }
+        if (hp_taskpool_start(conf.num_compute_threads) != 0) {
+                perror("failed to start the task pool");
+                return EX_OSERR;
         }
+        conf.threads = alloca(sizeof(conf.threads[0]) * conf.num_threads);
+        memset(conf.threads, 0, sizeof(conf.threads[0]) * conf.num_threads);
+        size_t i;
+        for (i = 1; i != conf.num_threads; ++i)
+                pthread_create(&conf.threads[i].tid, NULL, run_loop, (void *)i);
+        conf.threads[0].tid = pthread_self();
 
         /* this thread becomes the first thread */
         run_loop((void *)0);
@@ -0,0 +1,54 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Runs independent start-up jobs (resolving and binding listeners, loading certificates) on
+   short-lived threads.  Jobs are handed out by an atomic counter, so slow ones do not hold up
+   the rest. */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "hoppang.h"
+
+struct st_parallel_ctx_t {
+        size_t num_jobs;
+        size_t next;
+        void (*cb)(size_t index, void *arg);
+        void *arg;
+};
+
+static void *parallel_main(void *_ctx)
+{
+        struct st_parallel_ctx_t *ctx = _ctx;
+        size_t index;
+
+        while ((index = __sync_fetch_and_add(&ctx->next, 1)) < ctx->num_jobs)
+                ctx->cb(index, ctx->arg);
+
+        return NULL;
+}
+
+void hp_parallel_for(size_t num_jobs, size_t num_threads, void (*cb)(size_t index, void *arg), void *arg)
+{
+        struct st_parallel_ctx_t ctx = {num_jobs, 0, cb, arg};
+        pthread_t *tids;
+        size_t i, num_started = 0;
+
+        if (num_threads > num_jobs)
+                num_threads = num_jobs;
+        if (num_threads > 1 && (tids = malloc(sizeof(*tids) * (num_threads - 1))) != NULL) {
+                for (i = 0; i != num_threads - 1; ++i) {
+                        if (pthread_create(tids + i, NULL, parallel_main, &ctx) != 0)
+                                break;
+                        ++num_started;
+                }
+        } else {
+                tids = NULL;
+        }
+
+        /* the calling thread takes part, and finishes the jobs alone if no thread could be started */
+        parallel_main(&ctx);
+
+        for (i = 0; i != num_started; ++i)
+                pthread_join(tids[i], NULL);
+        free(tids);
+}
@@ -0,0 +1,416 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* A sampling profiler for the loops, for where perf cannot be run.  Once started, a timer on the
+   CPU clock of the loop thread sends it SIGPROF at the given rate, and the handler appends the
+   backtrace of what it interrupted to a buffer of the thread: a word holding the depth, then the
+   return addresses.  Only the thread writes the buffer, from the handler, so it needs no lock.
+   When stopped, the buffer is handed to the task pool, where the stacks are folded, the addresses
+   named (by dladdr(3) in the shared libraries and, as annotate-backtrace-symbols does, by
+   addr2line(1) in the executable, whose functions are mostly static) and appended to a file in the
+   format of stackcollapse, one line per distinct stack, ready for flamegraph.pl or speedscope.
+
+   backtrace(3) is not async-signal-safe in general; it allocates once, when it loads the unwinder,
+   which hp_profile_start() does outside of the handler. */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hoppang.h"
+
+#define BUFFER_WORDS (4 * 1024 * 1024) /* 32MB of address space, touched as it fills; 20 minutes at 99Hz */
+#define SKIP_FRAMES 2                   /* the handler and the signal trampoline */
+
+extern char **environ;
+
+struct st_hp_profile_t {
+        timer_t timer;
+        volatile sig_atomic_t stopped;
+        size_t size; /* in words */
+        size_t num_samples;
+        size_t num_dropped;
+        void **words;
+};
+
+struct st_profile_write_t {
+        hp_task_t super;
+        hp_profile_t *profile;
+        char *path;
+        char label[64];
+        size_t num_stacks;
+        int failed;
+};
+
+struct st_stack_slot_t {
+        size_t offset; /* of the depth word; SIZE_MAX if empty */
+        size_t count;
+};
+
+struct st_symbol_t {
+        void *addr;
+        char *name;
+};
+
+static __thread hp_profile_t *current;
+
+static void on_sigprof(int signo)
+{
+        hp_profile_t *p = current;
+        int saved_errno = errno, n;
+
+        if (p == NULL || p->stopped)
+                return;
+        if (p->size + 1 + HP_PROFILE_MAX_DEPTH > BUFFER_WORDS) {
+                ++p->num_dropped;
+                return;
+        }
+        n = backtrace(p->words + p->size + 1, HP_PROFILE_MAX_DEPTH);
+        p->words[p->size] = (void *)(uintptr_t)n;
+        p->size += 1 + n;
+        ++p->num_samples;
+        errno = saved_errno;
+}
+
+void hp_profile_init(void)
+{
+        struct sigaction action;
+
+        memset(&action, 0, sizeof(action));
+        sigemptyset(&action.sa_mask);
+        action.sa_handler = on_sigprof;
+        /* the samples interrupt whatever the loop was doing, system calls included */
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGPROF, &action, NULL);
+}
+
+int hp_profile_start(unsigned rate)
+{
+        struct sigevent sev;
+        struct itimerspec its;
+        clockid_t clock;
+        hp_profile_t *p;
+        void *frame;
+
+        if (current != NULL || rate == 0)
+                return -1;
+        if ((p = calloc(1, sizeof(*p))) == NULL)
+                return -1;
+        if ((p->words = mmap(NULL, BUFFER_WORDS * sizeof(void *), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED)
+                goto Error;
+        backtrace(&frame, 1);
+
+        /* on the CPU clock of the thread, so that a loop waiting for events is not sampled */
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGPROF;
+        sev._sigev_un._tid = gettid();
+        if (pthread_getcpuclockid(pthread_self(), &clock) != 0 || timer_create(clock, &sev, &p->timer) != 0) {
+                munmap(p->words, BUFFER_WORDS * sizeof(void *));
+                goto Error;
+        }
+        its.it_interval.tv_sec = 1 / rate;
+        its.it_interval.tv_nsec = 1000000000 / rate % 1000000000;
+        its.it_value = its.it_interval;
+        if (timer_settime(p->timer, 0, &its, NULL) != 0) {
+                timer_delete(p->timer);
+                munmap(p->words, BUFFER_WORDS * sizeof(void *));
+                goto Error;
+        }
+        current = p;
+        return 0;
+
+Error:
+        free(p);
+        return -1;
+}
+
+static int compare_symbols(const void *_x, const void *_y)
+{
+        const struct st_symbol_t *x = _x, *y = _y;
+
+        return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* the unique addresses, sorted so that they can be searched */
+static struct st_symbol_t *collect_addresses(hp_profile_t *p, size_t *num_symbols)
+{
+        struct st_symbol_t *symbols;
+        size_t offset, depth, i, n = 0;
+
+        if ((symbols = malloc((p->size + 1) * sizeof(*symbols))) == NULL)
+                return NULL;
+        for (offset = 0; offset < p->size; offset += 1 + depth) {
+                depth = (uintptr_t)p->words[offset];
+                for (i = SKIP_FRAMES; i < depth; ++i)
+                        symbols[n++] = (struct st_symbol_t){p->words[offset + 1 + i]};
+        }
+        qsort(symbols, n, sizeof(*symbols), compare_symbols);
+        for (i = 0, *num_symbols = 0; i != n; ++i)
+                if (*num_symbols == 0 || symbols[*num_symbols - 1].addr != symbols[i].addr)
+                        symbols[(*num_symbols)++] = symbols[i];
+        return symbols;
+}
+
+static char *find_name(struct st_symbol_t *symbols, size_t num_symbols, void *addr)
+{
+        struct st_symbol_t key = {addr}, *found;
+
+        found = bsearch(&key, symbols, num_symbols, sizeof(*symbols), compare_symbols);
+        return found != NULL && found->name != NULL ? found->name : "??";
+}
+
+/* names the addresses of the executable in one run of addr2line, which reads them from a memfd and prints a function
+   name and a location for each */
+static void run_addr2line(struct st_symbol_t *symbols, size_t num_symbols, uintptr_t exe_base)
+{
+        char exe[4096], *argv[] = {"addr2line", "-f", "-e", exe, NULL}, line[4096];
+        posix_spawn_file_actions_t actions;
+        int addrs_fd = -1, pipefds[2] = {-1, -1};
+        ssize_t exe_len;
+        size_t i;
+        Dl_info info;
+        FILE *fp;
+        pid_t pid;
+
+        if ((exe_len = readlink("/proc/self/exe", exe, sizeof(exe) - 1)) <= 0)
+                return;
+        exe[exe_len] = '\0';
+        if ((addrs_fd = memfd_create("hoppang-profile", MFD_CLOEXEC)) == -1 || (fp = fdopen(dup(addrs_fd), "w")) == NULL)
+                goto Exit;
+        for (i = 0; i != num_symbols; ++i)
+                if (dladdr(symbols[i].addr, &info) != 0 && (uintptr_t)info.dli_fbase == exe_base)
+                        fprintf(fp, "%lx\n", (unsigned long)((uintptr_t)symbols[i].addr - exe_base));
+        fclose(fp);
+        lseek(addrs_fd, 0, SEEK_SET);
+        if (pipe2(pipefds, O_CLOEXEC) != 0)
+                goto Exit;
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, addrs_fd, 0);
+        posix_spawn_file_actions_adddup2(&actions, pipefds[1], 1);
+        if (posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ) != 0) {
+                posix_spawn_file_actions_destroy(&actions);
+                goto Exit;
+        }
+        posix_spawn_file_actions_destroy(&actions);
+        close(pipefds[1]);
+        pipefds[1] = -1;
+
+        /* in the order written; a missing addr2line leaves the addresses unnamed */
+        if ((fp = fdopen(pipefds[0], "r")) != NULL) {
+                pipefds[0] = -1;
+                for (i = 0; i != num_symbols; ++i) {
+                        if (dladdr(symbols[i].addr, &info) == 0 || (uintptr_t)info.dli_fbase != exe_base)
+                                continue;
+                        if (fgets(line, sizeof(line), fp) == NULL)
+                                break;
+                        line[strcspn(line, "\n")] = '\0';
+                        if (strcmp(line, "??") != 0)
+                                symbols[i].name = strdup(line);
+                        if (fgets(line, sizeof(line), fp) == NULL)
+                                break;
+                }
+                fclose(fp);
+        }
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+                ;
+
+Exit:
+        if (addrs_fd != -1)
+                close(addrs_fd);
+        if (pipefds[0] != -1)
+                close(pipefds[0]);
+        if (pipefds[1] != -1)
+                close(pipefds[1]);
+}
+
+static void name_symbols(struct st_symbol_t *symbols, size_t num_symbols)
+{
+        char buf[256];
+        const char *slash;
+        uintptr_t exe_base = 0;
+        Dl_info info;
+        size_t i;
+
+        if (dladdr((void *)hp_profile_init, &info) != 0)
+                exe_base = (uintptr_t)info.dli_fbase;
+        run_addr2line(symbols, num_symbols, exe_base);
+        for (i = 0; i != num_symbols; ++i) {
+                if (symbols[i].name != NULL)
+                        continue;
+                if (dladdr(symbols[i].addr, &info) == 0 || info.dli_fname == NULL) {
+                        snprintf(buf, sizeof(buf), "%p", symbols[i].addr);
+                } else if (info.dli_sname != NULL) {
+                        snprintf(buf, sizeof(buf), "%s", info.dli_sname);
+                } else {
+                        slash = strrchr(info.dli_fname, '/');
+                        snprintf(buf, sizeof(buf), "%s+0x%lx", slash != NULL ? slash + 1 : info.dli_fname,
+                                 (unsigned long)((uintptr_t)symbols[i].addr - (uintptr_t)info.dli_fbase));
+                }
+                symbols[i].name = strdup(buf);
+        }
+}
+
+static size_t hash_stack(void **frames, size_t depth)
+{
+        return hp_hash(frames, depth * sizeof(*frames));
+}
+
+static int append(hp_buffer_t *buf, const char *s, size_t len)
+{
+        size_t capacity;
+        char *bytes;
+
+        if (buf->capacity - buf->size < len) {
+                for (capacity = buf->capacity != 0 ? buf->capacity : 65536; capacity - buf->size < len; capacity *= 2)
+                        ;
+                if ((bytes = realloc(buf->bytes, capacity)) == NULL)
+                        return -1;
+                buf->bytes = bytes;
+                buf->capacity = capacity;
+        }
+        memcpy(buf->bytes + buf->size, s, len);
+        buf->size += len;
+        return 0;
+}
+
+static void write_profile(hp_task_t *_task)
+{
+        struct st_profile_write_t *task = HP_STRUCT_FROM_MEMBER(struct st_profile_write_t, super, _task);
+        hp_profile_t *p = task->profile;
+        struct st_stack_slot_t *slots = NULL, *slot;
+        struct st_symbol_t *symbols = NULL;
+        size_t num_symbols = 0, num_slots, offset, depth, i, j, mask;
+        hp_buffer_t out = {NULL};
+        char count[32];
+        int fd;
+
+        /* return addresses point past the call; the one before it is in the calling line */
+        for (offset = 0; offset < p->size; offset += 1 + depth) {
+                depth = (uintptr_t)p->words[offset];
+                for (i = SKIP_FRAMES + 1; i < depth; ++i)
+                        p->words[offset + 1 + i] = (char *)p->words[offset + 1 + i] - 1;
+        }
+
+        /* fold the identical stacks */
+        for (num_slots = 64; num_slots < p->num_samples * 2; num_slots *= 2)
+                ;
+        mask = num_slots - 1;
+        if ((slots = malloc(num_slots * sizeof(*slots))) == NULL)
+                goto Error;
+        memset(slots, 0xff, num_slots * sizeof(*slots));
+        for (offset = 0; offset < p->size; offset += 1 + depth) {
+                depth = (uintptr_t)p->words[offset];
+                for (i = hash_stack(p->words + offset + 1, depth) & mask;; i = (i + 1) & mask) {
+                        slot = slots + i;
+                        if (slot->offset == SIZE_MAX) {
+                                *slot = (struct st_stack_slot_t){offset, 1};
+                                ++task->num_stacks;
+                                break;
+                        }
+                        if ((uintptr_t)p->words[slot->offset] == depth &&
+                            memcmp(p->words + slot->offset + 1, p->words + offset + 1, depth * sizeof(void *)) == 0) {
+                                ++slot->count;
+                                break;
+                        }
+                }
+        }
+
+        if ((symbols = collect_addresses(p, &num_symbols)) == NULL)
+                goto Error;
+        name_symbols(symbols, num_symbols);
+
+        /* outermost first, in the format of stackcollapse */
+        for (i = 0; i != num_slots; ++i) {
+                if ((slot = slots + i)->offset == SIZE_MAX)
+                        continue;
+                depth = (uintptr_t)p->words[slot->offset];
+                if (append(&out, task->label, strlen(task->label)) != 0)
+                        goto Error;
+                for (j = depth; j > SKIP_FRAMES; --j) {
+                        const char *name = find_name(symbols, num_symbols, p->words[slot->offset + j]);
+                        if (append(&out, ";", 1) != 0 || append(&out, name, strlen(name)) != 0)
+                                goto Error;
+                }
+                sprintf(count, " %zu\n", slot->count);
+                if (append(&out, count, strlen(count)) != 0)
+                        goto Error;
+        }
+
+        /* one write, so that the threads and the workers appending to the file do not interleave */
+        if ((fd = open(task->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1)
+                goto Error;
+        if (out.size != 0 && write(fd, out.bytes, out.size) != (ssize_t)out.size) {
+                close(fd);
+                goto Error;
+        }
+        close(fd);
+        goto Exit;
+
+Error:
+        task->failed = 1;
+Exit:
+        if (symbols != NULL) {
+                for (i = 0; i != num_symbols; ++i)
+                        free(symbols[i].name);
+                free(symbols);
+        }
+        free(slots);
+        free(out.bytes);
+}
+
+static void on_profile_written(hp_loop_t *loop, hp_task_t *_task)
+{
+        struct st_profile_write_t *task = HP_STRUCT_FROM_MEMBER(struct st_profile_write_t, super, _task);
+        hp_profile_t *p = task->profile;
+
+        if (task->failed) {
+                fprintf(stderr, "[ERROR] failed to write the profile of thread %zu to %s\n", loop->thread_index, task->path);
+        } else {
+                fprintf(stderr, "[INFO] profile of thread %zu: %zu samples, %zu dropped, %zu stacks appended to %s\n",
+                        loop->thread_index, p->num_samples, p->num_dropped, task->num_stacks, task->path);
+        }
+        munmap(p->words, BUFFER_WORDS * sizeof(void *));
+        free(p);
+        free(task->path);
+        free(task);
+}
+
+int hp_profile_stop(hp_loop_t *loop, const char *path, const char *label)
+{
+        struct st_profile_write_t *task;
+        hp_profile_t *p;
+
+        if ((p = current) == NULL)
+                return -1;
+        /* a signal already queued finds the profile stopped */
+        p->stopped = 1;
+        timer_delete(p->timer);
+        current = NULL;
+
+        if ((task = calloc(1, sizeof(*task))) == NULL || (task->path = strdup(path)) == NULL) {
+                free(task);
+                munmap(p->words, BUFFER_WORDS * sizeof(void *));
+                free(p);
+                return -1;
+        }
+        task->super.run = write_profile;
+        task->super.on_complete = on_profile_written;
+        task->profile = p;
+        snprintf(task->label, sizeof(task->label), "%s", label);
+        /* without compute threads the task runs here, addr2line included, and the loop waits for it */
+        hp_task_submit(loop, &task->super);
+        return 0;
+}
@@ -0,0 +1,316 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Reverse proxy over the frame protocol.  Every frame from a client is forwarded to one of the
+   upstreams over a pooled connection, and the frame that comes back is relayed as the response.
+   Frames of one client may be in flight on several upstream connections at once; the responses
+   are relayed in the order of the requests.
+
+   With a cache, a frame is looked up before going anywhere; of the concurrent misses for the same
+   frame, the first one is forwarded and fills the cache, and the others wait for it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hoppang.h"
+
+struct st_proxy_req_t;
+
+enum {
+        CACHE_NONE,
+        CACHE_FETCHING, /* the response is to be stored */
+        CACHE_WAITING,  /* for another request fetching the same */
+        CACHE_ORPHANED  /* the client is gone but the callback of the cache is already on its way */
+};
+
+struct st_proxy_client_t {
+        hp_conn_t *conn;
+        struct st_proxy_req_t *head;
+        struct st_proxy_req_t **tail;
+};
+
+struct st_proxy_req_t {
+        hp_upstream_req_t super;
+        struct st_proxy_client_t *client;
+        hp_conn_t *upstream; /* while leased */
+        hp_iovec_t frame;    /* the request, header included; kept for a retry */
+        hp_iovec_t response; /* copy of the response, if it came before those of the preceding requests */
+        hp_cache_entry_t *cached;
+        hp_cache_waiter_t waiter;
+        int cache_state;
+        int done;
+        int retried;
+        struct st_proxy_req_t *next;
+};
+
+static const hp_proxy_config_t *config;
+static hp_frame_handler_t proxy_handler;
+
+/* one pool per loop, and each loop runs on its own thread */
+static __thread hp_upstream_pool_t *pool;
+static __thread struct st_hp_proxy_stats_t stats;
+
+hp_upstream_pool_t *hp_proxy_get_pool(void)
+{
+        return pool;
+}
+
+const struct st_hp_proxy_stats_t *hp_proxy_get_stats(void)
+{
+        return &stats;
+}
+
+static hp_upstream_pool_t *get_pool(hp_loop_t *loop)
+{
+        if (pool == NULL) {
+                if ((pool = malloc(sizeof(*pool))) == NULL ||
+                    hp_upstream_pool_init(pool, loop, config->upstreams, config->num_upstreams, config->max_conns,
+                                          config->queue_timeout) != 0) {
+                        perror("failed to create upstream pool");
+                        abort();
+                }
+        }
+        return pool;
+}
+
+static hp_iovec_t req_payload(struct st_proxy_req_t *req)
+{
+        return hp_iovec_init(req->frame.base + HP_FRAME_HEADER_SIZE, req->frame.len - HP_FRAME_HEADER_SIZE);
+}
+
+static void free_req(struct st_proxy_req_t *req)
+{
+        if (req->cached != NULL)
+                hp_cache_release(req->cached);
+        free(req->frame.base);
+        free(req->response.base);
+        free(req);
+}
+
+/* relays the responses that are next in line */
+static void flush_responses(struct st_proxy_client_t *client)
+{
+        struct st_proxy_req_t *req;
+
+        while ((req = client->head) != NULL && req->done) {
+                if (req->cached != NULL) {
+                        hp_frame_send(client->conn, req->cached->value.base, req->cached->value.len);
+                } else if (req->response.base != NULL) {
+                        hp_frame_send(client->conn, req->response.base, req->response.len);
+                }
+                if ((client->head = req->next) == NULL)
+                        client->tail = &client->head;
+                free_req(req);
+        }
+}
+
+static void fail_req(struct st_proxy_req_t *req)
+{
+        /* the protocol has no way to report an error but closing */
+        hp_conn_close(req->client->conn);
+}
+
+static void on_upstream_connect(hp_upstream_req_t *_req, hp_conn_t *upstream)
+{
+        struct st_proxy_req_t *req = HP_STRUCT_FROM_MEMBER(struct st_proxy_req_t, super, _req);
+
+        if (upstream == NULL) {
+                fail_req(req);
+                return;
+        }
+        req->upstream = upstream;
+        hp_conn_write(upstream, req->frame.base, req->frame.len);
+}
+
+static ssize_t on_upstream_read(hp_upstream_req_t *_req, hp_conn_t *upstream, hp_iovec_t input)
+{
+        struct st_proxy_req_t *req = HP_STRUCT_FROM_MEMBER(struct st_proxy_req_t, super, _req);
+        struct st_proxy_client_t *client = req->client;
+        hp_iovec_t payload;
+        ssize_t r;
+
+        if ((r = hp_frame_decode(input, proxy_handler.max_frame_size, &payload)) == 0)
+                return 0;
+        req->upstream = NULL;
+        if (r == -1) {
+                hp_upstream_release(get_pool(upstream->loop), upstream, 0);
+                fail_req(req);
+                return -1;
+        }
+
+        if (req == client->head) {
+                hp_frame_send(client->conn, payload.base, payload.len);
+        } else if ((req->response.base = malloc(payload.len + 1)) != NULL) {
+                memcpy(req->response.base, payload.base, payload.len);
+                req->response.len = payload.len;
+        } else {
+                fail_req(req);
+        }
+        req->done = 1;
+        if (req->cache_state == CACHE_FETCHING) {
+                hp_cache_fill(config->cache, req_payload(req), payload, upstream->loop->now);
+                req->cache_state = CACHE_NONE;
+        }
+        /* anything beyond the response was not asked for; do not trust the connection any more */
+        hp_upstream_release(get_pool(upstream->loop), upstream, (size_t)r == input.len);
+        flush_responses(client);
+
+        return r;
+}
+
+static void on_upstream_close(hp_upstream_req_t *_req)
+{
+        struct st_proxy_req_t *req = HP_STRUCT_FROM_MEMBER(struct st_proxy_req_t, super, _req);
+        hp_loop_t *loop = req->client->conn->loop;
+
+        req->upstream = NULL;
+        /* a reused connection may have been closed by the upstream just before the request was sent; try once more */
+        if (req->super.reused && !req->retried) {
+                req->retried = 1;
+                hp_upstream_acquire(get_pool(loop), &req->super);
+                return;
+        }
+        fail_req(req);
+}
+
+static int on_client_accept(hp_conn_t *conn)
+{
+        struct st_proxy_client_t *client;
+
+        if ((client = malloc(sizeof(*client))) == NULL)
+                return -1;
+        client->conn = conn;
+        client->head = NULL;
+        client->tail = &client->head;
+        conn->data = client;
+        return 0;
+}
+
+static void on_cache_wait(hp_cache_waiter_t *waiter, hp_cache_entry_t *entry)
+{
+        struct st_proxy_req_t *req = HP_STRUCT_FROM_MEMBER(struct st_proxy_req_t, waiter, waiter);
+
+        if (req->cache_state == CACHE_ORPHANED) {
+                if (entry != NULL)
+                        hp_cache_release(entry);
+                free_req(req);
+                return;
+        }
+        req->cache_state = CACHE_NONE;
+        if (entry == NULL) {
+                /* the fetch failed or was given up; try on our own */
+                hp_upstream_acquire(get_pool(waiter->loop), &req->super);
+                return;
+        }
+        req->cached = entry;
+        req->done = 1;
+        flush_responses(req->client);
+}
+
+static int on_client_frame(hp_conn_t *conn, hp_iovec_t payload)
+{
+        struct st_proxy_client_t *client = conn->data;
+        struct st_proxy_req_t *req;
+        hp_cache_entry_t *entry = NULL;
+
+        if (config->cache != NULL) {
+                if ((entry = hp_cache_get(config->cache, payload, conn->loop->now)) != NULL) {
+                        ++stats.cache_hits;
+                        if (client->head == NULL)
+                                return hp_frame_send(conn, entry->value.base, entry->value.len) != 0;
+                } else {
+                        ++stats.cache_misses;
+                }
+        }
+
+        if ((req = calloc(1, sizeof(*req))) == NULL)
+                return -1;
+        /* the payload is borrowed from the receive buffer; the header is written anew, as SOCK_SEQPACKET clients send none */
+        req->frame.len = HP_FRAME_HEADER_SIZE + payload.len;
+        if ((req->frame.base = malloc(req->frame.len)) == NULL) {
+                free(req);
+                return -1;
+        }
+        req->frame.base[0] = (char)(payload.len >> 24);
+        req->frame.base[1] = (char)(payload.len >> 16);
+        req->frame.base[2] = (char)(payload.len >> 8);
+        req->frame.base[3] = (char)payload.len;
+        memcpy(req->frame.base + HP_FRAME_HEADER_SIZE, payload.base, payload.len);
+        req->super.on_connect = on_upstream_connect;
+        req->super.on_read = on_upstream_read;
+        req->super.on_close = on_upstream_close;
+        req->client = client;
+        *client->tail = req;
+        client->tail = &req->next;
+
+        if (entry != NULL) {
+                /* behind responses yet to come */
+                hp_cache_retain(entry);
+                req->cached = entry;
+                req->done = 1;
+                return 0;
+        }
+        if (config->cache != NULL) {
+                req->waiter.loop = conn->loop;
+                req->waiter.cb = on_cache_wait;
+                if (hp_cache_join(config->cache, payload, &req->waiter, conn->loop->now) == HP_CACHE_WAIT) {
+                        ++stats.cache_waits;
+                        req->cache_state = CACHE_WAITING;
+                        return 0;
+                }
+                req->cache_state = CACHE_FETCHING;
+        }
+
+        hp_upstream_acquire(get_pool(conn->loop), &req->super);
+        return 0;
+}
+
+static void on_client_close(hp_conn_t *conn)
+{
+        struct st_proxy_client_t *client = conn->data;
+        struct st_proxy_req_t *req;
+
+        if (client == NULL)
+                return;
+        while ((req = client->head) != NULL) {
+                client->head = req->next;
+                if (req->cache_state == CACHE_WAITING) {
+                        if (hp_cache_cancel_wait(config->cache, &req->waiter) != 0) {
+                                /* freed by on_cache_wait */
+                                req->cache_state = CACHE_ORPHANED;
+                                continue;
+                        }
+                        free_req(req);
+                        continue;
+                }
+                /* those waiting for this one fetch by themselves */
+                if (req->cache_state == CACHE_FETCHING)
+                        hp_cache_abandon(config->cache, req_payload(req));
+                /* a response still in flight would arrive on a connection nobody reads in order; close it */
+                if (req->upstream != NULL) {
+                        hp_upstream_release(get_pool(conn->loop), req->upstream, 0);
+                } else if (!req->done) {
+                        hp_upstream_cancel(get_pool(conn->loop), &req->super);
+                }
+                free_req(req);
+        }
+        free(client);
+}
+
+/* requests in flight are tied to the upstream pool of the loop */
+static int on_client_migrate(hp_conn_t *conn)
+{
+        struct st_proxy_client_t *client = conn->data;
+
+        return client != NULL && client->head != NULL;
+}
+
+void hp_proxy_register(const hp_proxy_config_t *_config)
+{
+        config = _config;
+        hp_frame_handler_init(&proxy_handler, "proxy", on_client_frame);
+        proxy_handler.super.on_accept = on_client_accept;
+        proxy_handler.super.on_close = on_client_close;
+        proxy_handler.super.on_migrate = on_client_migrate;
+        hp_register_handler(&proxy_handler.super);
+}
@@ -0,0 +1,211 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Token buckets in an open-addressing table.  A slot is a key and a word that packs the tokens left
+   (in thousandths) with the time they were counted (in milliseconds, modulo 2^32), so that a bucket
+   is refilled and charged by one compare-and-swap.  Slots are claimed by swapping the key in; a key
+   that finds no room within its probe window takes over the slot that has been idle the longest, or
+   is let through if every slot in the window is busy.  The table is sharded only to keep the
+   rejection counters apart. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "hoppang.h"
+
+#define NUM_SHARDS 16
+#define PROBE_WINDOW 8 /* two cache lines */
+#define IDLE_AFTER 60000 /* a slot untouched for this many milliseconds may be taken over */
+#define TOKEN 1000
+
+struct st_slot_t {
+        uint64_t key; /* 0 if free */
+        uint64_t state; /* tokens << 32 | time; 0 for a full bucket */
+};
+
+struct st_shard_t {
+        struct st_slot_t *slots;
+        size_t mask;
+        uint64_t rejected[HP_RATELIMIT_NUM_SCOPES];
+        uint64_t table_full;
+} __attribute__((aligned(64)));
+
+static struct st_shard_t shards[NUM_SHARDS];
+
+void hp_ratelimit_init(size_t num_slots)
+{
+        size_t per_shard = PROBE_WINDOW, i;
+
+        while (per_shard * NUM_SHARDS < num_slots)
+                per_shard *= 2;
+        for (i = 0; i != NUM_SHARDS; ++i) {
+                /* calloc leaves the pages untouched until a client lands on them */
+                if ((shards[i].slots = calloc(per_shard, sizeof(shards[i].slots[0]))) == NULL) {
+                        perror("calloc");
+                        abort();
+                }
+                shards[i].mask = per_shard - 1;
+        }
+}
+
+uint64_t hp_ratelimit_addr_key(const struct sockaddr *addr)
+{
+        switch (addr->sa_family) {
+        case AF_INET:
+                return hp_hash(&((const struct sockaddr_in *)addr)->sin_addr, 4);
+        case AF_INET6: {
+                const struct in6_addr *a = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+                if (IN6_IS_ADDR_V4MAPPED(a))
+                        return hp_hash(a->s6_addr + 12, 4);
+                return hp_hash(a->s6_addr, 8);
+        }
+        default:
+                return 0;
+        }
+}
+
+static uint64_t slot_key(hp_ratelimit_scope_t scope, uint64_t key)
+{
+        key ^= (scope + 1) * 0x9e3779b97f4a7c15;
+        key ^= key >> 29;
+        key *= 0xbf58476d1ce4e5b9;
+        key ^= key >> 32;
+        return key != 0 ? key : 1;
+}
+
+static uint32_t tokens_at(uint64_t state, const hp_ratelimit_rule_t *rule, uint32_t now)
+{
+        uint64_t full = (uint64_t)rule->burst * TOKEN, tokens = state >> 32;
+        uint32_t elapsed = now - (uint32_t)state;
+
+        /* a rate of N per second adds N thousandths each millisecond */
+        if (state == 0 || elapsed >= (full - tokens + rule->rate - 1) / rule->rate)
+                return (uint32_t)full;
+        return (uint32_t)(tokens + (uint64_t)elapsed * rule->rate);
+}
+
+static struct st_slot_t *find_slot(struct st_shard_t *shard, uint64_t key, uint32_t now, int claim)
+{
+        struct st_slot_t *idlest = NULL;
+        uint32_t idlest_for = IDLE_AFTER;
+        uint64_t k, state;
+        size_t i, start = (key >> 32) & shard->mask;
+
+        for (i = 0; i != PROBE_WINDOW; ++i) {
+                struct st_slot_t *slot = shard->slots + ((start + i) & shard->mask);
+                if ((k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE)) == key)
+                        return slot;
+                if (k == 0) {
+                        if (!claim)
+                                return NULL;
+                        if (__atomic_compare_exchange_n(&slot->key, &k, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                                return slot;
+                        if (k == key)
+                                return slot;
+                        continue;
+                }
+                state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+                if (state != 0 && now - (uint32_t)state >= idlest_for) {
+                        idlest = slot;
+                        idlest_for = now - (uint32_t)state;
+                }
+        }
+        if (idlest == NULL || !claim)
+                return NULL;
+
+        /* the previous owner gets a fresh slot of its own when it comes back */
+        k = __atomic_load_n(&idlest->key, __ATOMIC_ACQUIRE);
+        if (!__atomic_compare_exchange_n(&idlest->key, &k, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return k == key ? idlest : NULL;
+        __atomic_store_n(&idlest->state, 0, __ATOMIC_RELAXED);
+        return idlest;
+}
+
+int hp_ratelimit_take(hp_ratelimit_scope_t scope, uint64_t key, const hp_ratelimit_rule_t *rule, uint64_t now)
+{
+        uint64_t k = slot_key(scope, key), state, newstate;
+        struct st_shard_t *shard = shards + (k & (NUM_SHARDS - 1));
+        struct st_slot_t *slot;
+        uint32_t tokens;
+
+        if (rule->rate == 0)
+                return 1;
+        if ((slot = find_slot(shard, k, (uint32_t)now, 1)) == NULL) {
+                __atomic_fetch_add(&shard->table_full, 1, __ATOMIC_RELAXED);
+                return 1;
+        }
+
+        state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+        do {
+                if ((tokens = tokens_at(state, rule, (uint32_t)now)) < TOKEN) {
+                        __atomic_fetch_add(&shard->rejected[scope], 1, __ATOMIC_RELAXED);
+                        return 0;
+                }
+                newstate = (uint64_t)(tokens - TOKEN) << 32 | (uint32_t)now;
+                /* the time is what keeps a drained bucket from reading as the full one */
+                if (newstate == 0)
+                        newstate = 1;
+        } while (!__atomic_compare_exchange_n(&slot->state, &state, newstate, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        return 1;
+}
+
+void hp_ratelimit_drain(hp_ratelimit_scope_t scope, uint64_t key, uint64_t now)
+{
+        uint64_t k = slot_key(scope, key), state = (uint32_t)now;
+        struct st_slot_t *slot;
+
+        if ((slot = find_slot(shards + (k & (NUM_SHARDS - 1)), k, (uint32_t)now, 0)) == NULL)
+                return;
+        __atomic_store_n(&slot->state, state != 0 ? state : 1, __ATOMIC_RELAXED);
+}
+
+int hp_ratelimit_request(hp_conn_t *conn, const hp_iovec_t *key)
+{
+        hp_loop_t *loop = conn->loop;
+
+        if (!hp_ratelimit_take(HP_RATELIMIT_REQUEST, conn->client_key, loop->config->rate_limits + HP_RATELIMIT_REQUEST,
+                               loop->now)) {
+                hp_ratelimit_drain(HP_RATELIMIT_ACCEPT, conn->client_key, loop->now);
+                return HP_RATELIMIT_REQUEST;
+        }
+        if (key != NULL && !hp_ratelimit_take(HP_RATELIMIT_KEY, hp_hash(key->base, key->len),
+                                              loop->config->rate_limits + HP_RATELIMIT_KEY, loop->now))
+                return HP_RATELIMIT_KEY;
+        return -1;
+}
+
+int hp_ratelimit_parse_rule(const char *s, hp_ratelimit_rule_t *rule)
+{
+        char *end;
+        unsigned long rate, burst;
+
+        rate = strtoul(s, &end, 10);
+        if (end == s || rate == 0 || rate > UINT32_MAX / TOKEN)
+                return -1;
+        burst = rate < HP_RATELIMIT_MAX_BURST ? rate : HP_RATELIMIT_MAX_BURST;
+        if (*end == '/') {
+                s = end + 1;
+                burst = strtoul(s, &end, 10);
+                if (end == s || burst == 0)
+                        return -1;
+        }
+        if (*end != '\0' || burst > HP_RATELIMIT_MAX_BURST)
+                return -1;
+        rule->rate = (uint32_t)rate;
+        rule->burst = (uint32_t)burst;
+        return 0;
+}
+
+void hp_ratelimit_get_stats(struct st_hp_ratelimit_stats_t *stats)
+{
+        size_t i, j;
+
+        memset(stats, 0, sizeof(*stats));
+        for (i = 0; i != NUM_SHARDS; ++i) {
+                for (j = 0; j != HP_RATELIMIT_NUM_SCOPES; ++j)
+                        stats->rejected[j] += __atomic_load_n(&shards[i].rejected[j], __ATOMIC_RELAXED);
+                stats->table_full += __atomic_load_n(&shards[i].table_full, __ATOMIC_RELAXED);
+        }
+}
@@ -0,0 +1,177 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Byte-class scanning.  A set is kept both as a 256-bit bitmap for the scalar path and as two
+   16-entry nibble tables for the vector paths: the low nibble of each byte selects a row via
+   PSHUFB, the high nibble selects a bit of that row.  This handles arbitrary sets, unlike
+   PCMPESTRI which is limited to 16 characters or 8 ranges. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HP_SCAN_X86
+#include <immintrin.h>
+#endif
+
+#include "hoppang.h"
+
+hp_scan_set_t hp_scan_eol_set;
+hp_scan_set_t hp_scan_colon_set;
+hp_scan_set_t hp_scan_nontoken_set;
+
+static const char *find_scalar(const char *p, const char *end, const hp_scan_set_t *set)
+{
+        for (; p != end; ++p) {
+                unsigned char c = *p;
+                if ((set->bitmap[c >> 3] & (1 << (c & 7))) != 0)
+                        break;
+        }
+        return p;
+}
+
+static int always_supported(void)
+{
+        return 1;
+}
+
+#ifdef HP_SCAN_X86
+
+static const uint8_t high_nibble_bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+
+__attribute__((target("sse4.2"))) static const char *find_sse42(const char *p, const char *end, const hp_scan_set_t *set)
+{
+        const __m128i rows_lo = _mm_loadu_si128((const __m128i *)set->nibble_lo),
+                      rows_hi = _mm_loadu_si128((const __m128i *)set->nibble_hi),
+                      bits = _mm_loadu_si128((const __m128i *)high_nibble_bits), low4 = _mm_set1_epi8(0x0f),
+                      zero = _mm_setzero_si128();
+
+        for (; end - p >= 16; p += 16) {
+                __m128i x = _mm_loadu_si128((const __m128i *)p), lo = _mm_and_si128(x, low4),
+                        hi = _mm_and_si128(_mm_srli_epi16(x, 4), low4),
+                        row = _mm_blendv_epi8(_mm_shuffle_epi8(rows_lo, lo), _mm_shuffle_epi8(rows_hi, lo), x),
+                        miss = _mm_cmpeq_epi8(_mm_and_si128(row, _mm_shuffle_epi8(bits, hi)), zero);
+                unsigned found = (unsigned)_mm_movemask_epi8(miss) ^ 0xffff;
+                if (found != 0)
+                        return p + __builtin_ctz(found);
+        }
+        return find_scalar(p, end, set);
+}
+
+__attribute__((target("avx2"))) static const char *find_avx2(const char *p, const char *end, const hp_scan_set_t *set)
+{
+        /* VPSHUFB works within 128-bit lanes, hence the tables are duplicated to both */
+        const __m256i rows_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->nibble_lo)),
+                      rows_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->nibble_hi)),
+                      bits = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)high_nibble_bits)),
+                      low4 = _mm256_set1_epi8(0x0f), zero = _mm256_setzero_si256();
+
+        for (; end - p >= 32; p += 32) {
+                __m256i x = _mm256_loadu_si256((const __m256i *)p), lo = _mm256_and_si256(x, low4),
+                        hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low4),
+                        row = _mm256_blendv_epi8(_mm256_shuffle_epi8(rows_lo, lo), _mm256_shuffle_epi8(rows_hi, lo), x),
+                        miss = _mm256_cmpeq_epi8(_mm256_and_si256(row, _mm256_shuffle_epi8(bits, hi)), zero);
+                unsigned found = ~(unsigned)_mm256_movemask_epi8(miss);
+                if (found != 0)
+                        return p + __builtin_ctz(found);
+        }
+        /* the 16-byte step is repeated here rather than calling find_sse42(); mixing legacy SSE with
+           dirty upper halves of the YMM registers costs more than the scan of a short header line */
+        if (end - p >= 16) {
+                __m128i x = _mm_loadu_si128((const __m128i *)p), lo = _mm_and_si128(x, _mm256_castsi256_si128(low4)),
+                        hi = _mm_and_si128(_mm_srli_epi16(x, 4), _mm256_castsi256_si128(low4)),
+                        row = _mm_blendv_epi8(_mm_shuffle_epi8(_mm256_castsi256_si128(rows_lo), lo),
+                                              _mm_shuffle_epi8(_mm256_castsi256_si128(rows_hi), lo), x),
+                        miss = _mm_cmpeq_epi8(_mm_and_si128(row, _mm_shuffle_epi8(_mm256_castsi256_si128(bits), hi)),
+                                              _mm_setzero_si128());
+                unsigned found = (unsigned)_mm_movemask_epi8(miss) ^ 0xffff;
+                if (found != 0)
+                        return p + __builtin_ctz(found);
+                p += 16;
+        }
+        return find_scalar(p, end, set);
+}
+
+static int sse42_supported(void)
+{
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2");
+}
+
+static int avx2_supported(void)
+{
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+const hp_scan_kernel_t hp_scan_kernels[] = {
+#ifdef HP_SCAN_X86
+    {"avx2", find_avx2, avx2_supported},
+    {"sse4.2", find_sse42, sse42_supported},
+#endif
+    {"scalar", find_scalar, always_supported},
+    {NULL}};
+
+hp_scan_find_cb hp_scan_find_impl = find_scalar;
+
+void hp_scan_set_init(hp_scan_set_t *set)
+{
+        memset(set, 0, sizeof(*set));
+}
+
+void hp_scan_set_add(hp_scan_set_t *set, unsigned char lo, unsigned char hi)
+{
+        unsigned c;
+
+        for (c = lo; c <= hi; ++c) {
+                set->bitmap[c >> 3] |= 1 << (c & 7);
+                if (c < 0x80) {
+                        set->nibble_lo[c & 0xf] |= 1 << (c >> 4);
+                } else {
+                        set->nibble_hi[c & 0xf] |= 1 << ((c >> 4) - 8);
+                }
+        }
+}
+
+const char *hp_scan_init(void)
+{
+        const hp_scan_kernel_t *kernel;
+        const char *forced = getenv("HOPPANG_SCAN_KERNEL");
+
+        hp_scan_set_init(&hp_scan_eol_set);
+        hp_scan_set_add(&hp_scan_eol_set, '\r', '\r');
+        hp_scan_set_add(&hp_scan_eol_set, '\n', '\n');
+
+        hp_scan_colon_set = hp_scan_eol_set;
+        hp_scan_set_add(&hp_scan_colon_set, ':', ':');
+
+        /* tchar = "!" / "#" / "$" / "%" / "&" / "'" / "*" / "+" / "-" / "." / "^" / "_" / "`" / "|" / "~" / DIGIT / ALPHA */
+        hp_scan_set_init(&hp_scan_nontoken_set);
+        hp_scan_set_add(&hp_scan_nontoken_set, 0x00, ' ');
+        hp_scan_set_add(&hp_scan_nontoken_set, '"', '"');
+        hp_scan_set_add(&hp_scan_nontoken_set, '(', ')');
+        hp_scan_set_add(&hp_scan_nontoken_set, ',', ',');
+        hp_scan_set_add(&hp_scan_nontoken_set, '/', '/');
+        hp_scan_set_add(&hp_scan_nontoken_set, ':', '@');
+        hp_scan_set_add(&hp_scan_nontoken_set, '[', ']');
+        hp_scan_set_add(&hp_scan_nontoken_set, '{', '{');
+        hp_scan_set_add(&hp_scan_nontoken_set, '}', '}');
+        hp_scan_set_add(&hp_scan_nontoken_set, 0x7f, 0xff);
+
+        for (kernel = hp_scan_kernels; kernel->name != NULL; ++kernel) {
+                if (forced != NULL && strcmp(forced, kernel->name) != 0)
+                        continue;
+                if (kernel->is_supported())
+                        break;
+        }
+        if (kernel->name == NULL) {
+                fprintf(stderr, "[WARN] scan kernel %s is not available, using scalar\n", forced);
+                kernel = hp_scan_kernels;
+                while (strcmp(kernel->name, "scalar") != 0)
+                        ++kernel;
+        }
+        hp_scan_find_impl = kernel->find;
+
+        return kernel->name;
+}
@@ -0,0 +1,444 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* A deny-list enforced by the kernel.  The program attached to the listening sockets looks at bare
+   SYNs only, looks the source address up in an LPM trie (one per address family) and drops the
+   packet on a match, so no request socket, SYN-ACK or accept() is spent on a denied client.  The
+   accepted sockets inherit the program; their traffic carries ACK and is let through after one
+   byte is read.  The tries are updated in place.  Loading eBPF takes CAP_BPF; without it, the list
+   is compiled into a classic filter that is attached again on every update. */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <sys/syscall.h>
+
+#include "hoppang.h"
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn){(c), (d), (s), (o), (i)})
+#define MAX_PROG_LEN 64
+#define TCP_FLAGS_OFF 13 /* from the TCP header, which is where skb->data points when the filter runs */
+#define TCP_SYN 0x02
+#define TCP_ACK 0x10
+
+struct st_lpm_key_t {
+        uint32_t prefixlen;
+        uint8_t addr[16];
+};
+
+static enum { MODE_NONE, MODE_EBPF, MODE_CLASSIC } mode;
+static int *listener_fds;
+static size_t num_listener_fds;
+static int trie_fds[2] = {-1, -1}; /* IPv4, IPv6 */
+static int dropped_fd = -1, prog_fd = -1;
+static size_t num_possible_cpus;
+
+static int family_index(int family)
+{
+        return family == AF_INET6;
+}
+
+static size_t key_size(int family)
+{
+        return offsetof(struct st_lpm_key_t, addr) + (family == AF_INET ? 4 : 16);
+}
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+        return (int)syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int create_map(uint32_t type, uint32_t key_size, uint32_t value_size, uint32_t max_entries, uint32_t flags)
+{
+        union bpf_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.map_type = type;
+        attr.key_size = key_size;
+        attr.value_size = value_size;
+        attr.max_entries = max_entries;
+        attr.map_flags = flags;
+        return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int map_op(int cmd, int fd, const void *key, void *value_or_next)
+{
+        union bpf_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = fd;
+        attr.key = (uint64_t)(uintptr_t)key;
+        attr.value = (uint64_t)(uintptr_t)value_or_next; /* aliases next_key */
+        return sys_bpf(cmd, &attr);
+}
+
+static size_t read_num_possible_cpus(void)
+{
+        FILE *fp;
+        unsigned lo, hi, n = 0;
+        int c;
+
+        /* a list such as "0-3,8-11"; the per-CPU values are laid out by CPU number up to the highest one */
+        if ((fp = fopen("/sys/devices/system/cpu/possible", "r")) == NULL)
+                return 0;
+        while (fscanf(fp, "%u", &lo) == 1) {
+                hi = lo;
+                if ((c = fgetc(fp)) == '-') {
+                        if (fscanf(fp, "%u", &hi) != 1)
+                                break;
+                        c = fgetc(fp);
+                }
+                n = hi + 1;
+                if (c != ',')
+                        break;
+        }
+        fclose(fp);
+        return n;
+}
+
+/* emits the instructions that build the key of the source address on the stack and set up the arguments of the lookup */
+static size_t emit_load_key(struct bpf_insn *p, int family, int fd)
+{
+        size_t n = 0, words = family == AF_INET ? 1 : 4, i;
+        int src = family == AF_INET ? 12 : 8, key = -(int)key_size(family);
+
+        for (i = 0; i != words; ++i) {
+                /* LD_ABS yields host order; the trie wants the bytes as they are on the wire */
+                p[n++] = INSN(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, SKF_NET_OFF + src + (int)i * 4);
+                p[n++] = INSN(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_0, 0, 0, 32);
+                p[n++] = INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_0, key + 4 + (int)i * 4, 0);
+        }
+        p[n++] = INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, key, family == AF_INET ? 32 : 128);
+        p[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+        p[n++] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, key);
+        p[n++] = INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, fd);
+        p[n++] = INSN(0, 0, 0, 0, 0);
+        return n;
+}
+
+static int load_ebpf(void)
+{
+        struct bpf_insn prog[MAX_PROG_LEN];
+        union bpf_attr attr;
+        size_t n = 0, jump_v4, jump_v6, jump_lookup, lookup, jump_accept[3];
+        int i;
+
+        if ((num_possible_cpus = read_num_possible_cpus()) == 0)
+                return -1;
+        if ((trie_fds[0] = create_map(BPF_MAP_TYPE_LPM_TRIE, key_size(AF_INET), 1, 65536, BPF_F_NO_PREALLOC)) == -1 ||
+            (trie_fds[1] = create_map(BPF_MAP_TYPE_LPM_TRIE, key_size(AF_INET6), 1, 65536, BPF_F_NO_PREALLOC)) == -1 ||
+            (dropped_fd = create_map(BPF_MAP_TYPE_PERCPU_ARRAY, 4, 8, 1, 0)) == -1)
+                goto Error;
+
+        prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0); /* LD_ABS reads the skb from r6 */
+        prog[n++] = INSN(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, TCP_FLAGS_OFF);
+        prog[n++] = INSN(BPF_ALU | BPF_AND | BPF_K, BPF_REG_0, 0, 0, TCP_SYN | TCP_ACK);
+        jump_accept[0] = n;
+        prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, TCP_SYN);
+        prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_6, offsetof(struct __sk_buff, protocol), 0);
+        jump_v4 = n;
+        prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, htons(ETH_P_IP));
+        jump_v6 = n;
+        prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, htons(ETH_P_IPV6));
+        jump_accept[1] = n;
+        prog[n++] = INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+
+        prog[jump_v4].off = (int16_t)(n - jump_v4 - 1);
+        n += emit_load_key(prog + n, AF_INET, trie_fds[0]);
+        jump_lookup = n;
+        prog[n++] = INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+        prog[jump_v6].off = (int16_t)(n - jump_v6 - 1);
+        n += emit_load_key(prog + n, AF_INET6, trie_fds[1]);
+        lookup = n;
+        prog[jump_lookup].off = (int16_t)(lookup - jump_lookup - 1);
+
+        prog[n++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+        jump_accept[2] = n;
+        prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0);
+        /* denied; count it */
+        prog[n++] = INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, 0);
+        prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+        prog[n++] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4);
+        prog[n++] = INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, dropped_fd);
+        prog[n++] = INSN(0, 0, 0, 0, 0);
+        prog[n++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+        prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 3, 0);
+        prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0, 0, 0);
+        prog[n++] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, 1);
+        prog[n++] = INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_0, BPF_REG_1, 0, 0);
+        prog[n++] = INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+        prog[n++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+        for (i = 0; i != 3; ++i)
+                prog[jump_accept[i]].off = (int16_t)(n - jump_accept[i] - 1);
+        prog[n++] = INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, -1);
+        prog[n++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+        memset(&attr, 0, sizeof(attr));
+        attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+        attr.insns = (uint64_t)(uintptr_t)prog;
+        attr.insn_cnt = (uint32_t)n;
+        attr.license = (uint64_t)(uintptr_t) "MIT";
+        if ((prog_fd = sys_bpf(BPF_PROG_LOAD, &attr)) == -1)
+                goto Error;
+        return 0;
+
+Error:
+        for (i = 0; i != 2; ++i) {
+                if (trie_fds[i] != -1)
+                        close(trie_fds[i]);
+                trie_fds[i] = -1;
+        }
+        if (dropped_fd != -1)
+                close(dropped_fd);
+        dropped_fd = -1;
+        return -1;
+}
+
+static int attach_ebpf(void)
+{
+        size_t i;
+
+        for (i = 0; i != num_listener_fds; ++i) {
+                if (setsockopt(listener_fds[i], SOL_SOCKET, SO_ATTACH_BPF, &prog_fd, sizeof(prog_fd)) != 0) {
+                        perror("failed to attach the socket filter");
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+static void range_to_key(const hp_addr_range_t *range, struct st_lpm_key_t *key)
+{
+        memset(key, 0, sizeof(*key));
+        key->prefixlen = range->prefixlen;
+        memcpy(key->addr, range->addr, range->family == AF_INET ? 4 : 16);
+}
+
+static int update_ebpf(const hp_addr_range_t *ranges, size_t num_ranges)
+{
+        struct st_lpm_key_t key, cur, next, *stale = NULL, *grown;
+        size_t num_stale = 0, i;
+        uint8_t one = 1;
+        int family, ret = -1;
+
+        /* add first, remove after, so that a range listed before and after the update is never let through */
+        for (i = 0; i != num_ranges; ++i) {
+                range_to_key(ranges + i, &key);
+                if (map_op(BPF_MAP_UPDATE_ELEM, trie_fds[family_index(ranges[i].family)], &key, &one) != 0) {
+                        perror("failed to update the deny-list");
+                        return -1;
+                }
+        }
+        for (family = AF_INET; family != -1; family = family == AF_INET ? AF_INET6 : -1) {
+                int fd = trie_fds[family_index(family)];
+                const void *prev = NULL;
+                /* collect before deleting; the trie cannot be walked while it changes */
+                while (map_op(BPF_MAP_GET_NEXT_KEY, fd, prev, &next) == 0) {
+                        for (i = 0; i != num_ranges; ++i) {
+                                range_to_key(ranges + i, &key);
+                                if (ranges[i].family == family && memcmp(&key, &next, key_size(family)) == 0)
+                                        break;
+                        }
+                        if (i == num_ranges) {
+                                if ((grown = realloc(stale, sizeof(*stale) * (num_stale + 1))) == NULL)
+                                        goto Exit;
+                                stale = grown;
+                                stale[num_stale++] = next;
+                        }
+                        cur = next;
+                        prev = &cur;
+                }
+                for (i = 0; i != num_stale; ++i)
+                        if (map_op(BPF_MAP_DELETE_ELEM, fd, stale + i, NULL) != 0 && errno != ENOENT)
+                                goto Exit;
+                num_stale = 0;
+        }
+        ret = 0;
+
+Exit:
+        free(stale);
+        return ret;
+}
+
+/* one block per range: A = word & mask, compared; `ret #0` when every word matches */
+static int update_classic(const hp_addr_range_t *ranges, size_t num_ranges)
+{
+        struct sock_filter *prog;
+        struct sock_fprog fprog;
+        size_t n = 0, i, family_start[2], jump_family[2];
+        int family, unused = 0, ret = -1;
+
+        if (num_ranges == 0) {
+                for (i = 0; i != num_listener_fds; ++i) {
+                        /* the value is ignored, but has to be there */
+                        if (setsockopt(listener_fds[i], SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused)) != 0 &&
+                            errno != ENOENT) {
+                                perror("failed to detach the socket filter");
+                                return -1;
+                        }
+                }
+                return 0;
+        }
+        if ((prog = malloc(sizeof(*prog) * BPF_MAXINSNS)) == NULL)
+                return -1;
+
+#define EMIT(c, t, f, k)                                                                                                         \
+        do {                                                                                                                     \
+                if (n == BPF_MAXINSNS)                                                                                           \
+                        goto TooLong;                                                                                            \
+                prog[n++] = (struct sock_filter)BPF_JUMP((c), (k), (t), (f));                                                   \
+        } while (0)
+
+        EMIT(BPF_LD | BPF_B | BPF_ABS, 0, 0, TCP_FLAGS_OFF);
+        EMIT(BPF_ALU | BPF_AND | BPF_K, 0, 0, TCP_SYN | TCP_ACK);
+        EMIT(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, TCP_SYN);
+        EMIT(BPF_RET | BPF_K, 0, 0, 0xffffffff);
+        EMIT(BPF_LD | BPF_H | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_PROTOCOL);
+        /* the blocks can be longer than a conditional jump reaches */
+        EMIT(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, ETH_P_IP);
+        jump_family[0] = n;
+        EMIT(BPF_JMP | BPF_JA, 0, 0, 0);
+        EMIT(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, ETH_P_IPV6);
+        jump_family[1] = n;
+        EMIT(BPF_JMP | BPF_JA, 0, 0, 0);
+        EMIT(BPF_RET | BPF_K, 0, 0, 0xffffffff);
+
+        for (family = AF_INET; family != -1; family = family == AF_INET ? AF_INET6 : -1) {
+                int src = family == AF_INET ? 12 : 8;
+                family_start[family_index(family)] = n;
+                for (i = 0; i != num_ranges; ++i) {
+                        const hp_addr_range_t *range = ranges + i;
+                        unsigned words = (range->prefixlen + 31) / 32, w;
+                        if (range->family != family)
+                                continue;
+                        for (w = 0; w != words; ++w) {
+                                unsigned bits = range->prefixlen - w * 32 < 32 ? range->prefixlen - w * 32 : 32;
+                                uint32_t mask = (uint32_t)(0xffffffffu << (32 - bits)), value;
+                                memcpy(&value, range->addr + w * 4, 4);
+                                EMIT(BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_NET_OFF + src + (int)w * 4));
+                                EMIT(BPF_ALU | BPF_AND | BPF_K, 0, 0, mask);
+                                /* skip the rest of the block, i.e. three per remaining word and the return */
+                                EMIT(BPF_JMP | BPF_JEQ | BPF_K, 0, (words - w - 1) * 3 + 1, ntohl(value) & mask);
+                        }
+                        EMIT(BPF_RET | BPF_K, 0, 0, 0);
+                }
+                EMIT(BPF_RET | BPF_K, 0, 0, 0xffffffff);
+        }
+#undef EMIT
+
+        for (i = 0; i != 2; ++i)
+                prog[jump_family[i]].k = (uint32_t)(family_start[i] - jump_family[i] - 1);
+        fprog.len = (unsigned short)n;
+        fprog.filter = prog;
+        for (i = 0; i != num_listener_fds; ++i) {
+                if (setsockopt(listener_fds[i], SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) != 0) {
+                        perror("failed to attach the socket filter");
+                        goto Exit;
+                }
+        }
+        ret = 0;
+        goto Exit;
+
+TooLong:
+        fprintf(stderr, "[ERROR] the deny-list is too long for a classic socket filter; keeping the previous one\n");
+Exit:
+        free(prog);
+        return ret;
+}
+
+int hp_sockfilter_set_listeners(const int *fds, size_t num_fds)
+{
+        int *copy;
+
+        /* one more, as malloc(0) may return NULL */
+        if ((copy = malloc(sizeof(*fds) * (num_fds + 1))) == NULL)
+                return -1;
+        memcpy(copy, fds, sizeof(*fds) * num_fds);
+        free(listener_fds);
+        listener_fds = copy;
+        num_listener_fds = num_fds;
+        return 0;
+}
+
+int hp_sockfilter_update(const hp_addr_range_t *ranges, size_t num_ranges)
+{
+        if (mode == MODE_NONE) {
+                /* nothing runs in the kernel until there is something to deny */
+                if (num_ranges == 0)
+                        return 0;
+                if (load_ebpf() == 0 && attach_ebpf() == 0) {
+                        mode = MODE_EBPF;
+                } else {
+                        fprintf(stderr, "[WARN] eBPF is not available (%s); using a classic socket filter\n", strerror(errno));
+                        mode = MODE_CLASSIC;
+                }
+        }
+        return mode == MODE_EBPF ? update_ebpf(ranges, num_ranges) : update_classic(ranges, num_ranges);
+}
+
+uint64_t hp_sockfilter_num_dropped(void)
+{
+        uint64_t *values, sum = 0;
+        uint32_t key = 0;
+        size_t i;
+
+        if (mode != MODE_EBPF || (values = calloc(num_possible_cpus, sizeof(*values))) == NULL)
+                return 0;
+        if (map_op(BPF_MAP_LOOKUP_ELEM, dropped_fd, &key, values) == 0)
+                for (i = 0; i != num_possible_cpus; ++i)
+                        sum += values[i];
+        free(values);
+        return sum;
+}
+
+int hp_parse_addr_range(const char *s, hp_addr_range_t *range)
+{
+        char buf[INET6_ADDRSTRLEN], *slash, *end;
+        unsigned long prefixlen;
+        unsigned max, i;
+
+        if ((slash = strchr(s, '/')) != NULL) {
+                if ((size_t)(slash - s) >= sizeof(buf))
+                        return -1;
+                memcpy(buf, s, slash - s);
+                buf[slash - s] = '\0';
+        } else {
+                if (strlen(s) >= sizeof(buf))
+                        return -1;
+                strcpy(buf, s);
+        }
+
+        memset(range, 0, sizeof(*range));
+        if (inet_pton(AF_INET, buf, range->addr) == 1) {
+                range->family = AF_INET;
+                max = 32;
+        } else if (inet_pton(AF_INET6, buf, range->addr) == 1) {
+                range->family = AF_INET6;
+                max = 128;
+        } else {
+                return -1;
+        }
+        prefixlen = max;
+        if (slash != NULL) {
+                prefixlen = strtoul(slash + 1, &end, 10);
+                if (end == slash + 1 || *end != '\0' || prefixlen > max)
+                        return -1;
+        }
+        range->prefixlen = (unsigned)prefixlen;
+
+        /* clear the host part; the classic filter compares masked words, the trie whole keys */
+        for (i = 0; i != max / 8; ++i) {
+                if (i * 8 >= prefixlen)
+                        range->addr[i] = 0;
+                else if (i * 8 + 8 > prefixlen)
+                        range->addr[i] &= (uint8_t)(0xff << (8 - (prefixlen - i * 8)));
+        }
+        return 0;
+}
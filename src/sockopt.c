@@ -0,0 +1,132 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* TCP profiles of the listeners.  Every option is set on the listening socket, before bind, and the
+   accepted sockets inherit them (Linux clones the listener into the child), so nothing is paid per
+   connection.  Busy polling is the exception: epoll does not look at SO_BUSY_POLL of the sockets it
+   watches, so the loop also turns it on for its epoll instance. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "hoppang.h"
+
+#ifdef __linux__
+#ifndef EPIOCSPARAMS
+/* since Linux 6.9; the headers may be older than the kernel */
+struct epoll_params {
+        uint32_t busy_poll_usecs;
+        uint16_t busy_poll_budget;
+        uint8_t prefer_busy_poll;
+        uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+#endif
+
+static int parse_int(const char *s, int *out)
+{
+        char *end;
+        long v;
+
+        errno = 0;
+        v = strtol(s, &end, 10);
+        if (errno != 0 || end == s || *end != '\0' || v < 0 || v > INT32_MAX)
+                return -1;
+        *out = (int)v;
+        return 0;
+}
+
+int hp_tcp_profile_parse_option(hp_tcp_profile_t *profile, const char *opt)
+{
+        static const struct {
+                const char *name;
+                size_t offset;
+        } int_options[] = {{"defer-accept", offsetof(hp_tcp_profile_t, defer_accept)},
+                           {"fastopen", offsetof(hp_tcp_profile_t, fastopen)},
+                           {"busy-poll", offsetof(hp_tcp_profile_t, busy_poll)},
+                           {"notsent-lowat", offsetof(hp_tcp_profile_t, notsent_lowat)},
+                           {"rcvbuf", offsetof(hp_tcp_profile_t, rcvbuf)},
+                           {"sndbuf", offsetof(hp_tcp_profile_t, sndbuf)}};
+        size_t i, len;
+
+        if (strcmp(opt, "nodelay") == 0) {
+                profile->nodelay = 1;
+                return 0;
+        }
+        if (strcmp(opt, "incoming-cpu") == 0) {
+                profile->incoming_cpu = 1;
+                return 0;
+        }
+        for (i = 0; i != sizeof(int_options) / sizeof(int_options[0]); ++i) {
+                len = strlen(int_options[i].name);
+                if (strncmp(opt, int_options[i].name, len) == 0 && opt[len] == '=') {
+                        if (parse_int(opt + len + 1, (int *)((char *)profile + int_options[i].offset)) != 0) {
+                                fprintf(stderr, "listen option `%s` takes a non-negative integer:%s\n", int_options[i].name, opt);
+                                return -1;
+                        }
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+int hp_tcp_profile_apply(int fd, const hp_tcp_profile_t *profile)
+{
+#define SET(level, name, value)                                                                                                  \
+        do {                                                                                                                     \
+                int v = (value);                                                                                                 \
+                if (setsockopt(fd, (level), (name), &v, sizeof(v)) != 0) {                                                       \
+                        fprintf(stderr, "failed to set " #name ":%s\n", strerror(errno));                                       \
+                        return -1;                                                                                               \
+                }                                                                                                                \
+        } while (0)
+
+#ifdef TCP_DEFER_ACCEPT
+        if (profile->defer_accept != 0)
+                SET(IPPROTO_TCP, TCP_DEFER_ACCEPT, profile->defer_accept);
+#endif
+#ifdef TCP_FASTOPEN
+        if (profile->fastopen != 0)
+                SET(IPPROTO_TCP, TCP_FASTOPEN, profile->fastopen);
+#endif
+#ifdef SO_BUSY_POLL
+        if (profile->busy_poll != 0)
+                SET(SOL_SOCKET, SO_BUSY_POLL, profile->busy_poll);
+#endif
+        if (profile->nodelay)
+                SET(IPPROTO_TCP, TCP_NODELAY, 1);
+#ifdef TCP_NOTSENT_LOWAT
+        if (profile->notsent_lowat != 0)
+                SET(IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile->notsent_lowat);
+#endif
+        /* fixing a size turns off autotuning; the window scale is chosen from it at listen time */
+        if (profile->rcvbuf != 0)
+                SET(SOL_SOCKET, SO_RCVBUF, profile->rcvbuf);
+        if (profile->sndbuf != 0)
+                SET(SOL_SOCKET, SO_SNDBUF, profile->sndbuf);
+
+#undef SET
+        return 0;
+}
+
+int hp_tcp_set_epoll_busy_poll(int epoll_fd, int usecs)
+{
+#ifdef __linux__
+        struct epoll_params params = {0};
+
+        params.busy_poll_usecs = (uint32_t)usecs;
+        params.busy_poll_budget = 8; /* the kernel default for NAPI busy polling */
+        params.prefer_busy_poll = 1;
+        return ioctl(epoll_fd, EPIOCSPARAMS, &params);
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+}
@@ -0,0 +1,274 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* TLS contexts of the listeners.  Parsing certificate chains and private keys dominates the
+   start-up time once there are many of them, so
+   - listeners naming the same certificate and key share one SSL_CTX,
+   - the remaining ones are loaded in parallel, and
+   - loaded contexts are cached by path and file identity (inode, size, mtime), so that
+     reloading the configuration only parses the files that have changed. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "hoppang.h"
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define SSL_CTX_up_ref(ctx) CRYPTO_add(&(ctx)->references, 1, CRYPTO_LOCK_SSL_CTX)
+#define TLS_server_method SSLv23_server_method
+#endif
+
+struct st_file_id_t {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+};
+
+struct st_ctx_cache_entry_t {
+        char *cert_file;
+        char *key_file;
+        struct st_file_id_t cert_id;
+        struct st_file_id_t key_id;
+        SSL_CTX *ctx;
+        struct st_ctx_cache_entry_t *next;
+};
+
+struct st_load_job_t {
+        const char *cert_file;
+        const char *key_file;
+        struct st_file_id_t cert_id;
+        struct st_file_id_t key_id;
+        SSL_CTX *ctx;
+        char err[256];
+};
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct st_ctx_cache_entry_t *cache = NULL;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static pthread_mutex_t *openssl_thread_locks;
+
+static unsigned long openssl_thread_id_callback(void)
+{
+        return (unsigned long)pthread_self();
+}
+
+static void openssl_thread_lock_callback(int mode, int n, const char *file, int line)
+{
+        if ((mode & CRYPTO_LOCK) != 0) {
+                pthread_mutex_lock(openssl_thread_locks + n);
+        } else if ((mode & CRYPTO_UNLOCK) != 0) {
+                pthread_mutex_unlock(openssl_thread_locks + n);
+        }
+}
+#endif
+
+void hp_ssl_init(void)
+{
+        static int ready = 0;
+
+        if (ready)
+                return;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+        {
+                int nlocks = CRYPTO_num_locks(), i;
+                openssl_thread_locks = malloc(sizeof(*openssl_thread_locks) * nlocks);
+                for (i = 0; i != nlocks; ++i)
+                        pthread_mutex_init(openssl_thread_locks + i, NULL);
+                CRYPTO_set_locking_callback(openssl_thread_lock_callback);
+                CRYPTO_set_id_callback(openssl_thread_id_callback);
+        }
+        SSL_load_error_strings();
+        SSL_library_init();
+        OpenSSL_add_all_algorithms();
+#else
+        OPENSSL_init_ssl(0, NULL);
+#endif
+        ready = 1;
+}
+
+static int get_file_id(const char *fn, struct st_file_id_t *id)
+{
+        struct stat st;
+
+        if (stat(fn, &st) != 0)
+                return -1;
+        id->dev = st.st_dev;
+        id->ino = st.st_ino;
+        id->size = st.st_size;
+        id->mtime = st.st_mtim;
+        return 0;
+}
+
+static int file_id_equals(const struct st_file_id_t *x, const struct st_file_id_t *y)
+{
+        return x->dev == y->dev && x->ino == y->ino && x->size == y->size && x->mtime.tv_sec == y->mtime.tv_sec &&
+               x->mtime.tv_nsec == y->mtime.tv_nsec;
+}
+
+static void set_openssl_error(struct st_load_job_t *job, const char *what, const char *fn)
+{
+        char detail[160];
+
+        ERR_error_string_n(ERR_get_error(), detail, sizeof(detail));
+        snprintf(job->err, sizeof(job->err), "failed to load %s:%s:%s", what, fn, detail);
+        ERR_clear_error();
+}
+
+static void load_ctx(size_t index, void *_jobs)
+{
+        struct st_load_job_t **jobs = _jobs, *job = jobs[index];
+        long ssl_options = SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3;
+        SSL_CTX *ctx;
+
+/* disable tls compression to avoid "CRIME" attacks (see http://en.wikipedia.org/wiki/CRIME) */
+#ifdef SSL_OP_NO_COMPRESSION
+        ssl_options |= SSL_OP_NO_COMPRESSION;
+#endif
+
+        if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+                set_openssl_error(job, "context for", job->cert_file);
+                return;
+        }
+        SSL_CTX_set_options(ctx, ssl_options);
+        SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        if (SSL_CTX_use_certificate_chain_file(ctx, job->cert_file) != 1) {
+                set_openssl_error(job, "certificate file", job->cert_file);
+                goto Error;
+        }
+        if (SSL_CTX_use_PrivateKey_file(ctx, job->key_file, SSL_FILETYPE_PEM) != 1) {
+                set_openssl_error(job, "private key file", job->key_file);
+                goto Error;
+        }
+        if (SSL_CTX_check_private_key(ctx) != 1) {
+                set_openssl_error(job, "private key file (does not match the certificate)", job->key_file);
+                goto Error;
+        }
+        job->ctx = ctx;
+        return;
+
+Error:
+        SSL_CTX_free(ctx);
+}
+
+static SSL_CTX *cache_lookup(struct st_load_job_t *job)
+{
+        struct st_ctx_cache_entry_t *entry;
+        SSL_CTX *ctx = NULL;
+
+        pthread_mutex_lock(&cache_mutex);
+        for (entry = cache; entry != NULL; entry = entry->next) {
+                if (strcmp(entry->cert_file, job->cert_file) == 0 && strcmp(entry->key_file, job->key_file) == 0) {
+                        if (file_id_equals(&entry->cert_id, &job->cert_id) && file_id_equals(&entry->key_id, &job->key_id)) {
+                                SSL_CTX_up_ref(entry->ctx);
+                                ctx = entry->ctx;
+                        }
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&cache_mutex);
+
+        return ctx;
+}
+
+static void cache_store(struct st_load_job_t *job)
+{
+        struct st_ctx_cache_entry_t **slot, *entry;
+
+        pthread_mutex_lock(&cache_mutex);
+        for (slot = &cache; *slot != NULL; slot = &(*slot)->next)
+                if (strcmp((*slot)->cert_file, job->cert_file) == 0 && strcmp((*slot)->key_file, job->key_file) == 0)
+                        break;
+        if ((entry = *slot) == NULL) {
+                entry = calloc(1, sizeof(*entry));
+                entry->cert_file = strdup(job->cert_file);
+                entry->key_file = strdup(job->key_file);
+                *slot = entry;
+        } else {
+                /* the files have changed; listeners still using the old context keep their references */
+                SSL_CTX_free(entry->ctx);
+        }
+        entry->cert_id = job->cert_id;
+        entry->key_id = job->key_id;
+        SSL_CTX_up_ref(job->ctx);
+        entry->ctx = job->ctx;
+        pthread_mutex_unlock(&cache_mutex);
+}
+
+int hp_ssl_load_contexts(hp_listener_t *listeners, size_t num_listeners, size_t num_threads, SSL_CTX **ctxs)
+{
+        struct st_load_job_t *jobs = calloc(num_listeners, sizeof(*jobs)), **misses = calloc(num_listeners, sizeof(*misses));
+        size_t *job_of = calloc(num_listeners, sizeof(*job_of)), num_jobs = 0, num_misses = 0, i, j;
+        struct timespec start, end;
+        int ret = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        hp_ssl_init();
+
+        /* one job per distinct pair of files */
+        for (i = 0; i != num_listeners; ++i) {
+                if (listeners[i].ssl_cert_file == NULL)
+                        continue;
+                for (j = 0; j != num_jobs; ++j)
+                        if (strcmp(jobs[j].cert_file, listeners[i].ssl_cert_file) == 0 &&
+                            strcmp(jobs[j].key_file, listeners[i].ssl_key_file) == 0)
+                                break;
+                if (j == num_jobs) {
+                        jobs[j].cert_file = listeners[i].ssl_cert_file;
+                        jobs[j].key_file = listeners[i].ssl_key_file;
+                        ++num_jobs;
+                }
+                job_of[i] = j;
+        }
+
+        for (j = 0; j != num_jobs; ++j) {
+                if (get_file_id(jobs[j].cert_file, &jobs[j].cert_id) != 0 || get_file_id(jobs[j].key_file, &jobs[j].key_id) != 0) {
+                        snprintf(jobs[j].err, sizeof(jobs[j].err), "failed to stat certificate or key file:%s:%s",
+                                 jobs[j].cert_file, strerror(errno));
+                        continue;
+                }
+                if ((jobs[j].ctx = cache_lookup(jobs + j)) == NULL)
+                        misses[num_misses++] = jobs + j;
+        }
+        hp_parallel_for(num_misses, num_threads, load_ctx, misses);
+        for (i = 0; i != num_misses; ++i)
+                if (misses[i]->ctx != NULL)
+                        cache_store(misses[i]);
+
+        for (j = 0; j != num_jobs; ++j) {
+                if (jobs[j].ctx == NULL) {
+                        fprintf(stderr, "[ERROR] %s\n", jobs[j].err);
+                        ret = -1;
+                }
+        }
+        for (i = 0; i != num_listeners; ++i) {
+                SSL_CTX *ctx;
+                if (listeners[i].ssl_cert_file == NULL || (ctx = jobs[job_of[i]].ctx) == NULL)
+                        continue;
+                SSL_CTX_up_ref(ctx);
+                ctxs[i] = ctx;
+        }
+        for (j = 0; j != num_jobs; ++j)
+                if (jobs[j].ctx != NULL)
+                        SSL_CTX_free(jobs[j].ctx);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (num_jobs != 0)
+                fprintf(stderr, "[INFO] %zu TLS contexts ready (%zu loaded, %zu cached) in %.1f ms\n", num_jobs, num_misses,
+                        num_jobs - num_misses, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+        free(jobs);
+        free(misses);
+        free(job_of);
+        return ret;
+}
@@ -0,0 +1,272 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* A pool of compute threads for the work that would stall a loop: compression, hashing, parsing of
+   large bodies.  Each thread owns a Chase-Lev deque: it pushes and takes at the bottom without a
+   lock, and the idle threads steal from the top of the others'.  The loops are not owners, so what
+   they submit goes through a locked queue, from which a thread moves a batch into its deque at a
+   time.  A finished task is posted back to the loop that submitted it (hp_loop_post), where
+   `on_complete` runs, so that handlers touch their connections from their own thread only.
+
+   The deques are of a fixed size; a thread whose deque is full runs what it would have pushed
+   itself. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hoppang.h"
+
+#define DEQUE_SIZE 4096 /* a power of two */
+#define INJECT_BATCH 16 /* taken from the submission queue at once */
+
+struct st_deque_t {
+        /* the owner works at the bottom, thieves at the top; apart, so that they do not share a cache line */
+        int64_t top;
+        char _pad1[64 - sizeof(int64_t)];
+        int64_t bottom;
+        char _pad2[64 - sizeof(int64_t)];
+        hp_task_t *tasks[DEQUE_SIZE];
+};
+
+struct st_worker_t {
+        struct st_deque_t deque;
+        pthread_t tid;
+        size_t index;
+        uint64_t rand_state;
+        /* written by the owner only */
+        uint64_t num_run;
+        uint64_t num_stolen;
+};
+
+static struct {
+        struct st_worker_t *workers;
+        size_t num_workers;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        /* submitted by the loops, oldest first */
+        hp_task_t *inject;
+        hp_task_t **inject_tail;
+        size_t num_sleeping;
+        uint64_t num_submitted;
+        uint64_t num_inline;
+} pool = {NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, &pool.inject};
+
+static __thread struct st_worker_t *self;
+
+static int deque_push(struct st_deque_t *q, hp_task_t *task)
+{
+        int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED), t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+
+        if (b - t >= DEQUE_SIZE)
+                return -1;
+        __atomic_store_n(&q->tasks[b & (DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+}
+
+static hp_task_t *deque_take(struct st_deque_t *q)
+{
+        int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1, t;
+        hp_task_t *task;
+
+        __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+        if (t > b) {
+                /* empty */
+                __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+                return NULL;
+        }
+        task = __atomic_load_n(&q->tasks[b & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+        if (t == b) {
+                /* the last one; a thief may be after it too */
+                if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                        task = NULL;
+                __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+        return task;
+}
+
+/* returns NULL if the deque is empty or if another thread took the task first */
+static hp_task_t *deque_steal(struct st_deque_t *q)
+{
+        int64_t t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE), b;
+        hp_task_t *task;
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+        if (t >= b)
+                return NULL;
+        task = __atomic_load_n(&q->tasks[t & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                return NULL;
+        return task;
+}
+
+static void on_task_complete(hp_loop_t *loop, hp_loop_message_t *msg)
+{
+        hp_task_t *task = HP_STRUCT_FROM_MEMBER(hp_task_t, _complete, msg);
+
+        task->on_complete(loop, task);
+}
+
+static void run_task(hp_task_t *task)
+{
+        task->run(task);
+        task->_complete.cb = on_task_complete;
+        hp_loop_post(task->_loop, &task->_complete);
+}
+
+/* moves a batch of the submitted tasks into the deque of the worker, returning the first to be run */
+static hp_task_t *take_submitted(struct st_worker_t *worker)
+{
+        hp_task_t *task, *next, *after;
+        size_t i;
+
+        pthread_mutex_lock(&pool.mutex);
+        if ((task = pool.inject) != NULL) {
+                for (next = task->_next, i = 1; next != NULL && i != INJECT_BATCH; next = after, ++i) {
+                        /* once pushed, a thief may run the task and its loop submit it again */
+                        after = next->_next;
+                        if (deque_push(&worker->deque, next) != 0)
+                                break;
+                }
+                if ((pool.inject = next) == NULL)
+                        pool.inject_tail = &pool.inject;
+                /* the others may steal from the batch */
+                if (i != 1 && pool.num_sleeping != 0)
+                        pthread_cond_signal(&pool.cond);
+        }
+        pthread_mutex_unlock(&pool.mutex);
+        return task;
+}
+
+static hp_task_t *steal(struct st_worker_t *worker)
+{
+        hp_task_t *task;
+        size_t i, start;
+
+        if (pool.num_workers == 1)
+                return NULL;
+        /* xorshift; starting at a random victim spreads the thieves */
+        worker->rand_state ^= worker->rand_state << 13;
+        worker->rand_state ^= worker->rand_state >> 7;
+        worker->rand_state ^= worker->rand_state << 17;
+        start = worker->rand_state % pool.num_workers;
+        for (i = 0; i != pool.num_workers; ++i) {
+                struct st_worker_t *victim = pool.workers + (start + i) % pool.num_workers;
+                if (victim != worker && (task = deque_steal(&victim->deque)) != NULL) {
+                        __atomic_store_n(&worker->num_stolen, worker->num_stolen + 1, __ATOMIC_RELAXED);
+                        return task;
+                }
+        }
+        return NULL;
+}
+
+static void *worker_main(void *_worker)
+{
+        struct st_worker_t *worker = _worker;
+        hp_task_t *task;
+
+        self = worker;
+        while (1) {
+                if ((task = deque_take(&worker->deque)) == NULL && (task = take_submitted(worker)) == NULL &&
+                    (task = steal(worker)) == NULL) {
+                        /* a task pushed by another worker meanwhile is not waited for; that worker runs it itself if
+                           no one steals it */
+                        pthread_mutex_lock(&pool.mutex);
+                        if (pool.inject == NULL) {
+                                ++pool.num_sleeping;
+                                pthread_cond_wait(&pool.cond, &pool.mutex);
+                                --pool.num_sleeping;
+                        }
+                        pthread_mutex_unlock(&pool.mutex);
+                        continue;
+                }
+                run_task(task);
+                __atomic_store_n(&worker->num_run, worker->num_run + 1, __ATOMIC_RELAXED);
+        }
+        return NULL;
+}
+
+int hp_taskpool_start(size_t num_threads)
+{
+        size_t i;
+        int r;
+
+        if (num_threads == 0)
+                return 0;
+        if ((r = posix_memalign((void **)&pool.workers, 64, sizeof(*pool.workers) * num_threads)) != 0) {
+                errno = r;
+                return -1;
+        }
+        memset(pool.workers, 0, sizeof(*pool.workers) * num_threads);
+        for (i = 0; i != num_threads; ++i) {
+                pool.workers[i].index = i;
+                pool.workers[i].rand_state = 0x9e3779b97f4a7c15 * (i + 1);
+        }
+        /* the workers look at one another's deques, hence are counted before any starts */
+        pool.num_workers = num_threads;
+        for (i = 0; i != num_threads; ++i) {
+                if ((r = pthread_create(&pool.workers[i].tid, NULL, worker_main, pool.workers + i)) != 0) {
+                        fprintf(stderr, "[ERROR] failed to start compute thread %zu:%s\n", i, strerror(r));
+                        abort();
+                }
+        }
+        return 0;
+}
+
+void hp_task_submit(hp_loop_t *loop, hp_task_t *task)
+{
+        task->_loop = loop;
+
+        if (pool.num_workers == 0) {
+                /* no pool; completes on the next turn of the loop like a task that ran elsewhere */
+                __atomic_add_fetch(&pool.num_inline, 1, __ATOMIC_RELAXED);
+                run_task(task);
+                return;
+        }
+        pthread_mutex_lock(&pool.mutex);
+        /* under the lock, as a worker taking the inject list may still be reading the link */
+        task->_next = NULL;
+        *pool.inject_tail = task;
+        pool.inject_tail = &task->_next;
+        ++pool.num_submitted;
+        if (pool.num_sleeping != 0)
+                pthread_cond_signal(&pool.cond);
+        pthread_mutex_unlock(&pool.mutex);
+}
+
+void hp_task_spawn(hp_task_t *parent, hp_task_t *task)
+{
+        task->_loop = parent->_loop;
+        task->_next = NULL;
+
+        if (self == NULL || deque_push(&self->deque, task) != 0) {
+                __atomic_add_fetch(&pool.num_inline, 1, __ATOMIC_RELAXED);
+                run_task(task);
+                return;
+        }
+        /* unlocked peek; a sleeper that is missed wakes up with the next submission */
+        if (__atomic_load_n(&pool.num_sleeping, __ATOMIC_RELAXED) != 0)
+                pthread_cond_signal(&pool.cond);
+}
+
+void hp_taskpool_get_stats(struct st_hp_taskpool_stats_t *stats)
+{
+        size_t i;
+
+        memset(stats, 0, sizeof(*stats));
+        stats->num_threads = pool.num_workers;
+        pthread_mutex_lock(&pool.mutex);
+        stats->submitted = pool.num_submitted;
+        pthread_mutex_unlock(&pool.mutex);
+        stats->run_inline = __atomic_load_n(&pool.num_inline, __ATOMIC_RELAXED);
+        for (i = 0; i != pool.num_workers; ++i) {
+                stats->run += __atomic_load_n(&pool.workers[i].num_run, __ATOMIC_RELAXED);
+                stats->stolen += __atomic_load_n(&pool.workers[i].num_stolen, __ATOMIC_RELAXED);
+        }
+}
@@ -0,0 +1,354 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Spans of the connections sampled for tracing.  Whether a connection is traced is decided when it
+   is accepted (head-based), and the connection is then one trace: a `connection` span from accept
+   to close, a `tls_handshake` span, and for each exchange a `request` span from the first byte
+   received to the last byte written before the next request or the close, with the `handler`
+   (until it first writes) and the `write` (from then on) under it.  The loop does not know where
+   the responses of a protocol end, so what a handler writes in pieces ends at the last of them.
+
+   The timestamps are kept in the connection, and a finished span is a fixed-size record in a ring
+   of the loop, allocated when the loop is made; a full ring drops spans rather than waiting.  An
+   exporter thread empties the rings twice a second and writes the spans as OTLP/JSON (an
+   ExportTraceServiceRequest per line, as the file receiver of the OpenTelemetry collector reads)
+   to a file or to a Unix socket. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hoppang.h"
+
+#define MAX_SPANS_PER_LINE 1024
+
+/* OTLP span kinds */
+#define KIND_INTERNAL 1
+#define KIND_SERVER 2
+
+typedef struct st_hp_span_t {
+        uint64_t trace_id[2]; /* 128 random bits, as OTLP asks for */
+        uint64_t span_id;
+        uint64_t parent_id; /* 0 for the root */
+        uint64_t start_nsec; /* by hp_clock_nsec() */
+        uint64_t end_nsec;
+        const char *handler; /* of `connection` spans */
+        uint32_t kind;       /* hp_span_kind_t */
+        uint32_t thread_index;
+        uint64_t attr; /* the number of requests of a connection, the index of a request */
+} hp_span_t;
+
+struct st_hp_trace_ring_t {
+        /* the loop writes at the head and the exporter reads at the tail; apart, so that they do not share a cache line */
+        size_t head;
+        char _pad1[64 - sizeof(size_t)];
+        size_t tail;
+        char _pad2[64 - sizeof(size_t)];
+        uint64_t rand_state;
+        size_t thread_index;
+        struct st_hp_trace_stats_t stats;
+        hp_trace_ring_t *_next;
+        hp_span_t spans[HP_TRACE_RING_SIZE];
+};
+
+static const char *span_names[] = {"connection", "tls_handshake", "request", "handler", "write"};
+
+int hp_trace_enabled;
+
+static struct {
+        uint64_t threshold; /* a connection is traced if a random 64-bit number is below */
+        const char *output;
+        struct sockaddr_un sun; /* if `output` is unix:PATH */
+        int fd;
+        int64_t wall_offset; /* from hp_clock_nsec() to the time since the epoch */
+        pthread_mutex_t mutex;
+        hp_trace_ring_t *rings;
+        hp_buffer_t buf;
+} trace = {0, NULL, {0}, -1, 0, PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t next_random(hp_trace_ring_t *ring)
+{
+        /* xorshift64* */
+        uint64_t x = ring->rand_state;
+
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        ring->rand_state = x;
+        return x * 0x2545f4914f6cdd1d;
+}
+
+static void record(hp_conn_t *conn, hp_span_kind_t kind, uint64_t span_id, uint64_t parent_id, uint64_t start, uint64_t end,
+                   uint64_t attr)
+{
+        hp_trace_ring_t *ring = conn->loop->_trace_ring;
+        size_t head = ring->head;
+
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == HP_TRACE_RING_SIZE) {
+                ++ring->stats.dropped;
+                return;
+        }
+        ring->spans[head & (HP_TRACE_RING_SIZE - 1)] =
+            (hp_span_t){{conn->_trace.trace_id[0], conn->_trace.trace_id[1]}, span_id, parent_id, start, end,
+                        kind == HP_SPAN_CONNECTION ? conn->handler->name : NULL, kind, (uint32_t)ring->thread_index, attr};
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        ++ring->stats.recorded;
+}
+
+static void finish_request(hp_conn_t *conn, uint64_t now)
+{
+        hp_trace_ring_t *ring = conn->loop->_trace_ring;
+        uint64_t request_id = next_random(ring), end;
+
+        /* a response not yet written out by the close ends there */
+        end = conn->_trace.flushed_at >= conn->_trace.replied_at ? conn->_trace.flushed_at : now;
+        record(conn, HP_SPAN_REQUEST, request_id, conn->_trace.id, conn->_trace.request_at, end, conn->_trace.num_requests);
+        record(conn, HP_SPAN_HANDLER, next_random(ring), request_id, conn->_trace.request_at, conn->_trace.replied_at,
+               conn->_trace.num_requests);
+        record(conn, HP_SPAN_WRITE, next_random(ring), request_id, conn->_trace.replied_at, end, conn->_trace.num_requests);
+        ++conn->_trace.num_requests;
+        conn->_trace.request_at = 0;
+        conn->_trace.replied_at = 0;
+        conn->_trace.flushed_at = 0;
+}
+
+void hp_trace_conn_open(hp_conn_t *conn)
+{
+        hp_trace_ring_t *ring = conn->loop->_trace_ring;
+        uint64_t r = next_random(ring);
+
+        if (r >= trace.threshold)
+                return;
+        /* never 0, which means untraced */
+        conn->_trace.id = next_random(ring) | 1;
+        conn->_trace.trace_id[0] = next_random(ring);
+        conn->_trace.trace_id[1] = next_random(ring);
+        conn->_trace.accepted_at = hp_clock_nsec();
+}
+
+void hp_trace_conn_handshake(hp_conn_t *conn)
+{
+        hp_trace_ring_t *ring = conn->loop->_trace_ring;
+
+        record(conn, HP_SPAN_TLS_HANDSHAKE, next_random(ring), conn->_trace.id, conn->_trace.accepted_at, hp_clock_nsec(), 0);
+}
+
+void hp_trace_conn_data(hp_conn_t *conn)
+{
+        uint64_t now;
+
+        /* bytes that arrive before the response is written belong to the same request */
+        if (conn->_trace.request_at != 0 && (conn->_trace.replied_at == 0 || conn->_trace.flushed_at < conn->_trace.replied_at))
+                return;
+        now = hp_clock_nsec();
+        if (conn->_trace.request_at != 0)
+                finish_request(conn, now);
+        conn->_trace.request_at = now;
+}
+
+void hp_trace_conn_reply(hp_conn_t *conn)
+{
+        if (conn->_trace.request_at != 0 && conn->_trace.replied_at == 0)
+                conn->_trace.replied_at = hp_clock_nsec();
+}
+
+void hp_trace_conn_flushed(hp_conn_t *conn)
+{
+        if (conn->_trace.replied_at != 0 && hp_conn_is_flushed(conn))
+                conn->_trace.flushed_at = hp_clock_nsec();
+}
+
+void hp_trace_conn_close(hp_conn_t *conn)
+{
+        uint64_t now = hp_clock_nsec();
+
+        if (conn->_trace.replied_at != 0)
+                finish_request(conn, now);
+        record(conn, HP_SPAN_CONNECTION, conn->_trace.id, 0, conn->_trace.accepted_at, now, conn->_trace.num_requests);
+        conn->_trace.id = 0;
+}
+
+hp_trace_ring_t *hp_trace_ring_create(size_t thread_index)
+{
+        hp_trace_ring_t *ring;
+
+        if ((ring = calloc(1, sizeof(*ring))) == NULL)
+                return NULL;
+        ring->thread_index = thread_index;
+        if (getrandom(&ring->rand_state, sizeof(ring->rand_state), 0) != sizeof(ring->rand_state))
+                ring->rand_state = hp_clock_nsec() ^ (uint64_t)getpid() << 32 ^ thread_index;
+        ring->rand_state |= 1;
+        pthread_mutex_lock(&trace.mutex);
+        ring->_next = trace.rings;
+        trace.rings = ring;
+        pthread_mutex_unlock(&trace.mutex);
+        return ring;
+}
+
+const struct st_hp_trace_stats_t *hp_trace_get_stats(hp_loop_t *loop)
+{
+        return &loop->_trace_ring->stats;
+}
+
+static int append(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static int append(const char *fmt, ...)
+{
+        va_list args;
+        size_t capacity;
+        char *bytes;
+        int n;
+
+        while (1) {
+                va_start(args, fmt);
+                n = vsnprintf(trace.buf.bytes + trace.buf.size, trace.buf.capacity - trace.buf.size, fmt, args);
+                va_end(args);
+                if (n < 0)
+                        return -1;
+                if ((size_t)n < trace.buf.capacity - trace.buf.size)
+                        break;
+                capacity = trace.buf.capacity != 0 ? trace.buf.capacity * 2 : 65536;
+                if ((bytes = realloc(trace.buf.bytes, capacity)) == NULL)
+                        return -1;
+                trace.buf.bytes = bytes;
+                trace.buf.capacity = capacity;
+        }
+        trace.buf.size += n;
+        return 0;
+}
+
+static void append_span(const hp_span_t *span, int first)
+{
+        append("%s{\"traceId\":\"%016" PRIx64 "%016" PRIx64 "\",\"spanId\":\"%016" PRIx64 "\"", first ? "" : ",",
+               span->trace_id[0], span->trace_id[1], span->span_id);
+        if (span->parent_id != 0)
+                append(",\"parentSpanId\":\"%016" PRIx64 "\"", span->parent_id);
+        append(",\"name\":\"%s\",\"kind\":%d,\"startTimeUnixNano\":\"%" PRIu64 "\",\"endTimeUnixNano\":\"%" PRIu64 "\"",
+               span_names[span->kind], span->kind == HP_SPAN_CONNECTION ? KIND_SERVER : KIND_INTERNAL,
+               span->start_nsec + trace.wall_offset, span->end_nsec + trace.wall_offset);
+        if (span->kind == HP_SPAN_CONNECTION) {
+                append(",\"attributes\":[{\"key\":\"hoppang.handler\",\"value\":{\"stringValue\":\"%s\"}},"
+                       "{\"key\":\"hoppang.thread\",\"value\":{\"intValue\":\"%" PRIu32 "\"}},"
+                       "{\"key\":\"hoppang.requests\",\"value\":{\"intValue\":\"%" PRIu64 "\"}}]}",
+                       span->handler, span->thread_index, span->attr);
+        } else if (span->kind == HP_SPAN_TLS_HANDSHAKE) {
+                append("}");
+        } else {
+                append(",\"attributes\":[{\"key\":\"hoppang.request\",\"value\":{\"intValue\":\"%" PRIu64 "\"}}]}", span->attr);
+        }
+}
+
+static int open_output(void)
+{
+        if (trace.sun.sun_family == AF_UNIX) {
+                if ((trace.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+                        return -1;
+                if (connect(trace.fd, (struct sockaddr *)&trace.sun, sizeof(trace.sun)) != 0) {
+                        close(trace.fd);
+                        trace.fd = -1;
+                        return -1;
+                }
+        } else if ((trace.fd = open(trace.output, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+                return -1;
+        }
+        return 0;
+}
+
+/* one write per line, so that the processes appending to the same file do not interleave */
+static void write_line(void)
+{
+        size_t off = 0;
+        ssize_t r;
+
+        /* a collector that is not listening misses the spans; it is retried with the next line */
+        if (trace.fd == -1 && open_output() != 0)
+                return;
+        while (off != trace.buf.size) {
+                if (trace.sun.sun_family == AF_UNIX) {
+                        r = send(trace.fd, trace.buf.bytes + off, trace.buf.size - off, MSG_NOSIGNAL);
+                } else {
+                        r = write(trace.fd, trace.buf.bytes + off, trace.buf.size - off);
+                }
+                if (r == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        close(trace.fd);
+                        trace.fd = -1;
+                        return;
+                }
+                off += r;
+        }
+}
+
+void hp_trace_export(void)
+{
+        hp_trace_ring_t *ring;
+        size_t tail, head, n;
+
+        pthread_mutex_lock(&trace.mutex);
+        for (ring = trace.rings; ring != NULL; ring = ring->_next) {
+                tail = ring->tail;
+                head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+                while (tail != head) {
+                        trace.buf.size = 0;
+                        append("{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+                               "{\"key\":\"service.name\",\"value\":{\"stringValue\":\"hoppang\"}},"
+                               "{\"key\":\"process.pid\",\"value\":{\"intValue\":\"%d\"}}]},"
+                               "\"scopeSpans\":[{\"scope\":{\"name\":\"hoppang\",\"version\":\"" PROG_VERSION "\"},\"spans\":[",
+                               (int)getpid());
+                        for (n = 0; tail != head && n != MAX_SPANS_PER_LINE; ++tail, ++n)
+                                append_span(ring->spans + (tail & (HP_TRACE_RING_SIZE - 1)), n == 0);
+                        /* the slots may be reused once the spans are formatted */
+                        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+                        if (append("]}]}]}\n") == 0)
+                                write_line();
+                }
+        }
+        pthread_mutex_unlock(&trace.mutex);
+}
+
+static void *exporter_main(void *unused)
+{
+        struct timespec interval = {HP_TRACE_EXPORT_INTERVAL / 1000, HP_TRACE_EXPORT_INTERVAL % 1000 * 1000000};
+
+        while (1) {
+                nanosleep(&interval, NULL);
+                hp_trace_export();
+        }
+        return NULL;
+}
+
+int hp_trace_init(const char *output, double ratio)
+{
+        struct timespec ts;
+        pthread_t tid;
+
+        trace.threshold = ratio >= 1 ? UINT64_MAX : (uint64_t)(ratio * 18446744073709551616.0);
+        trace.output = output;
+        if (strncmp(output, "unix:", 5) == 0) {
+                if (strlen(output + 5) >= sizeof(trace.sun.sun_path)) {
+                        errno = ENAMETOOLONG;
+                        return -1;
+                }
+                trace.sun.sun_family = AF_UNIX;
+                strcpy(trace.sun.sun_path, output + 5);
+        } else if (open_output() != 0) {
+                return -1;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        trace.wall_offset = (int64_t)((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) - (int64_t)hp_clock_nsec();
+        if ((errno = pthread_create(&tid, NULL, exporter_main, NULL)) != 0)
+                return -1;
+        hp_trace_enabled = 1;
+        return 0;
+}
@@ -0,0 +1,300 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* UDP listeners.  Every loop binds a socket of its own to the address of the listener, and
+   SO_REUSEPORT spreads the peers over them by hash, so that no two threads touch one socket.  A
+   readable socket is drained a batch at a time with recvmmsg, and the replies queued while the
+   handler looks at the batch leave with one sendmmsg.  UDP_GRO lets the kernel deliver a run of
+   datagrams from one peer as one, and UDP_SEGMENT lets us send a run of equal-sized ones as one,
+   which is where most of the per-packet cost goes. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "hoppang.h"
+
+#define RECV_SLOT_SIZE 65536 /* room for what GRO coalesces */
+#define SEND_BUF_SIZE (HP_UDP_BATCH * 2048)
+#define MAX_GSO_SEGMENTS 64 /* UDP_MAX_SEGMENTS of the kernel */
+#define MAX_BATCHES_PER_EVENT 4
+
+struct st_hp_udp_batch_t {
+        /* receiving */
+        struct mmsghdr rmsgs[HP_UDP_BATCH];
+        struct iovec riov[HP_UDP_BATCH];
+        union {
+                char buf[CMSG_SPACE(sizeof(int))];
+                struct cmsghdr align;
+        } rcmsg[HP_UDP_BATCH];
+        hp_datagram_t datagrams[HP_UDP_BATCH];
+        char *rbuf;
+        /* sending; the payloads are laid out back to back in `sbuf`, so that a GSO run is one iovec */
+        struct mmsghdr smsgs[HP_UDP_BATCH];
+        struct iovec siov[HP_UDP_BATCH];
+        union {
+                char buf[CMSG_SPACE(sizeof(uint16_t))];
+                struct cmsghdr align;
+        } scmsg[HP_UDP_BATCH];
+        struct sockaddr_storage speers[HP_UDP_BATCH];
+        size_t ssegment[HP_UDP_BATCH];  /* length of the first datagram of the message */
+        size_t nsegments[HP_UDP_BATCH]; /* datagrams in the message */
+        size_t num_sends;
+        char sbuf[SEND_BUF_SIZE];
+        size_t sbuf_used;
+};
+
+static void on_udp_event(hp_loop_t *loop, hp_watcher_t *watcher, uint32_t revents);
+
+hp_udp_t *hp_udp_open(hp_loop_t *loop, hp_listener_t *listener)
+{
+        hp_udp_t *udp;
+        struct st_hp_udp_batch_t *b;
+        size_t i;
+        int fd, flag = 1;
+
+        if ((fd = socket(listener->addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP)) == -1)
+                goto Error;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) != 0)
+                goto Error;
+        if (listener->addr.ss_family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag)) != 0)
+                goto Error;
+        if (bind(fd, (struct sockaddr *)&listener->addr, listener->addrlen) != 0)
+                goto Error;
+        /* older kernels lack it; datagrams then come one by one */
+        if (listener->udp_gro && setsockopt(fd, IPPROTO_UDP, UDP_GRO, &flag, sizeof(flag)) != 0)
+                fprintf(stderr, "[WARN] UDP_GRO is not available:%s\n", strerror(errno));
+
+        if ((udp = calloc(1, sizeof(*udp))) == NULL || (udp->_batch = b = calloc(1, sizeof(*b))) == NULL) {
+                free(udp);
+                goto Error;
+        }
+        /* the pages of a slot are only touched as far as the datagrams reach */
+        if ((b->rbuf = malloc((size_t)HP_UDP_BATCH * RECV_SLOT_SIZE)) == NULL) {
+                free(b);
+                free(udp);
+                goto Error;
+        }
+        for (i = 0; i != HP_UDP_BATCH; ++i) {
+                b->riov[i] = (struct iovec){b->rbuf + i * RECV_SLOT_SIZE, RECV_SLOT_SIZE};
+                b->rmsgs[i].msg_hdr.msg_iov = b->riov + i;
+                b->rmsgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        udp->watcher = (hp_watcher_t){fd, EPOLLIN, on_udp_event};
+        udp->loop = loop;
+        udp->listener = listener;
+        udp->gso = listener->udp_gso;
+        if (hp_loop_add_watcher(loop, &udp->watcher) != 0) {
+                free(b->rbuf);
+                free(b);
+                free(udp);
+                goto Error;
+        }
+        return udp;
+
+Error:
+        perror("failed to open UDP socket");
+        if (fd != -1)
+                close(fd);
+        return NULL;
+}
+
+static size_t read_batch(hp_udp_t *udp)
+{
+        struct st_hp_udp_batch_t *b = udp->_batch;
+        struct cmsghdr *cmsg;
+        size_t i, num_datagrams = 0;
+        int n, segment_size;
+
+        for (i = 0; i != HP_UDP_BATCH; ++i) {
+                b->rmsgs[i].msg_hdr.msg_name = &b->datagrams[i].peer;
+                b->rmsgs[i].msg_hdr.msg_namelen = sizeof(b->datagrams[i].peer);
+                b->rmsgs[i].msg_hdr.msg_control = b->rcmsg[i].buf;
+                b->rmsgs[i].msg_hdr.msg_controllen = sizeof(b->rcmsg[i].buf);
+                b->rmsgs[i].msg_hdr.msg_flags = 0;
+        }
+        while ((n = recvmmsg(udp->watcher.fd, b->rmsgs, HP_UDP_BATCH, MSG_DONTWAIT, NULL)) == -1 && errno == EINTR)
+                ;
+        if (n <= 0)
+                return 0;
+
+        for (i = 0; i != (size_t)n; ++i) {
+                hp_datagram_t *d = b->datagrams + i;
+                d->data = hp_iovec_init(b->riov[i].iov_base, b->rmsgs[i].msg_len);
+                d->peerlen = b->rmsgs[i].msg_hdr.msg_namelen;
+                d->segment_size = d->data.len;
+                for (cmsg = CMSG_FIRSTHDR(&b->rmsgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&b->rmsgs[i].msg_hdr, cmsg)) {
+                        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+                                memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+                                d->segment_size = segment_size;
+                        }
+                }
+                udp->loop->num_datagrams_received +=
+                    d->data.len > d->segment_size ? (d->data.len + d->segment_size - 1) / d->segment_size : 1;
+                /* larger than a slot, hence not GRO; the bytes are gone */
+                if ((b->rmsgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0) {
+                        ++udp->loop->num_datagrams_dropped;
+                        continue;
+                }
+                /* compacts the batch over the truncated ones; the data stays in its slot */
+                if (num_datagrams != i)
+                        b->datagrams[num_datagrams] = *d;
+                ++num_datagrams;
+        }
+        return num_datagrams;
+}
+
+static void on_udp_event(hp_loop_t *loop, hp_watcher_t *watcher, uint32_t revents)
+{
+        hp_udp_t *udp = HP_STRUCT_FROM_MEMBER(hp_udp_t, watcher, watcher);
+        size_t num_batches = MAX_BATCHES_PER_EVENT, n;
+
+        do {
+                if ((n = read_batch(udp)) != 0)
+                        udp->listener->handler->on_datagrams(udp, udp->_batch->datagrams, n);
+                hp_udp_flush(udp);
+        } while (n == HP_UDP_BATCH && --num_batches != 0);
+}
+
+int hp_udp_send(hp_udp_t *udp, const struct sockaddr *peer, socklen_t peerlen, const void *payload, size_t len)
+{
+        struct st_hp_udp_batch_t *b = udp->_batch;
+        size_t i;
+
+        if (len > HP_UDP_MAX_PAYLOAD || len > SEND_BUF_SIZE) {
+                ++udp->loop->num_datagrams_dropped;
+                return -1;
+        }
+
+        /* extends the last message if it is a run to the same peer that this datagram can close or continue */
+        if (udp->gso && b->num_sends != 0) {
+                i = b->num_sends - 1;
+                if (b->ssegment[i] != 0 && b->siov[i].iov_len % b->ssegment[i] == 0 && len <= b->ssegment[i] && b->nsegments[i] < MAX_GSO_SEGMENTS &&
+                    b->siov[i].iov_len + len <= HP_UDP_MAX_PAYLOAD && b->sbuf_used + len <= SEND_BUF_SIZE &&
+                    b->smsgs[i].msg_hdr.msg_namelen == peerlen && memcmp(b->speers + i, peer, peerlen) == 0) {
+                        memcpy(b->sbuf + b->sbuf_used, payload, len);
+                        b->sbuf_used += len;
+                        b->siov[i].iov_len += len;
+                        ++b->nsegments[i];
+                        return 0;
+                }
+        }
+
+        if (b->num_sends == HP_UDP_BATCH || b->sbuf_used + len > SEND_BUF_SIZE)
+                hp_udp_flush(udp);
+        i = b->num_sends++;
+        memcpy(b->sbuf + b->sbuf_used, payload, len);
+        b->siov[i] = (struct iovec){b->sbuf + b->sbuf_used, len};
+        b->sbuf_used += len;
+        memcpy(b->speers + i, peer, peerlen);
+        memset(&b->smsgs[i], 0, sizeof(b->smsgs[i]));
+        b->smsgs[i].msg_hdr.msg_name = b->speers + i;
+        b->smsgs[i].msg_hdr.msg_namelen = peerlen;
+        b->smsgs[i].msg_hdr.msg_iov = b->siov + i;
+        b->smsgs[i].msg_hdr.msg_iovlen = 1;
+        /* an empty datagram cannot start a run */
+        b->ssegment[i] = len;
+        b->nsegments[i] = 1;
+        return 0;
+}
+
+/* a run that the kernel would not segment, e.g. for being larger than the MTU of the route, goes out datagram by datagram */
+static void send_segments(hp_udp_t *udp, size_t i)
+{
+        struct st_hp_udp_batch_t *b = udp->_batch;
+        struct msghdr *msg = &b->smsgs[i].msg_hdr;
+        size_t off, len;
+        ssize_t r;
+
+        for (off = 0; off < b->siov[i].iov_len; off += len) {
+                len = b->siov[i].iov_len - off < b->ssegment[i] ? b->siov[i].iov_len - off : b->ssegment[i];
+                while ((r = sendto(udp->watcher.fd, (char *)b->siov[i].iov_base + off, len, MSG_DONTWAIT, msg->msg_name,
+                                   msg->msg_namelen)) == -1 &&
+                       errno == EINTR)
+                        ;
+                if (r == -1) {
+                        ++udp->loop->num_datagrams_dropped;
+                } else {
+                        ++udp->loop->num_datagrams_sent;
+                }
+        }
+}
+
+void hp_udp_flush(hp_udp_t *udp)
+{
+        struct st_hp_udp_batch_t *b = udp->_batch;
+        struct cmsghdr *cmsg;
+        uint16_t segment_size;
+        size_t i, sent = 0;
+        int n;
+
+        if (b->num_sends == 0)
+                return;
+        for (i = 0; i != b->num_sends; ++i) {
+                if (b->nsegments[i] == 1)
+                        continue;
+                b->smsgs[i].msg_hdr.msg_control = b->scmsg[i].buf;
+                b->smsgs[i].msg_hdr.msg_controllen = sizeof(b->scmsg[i].buf);
+                cmsg = CMSG_FIRSTHDR(&b->smsgs[i].msg_hdr);
+                cmsg->cmsg_level = IPPROTO_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(segment_size));
+                segment_size = (uint16_t)b->ssegment[i];
+                memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+        }
+
+        while (sent != b->num_sends) {
+                if ((n = sendmmsg(udp->watcher.fd, b->smsgs + sent, b->num_sends - sent, MSG_DONTWAIT)) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (b->nsegments[sent] != 1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                                /* the device cannot checksum what it would segment; no more runs on this socket */
+                                if (errno == EIO && udp->gso) {
+                                        fprintf(stderr, "[WARN] UDP_SEGMENT refused; sending datagrams one by one\n");
+                                        udp->gso = 0;
+                                }
+                                send_segments(udp, sent);
+                        } else {
+                                /* a full socket buffer drops like the network would */
+                                udp->loop->num_datagrams_dropped += b->nsegments[sent];
+                        }
+                        ++sent;
+                        continue;
+                }
+                for (; n != 0; --n, ++sent)
+                        udp->loop->num_datagrams_sent += b->nsegments[sent];
+        }
+        b->num_sends = 0;
+        b->sbuf_used = 0;
+}
+
+static void on_echo_datagrams(hp_udp_t *udp, hp_datagram_t *datagrams, size_t cnt)
+{
+        size_t i, off, len;
+
+        for (i = 0; i != cnt; ++i) {
+                hp_datagram_t *d = datagrams + i;
+                if (d->data.len == 0) {
+                        hp_udp_send(udp, (struct sockaddr *)&d->peer, d->peerlen, "", 0);
+                        continue;
+                }
+                for (off = 0; off < d->data.len; off += len) {
+                        len = d->data.len - off < d->segment_size ? d->data.len - off : d->segment_size;
+                        hp_udp_send(udp, (struct sockaddr *)&d->peer, d->peerlen, d->data.base + off, len);
+                }
+        }
+}
+
+void hp_udp_register_echo(void)
+{
+        static hp_handler_t echo = {"udp-echo", NULL, NULL, NULL, NULL, on_echo_datagrams, NULL};
+
+        hp_register_handler(&echo);
+}
@@ -0,0 +1,309 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Connections to the backends, owned by one loop.  A request leases a connection for as long as
+   it needs it, then returns it to the idle list of its backend, where the next request picks it
+   up without a new handshake.  Each backend is capped at `max_conns`; the request goes to the
+   backend with the fewest outstanding requests among those that can take it, and waits in a
+   FIFO when none can.  A backend that fails to accept a connection is skipped for a while, and
+   the request moves on to another one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hoppang.h"
+
+#define BACKEND_DOWN_INTERVAL 1000 /* in milliseconds */
+
+struct st_upstream_conn_t;
+
+struct st_hp_upstream_backend_t {
+        hp_upstream_t *upstream;
+        struct st_upstream_conn_t *idle; /* LIFO, so that the connections in use stay few and warm */
+        size_t num_conns;
+        size_t num_outstanding;
+        uint64_t down_until;
+};
+
+struct st_upstream_conn_t {
+        hp_conn_t *conn;
+        hp_upstream_pool_t *pool;
+        struct st_hp_upstream_backend_t *backend;
+        hp_upstream_req_t *req; /* NULL unless leased */
+        int is_idle;
+        struct st_upstream_conn_t *prev_idle;
+        struct st_upstream_conn_t *next_idle;
+};
+
+static void serve_queue(hp_upstream_pool_t *pool);
+static void submit(hp_upstream_pool_t *pool, hp_upstream_req_t *req, int bypass_queue);
+
+static void idle_push(struct st_upstream_conn_t *uc)
+{
+        struct st_hp_upstream_backend_t *backend = uc->backend;
+
+        uc->prev_idle = NULL;
+        uc->next_idle = backend->idle;
+        if (backend->idle != NULL)
+                backend->idle->prev_idle = uc;
+        backend->idle = uc;
+        uc->is_idle = 1;
+}
+
+static void idle_unlink(struct st_upstream_conn_t *uc)
+{
+        if (uc->prev_idle != NULL) {
+                uc->prev_idle->next_idle = uc->next_idle;
+        } else {
+                uc->backend->idle = uc->next_idle;
+        }
+        if (uc->next_idle != NULL)
+                uc->next_idle->prev_idle = uc->prev_idle;
+        uc->is_idle = 0;
+}
+
+static int on_upstream_connect(hp_conn_t *conn)
+{
+        struct st_upstream_conn_t *uc = conn->data;
+        hp_upstream_req_t *req = uc->req;
+
+        if (req == NULL) {
+                /* the request went away while connecting; keep the connection for the next one */
+                idle_push(uc);
+                serve_queue(uc->pool);
+                return 0;
+        }
+        req->on_connect(req, conn);
+        return 0;
+}
+
+static void on_connect_error(hp_upstream_pool_t *pool, struct st_hp_upstream_backend_t *backend, hp_upstream_req_t *req)
+{
+        ++pool->stats.connect_errors;
+        if (backend->down_until <= pool->loop->now)
+                fprintf(stderr, "[WARN] failed to connect to upstream %s; skipping it for %d ms\n", backend->upstream->name,
+                        BACKEND_DOWN_INTERVAL);
+        backend->down_until = pool->loop->now + BACKEND_DOWN_INTERVAL;
+        /* nothing has been sent yet; it is safe to go elsewhere */
+        submit(pool, req, 1);
+}
+
+static ssize_t on_upstream_read(hp_conn_t *conn, hp_iovec_t input)
+{
+        struct st_upstream_conn_t *uc = conn->data;
+
+        /* an idle connection has nothing to say */
+        if (uc->req == NULL)
+                return -1;
+        return uc->req->on_read(uc->req, conn, input);
+}
+
+static void on_upstream_close(hp_conn_t *conn)
+{
+        struct st_upstream_conn_t *uc = conn->data;
+        hp_upstream_pool_t *pool = uc->pool;
+        hp_upstream_req_t *req = uc->req;
+
+        --uc->backend->num_conns;
+        if (uc->is_idle)
+                idle_unlink(uc);
+        if (req != NULL) {
+                --uc->backend->num_outstanding;
+                req->_lease = NULL;
+                if (conn->connecting) {
+                        on_connect_error(pool, uc->backend, req);
+                } else {
+                        req->on_close(req);
+                }
+        }
+        free(uc);
+
+        /* a slot has opened */
+        serve_queue(pool);
+}
+
+static hp_handler_t upstream_handler = {"upstream", on_upstream_connect, on_upstream_read, on_upstream_close, NULL, NULL,
+                                        NULL};
+
+static void update_queue_timer(hp_upstream_pool_t *pool)
+{
+        hp_upstream_req_t *head = pool->_queue._next;
+        uint64_t now = pool->loop->now;
+
+        hp_timer_unlink(&pool->_queue_timer);
+        if (head != &pool->_queue)
+                hp_timer_link(pool->loop, &pool->_queue_timer, head->_deadline > now ? head->_deadline - now : 0);
+}
+
+static void queue_unlink(hp_upstream_req_t *req)
+{
+        req->_prev->_next = req->_next;
+        req->_next->_prev = req->_prev;
+        req->_prev = req->_next = NULL;
+}
+
+static void on_queue_timeout(hp_loop_t *loop, hp_timer_t *timer)
+{
+        hp_upstream_pool_t *pool = HP_STRUCT_FROM_MEMBER(hp_upstream_pool_t, _queue_timer, timer);
+        hp_upstream_req_t *req;
+
+        /* all requests wait for the same duration, hence the queue is ordered by deadline */
+        while ((req = pool->_queue._next) != &pool->_queue && req->_deadline <= loop->now) {
+                queue_unlink(req);
+                ++pool->stats.timeouts;
+                req->on_connect(req, NULL);
+        }
+        update_queue_timer(pool);
+}
+
+int hp_upstream_pool_init(hp_upstream_pool_t *pool, hp_loop_t *loop, hp_upstream_t *upstreams, size_t num_upstreams,
+                          size_t max_conns, uint64_t queue_timeout)
+{
+        size_t i;
+
+        memset(pool, 0, sizeof(*pool));
+        if ((pool->backends = calloc(num_upstreams, sizeof(pool->backends[0]))) == NULL)
+                return -1;
+        for (i = 0; i != num_upstreams; ++i)
+                pool->backends[i].upstream = upstreams + i;
+        pool->loop = loop;
+        pool->num_backends = num_upstreams;
+        pool->max_conns = max_conns;
+        pool->queue_timeout = queue_timeout;
+        pool->_queue._prev = pool->_queue._next = &pool->_queue;
+        pool->_queue_timer.cb = on_queue_timeout;
+        return 0;
+}
+
+static struct st_hp_upstream_backend_t *pick_backend(hp_upstream_pool_t *pool)
+{
+        struct st_hp_upstream_backend_t *best = NULL, *backend;
+        size_t i;
+
+        for (i = 0; i != pool->num_backends; ++i) {
+                backend = pool->backends + i;
+                if (backend->idle == NULL && (backend->num_conns >= pool->max_conns || backend->down_until > pool->loop->now))
+                        continue;
+                /* on a tie, prefer the one that does not need a new connection */
+                if (best == NULL || backend->num_outstanding < best->num_outstanding ||
+                    (backend->num_outstanding == best->num_outstanding && backend->idle != NULL && best->idle == NULL))
+                        best = backend;
+        }
+        return best;
+}
+
+static int all_down(hp_upstream_pool_t *pool)
+{
+        size_t i;
+
+        for (i = 0; i != pool->num_backends; ++i)
+                if (pool->backends[i].down_until <= pool->loop->now || pool->backends[i].idle != NULL)
+                        return 0;
+        return 1;
+}
+
+static void dispatch(hp_upstream_pool_t *pool, struct st_hp_upstream_backend_t *backend, hp_upstream_req_t *req)
+{
+        struct st_upstream_conn_t *uc;
+
+        if ((uc = backend->idle) != NULL) {
+                idle_unlink(uc);
+                uc->req = req;
+                req->_lease = uc;
+                req->reused = 1;
+                ++backend->num_outstanding;
+                ++pool->stats.reuses;
+                req->on_connect(req, uc->conn);
+                return;
+        }
+
+        if ((uc = calloc(1, sizeof(*uc))) == NULL ||
+            (uc->conn = hp_conn_connect(pool->loop, (struct sockaddr *)&backend->upstream->addr, backend->upstream->addrlen,
+                                        &upstream_handler, uc)) == NULL) {
+                free(uc);
+                on_connect_error(pool, backend, req);
+                return;
+        }
+        uc->pool = pool;
+        uc->backend = backend;
+        uc->req = req;
+        req->_lease = uc;
+        req->reused = 0;
+        ++backend->num_conns;
+        ++backend->num_outstanding;
+        ++pool->stats.connects;
+}
+
+static void serve_queue(hp_upstream_pool_t *pool)
+{
+        struct st_hp_upstream_backend_t *backend;
+        hp_upstream_req_t *req;
+
+        while ((req = pool->_queue._next) != &pool->_queue && (backend = pick_backend(pool)) != NULL) {
+                queue_unlink(req);
+                dispatch(pool, backend, req);
+        }
+        update_queue_timer(pool);
+}
+
+static void submit(hp_upstream_pool_t *pool, hp_upstream_req_t *req, int bypass_queue)
+{
+        struct st_hp_upstream_backend_t *backend;
+
+        req->_lease = NULL;
+        req->_prev = req->_next = NULL;
+        if ((bypass_queue || pool->_queue._next == &pool->_queue) && (backend = pick_backend(pool)) != NULL) {
+                dispatch(pool, backend, req);
+                return;
+        }
+        /* waiting is pointless if no backend is reachable */
+        if (all_down(pool)) {
+                req->on_connect(req, NULL);
+                return;
+        }
+        req->_deadline = pool->loop->now + pool->queue_timeout;
+        req->_prev = pool->_queue._prev;
+        req->_next = &pool->_queue;
+        pool->_queue._prev->_next = req;
+        pool->_queue._prev = req;
+        ++pool->stats.queued;
+        if (!hp_timer_is_linked(&pool->_queue_timer))
+                update_queue_timer(pool);
+}
+
+void hp_upstream_acquire(hp_upstream_pool_t *pool, hp_upstream_req_t *req)
+{
+        /* the ones already waiting go first */
+        submit(pool, req, 0);
+}
+
+void hp_upstream_cancel(hp_upstream_pool_t *pool, hp_upstream_req_t *req)
+{
+        struct st_upstream_conn_t *uc;
+
+        if (req->_next != NULL) {
+                queue_unlink(req);
+                update_queue_timer(pool);
+        } else if ((uc = req->_lease) != NULL) {
+                /* still connecting; the connection becomes idle once established */
+                uc->req = NULL;
+                --uc->backend->num_outstanding;
+                req->_lease = NULL;
+        }
+}
+
+void hp_upstream_release(hp_upstream_pool_t *pool, hp_conn_t *conn, int reusable)
+{
+        struct st_upstream_conn_t *uc = conn->data;
+
+        uc->req->_lease = NULL;
+        uc->req = NULL;
+        --uc->backend->num_outstanding;
+        if (!reusable || conn->closing) {
+                /* the slot is given to the queue once the connection is disposed */
+                hp_conn_close(conn);
+                return;
+        }
+        idle_push(uc);
+        serve_queue(pool);
+}
@@ -0,0 +1,199 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Attaches the deny-list to a listener on 127.0.0.1 and connects to it from 127.0.0.2, which is
+   denied, and from 127.0.0.1, which is not: the first connect must not complete while the second
+   must, and must carry data past the filter the accepted socket inherits.  Emptying the list must
+   let 127.0.0.2 in again.  Each case runs in a child of its own, as the mode of the filter is
+   chosen once per process: once without the capabilities eBPF needs, which forces the classic filter,
+   and once as is, which is expected to load eBPF.  Exits with 77 if eBPF is not available, after
+   checking the classic filter all the same. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/capability.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "hoppang.h"
+
+#define EXIT_SKIP 77
+#define SYN_WAIT 500 /* in milliseconds; a dropped SYN is not sent again within a second */
+
+static int listen_fd;
+static struct sockaddr_in listen_addr;
+
+static int connect_from(const char *src)
+{
+        struct sockaddr_in addr;
+        int fd;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        inet_pton(AF_INET, src, &addr.sin_addr);
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                perror("failed to bind the client socket");
+                exit(1);
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        if (connect(fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) != 0 && errno != EINPROGRESS) {
+                perror("connect");
+                exit(1);
+        }
+        return fd;
+}
+
+/* returns whether the handshake completes within SYN_WAIT */
+static int handshake_completes(int fd)
+{
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        int error = 0;
+        socklen_t len = sizeof(error);
+
+        if (poll(&pfd, 1, SYN_WAIT) != 1)
+                return 0;
+        return getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0;
+}
+
+static void expect_allowed(const char *src)
+{
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        char buf[5];
+        int fd, accepted;
+
+        fd = connect_from(src);
+        if (!handshake_completes(fd) || poll(&pfd, 1, SYN_WAIT) != 1 || (accepted = accept(listen_fd, NULL, NULL)) == -1) {
+                fprintf(stderr, "[ERROR] connection from %s was not accepted\n", src);
+                exit(1);
+        }
+        if (write(fd, "ping", 4) != 4 || (pfd.fd = accepted, poll(&pfd, 1, SYN_WAIT)) != 1 || read(accepted, buf, 5) != 4) {
+                fprintf(stderr, "[ERROR] data from %s did not get through\n", src);
+                exit(1);
+        }
+        close(accepted);
+        close(fd);
+}
+
+static void expect_denied(const char *src)
+{
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        int fd;
+
+        fd = connect_from(src);
+        if (handshake_completes(fd)) {
+                fprintf(stderr, "[ERROR] connection from %s completed\n", src);
+                exit(1);
+        }
+        close(fd);
+        if (poll(&pfd, 1, 0) != 0) {
+                fprintf(stderr, "[ERROR] connection from %s was queued for accept\n", src);
+                exit(1);
+        }
+}
+
+/* loading eBPF takes CAP_BPF, or CAP_SYS_ADMIN on kernels that predate it */
+static void drop_bpf_capabilities(void)
+{
+        struct __user_cap_header_struct header = {_LINUX_CAPABILITY_VERSION_3, 0};
+        struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+
+        if (syscall(SYS_capget, &header, data) != 0) {
+                perror("capget");
+                exit(1);
+        }
+        data[CAP_TO_INDEX(CAP_BPF)].effective &= ~CAP_TO_MASK(CAP_BPF);
+        data[CAP_TO_INDEX(CAP_SYS_ADMIN)].effective &= ~CAP_TO_MASK(CAP_SYS_ADMIN);
+        if (syscall(SYS_capset, &header, data) != 0) {
+                perror("capset");
+                exit(1);
+        }
+}
+
+static int run(int classic)
+{
+        hp_addr_range_t range;
+        socklen_t addrlen = sizeof(listen_addr);
+
+        if (classic)
+                drop_bpf_capabilities();
+
+        memset(&listen_addr, 0, sizeof(listen_addr));
+        listen_addr.sin_family = AF_INET;
+        listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+            bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) != 0 || listen(listen_fd, 16) != 0 ||
+            getsockname(listen_fd, (struct sockaddr *)&listen_addr, &addrlen) != 0) {
+                perror("failed to listen on loopback");
+                return 1;
+        }
+        if (hp_sockfilter_set_listeners(&listen_fd, 1) != 0 || hp_parse_addr_range("127.0.0.2/32", &range) != 0 ||
+            hp_sockfilter_update(&range, 1) != 0) {
+                fprintf(stderr, "[ERROR] failed to set up the deny-list\n");
+                return 1;
+        }
+
+        expect_denied("127.0.0.2");
+        /* only the eBPF program counts */
+        if (!classic && hp_sockfilter_num_dropped() == 0)
+                return EXIT_SKIP;
+        if (classic && hp_sockfilter_num_dropped() != 0) {
+                fprintf(stderr, "[ERROR] eBPF was loaded without CAP_BPF\n");
+                return 1;
+        }
+        expect_allowed("127.0.0.1");
+
+        if (hp_sockfilter_update(NULL, 0) != 0) {
+                fprintf(stderr, "[ERROR] failed to empty the deny-list\n");
+                return 1;
+        }
+        expect_allowed("127.0.0.2");
+
+        fprintf(stderr, "[INFO] %s filter drops SYNs from a denied range\n", classic ? "classic" : "eBPF");
+        return 0;
+}
+
+static int run_in_child(int classic)
+{
+        pid_t pid;
+        int status;
+
+        if ((pid = fork()) == -1) {
+                perror("fork");
+                exit(1);
+        }
+        if (pid == 0)
+                _exit(run(classic));
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+                return 1;
+        return WEXITSTATUS(status);
+}
+
+int main(void)
+{
+        struct sockaddr_in addr;
+        int fd, ret;
+
+        /* the test needs a second loopback address to be denied */
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        inet_pton(AF_INET, "127.0.0.2", &addr.sin_addr);
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                fprintf(stderr, "[INFO] cannot bind to 127.0.0.2; skipping\n");
+                return EXIT_SKIP;
+        }
+        close(fd);
+
+        if ((ret = run_in_child(1)) != 0)
+                return ret;
+        if ((ret = run_in_child(0)) == EXIT_SKIP)
+                fprintf(stderr, "[INFO] eBPF is not available; only the classic filter was checked\n");
+        return ret;
+}
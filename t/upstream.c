@@ -0,0 +1,285 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Runs the `proxy` handler of the binary given as the argument in front of a blocking upstream on
+   loopback, and checks the upstream pool through it: that the responses of pipelined requests come
+   back in the order of the requests when the upstream answers them out of order, that a request is
+   sent again when the upstream closes a reused connection upon receiving it, and that a request
+   waiting for a connection gives up after the queue timeout.  The payload of a frame tells the
+   upstream what to do with it. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define MAX_CONNS 3
+#define QUEUE_TIMEOUT 200 /* in milliseconds */
+#define MAX_PAYLOAD 256
+
+static pid_t proxy_pid;
+static int num_close_once; /* times the upstream has seen a "close-once" request */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_msec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* a failing check exits; the proxy must not outlive it, or whoever waits for its output keeps waiting */
+static void stop_proxy(void)
+{
+        if (proxy_pid > 0) {
+                kill(proxy_pid, SIGTERM);
+                waitpid(proxy_pid, NULL, 0);
+        }
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+        ssize_t r;
+
+        while (len != 0) {
+                if ((r = read(fd, buf, len)) <= 0) {
+                        if (r == -1 && errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                buf = (char *)buf + r;
+                len -= r;
+        }
+        return 0;
+}
+
+static int write_frame(int fd, const char *payload, size_t len)
+{
+        char buf[4 + MAX_PAYLOAD];
+
+        buf[0] = (char)(len >> 24);
+        buf[1] = (char)(len >> 16);
+        buf[2] = (char)(len >> 8);
+        buf[3] = (char)len;
+        memcpy(buf + 4, payload, len);
+        return write(fd, buf, 4 + len) == (ssize_t)(4 + len) ? 0 : -1;
+}
+
+/* returns the length of the payload, or -1 on EOF or error */
+static ssize_t read_frame(int fd, char *payload)
+{
+        unsigned char header[4];
+        size_t len;
+
+        if (read_full(fd, header, 4) != 0)
+                return -1;
+        len = (size_t)header[0] << 24 | (size_t)header[1] << 16 | (size_t)header[2] << 8 | header[3];
+        if (len >= MAX_PAYLOAD || read_full(fd, payload, len) != 0)
+                return -1;
+        payload[len] = '\0';
+        return (ssize_t)len;
+}
+
+/* "delay MSEC ...": echoed after MSEC; "close-once": the connection is closed the first time, echoed after that; "hold":
+   never answered */
+static void *upstream_conn_main(void *arg)
+{
+        int fd = (int)(intptr_t)arg, close_now;
+        char payload[MAX_PAYLOAD];
+        ssize_t len;
+
+        while ((len = read_frame(fd, payload)) != -1) {
+                if (strncmp(payload, "delay ", 6) == 0) {
+                        usleep(atoi(payload + 6) * 1000);
+                } else if (strcmp(payload, "close-once") == 0) {
+                        pthread_mutex_lock(&mutex);
+                        close_now = num_close_once++ == 0;
+                        pthread_mutex_unlock(&mutex);
+                        if (close_now)
+                                break;
+                } else if (strcmp(payload, "hold") == 0) {
+                        continue;
+                }
+                if (write_frame(fd, payload, (size_t)len) != 0)
+                        break;
+        }
+        close(fd);
+        return NULL;
+}
+
+static void *upstream_main(void *arg)
+{
+        int listen_fd = (int)(intptr_t)arg, fd;
+        pthread_t tid;
+
+        while ((fd = accept(listen_fd, NULL, NULL)) != -1) {
+                if (pthread_create(&tid, NULL, upstream_conn_main, (void *)(intptr_t)fd) != 0) {
+                        close(fd);
+                        continue;
+                }
+                pthread_detach(tid);
+        }
+        return NULL;
+}
+
+static int listen_loopback(struct sockaddr_in *addr)
+{
+        socklen_t addrlen = sizeof(*addr);
+        int fd;
+
+        memset(addr, 0, sizeof(*addr));
+        addr->sin_family = AF_INET;
+        addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 || bind(fd, (struct sockaddr *)addr, sizeof(*addr)) != 0 ||
+            listen(fd, 128) != 0 || getsockname(fd, (struct sockaddr *)addr, &addrlen) != 0) {
+                perror("failed to listen on loopback");
+                exit(1);
+        }
+        return fd;
+}
+
+/* waits for the proxy to start listening */
+static int connect_proxy(const struct sockaddr_in *addr)
+{
+        uint64_t deadline = now_msec() + 10000;
+        int fd;
+
+        do {
+                if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+                        break;
+                if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0)
+                        return fd;
+                close(fd);
+                usleep(50000);
+        } while (now_msec() < deadline);
+        fprintf(stderr, "[ERROR] failed to connect to the proxy\n");
+        exit(1);
+}
+
+static void expect_frame(int fd, const char *expected)
+{
+        char payload[MAX_PAYLOAD];
+
+        if (read_frame(fd, payload) == -1) {
+                fprintf(stderr, "[ERROR] connection closed while expecting `%s`\n", expected);
+                exit(1);
+        }
+        if (strcmp(payload, expected) != 0) {
+                fprintf(stderr, "[ERROR] got `%s`, expected `%s`\n", payload, expected);
+                exit(1);
+        }
+}
+
+static void test_order(int fd)
+{
+        static const char *reqs[] = {"delay 300 first", "delay 150 second", "delay 0 third"};
+        size_t i;
+
+        /* one connection each, answered last to first */
+        for (i = 0; i != sizeof(reqs) / sizeof(reqs[0]); ++i)
+                write_frame(fd, reqs[i], strlen(reqs[i]));
+        for (i = 0; i != sizeof(reqs) / sizeof(reqs[0]); ++i)
+                expect_frame(fd, reqs[i]);
+        fprintf(stderr, "[INFO] responses are relayed in the order of the requests\n");
+}
+
+static void test_retry(int fd)
+{
+        int n;
+
+        /* every connection of the pool has served a request by now, hence this one goes to a reused connection */
+        write_frame(fd, "close-once", 10);
+        expect_frame(fd, "close-once");
+        pthread_mutex_lock(&mutex);
+        n = num_close_once;
+        pthread_mutex_unlock(&mutex);
+        if (n != 2) {
+                fprintf(stderr, "[ERROR] upstream saw the request %d times, expected 2\n", n);
+                exit(1);
+        }
+        fprintf(stderr, "[INFO] a request is retried when the upstream closes a reused connection\n");
+}
+
+static void test_queue_timeout(int fd)
+{
+        char payload[MAX_PAYLOAD];
+        uint64_t start, elapsed;
+        int i;
+
+        for (i = 0; i != MAX_CONNS; ++i)
+                write_frame(fd, "hold", 4);
+        start = now_msec();
+        write_frame(fd, "queued", 6);
+        /* the request cannot be answered; the protocol reports the failure by closing */
+        if (read_frame(fd, payload) != -1) {
+                fprintf(stderr, "[ERROR] got `%s` for a request that should have timed out\n", payload);
+                exit(1);
+        }
+        elapsed = now_msec() - start;
+        if (elapsed < QUEUE_TIMEOUT - 50 || elapsed > QUEUE_TIMEOUT * 10) {
+                fprintf(stderr, "[ERROR] queued request gave up after %llu ms, expected about %d\n", (unsigned long long)elapsed,
+                        QUEUE_TIMEOUT);
+                exit(1);
+        }
+        fprintf(stderr, "[INFO] a queued request gives up after %llu ms\n", (unsigned long long)elapsed);
+}
+
+int main(int argc, char **argv)
+{
+        struct sockaddr_in upstream_addr, proxy_addr;
+        char listen_arg[64], upstream_arg[64], max_conns_arg[16], queue_timeout_arg[16];
+        int upstream_fd, probe_fd, fd;
+        pthread_t tid;
+
+        if (argc != 2) {
+                fprintf(stderr, "usage: %s path-to-hoppang\n", argv[0]);
+                return 1;
+        }
+        signal(SIGPIPE, SIG_IGN);
+
+        upstream_fd = listen_loopback(&upstream_addr);
+        if (pthread_create(&tid, NULL, upstream_main, (void *)(intptr_t)upstream_fd) != 0) {
+                perror("pthread_create");
+                return 1;
+        }
+        /* a free port for the proxy */
+        probe_fd = listen_loopback(&proxy_addr);
+        close(probe_fd);
+
+        snprintf(listen_arg, sizeof(listen_arg), "127.0.0.1:%u,handler=proxy", ntohs(proxy_addr.sin_port));
+        snprintf(upstream_arg, sizeof(upstream_arg), "127.0.0.1:%u", ntohs(upstream_addr.sin_port));
+        snprintf(max_conns_arg, sizeof(max_conns_arg), "%d", MAX_CONNS);
+        snprintf(queue_timeout_arg, sizeof(queue_timeout_arg), "%d", QUEUE_TIMEOUT);
+        if ((proxy_pid = fork()) == -1) {
+                perror("fork");
+                return 1;
+        }
+        if (proxy_pid == 0) {
+                execl(argv[1], argv[1], "--listen", listen_arg, "--upstream", upstream_arg, "--upstream-max-conns",
+                      max_conns_arg, "--upstream-queue-timeout", queue_timeout_arg, NULL);
+                perror("failed to run hoppang");
+                _exit(1);
+        }
+        atexit(stop_proxy);
+
+        /* the pool is per thread, and the requests of a connection are all served by the same one */
+        fd = connect_proxy(&proxy_addr);
+        test_order(fd);
+        test_retry(fd);
+        close(fd);
+        fd = connect_proxy(&proxy_addr);
+        test_queue_timeout(fd);
+        close(fd);
+
+        return 0;
+}
@@ -0,0 +1,214 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Measures what a coroutine per connection costs: the time of a switch (next to swapcontext(3),
+   which the hand-rolled switch replaces), the time to create and finish one with and without a
+   stack from the pool, and the memory taken by parked coroutines that have used a given depth of
+   their stacks, next to what a thread per connection would reserve. */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+
+#include "hoppang.h"
+
+static struct {
+        size_t switches;
+        size_t creates;
+        size_t parked;
+        size_t stack_size;
+} conf = {10000000, 100000, 2000, HP_CORO_DEFAULT_STACK_SIZE};
+
+static uint64_t now_nsec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t resident_bytes(void)
+{
+        FILE *fp;
+        unsigned long size, resident = 0;
+
+        if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+                return 0;
+        if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+                resident = 0;
+        fclose(fp);
+        return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void yield_forever(hp_coro_t *co, void *arg)
+{
+        while (1)
+                hp_coro_yield(co);
+}
+
+static void return_at_once(hp_coro_t *co, void *arg)
+{
+}
+
+/* takes `depth` bytes of stack, as a handler with that many locals down its call chain would, and parks */
+static void touch_and_park(hp_coro_t *co, void *arg)
+{
+        size_t depth = (size_t)arg, i;
+        volatile char *p = alloca(depth);
+
+        /* stores through a volatile pointer are not dropped for being dead */
+        for (i = 0; i < depth; i += 64)
+                p[i] = 0;
+        hp_coro_yield(co);
+}
+
+static ucontext_t uc_main, uc_co;
+
+static void uc_yield_forever(void)
+{
+        while (1)
+                swapcontext(&uc_co, &uc_main);
+}
+
+static void bench_switch(void)
+{
+        hp_coro_t *co = hp_coro_create(yield_forever, NULL, conf.stack_size);
+        char *uc_stack = malloc(conf.stack_size);
+        uint64_t start, elapsed;
+        size_t i;
+
+        start = now_nsec();
+        for (i = 0; i != conf.switches; ++i)
+                hp_coro_resume(co);
+        elapsed = now_nsec() - start;
+        printf("switch (resume + yield)     %8.1f ns\n", (double)elapsed / conf.switches);
+
+        getcontext(&uc_co);
+        uc_co.uc_stack.ss_sp = uc_stack;
+        uc_co.uc_stack.ss_size = conf.stack_size;
+        uc_co.uc_link = NULL;
+        makecontext(&uc_co, uc_yield_forever, 0);
+        start = now_nsec();
+        for (i = 0; i != conf.switches; ++i)
+                swapcontext(&uc_main, &uc_co);
+        elapsed = now_nsec() - start;
+        printf("swapcontext (there + back)  %8.1f ns\n", (double)elapsed / conf.switches);
+        free(uc_stack);
+}
+
+static void bench_create(void)
+{
+        hp_coro_t **cos = malloc(sizeof(*cos) * conf.parked);
+        uint64_t start, elapsed, maps;
+        size_t i;
+
+        /* a stack at a time, always from the pool after the first */
+        start = now_nsec();
+        for (i = 0; i != conf.creates; ++i)
+                hp_coro_resume(hp_coro_create(return_at_once, NULL, conf.stack_size));
+        elapsed = now_nsec() - start;
+        printf("create + run, pooled        %8.1f ns\n", (double)elapsed / conf.creates);
+
+        /* all alive at once, so that the stacks beyond those pooled are newly mapped, and unmapped when done */
+        maps = hp_coro_get_stats()->stack_maps;
+        start = now_nsec();
+        for (i = 0; i != conf.parked; ++i) {
+                cos[i] = hp_coro_create(touch_and_park, (void *)(size_t)64, conf.stack_size);
+                hp_coro_resume(cos[i]);
+        }
+        for (i = 0; i != conf.parked; ++i)
+                hp_coro_resume(cos[i]);
+        elapsed = now_nsec() - start;
+        printf("create + run, mapped        %8.1f ns (%" PRIu64 " of %zu stacks mapped)\n", (double)elapsed / conf.parked,
+               hp_coro_get_stats()->stack_maps - maps, conf.parked);
+        free(cos);
+}
+
+static void bench_memory(size_t depth)
+{
+        hp_coro_t **cos = malloc(sizeof(*cos) * conf.parked);
+        size_t before, after, i, used = 0;
+
+        before = resident_bytes();
+        for (i = 0; i != conf.parked; ++i) {
+                if ((cos[i] = hp_coro_create(touch_and_park, (void *)depth, conf.stack_size)) == NULL) {
+                        perror("hp_coro_create");
+                        exit(1);
+                }
+                hp_coro_resume(cos[i]);
+        }
+        after = resident_bytes();
+        for (i = 0; i != conf.parked; ++i)
+                used += hp_coro_stack_used(cos[i]);
+        printf("stack depth %7zu bytes    %8.1f KB of stack resident per coroutine, process grew %.1f KB per coroutine\n",
+               depth, (double)used / conf.parked / 1024, (double)(after - before) / conf.parked / 1024);
+        /* the pooled stacks keep the pages they touched; as the depths grow, the next round touches more */
+        for (i = 0; i != conf.parked; ++i)
+                hp_coro_resume(cos[i]);
+        free(cos);
+}
+
+static void usage(const char *cmd)
+{
+        printf("Usage: %s [options]\n"
+               "\n"
+               "Options:\n"
+               "  -n switches  resume/yield round trips (default: %zu)\n"
+               "  -c count     coroutines created and run (default: %zu)\n"
+               "  -p count     coroutines parked for the memory figures (default: %zu)\n"
+               "  -s bytes     stack size (default: %zu)\n"
+               "  -h           prints this help\n",
+               cmd, conf.switches, conf.creates, conf.parked, conf.stack_size);
+}
+
+int main(int argc, char **argv)
+{
+        static const size_t depths[] = {256, 4096, 16384, 49152};
+        pthread_attr_t attr;
+        size_t i, thread_stack_size = 0;
+        int ch;
+
+        while ((ch = getopt(argc, argv, "n:c:p:s:h")) != -1) {
+                switch (ch) {
+                case 'n':
+                        conf.switches = strtoul(optarg, NULL, 10);
+                        break;
+                case 'c':
+                        conf.creates = strtoul(optarg, NULL, 10);
+                        break;
+                case 'p':
+                        conf.parked = strtoul(optarg, NULL, 10);
+                        break;
+                case 's':
+                        conf.stack_size = strtoul(optarg, NULL, 10);
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return 0;
+                default:
+                        return 1;
+                }
+        }
+        if (conf.switches == 0 || conf.creates == 0 || conf.parked == 0 || conf.stack_size < 65536) {
+                fprintf(stderr, "-n, -c and -p take positive integers, -s at least 65536\n");
+                return 1;
+        }
+
+        bench_switch();
+        bench_create();
+        for (i = 0; i != sizeof(depths) / sizeof(depths[0]); ++i)
+                if (depths[i] + 4096 <= conf.stack_size)
+                        bench_memory(depths[i]);
+
+        pthread_attr_init(&attr);
+        pthread_attr_getstacksize(&attr, &thread_stack_size);
+        printf("stack reserved per coroutine %7zu KB, per thread %zu KB (address space; memory as touched)\n",
+               conf.stack_size / 1024, thread_stack_size / 1024);
+        return 0;
+}
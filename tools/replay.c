@@ -0,0 +1,590 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Sends what a capture (--capture) recorded to a server again: the connections are opened, fed
+   and closed at the times they were, or that many times faster, from one thread.  The latency of
+   each request, from sending it to the first byte of the response, is compared with the latencies
+   recorded in the capture and with those of an earlier replay, so that a change can be checked
+   against the traffic it will see.
+
+   The latencies of the capture are taken in the server, up to the first write of the handler,
+   whereas the replay sees them from the client; an earlier replay against the same host is what
+   compares like with like. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hoppang.h"
+
+#define READ_SIZE 65536
+
+static struct {
+        double speed;
+        double wait_sec;
+        const char *baseline_path;
+        const char *output_path;
+        double threshold;
+} conf = {1, 1, NULL, NULL, 0};
+
+struct event_t {
+        int type;
+        size_t conn;
+        uint64_t usec;
+        const char *bytes;
+        size_t len;
+        size_t seq; /* the position in the file */
+};
+
+struct conn_t {
+        uint64_t id;
+        int fd;
+        int connected;
+        int shut_requested;
+        int done;
+        hp_buffer_t pending;
+        size_t sent;
+        uint64_t awaiting_since; /* in nanoseconds, 0 unless a request is unanswered */
+};
+
+struct latencies_t {
+        uint64_t *values; /* in microseconds */
+        size_t size;
+        size_t capacity;
+};
+
+static struct event_t *events;
+static size_t num_events, events_capacity;
+static struct conn_t *conns;
+static size_t num_conns, conns_capacity;
+
+static struct sockaddr_storage target;
+static socklen_t target_len;
+
+static uint64_t now_nsec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *grow(void *array, size_t *capacity, size_t size, size_t elem_size)
+{
+        void *grown;
+
+        if (size < *capacity)
+                return array;
+        if (*capacity == 0)
+                *capacity = 1024;
+        while (*capacity <= size)
+                *capacity *= 2;
+        if ((grown = realloc(array, *capacity * elem_size)) == NULL) {
+                perror("realloc");
+                exit(1);
+        }
+        return grown;
+}
+
+static void push_latency(struct latencies_t *l, uint64_t usec)
+{
+        l->values = grow(l->values, &l->capacity, l->size, sizeof(l->values[0]));
+        l->values[l->size++] = usec;
+}
+
+static int decode_varint(const char **p, const char *end, uint64_t *v)
+{
+        unsigned shift = 0;
+
+        *v = 0;
+        while (*p != end && shift < 64) {
+                *v |= (uint64_t)(**p & 0x7f) << shift;
+                if ((*(*p)++ & 0x80) == 0)
+                        return 0;
+                shift += 7;
+        }
+        return -1;
+}
+
+/* from the ids of the capture to the connections, by open addressing */
+static size_t *id_table;
+static size_t id_table_size;
+
+static size_t lookup_conn(uint64_t id)
+{
+        size_t slot, i, *old_table, old_size;
+
+        if (num_conns * 2 >= id_table_size) {
+                old_table = id_table;
+                old_size = id_table_size;
+                id_table_size = id_table_size != 0 ? id_table_size * 2 : 4096;
+                if ((id_table = malloc(id_table_size * sizeof(id_table[0]))) == NULL) {
+                        perror("malloc");
+                        exit(1);
+                }
+                memset(id_table, 0xff, id_table_size * sizeof(id_table[0]));
+                for (i = 0; i != old_size; ++i) {
+                        if (old_table[i] == SIZE_MAX)
+                                continue;
+                        for (slot = hp_hash(&conns[old_table[i]].id, sizeof(id)) & (id_table_size - 1); id_table[slot] != SIZE_MAX;
+                             slot = (slot + 1) & (id_table_size - 1))
+                                ;
+                        id_table[slot] = old_table[i];
+                }
+                free(old_table);
+        }
+        for (slot = hp_hash(&id, sizeof(id)) & (id_table_size - 1); id_table[slot] != SIZE_MAX;
+             slot = (slot + 1) & (id_table_size - 1))
+                if (conns[id_table[slot]].id == id)
+                        return id_table[slot];
+        conns = grow(conns, &conns_capacity, num_conns, sizeof(conns[0]));
+        conns[num_conns] = (struct conn_t){id, -1};
+        id_table[slot] = num_conns;
+        return num_conns++;
+}
+
+static int compare_events(const void *_x, const void *_y)
+{
+        const struct event_t *x = _x, *y = _y;
+
+        /* the records of a connection are in order in the file, which breaks ties */
+        if (x->usec != y->usec)
+                return x->usec < y->usec ? -1 : 1;
+        return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int load_capture(const char *path)
+{
+        const char *p, *end;
+        struct event_t *ev;
+        struct stat st;
+        uint64_t id, usec, len;
+        int fd, type;
+
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st) != 0) {
+                fprintf(stderr, "failed to open %s:%s\n", path, strerror(errno));
+                return -1;
+        }
+        if (st.st_size < HP_CAPTURE_HEADER_SIZE ||
+            (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED ||
+            memcmp(p, HP_CAPTURE_MAGIC, sizeof(HP_CAPTURE_MAGIC)) != 0) {
+                fprintf(stderr, "%s is not a capture\n", path);
+                close(fd);
+                return -1;
+        }
+        close(fd);
+        end = p + st.st_size;
+        p += HP_CAPTURE_HEADER_SIZE;
+
+        while (p != end) {
+                type = *p++;
+                len = 0;
+                if (decode_varint(&p, end, &id) != 0 || decode_varint(&p, end, &usec) != 0)
+                        goto Truncated;
+                switch (type) {
+                case HP_CAPTURE_DATA:
+                        if (decode_varint(&p, end, &len) != 0 || len > (uint64_t)(end - p))
+                                goto Truncated;
+                        break;
+                case HP_CAPTURE_OPEN:
+                case HP_CAPTURE_REPLY:
+                case HP_CAPTURE_CLOSE:
+                        break;
+                default:
+                        fprintf(stderr, "%s: unknown record type %d\n", path, type);
+                        return -1;
+                }
+                events = grow(events, &events_capacity, num_events, sizeof(events[0]));
+                ev = events + num_events++;
+                *ev = (struct event_t){type, lookup_conn(id), usec, p, len, num_events};
+                p += len;
+        }
+        goto Exit;
+
+Truncated:
+        /* the server was stopped while writing; what came before is whole */
+        fprintf(stderr, "%s: the last record is truncated; ignored\n", path);
+Exit:
+        qsort(events, num_events, sizeof(events[0]), compare_events);
+        return 0;
+}
+
+static void captured_latencies(struct latencies_t *out)
+{
+        struct event_t *ev;
+        struct conn_t *conn;
+        size_t i;
+
+        for (i = 0; i != num_events; ++i) {
+                ev = events + i;
+                conn = conns + ev->conn;
+                if (ev->type == HP_CAPTURE_DATA && conn->awaiting_since == 0) {
+                        conn->awaiting_since = ev->usec + 1;
+                } else if (ev->type == HP_CAPTURE_REPLY && conn->awaiting_since != 0) {
+                        push_latency(out, ev->usec + 1 - conn->awaiting_since);
+                        conn->awaiting_since = 0;
+                } else if (ev->type == HP_CAPTURE_CLOSE) {
+                        conn->awaiting_since = 0;
+                }
+        }
+}
+
+static int parse_target(const char *s)
+{
+        struct sockaddr_un *sun = (struct sockaddr_un *)&target;
+        struct addrinfo hints = {0}, *res;
+        char host[256];
+        const char *colon;
+        int r;
+
+        if (strncmp(s, "unix:", 5) == 0) {
+                if (strlen(s + 5) >= sizeof(sun->sun_path))
+                        return -1;
+                sun->sun_family = AF_UNIX;
+                strcpy(sun->sun_path, s + 5);
+                target_len = sizeof(*sun);
+                return 0;
+        }
+        if ((colon = strrchr(s, ':')) == NULL || (size_t)(colon - s) >= sizeof(host))
+                return -1;
+        memcpy(host, s, colon - s);
+        host[colon - s] = '\0';
+        hints.ai_socktype = SOCK_STREAM;
+        if ((r = getaddrinfo(host, colon + 1, &hints, &res)) != 0) {
+                fprintf(stderr, "failed to resolve %s:%s\n", s, gai_strerror(r));
+                return -1;
+        }
+        memcpy(&target, res->ai_addr, res->ai_addrlen);
+        target_len = res->ai_addrlen;
+        freeaddrinfo(res);
+        return 0;
+}
+
+static void finish(int epfd, struct conn_t *conn)
+{
+        if (conn->fd != -1) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                close(conn->fd);
+                conn->fd = -1;
+        }
+        conn->done = 1;
+}
+
+static void update_interest(int epfd, struct conn_t *conn)
+{
+        struct epoll_event ev = {EPOLLIN, {.ptr = conn}};
+
+        if (!conn->connected || conn->sent != conn->pending.size)
+                ev.events |= EPOLLOUT;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void flush(int epfd, struct conn_t *conn)
+{
+        ssize_t r;
+
+        while (conn->sent != conn->pending.size) {
+                if ((r = send(conn->fd, conn->pending.bytes + conn->sent, conn->pending.size - conn->sent, MSG_NOSIGNAL)) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno != EAGAIN)
+                                finish(epfd, conn);
+                        break;
+                }
+                conn->sent += r;
+        }
+        if (conn->done)
+                return;
+        if (conn->sent == conn->pending.size) {
+                conn->sent = 0;
+                conn->pending.size = 0;
+                if (conn->shut_requested)
+                        shutdown(conn->fd, SHUT_WR);
+        }
+        update_interest(epfd, conn);
+}
+
+static void on_event(int epfd, struct conn_t *conn, uint32_t events, struct latencies_t *replayed)
+{
+        char buf[READ_SIZE];
+        ssize_t r;
+
+        if (!conn->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0) {
+                int err = 0;
+                socklen_t errlen = sizeof(err);
+                getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                if (err != 0) {
+                        fprintf(stderr, "failed to connect:%s\n", strerror(err));
+                        finish(epfd, conn);
+                        return;
+                }
+                conn->connected = 1;
+        }
+        if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0) {
+                while ((r = read(conn->fd, buf, sizeof(buf))) > 0) {
+                        if (conn->awaiting_since != 0) {
+                                push_latency(replayed, (now_nsec() - conn->awaiting_since) / 1000);
+                                conn->awaiting_since = 0;
+                        }
+                }
+                if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+                        finish(epfd, conn);
+                        return;
+                }
+        }
+        flush(epfd, conn);
+}
+
+static void play(int epfd, struct event_t *ev)
+{
+        struct conn_t *conn = conns + ev->conn;
+        struct epoll_event epev = {EPOLLIN | EPOLLOUT, {.ptr = conn}};
+
+        switch (ev->type) {
+        case HP_CAPTURE_OPEN:
+                if ((conn->fd = socket(target.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ||
+                    (connect(conn->fd, (struct sockaddr *)&target, target_len) != 0 && errno != EINPROGRESS)) {
+                        fprintf(stderr, "failed to connect:%s\n", strerror(errno));
+                        finish(epfd, conn);
+                        break;
+                }
+                epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &epev);
+                break;
+        case HP_CAPTURE_DATA:
+                /* the capture may have begun after the connection was accepted */
+                if (conn->fd == -1 || conn->done)
+                        break;
+                conn->pending.bytes = grow(conn->pending.bytes, &conn->pending.capacity, conn->pending.size + ev->len, 1);
+                memcpy(conn->pending.bytes + conn->pending.size, ev->bytes, ev->len);
+                conn->pending.size += ev->len;
+                if (conn->awaiting_since == 0)
+                        conn->awaiting_since = now_nsec();
+                if (conn->connected)
+                        flush(epfd, conn);
+                break;
+        case HP_CAPTURE_CLOSE:
+                if (conn->fd == -1 || conn->done)
+                        break;
+                conn->shut_requested = 1;
+                if (conn->connected)
+                        flush(epfd, conn);
+                break;
+        default:
+                break;
+        }
+}
+
+static size_t num_open(void)
+{
+        size_t i, n = 0;
+
+        for (i = 0; i != num_conns; ++i)
+                if (conns[i].fd != -1)
+                        ++n;
+        return n;
+}
+
+static int replay(struct latencies_t *replayed)
+{
+        struct epoll_event evs[256];
+        uint64_t start, now, due, deadline;
+        size_t next = 0;
+        int epfd, n, i, timeout;
+
+        if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+                perror("epoll_create1");
+                return -1;
+        }
+        for (i = 0; (size_t)i != num_conns; ++i)
+                conns[i].awaiting_since = 0;
+
+        start = now_nsec();
+        deadline = UINT64_MAX;
+        while (1) {
+                now = now_nsec();
+                while (next != num_events &&
+                       (due = start + (uint64_t)((events[next].usec - events[0].usec) * 1000 / conf.speed)) <= now)
+                        play(epfd, events + next++);
+                if (next == num_events) {
+                        if (deadline == UINT64_MAX)
+                                deadline = now + (uint64_t)(conf.wait_sec * 1e9);
+                        if (now >= deadline || num_open() == 0)
+                                break;
+                        timeout = (int)((deadline - now + 999999) / 1000000);
+                } else {
+                        timeout = (int)((due - now + 999999) / 1000000);
+                }
+                if ((n = epoll_wait(epfd, evs, sizeof(evs) / sizeof(evs[0]), timeout)) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("epoll_wait");
+                        return -1;
+                }
+                for (i = 0; i != n; ++i)
+                        on_event(epfd, evs[i].data.ptr, evs[i].events, replayed);
+        }
+        for (i = 0; (size_t)i != num_conns; ++i)
+                finish(epfd, conns + i);
+        close(epfd);
+        return 0;
+}
+
+static int load_latencies(const char *path, struct latencies_t *out)
+{
+        unsigned long long v;
+        FILE *fp;
+
+        if ((fp = fopen(path, "r")) == NULL) {
+                fprintf(stderr, "failed to open %s:%s\n", path, strerror(errno));
+                return -1;
+        }
+        while (fscanf(fp, "%llu", &v) == 1)
+                push_latency(out, v);
+        fclose(fp);
+        return 0;
+}
+
+static int save_latencies(const char *path, const struct latencies_t *l)
+{
+        FILE *fp;
+        size_t i;
+
+        if ((fp = fopen(path, "w")) == NULL) {
+                fprintf(stderr, "failed to open %s:%s\n", path, strerror(errno));
+                return -1;
+        }
+        for (i = 0; i != l->size; ++i)
+                fprintf(fp, "%" PRIu64 "\n", l->values[i]);
+        return fclose(fp);
+}
+
+static int compare_u64(const void *_x, const void *_y)
+{
+        uint64_t x = *(const uint64_t *)_x, y = *(const uint64_t *)_y;
+
+        return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct latencies_t *l, double p)
+{
+        size_t rank = (size_t)(l->size * p / 100);
+
+        return l->values[rank < l->size ? rank : l->size - 1];
+}
+
+static void report(const char *label, struct latencies_t *l)
+{
+        if (l->size == 0) {
+                printf("%-10s %9zu\n", label, (size_t)0);
+                return;
+        }
+        qsort(l->values, l->size, sizeof(l->values[0]), compare_u64);
+        printf("%-10s %9zu %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n", label, l->size,
+               percentile(l, 50), percentile(l, 90), percentile(l, 99), percentile(l, 99.9), l->values[l->size - 1]);
+}
+
+static void usage(const char *cmd)
+{
+        printf("Usage: %s [options] CAPTURE HOST:PORT|unix:PATH\n"
+               "\n"
+               "Sends the connections of a capture made with --capture to the server again, and\n"
+               "reports the latencies of the requests: from sending one to the first byte of the\n"
+               "response, next to those recorded in the capture.\n"
+               "\n"
+               "Options:\n"
+               "  -s speed    how many times faster than recorded (default: %g)\n"
+               "  -w seconds  how long to wait for the responses after the last record (default: %g)\n"
+               "  -o file     saves the latencies of the replay, one per line in microseconds\n"
+               "  -b file     compares against the latencies saved by an earlier replay\n"
+               "  -t ratio    fails if p99 exceeds that of the baseline, or else of the capture,\n"
+               "              times ratio\n"
+               "  -h          prints this help\n"
+               "\n"
+               "Connections already open when the capture began are not replayed.  TLS traffic is\n"
+               "recorded decrypted and is sent in plaintext.\n",
+               cmd, conf.speed, conf.wait_sec);
+}
+
+int main(int argc, char **argv)
+{
+        struct latencies_t captured = {NULL}, replayed = {NULL}, baseline = {NULL}, *reference;
+        int ch;
+
+        while ((ch = getopt(argc, argv, "s:w:o:b:t:h")) != -1) {
+                switch (ch) {
+                case 's':
+                        conf.speed = strtod(optarg, NULL);
+                        break;
+                case 'w':
+                        conf.wait_sec = strtod(optarg, NULL);
+                        break;
+                case 'o':
+                        conf.output_path = optarg;
+                        break;
+                case 'b':
+                        conf.baseline_path = optarg;
+                        break;
+                case 't':
+                        conf.threshold = strtod(optarg, NULL);
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return 0;
+                default:
+                        return 1;
+                }
+        }
+        if (conf.speed <= 0 || conf.wait_sec < 0 || conf.threshold < 0) {
+                fprintf(stderr, "-s and -t take positive numbers, and -w one that is not negative\n");
+                return 1;
+        }
+        argc -= optind;
+        argv += optind;
+        if (argc != 2) {
+                usage(argv[-optind]);
+                return 1;
+        }
+
+        if (load_capture(argv[0]) != 0 || parse_target(argv[1]) != 0)
+                return 1;
+        if (conf.baseline_path != NULL && load_latencies(conf.baseline_path, &baseline) != 0)
+                return 1;
+        if (num_events == 0) {
+                fprintf(stderr, "%s has no records\n", argv[0]);
+                return 1;
+        }
+        captured_latencies(&captured);
+        printf("replaying %zu connections, %.1f seconds recorded, at %gx\n", num_conns,
+               (events[num_events - 1].usec - events[0].usec) / 1e6, conf.speed);
+        if (replay(&replayed) != 0)
+                return 1;
+        if (conf.output_path != NULL && save_latencies(conf.output_path, &replayed) != 0)
+                return 1;
+
+        printf("%-10s %9s %9s %9s %9s %9s %9s\n", "(us)", "requests", "p50", "p90", "p99", "p99.9", "max");
+        report("captured", &captured);
+        report("replayed", &replayed);
+        if (conf.baseline_path != NULL)
+                report("baseline", &baseline);
+
+        reference = conf.baseline_path != NULL ? &baseline : &captured;
+        if (conf.threshold != 0 && reference->size != 0 && replayed.size != 0 &&
+            percentile(&replayed, 99) > percentile(reference, 99) * conf.threshold) {
+                fprintf(stderr, "p99 of the replay exceeds %g times that of the %s\n", conf.threshold,
+                        reference == &baseline ? "baseline" : "capture");
+                return 2;
+        }
+        return 0;
+}
@@ -0,0 +1,191 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Fuzzes the scan kernels against the scalar path, then benchmarks them on request corpora.
+   Each corpus file is a raw capture of request bytes; without one, a built-in request is used. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hoppang.h"
+
+static const char sample_request[] = "GET /index.html?q=hoppang&lang=ko HTTP/1.1\r\n"
+                                     "Host: www.example.com\r\n"
+                                     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:60.0) Gecko/20100101 Firefox/60.0\r\n"
+                                     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+                                     "Accept-Language: ko-KR,ko;q=0.8,en-US;q=0.5,en;q=0.3\r\n"
+                                     "Accept-Encoding: gzip, deflate, br\r\n"
+                                     "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+                                     "Connection: keep-alive\r\n"
+                                     "\r\n";
+
+static struct {
+        const char *name;
+        hp_scan_set_t *set;
+} sets[] = {{"eol", &hp_scan_eol_set}, {"colon", &hp_scan_colon_set}, {"nontoken", &hp_scan_nontoken_set}};
+
+#define NUM_SETS (sizeof(sets) / sizeof(sets[0]))
+
+static hp_scan_find_cb scalar_find(void)
+{
+        const hp_scan_kernel_t *kernel;
+
+        for (kernel = hp_scan_kernels; strcmp(kernel->name, "scalar") != 0; ++kernel)
+                ;
+        return kernel->find;
+}
+
+static int verify(const hp_scan_kernel_t *kernel, const char *buf, size_t len, const hp_scan_set_t *set, const char *what)
+{
+        hp_scan_find_cb ref = scalar_find();
+        const char *end = buf + len, *p;
+
+        /* every start offset, so that every alignment and tail length is covered */
+        for (p = buf; p <= end; ++p) {
+                const char *expected = ref(p, end, set), *actual = kernel->find(p, end, set);
+                if (actual != expected) {
+                        fprintf(stderr, "[FAIL] %s: %s returned offset %zd from %zd, expected %zd\n", what, kernel->name,
+                                actual - buf, p - buf, expected - buf);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+static int fuzz(const hp_scan_kernel_t *kernel, size_t rounds, unsigned seed)
+{
+        char buf[512];
+        size_t round, i;
+
+        srandom(seed);
+        for (round = 0; round != rounds; ++round) {
+                hp_scan_set_t set;
+                size_t len = random() % sizeof(buf), nranges = 1 + random() % 4;
+                hp_scan_set_init(&set);
+                for (i = 0; i != nranges; ++i) {
+                        unsigned char lo = random(), hi = lo + random() % 8;
+                        hp_scan_set_add(&set, lo, hi < lo ? 0xff : hi);
+                }
+                /* mostly bytes outside the set, so that matches land at varying depths */
+                for (i = 0; i != len; ++i)
+                        buf[i] = random() % 64 == 0 ? (char)random() : 'a' + random() % 26;
+                if (verify(kernel, buf, len, &set, "fuzz") != 0)
+                        return -1;
+        }
+        return 0;
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const hp_scan_kernel_t *kernel, const char *buf, size_t len, size_t iterations)
+{
+        size_t i, s, hits;
+
+        for (s = 0; s != NUM_SETS; ++s) {
+                double start = now(), elapsed;
+                hits = 0;
+                for (i = 0; i != iterations; ++i) {
+                        const char *p = buf, *end = buf + len;
+                        while ((p = kernel->find(p, end, sets[s].set)) != end) {
+                                ++hits;
+                                ++p;
+                        }
+                }
+                elapsed = now() - start;
+                printf("%-8s %-10s %10.1f MB/s (%zu hits)\n", kernel->name, sets[s].name,
+                       (double)len * iterations / elapsed / 1e6, hits / iterations);
+        }
+}
+
+static char *load_file(const char *fn, size_t *len)
+{
+        FILE *fp;
+        char *buf = NULL;
+        size_t capacity = 0, r;
+
+        if ((fp = fopen(fn, "rb")) == NULL) {
+                fprintf(stderr, "failed to open file:%s:%s\n", fn, strerror(errno));
+                return NULL;
+        }
+        *len = 0;
+        do {
+                if (capacity - *len < 65536)
+                        buf = realloc(buf, capacity = capacity * 2 + 65536);
+                r = fread(buf + *len, 1, capacity - *len, fp);
+                *len += r;
+        } while (r != 0);
+        fclose(fp);
+
+        return buf;
+}
+
+int main(int argc, char **argv)
+{
+        size_t iterations = 10000, fuzz_rounds = 10000, s;
+        const hp_scan_kernel_t *kernel;
+        int ch, i, failed = 0;
+
+        while ((ch = getopt(argc, argv, "n:f:h")) != -1) {
+                switch (ch) {
+                case 'n':
+                        iterations = strtoul(optarg, NULL, 10);
+                        break;
+                case 'f':
+                        fuzz_rounds = strtoul(optarg, NULL, 10);
+                        break;
+                default:
+                        printf("Usage: %s [-n iterations] [-f fuzz-rounds] [corpus-file...]\n", argv[0]);
+                        return ch == 'h' ? 0 : EX_CONFIG;
+                }
+        }
+        argc -= optind;
+        argv += optind;
+
+        printf("selected kernel: %s\n", hp_scan_init());
+
+        for (i = 0; i == 0 || i < argc; ++i) {
+                const char *name = argc != 0 ? argv[i] : "(built-in)";
+                char *buf;
+                size_t len;
+                if (argc != 0) {
+                        if ((buf = load_file(argv[i], &len)) == NULL)
+                                return EX_CONFIG;
+                } else {
+                        buf = strdup(sample_request);
+                        len = sizeof(sample_request) - 1;
+                }
+                printf("corpus %s: %zu bytes\n", name, len);
+                for (kernel = hp_scan_kernels; kernel->name != NULL; ++kernel) {
+                        if (!kernel->is_supported()) {
+                                printf("%-8s not supported on this CPU\n", kernel->name);
+                                continue;
+                        }
+                        for (s = 0; s != NUM_SETS; ++s)
+                                if (verify(kernel, buf, len < 4096 ? len : 4096, sets[s].set, name) != 0)
+                                        failed = 1;
+                        bench(kernel, buf, len, iterations);
+                }
+                free(buf);
+        }
+
+        for (kernel = hp_scan_kernels; kernel->name != NULL; ++kernel) {
+                if (!kernel->is_supported())
+                        continue;
+                if (fuzz(kernel, fuzz_rounds, 1) != 0)
+                        failed = 1;
+                else
+                        printf("%-8s passed %zu fuzz rounds\n", kernel->name, fuzz_rounds);
+        }
+
+        return failed ? EX_SOFTWARE : 0;
+}
@@ -0,0 +1,330 @@
+/* set ts=8 sw=8 enc=utf-8: -*- Mode: c; tab-width: 8; c-basic-offset:8; coding: utf-8 -*- */
+
+/* Measures what the TCP options of a listener cost or save, one profile at a time, over loopback.
+   Each profile gets a fresh listener and a blocking server thread; the client always sets
+   TCP_NODELAY, so that only the options of the server side differ between the rows.  Three numbers
+   are taken: connection setup up to the first response, request/response round trips on one
+   connection (the responses are written in two pieces, which is where Nagle shows), and the rate of
+   a bulk transfer. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "hoppang.h"
+
+#define REQUEST_SIZE 16
+
+static const char *default_profiles[] = {"default",    "nodelay",           "defer-accept=0",
+                                         "fastopen=256", "busy-poll=50",      "notsent-lowat=16384",
+                                         "rcvbuf=65536,sndbuf=65536"};
+
+static struct {
+        size_t rounds;
+        size_t connects;
+        size_t bulk_bytes;
+} conf = {10000, 1000, 64 * 1024 * 1024};
+
+struct server_t {
+        int listen_fd;
+        pthread_t tid;
+};
+
+static uint64_t now_nsec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+        ssize_t r;
+
+        while (len != 0) {
+                if ((r = read(fd, buf, len)) <= 0) {
+                        if (r == -1 && errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                buf = (char *)buf + r;
+                len -= r;
+        }
+        return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+        ssize_t r;
+
+        while (len != 0) {
+                if ((r = write(fd, buf, len)) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                buf = (const char *)buf + r;
+                len -= r;
+        }
+        return 0;
+}
+
+/* 'P' is answered with the request itself in two writes, 'B' with conf.bulk_bytes */
+static void serve(int fd)
+{
+        static const char zeros[65536];
+        char req[REQUEST_SIZE];
+        size_t left;
+
+        while (read_full(fd, req, sizeof(req)) == 0) {
+                if (req[0] == 'P') {
+                        if (write_full(fd, req, REQUEST_SIZE / 2) != 0 || write_full(fd, req + REQUEST_SIZE / 2, REQUEST_SIZE / 2) != 0)
+                                return;
+                } else {
+                        for (left = conf.bulk_bytes; left != 0; left -= left < sizeof(zeros) ? left : sizeof(zeros))
+                                if (write_full(fd, zeros, left < sizeof(zeros) ? left : sizeof(zeros)) != 0)
+                                        return;
+                }
+        }
+}
+
+static void *server_main(void *_server)
+{
+        struct server_t *server = _server;
+        int fd;
+
+        /* ends when the listener is shut down */
+        while ((fd = accept(server->listen_fd, NULL, NULL)) != -1) {
+                serve(fd);
+                close(fd);
+        }
+        return NULL;
+}
+
+static int start_server(struct server_t *server, const hp_tcp_profile_t *profile, struct sockaddr_in *addr)
+{
+        socklen_t addrlen = sizeof(*addr);
+        int flag = 1;
+
+        memset(addr, 0, sizeof(*addr));
+        addr->sin_family = AF_INET;
+        addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if ((server->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+            setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) != 0 ||
+            hp_tcp_profile_apply(server->listen_fd, profile) != 0 ||
+            bind(server->listen_fd, (struct sockaddr *)addr, sizeof(*addr)) != 0 || listen(server->listen_fd, 128) != 0 ||
+            getsockname(server->listen_fd, (struct sockaddr *)addr, &addrlen) != 0) {
+                perror("failed to set up the listener");
+                return -1;
+        }
+        pthread_create(&server->tid, NULL, server_main, server);
+        return 0;
+}
+
+static void stop_server(struct server_t *server)
+{
+        shutdown(server->listen_fd, SHUT_RDWR);
+        pthread_join(server->tid, NULL);
+        close(server->listen_fd);
+}
+
+static int client_socket(void)
+{
+        int fd, flag = 1;
+
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+                return -1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        return fd;
+}
+
+/* returns 1 if the request went with the SYN, 0 if not, -1 on error */
+static int connect_and_ping(const struct sockaddr_in *addr, int fastopen)
+{
+        char req[REQUEST_SIZE] = "P";
+        struct tcp_info info;
+        socklen_t infolen = sizeof(info);
+        int fd, ret = -1;
+
+        if ((fd = client_socket()) == -1)
+                return -1;
+        if (fastopen) {
+                if (sendto(fd, req, sizeof(req), MSG_FASTOPEN, (const struct sockaddr *)addr, sizeof(*addr)) != sizeof(req))
+                        goto Exit;
+        } else {
+                if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) != 0 || write_full(fd, req, sizeof(req)) != 0)
+                        goto Exit;
+        }
+        if (read_full(fd, req, sizeof(req)) != 0)
+                goto Exit;
+        ret = getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &infolen) == 0 && (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+
+Exit:
+        close(fd);
+        return ret;
+}
+
+static int cmp_u64(const void *_x, const void *_y)
+{
+        uint64_t x = *(const uint64_t *)_x, y = *(const uint64_t *)_y;
+        return x < y ? -1 : x > y;
+}
+
+static double percentile_usec(uint64_t *samples, size_t n, double p)
+{
+        qsort(samples, n, sizeof(samples[0]), cmp_u64);
+        return samples[(size_t)((n - 1) * p)] / 1000.;
+}
+
+static int run_profile(const char *spec)
+{
+        hp_tcp_profile_t profile = HP_TCP_PROFILE_INITIALIZER;
+        struct server_t server;
+        struct sockaddr_in addr;
+        char *copy = strdup(spec), *p = copy, *opt, req[REQUEST_SIZE] = "P", buf[65536];
+        uint64_t *samples = malloc(sizeof(*samples) * (conf.rounds > conf.connects ? conf.rounds : conf.connects)), start;
+        size_t i, num_fastopen = 0, left;
+        double connect_p50, connect_p99, ping_p50, ping_p99, bulk_mbps;
+        int fd = -1, r, ret = -1;
+
+        while ((opt = strsep(&p, ",")) != NULL) {
+                if (strcmp(opt, "default") == 0)
+                        continue;
+                if ((r = hp_tcp_profile_parse_option(&profile, opt)) != 0) {
+                        if (r == 1)
+                                fprintf(stderr, "unknown TCP option:%s\n", opt);
+                        goto Exit;
+                }
+        }
+        if (start_server(&server, &profile, &addr) != 0)
+                goto Exit;
+
+        /* connection setup; the first one with Fast Open only fetches the cookie */
+        for (i = 0; i != conf.connects; ++i) {
+                start = now_nsec();
+                if ((r = connect_and_ping(&addr, profile.fastopen != 0)) == -1) {
+                        perror("connect");
+                        goto Stop;
+                }
+                samples[i] = now_nsec() - start;
+                num_fastopen += r;
+        }
+        connect_p50 = percentile_usec(samples, conf.connects, 0.5);
+        connect_p99 = percentile_usec(samples, conf.connects, 0.99);
+
+        if ((fd = client_socket()) == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                perror("connect");
+                goto Stop;
+        }
+        for (i = 0; i != conf.rounds; ++i) {
+                start = now_nsec();
+                if (write_full(fd, req, sizeof(req)) != 0 || read_full(fd, req, sizeof(req)) != 0) {
+                        perror("ping");
+                        goto Stop;
+                }
+                samples[i] = now_nsec() - start;
+        }
+        ping_p50 = percentile_usec(samples, conf.rounds, 0.5);
+        ping_p99 = percentile_usec(samples, conf.rounds, 0.99);
+
+        req[0] = 'B';
+        start = now_nsec();
+        if (write_full(fd, req, sizeof(req)) != 0)
+                goto Stop;
+        for (left = conf.bulk_bytes; left != 0; left -= left < sizeof(buf) ? left : sizeof(buf)) {
+                if (read_full(fd, buf, left < sizeof(buf) ? left : sizeof(buf)) != 0) {
+                        perror("bulk");
+                        goto Stop;
+                }
+        }
+        bulk_mbps = conf.bulk_bytes / ((now_nsec() - start) / 1e9) / (1024 * 1024);
+
+        printf("%-28s %9.1f %9.1f %9.1f %9.1f %10.1f", spec, connect_p50, connect_p99, ping_p50, ping_p99, bulk_mbps);
+        if (profile.fastopen != 0)
+                printf("  fast open %zu/%zu", num_fastopen, conf.connects);
+        printf("\n");
+        fflush(stdout);
+        ret = 0;
+
+Stop:
+        if (fd != -1)
+                close(fd);
+        stop_server(&server);
+Exit:
+        free(samples);
+        free(copy);
+        return ret;
+}
+
+static void usage(const char *cmd)
+{
+        printf("Usage: %s [options] [PROFILE...]\n"
+               "\n"
+               "PROFILE is a comma-separated list of the TCP options of --listen, or `default`.\n"
+               "Without profiles, the defaults and each option on its own are measured.\n"
+               "\n"
+               "Options:\n"
+               "  -n rounds   request/response round trips per profile (default: %zu)\n"
+               "  -c count    connections set up per profile (default: %zu)\n"
+               "  -b bytes    size of the bulk transfer (default: %zu)\n"
+               "  -h          prints this help\n"
+               "\n"
+               "Fast Open needs the server bit of net.ipv4.tcp_fastopen (e.g. 3); busy polling has no\n"
+               "effect over loopback, which has no NAPI context to poll.\n",
+               cmd, conf.rounds, conf.connects, conf.bulk_bytes);
+}
+
+int main(int argc, char **argv)
+{
+        size_t i;
+        int ch, ret = 0;
+
+        while ((ch = getopt(argc, argv, "n:c:b:h")) != -1) {
+                switch (ch) {
+                case 'n':
+                        conf.rounds = strtoul(optarg, NULL, 10);
+                        break;
+                case 'c':
+                        conf.connects = strtoul(optarg, NULL, 10);
+                        break;
+                case 'b':
+                        conf.bulk_bytes = strtoul(optarg, NULL, 10);
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return 0;
+                default:
+                        return 1;
+                }
+        }
+        if (conf.rounds == 0 || conf.connects == 0 || conf.bulk_bytes == 0) {
+                fprintf(stderr, "-n, -c and -b take positive integers\n");
+                return 1;
+        }
+        argc -= optind;
+        argv += optind;
+
+        printf("%-28s %9s %9s %9s %9s %10s\n", "profile", "conn p50", "conn p99", "rtt p50", "rtt p99", "bulk MB/s");
+        printf("%-28s %9s %9s %9s %9s\n", "", "(us)", "(us)", "(us)", "(us)");
+        if (argc != 0) {
+                for (i = 0; i != (size_t)argc; ++i)
+                        if (run_profile(argv[i]) != 0)
+                                ret = 1;
+        } else {
+                for (i = 0; i != sizeof(default_profiles) / sizeof(default_profiles[0]); ++i)
+                        if (run_profile(default_profiles[i]) != 0)
+                                ret = 1;
+        }
+        return ret;
+}